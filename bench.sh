@@ -0,0 +1,249 @@
+# usage : sh bench.sh run [results.csv]
+#         sh bench.sh compare <baseline.csv> <results.csv> [threshold_percent]
+#         sh bench.sh mmap [input]
+#         sh bench.sh convert [input]
+#         sh bench.sh audio [input]
+#         sh bench.sh allocs [input]
+#
+# Inputs are generated with ffmpeg's lavfi test sources into $BENCH_DIR,
+# so nothing has to be downloaded. Build with "sh build.sh release" first.
+
+BENCH_DIR=${BENCH_DIR:-bench_data}
+BENCH_RUNS=${BENCH_RUNS:-3}
+FFMPEG=${FFMPEG:-ffmpeg}
+TIME=${TIME:-/usr/bin/time}
+
+RESOLUTIONS="640x360 1280x720 1920x1080"
+DURATIONS="10 60"
+FRAME_RATE=30
+# <video encoder>:<audio encoder>:<container>
+CODECS="libx264:aac:mp4 mpeg2video:mp2:ts"
+
+generate_inputs()
+{
+  mkdir -p "$BENCH_DIR"
+  for codec in $CODECS; do
+    vcodec=${codec%%:*}
+    acodec=${codec#*:}; acodec=${acodec%%:*}
+    ext=${codec##*:}
+    for res in $RESOLUTIONS; do
+      for dur in $DURATIONS; do
+        input="$BENCH_DIR/${vcodec}_${res}_${dur}s.$ext"
+        if [ -f "$input" ]; then
+          continue
+        fi
+        "$FFMPEG" -loglevel error -y \
+          -f lavfi -i "testsrc2=size=$res:rate=$FRAME_RATE:duration=$dur" \
+          -f lavfi -i "sine=frequency=1000:sample_rate=48000:duration=$dur" \
+          -c:v "$vcodec" -c:a "$acodec" -ac 2 "$input" || exit 1
+      done
+    done
+  done
+}
+
+# Prints "<wall> <cpu> <max_rss_kb>" of the fastest of $BENCH_RUNS runs,
+# or "failed failed failed" as soon as one run exits with an error.
+measure()
+{
+  best=""
+  run=0
+  while [ $run -lt "$BENCH_RUNS" ]; do
+    # time exits with the status of the command, a run which failed right away must not count as fastest.
+    if ! "$TIME" -f "%e %U %S %M" -o "$BENCH_DIR/time.txt" "$@" > /dev/null 2>&1; then
+      echo "failed failed failed"
+      return 1
+    fi
+    line=$(tail -n 1 "$BENCH_DIR/time.txt" | awk '{ printf "%s %.2f %s", $1, $2 + $3, $4 }')
+    if [ -z "$best" ] || awk -v a="$line" -v b="$best" 'BEGIN { split(a, x, " "); split(b, y, " "); exit !(x[1] < y[1]) }'; then
+      best=$line
+    fi
+    run=$((run + 1))
+  done
+  echo "$best"
+}
+
+run_bench()
+{
+  results=${1:-bench_results.csv}
+
+  generate_inputs
+  echo "sample,input,wall_s,cpu_s,max_rss_kb,fps" > "$results"
+
+  for input in "$BENCH_DIR"/*_*_*s.*; do
+    name=$(basename "$input")
+    dur=${name##*_}; dur=${dur%%s.*}
+    frames=$((dur * FRAME_RATE))
+    ext=${name##*.}
+
+    for sample in sample01_scanning sample02_demuxing sample03_remuxing sample04_decoding sample05_filtering sample06_encoding; do
+      case $sample in
+        sample03_remuxing) set -- "./$sample" "$input" "$BENCH_DIR/remux.$ext" ;;
+        sample06_encoding) set -- "./$sample" "$input" "$BENCH_DIR/encode.mp4" ;;
+        *) set -- "./$sample" "$input" ;;
+      esac
+
+      set -- $(measure "$@")
+      if [ "$1" = failed ]; then
+        fps=failed
+      else
+        fps=$(awk -v f="$frames" -v t="$1" 'BEGIN { printf "%.1f", (t > 0) ? f / t : 0 }')
+      fi
+      echo "$sample,$name,$1,$2,$3,$fps" | tee -a "$results"
+    done
+  done
+}
+
+# Flags every sample/input pair whose wall time or peak RSS grew by more than the threshold.
+compare_bench()
+{
+  awk -F, -v threshold="${3:-10}" '
+    FNR == 1 { next }
+    NR == FNR { wall[$1 "," $2] = $3; rss[$1 "," $2] = $5; next }
+    ($1 "," $2) in wall && $3 == "failed" {
+      failed = 1
+      printf "%-10s %-20s %-32s\n", "FAILED", $1, $2
+      next
+    }
+    ($1 "," $2) in wall && wall[$1 "," $2] != "failed" {
+      key = $1 "," $2
+      dwall = (wall[key] > 0) ? ($3 - wall[key]) * 100 / wall[key] : 0
+      drss = (rss[key] > 0) ? ($5 - rss[key]) * 100 / rss[key] : 0
+      status = (dwall > threshold || drss > threshold) ? "REGRESSION" : "ok"
+      if(status != "ok") failed = 1
+      printf "%-10s %-20s %-32s wall %+6.1f%% rss %+6.1f%%\n", status, $1, $2, dwall, drss
+    }
+    END { exit failed }' "$1" "$2"
+}
+
+# Demuxes and remuxes a multi-GB file through the file protocol and through -m.
+mmap_bench()
+{
+  input=$1
+  if [ -z "$input" ]; then
+    mkdir -p "$BENCH_DIR"
+    input="$BENCH_DIR/large_1920x1080.ts"
+    if [ ! -f "$input" ]; then
+      # About 2.2GB at 50Mbps for 6 minutes.
+      "$FFMPEG" -loglevel error -y -f lavfi -i "testsrc2=size=1920x1080:rate=$FRAME_RATE:duration=360" \
+        -c:v mpeg2video -b:v 50M -minrate 50M -maxrate 50M -bufsize 10M "$input" || exit 1
+    fi
+  fi
+
+  echo "sample,io,wall_s,cpu_s,max_rss_kb"
+  for sample in sample02_demuxing sample03_remuxing; do
+    for io in file mmap; do
+      flag=""
+      if [ $io = mmap ]; then
+        flag="-m"
+      fi
+
+      if [ $sample = sample03_remuxing ]; then
+        set -- $(measure "./$sample" $flag "$input" "$BENCH_DIR/remux.ts")
+      else
+        set -- $(measure "./$sample" $flag "$input")
+      fi
+      echo "$sample,$io,$1,$2,$3"
+    done
+  done
+}
+
+# Runs the filter graph and the direct swscale/swresample engine over the same input.
+convert_bench()
+{
+  input=$1
+  if [ -z "$input" ]; then
+    generate_inputs
+    input="$BENCH_DIR/libx264_1920x1080_60s.mp4"
+  fi
+
+  echo "sample,engine,wall_s,cpu_s,max_rss_kb"
+  for sample in sample05_filtering sample06_encoding; do
+    for engine in graph direct:1 direct; do
+      if [ $sample = sample06_encoding ]; then
+        set -- $(measure "./$sample" -c $engine "$input" "$BENCH_DIR/encode.mp4")
+      else
+        set -- $(measure "./$sample" -c $engine "$input")
+      fi
+      echo "$sample,$engine,$1,$2,$3"
+    done
+  done
+}
+
+# Encodes only the audio of each input with and without batching to the encoder frame size,
+# with the encoder's own calls and time per call taken from sample06's report.
+audio_bench()
+{
+  if [ -n "$1" ]; then
+    inputs=$1
+  else
+    generate_inputs
+    inputs="$BENCH_DIR/libx264_640x360_60s.mp4 $BENCH_DIR/mpeg2video_640x360_60s.ts"
+  fi
+
+  echo "input,batching,wall_s,cpu_s,max_rss_kb,encode_calls,us_per_call"
+  for input in $inputs; do
+    for batch in off default; do
+      flag=""
+      if [ $batch = off ]; then
+        flag="-A off"
+      fi
+
+      set -- $(measure ./sample06_encoding -T audio $flag "$input" "$BENCH_DIR/audio.mp4")
+      report=$(./sample06_encoding -T audio $flag "$input" "$BENCH_DIR/audio.mp4" 2> /dev/null | \
+        awk '/^Audio encode :/ { printf "%s,%s", $6, $13 }')
+      echo "$(basename "$input"),$batch,$1,$2,$3,${report:-failed,}"
+    done
+  done
+}
+
+# Heap allocations of the remux and transcode loops, in total and per packet or frame after warm-up.
+# Counting replaces the allocator, so it runs on its own build of the samples.
+allocs_bench()
+{
+  mkdir -p "$BENCH_DIR/allocs"
+  EXTRA_CFLAGS="-DCOUNT_ALLOCS" BIN_DIR="$BENCH_DIR/allocs" sh build.sh release || exit 1
+
+  if [ -n "$1" ]; then
+    inputs=$1
+  else
+    generate_inputs
+    inputs="$BENCH_DIR/libx264_1280x720_10s.mp4 $BENCH_DIR/mpeg2video_1280x720_10s.ts"
+  fi
+
+  echo "sample,input,allocs,allocs_per_frame"
+  for input in $inputs; do
+    ext=${input##*.}
+    for sample in sample03_remuxing sample06_encoding; do
+      if [ $sample = sample03_remuxing ]; then
+        output="$BENCH_DIR/remux.$ext"
+      else
+        output="$BENCH_DIR/encode.mp4"
+      fi
+
+      report=$("$BENCH_DIR/allocs/$sample" "$input" "$output" 2> /dev/null | awk '/^[Aa]llocations :/ { printf "%s,%s", $3, $5 }')
+      echo "$sample,$(basename "$input"),${report:-failed,}"
+    done
+  done
+}
+
+case $1 in
+  run) run_bench "$2" ;;
+  mmap) mmap_bench "$2" ;;
+  convert) convert_bench "$2" ;;
+  audio) audio_bench "$2" ;;
+  allocs) allocs_bench "$2" ;;
+  compare)
+    if [ $# -lt 3 ]; then
+      echo "usage : $0 compare <baseline.csv> <results.csv> [threshold_percent]"
+      exit 1
+    fi
+    compare_bench "$2" "$3" "$4" ;;
+  *)
+    echo "usage : $0 run [results.csv]"
+    echo "        $0 compare <baseline.csv> <results.csv> [threshold_percent]"
+    echo "        $0 mmap [input]"
+    echo "        $0 convert [input]"
+    echo "        $0 audio [input]"
+    echo "        $0 allocs [input]"
+    exit 1 ;;
+esac
@@ -1,6 +1,15 @@
-gcc -g -o sample01_scanning sample01_scanning.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil);
-gcc -g -o sample02_demuxing sample02_demuxing.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil);
-gcc -g -o sample03_remuxing sample03_remuxing.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil);
-gcc -g -o sample04_decoding sample04_decoding.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil);
-gcc -g -o sample05_filtering sample05_filtering.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil libavfilter);
-gcc -g -o sample06_encoding sample06_encoding.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil libavfilter);
+# usage : sh build.sh [debug|release]
+# EXTRA_CFLAGS is added to the flags, e.g. -DCOUNT_ALLOCS, and BIN_DIR is where binaries go.
+CFLAGS="-g"
+if [ "$1" = "release" ]; then
+  CFLAGS="-O2 -g -DNDEBUG"
+fi
+CFLAGS="$CFLAGS $EXTRA_CFLAGS"
+BIN_DIR=${BIN_DIR:-.}
+
+gcc $CFLAGS -o "$BIN_DIR/sample01_scanning" sample01_scanning.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil) -lpthread;
+gcc $CFLAGS -o "$BIN_DIR/sample02_demuxing" sample02_demuxing.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil);
+gcc $CFLAGS -o "$BIN_DIR/sample03_remuxing" sample03_remuxing.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil) -lpthread;
+gcc $CFLAGS -o "$BIN_DIR/sample04_decoding" sample04_decoding.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil libswscale) -lpthread;
+gcc $CFLAGS -o "$BIN_DIR/sample05_filtering" sample05_filtering.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil libavfilter libswscale libswresample) -lpthread;
+gcc $CFLAGS -o "$BIN_DIR/sample06_encoding" sample06_encoding.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil libavfilter libswscale libswresample) -lpthread -lm;
@@ -1,28 +1,748 @@
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/cpu.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+enum
+{
+  OUTPUT_JSON = 0,
+  OUTPUT_CSV
+};
+
+// Stream parameters as reported by the scanner and kept in the catalog.
+typedef struct _StreamInfo
+{
+  int index;
+  int codec_id;
+  int64_t bit_rate;
+  double duration;
+  AVRational time_base;
+  int width;
+  int height;
+  int sample_rate;
+  int channels;
+  char type[16];
+  char codec[32];
+  char pix_fmt[32];
+  char sample_fmt[16];
+} StreamInfo;
+
+// Result of probing one file. size and mtime tell whether a catalog entry is still valid.
+typedef struct _ScanEntry
+{
+  char* path;
+  int64_t size;
+  int64_t mtime;      // nanoseconds, as a file rewritten within one second must not look unchanged
+  char format[32];
+  char error[16];     // empty when probing succeeded
+  StreamInfo* streams;
+  int nb_streams;
+  int rescanned;      // catalog entry replaced by this scan
+} ScanEntry;
+
+// Paths to probe, shared by scanner threads.
+typedef struct _ScanList
+{
+  ScanEntry* entries;
+  int nb_entries;
+  int next_entry;
+  int nb_failed;
+  int nb_cached;
+  pthread_mutex_t mutex;
+} ScanList;
 
 static AVFormatContext* fmt_ctx = NULL;
 
+static ScanList scan_list;
+static ScanEntry* catalog = NULL;     // sorted by path
+static int nb_catalog = 0;
+static int output_format = OUTPUT_JSON;
+static int64_t probe_size = 0;        // 0 keeps the libavformat default
+static int64_t analyze_duration = 0;  // microseconds, 0 keeps the default
+
+static int lock_manager(void** mutex, enum AVLockOp op)
+{
+  switch(op)
+  {
+  case AV_LOCK_CREATE:
+    *mutex = av_malloc(sizeof(pthread_mutex_t));
+    return (*mutex == NULL || pthread_mutex_init(*mutex, NULL) != 0);
+  case AV_LOCK_OBTAIN:
+    return (pthread_mutex_lock(*mutex) != 0);
+  case AV_LOCK_RELEASE:
+    return (pthread_mutex_unlock(*mutex) != 0);
+  case AV_LOCK_DESTROY:
+    pthread_mutex_destroy(*mutex);
+    av_freep(mutex);
+    return 0;
+  }
+
+  return 1;
+}
+
+static void print_escaped(FILE* out, const char* str)
+{
+  for(; *str != '\0'; str++)
+  {
+    if(output_format == OUTPUT_JSON && (*str == '"' || *str == '\\'))
+    {
+      fprintf(out, "\\%c", *str);
+    }
+    else if(output_format == OUTPUT_JSON && (unsigned char)*str < 0x20)
+    {
+      fprintf(out, "\\u%04x", *str);
+    }
+    else if(output_format == OUTPUT_CSV && *str == '"')
+    {
+      fputs("\"\"", out);
+    }
+    else
+    {
+      fputc(*str, out);
+    }
+  }
+}
+
+// One record per stream, every stream of the file and not just the first video and audio.
+static void print_entry(FILE* out, const ScanEntry* entry)
+{
+  int index;
+
+  if(entry->error[0] != '\0')
+  {
+    if(output_format == OUTPUT_JSON)
+    {
+      fputs("{\"path\": \"", out);
+      print_escaped(out, entry->path);
+      fprintf(out, "\", \"error\": \"%s\"}\n", entry->error);
+    }
+    else
+    {
+      fputc('"', out);
+      print_escaped(out, entry->path);
+      fprintf(out, "\",,,error,%s,,,,,,,,,,\n", entry->error);
+    }
+    return;
+  }
+
+  for(index = 0; index < entry->nb_streams; index++)
+  {
+    const StreamInfo* info = &entry->streams[index];
+
+    if(output_format == OUTPUT_JSON)
+    {
+      fputs("{\"path\": \"", out);
+      print_escaped(out, entry->path);
+      fprintf(out, "\", \"format\": \"%s\", \"index\": %d, \"type\": \"%s\", \"codec\": \"%s\", \"codec_id\": %d"
+        ", \"bit_rate\": %"PRId64", \"duration\": %.3f, \"time_base\": \"%d/%d\""
+        ", \"width\": %d, \"height\": %d, \"pix_fmt\": \"%s\""
+        ", \"sample_rate\": %d, \"channels\": %d, \"sample_fmt\": \"%s\"}\n"
+        , entry->format, info->index, info->type, info->codec, info->codec_id
+        , info->bit_rate, info->duration, info->time_base.num, info->time_base.den
+        , info->width, info->height, info->pix_fmt
+        , info->sample_rate, info->channels, info->sample_fmt);
+    }
+    else
+    {
+      // Demuxer names like "mov,mp4,m4a,3gp,3g2,mj2" have commas of their own.
+      fputc('"', out);
+      print_escaped(out, entry->path);
+      fputs("\",\"", out);
+      print_escaped(out, entry->format);
+      fprintf(out, "\",%d,%s,%s,%d,%"PRId64",%.3f,%d/%d,%d,%d,%s,%d,%d,%s\n"
+        , info->index, info->type, info->codec, info->codec_id
+        , info->bit_rate, info->duration, info->time_base.num, info->time_base.den
+        , info->width, info->height, info->pix_fmt
+        , info->sample_rate, info->channels, info->sample_fmt);
+    }
+  }
+}
+
+static void fill_stream_info(StreamInfo* info, AVFormatContext* ctx, AVStream* stream)
+{
+  AVCodecContext* codec_ctx = stream->codec;
+  const char* type = av_get_media_type_string(codec_ctx->codec_type);
+  const char* pix_fmt = av_get_pix_fmt_name(codec_ctx->pix_fmt);
+  const char* sample_fmt = av_get_sample_fmt_name(codec_ctx->sample_fmt);
+
+  info->index = stream->index;
+  info->codec_id = codec_ctx->codec_id;
+  info->bit_rate = codec_ctx->bit_rate;
+  info->duration = (stream->duration != AV_NOPTS_VALUE) ? stream->duration * av_q2d(stream->time_base) :
+                   (ctx->duration != AV_NOPTS_VALUE) ? ctx->duration / (double)AV_TIME_BASE : 0;
+  info->time_base = stream->time_base;
+  info->width = codec_ctx->width;
+  info->height = codec_ctx->height;
+  info->sample_rate = codec_ctx->sample_rate;
+  info->channels = codec_ctx->channels;
+  snprintf(info->type, sizeof(info->type), "%s", (type != NULL) ? type : "unknown");
+  snprintf(info->codec, sizeof(info->codec), "%s", avcodec_get_name(codec_ctx->codec_id));
+  snprintf(info->pix_fmt, sizeof(info->pix_fmt), "%s", (pix_fmt != NULL) ? pix_fmt : "");
+  snprintf(info->sample_fmt, sizeof(info->sample_fmt), "%s", (sample_fmt != NULL) ? sample_fmt : "");
+}
+
+static void probe_file(ScanEntry* entry)
+{
+  AVFormatContext* ctx = NULL;
+  AVDictionary* options = NULL;
+  unsigned int index;
+
+  if(probe_size > 0)
+  {
+    av_dict_set_int(&options, "probesize", probe_size, 0);
+  }
+  if(analyze_duration > 0)
+  {
+    av_dict_set_int(&options, "analyzeduration", analyze_duration, 0);
+  }
+
+  if(avformat_open_input(&ctx, entry->path, NULL, &options) < 0)
+  {
+    snprintf(entry->error, sizeof(entry->error), "open");
+  }
+  else if(avformat_find_stream_info(ctx, NULL) < 0)
+  {
+    snprintf(entry->error, sizeof(entry->error), "stream_info");
+  }
+  else if((entry->streams = av_mallocz_array(FFMAX(ctx->nb_streams, 1), sizeof(StreamInfo))) == NULL)
+  {
+    snprintf(entry->error, sizeof(entry->error), "nomem");
+  }
+  else
+  {
+    snprintf(entry->format, sizeof(entry->format), "%s", ctx->iformat->name);
+    for(index = 0; index < ctx->nb_streams; index++)
+    {
+      fill_stream_info(&entry->streams[index], ctx, ctx->streams[index]);
+    }
+    entry->nb_streams = ctx->nb_streams;
+  }
+
+  avformat_close_input(&ctx);
+  av_dict_free(&options);
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+  return strcmp(((const ScanEntry*)a)->path, ((const ScanEntry*)b)->path);
+}
+
+static ScanEntry* find_catalog_entry(const char* path)
+{
+  ScanEntry key;
+
+  if(nb_catalog == 0)
+  {
+    return NULL;
+  }
+
+  key.path = (char*)path;
+  return bsearch(&key, catalog, nb_catalog, sizeof(ScanEntry), compare_entries);
+}
+
+// Takes the streams of an unchanged file from the catalog instead of probing it.
+static int reuse_catalog_entry(ScanEntry* entry)
+{
+  ScanEntry* cached = find_catalog_entry(entry->path);
+
+  if(cached == NULL || cached->size != entry->size || cached->mtime != entry->mtime)
+  {
+    return 0;
+  }
+
+  if(cached->nb_streams > 0)
+  {
+    entry->streams = av_malloc_array(cached->nb_streams, sizeof(StreamInfo));
+    if(entry->streams == NULL)
+    {
+      return 0;
+    }
+    memcpy(entry->streams, cached->streams, cached->nb_streams * sizeof(StreamInfo));
+  }
+
+  entry->nb_streams = cached->nb_streams;
+  memcpy(entry->format, cached->format, sizeof(entry->format));
+  memcpy(entry->error, cached->error, sizeof(entry->error));
+
+  return 1;
+}
+
+static void* scan_worker(void* arg)
+{
+  ScanEntry* entry;
+  struct stat st;
+  char* records = NULL;
+  size_t size = 0;
+  FILE* out;
+  int cached;
+
+  while(1)
+  {
+    pthread_mutex_lock(&scan_list.mutex);
+    entry = (scan_list.next_entry < scan_list.nb_entries) ? &scan_list.entries[scan_list.next_entry++] : NULL;
+    pthread_mutex_unlock(&scan_list.mutex);
+
+    if(entry == NULL)
+    {
+      break;
+    }
+
+    cached = 0;
+    if(stat(entry->path, &st) == 0)
+    {
+      entry->size = st.st_size;
+      entry->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+      cached = reuse_catalog_entry(entry);
+    }
+
+    if(!cached)
+    {
+      probe_file(entry);
+    }
+
+    // Records of one file are written in one piece, so files probed at the same time never interleave.
+    out = open_memstream(&records, &size);
+    if(out != NULL)
+    {
+      print_entry(out, entry);
+      fclose(out);
+    }
+
+    pthread_mutex_lock(&scan_list.mutex);
+    if(records != NULL)
+    {
+      fputs(records, stdout);
+    }
+    scan_list.nb_failed += (entry->error[0] != '\0');
+    scan_list.nb_cached += cached;
+    pthread_mutex_unlock(&scan_list.mutex);
+
+    free(records);
+    records = NULL;
+  } // while
+
+  return NULL;
+}
+
+static int add_entry(ScanEntry** entries, int* nb_entries, const char* path)
+{
+  ScanEntry* grown = av_realloc_array(*entries, *nb_entries + 1, sizeof(ScanEntry));
+  if(grown == NULL)
+  {
+    return AVERROR(ENOMEM);
+  }
+
+  *entries = grown;
+  memset(&grown[*nb_entries], 0, sizeof(ScanEntry));
+  grown[*nb_entries].path = av_strdup(path);
+  if(grown[*nb_entries].path == NULL)
+  {
+    return AVERROR(ENOMEM);
+  }
+  (*nb_entries)++;
+
+  return 0;
+}
+
+static void free_entries(ScanEntry** entries, int* nb_entries)
+{
+  int index;
+
+  for(index = 0; index < *nb_entries; index++)
+  {
+    av_free((*entries)[index].path);
+    av_free((*entries)[index].streams);
+  }
+
+  av_freep(entries);
+  *nb_entries = 0;
+}
+
+// list_path names a file with one path per line, "-" reads them from stdin.
+static int load_scan_list(const char* list_path)
+{
+  char path[4096];
+  FILE* list;
+  int ret = 0;
+
+  list = (strcmp(list_path, "-") == 0) ? stdin : fopen(list_path, "r");
+  if(list == NULL)
+  {
+    printf("Could not open list %s\n", list_path);
+    return -1;
+  }
+
+  while(ret >= 0 && fgets(path, sizeof(path), list) != NULL)
+  {
+    path[strcspn(path, "\r\n")] = '\0';
+    if(path[0] != '\0')
+    {
+      ret = add_entry(&scan_list.entries, &scan_list.nb_entries, path);
+    }
+  }
+
+  if(list != stdin)
+  {
+    fclose(list);
+  }
+
+  return ret;
+}
+
+// Splits line at tabs in place, empty strings are stored as "-".
+static int split_fields(char* line, char** fields, int max_fields)
+{
+  int count = 0;
+
+  line[strcspn(line, "\r\n")] = '\0';
+  while(count < max_fields)
+  {
+    fields[count++] = line;
+    line = strchr(line, '\t');
+    if(line == NULL)
+    {
+      break;
+    }
+    *line++ = '\0';
+  }
+
+  return count;
+}
+
+static void copy_field(char* dst, size_t size, const char* field)
+{
+  snprintf(dst, size, "%s", (strcmp(field, "-") == 0) ? "" : field);
+}
+
+// Catalog is a text file. Each file is a line
+//   F <path> <size> <mtime_ns> <format> <error> <nb_streams>
+// followed by one line per stream
+//   S <index> <type> <codec> <codec_id> <bit_rate> <duration> <tb_num> <tb_den>
+//     <width> <height> <pix_fmt> <sample_rate> <channels> <sample_fmt>
+// with tab separated fields.
+static int load_catalog(const char* catalog_path)
+{
+  char line[8192];
+  char* fields[16];
+  ScanEntry* entry = NULL;
+  int nb_streams = 0;
+  FILE* file;
+  int count;
+
+  file = fopen(catalog_path, "r");
+  if(file == NULL)
+  {
+    // First scan, there is nothing to reuse yet.
+    return 0;
+  }
+
+  while(fgets(line, sizeof(line), file) != NULL)
+  {
+    count = split_fields(line, fields, 16);
+    if(strcmp(fields[0], "F") == 0 && count == 7)
+    {
+      if(add_entry(&catalog, &nb_catalog, fields[1]) < 0)
+      {
+        break;
+      }
+
+      entry = &catalog[nb_catalog - 1];
+      entry->size = strtoll(fields[2], NULL, 10);
+      entry->mtime = strtoll(fields[3], NULL, 10);
+      copy_field(entry->format, sizeof(entry->format), fields[4]);
+      copy_field(entry->error, sizeof(entry->error), fields[5]);
+      nb_streams = FFMAX(atoi(fields[6]), 0);
+      entry->streams = av_mallocz_array(FFMAX(nb_streams, 1), sizeof(StreamInfo));
+      if(entry->streams == NULL)
+      {
+        break;
+      }
+    }
+    else if(strcmp(fields[0], "S") == 0 && count == 15 && entry != NULL && entry->nb_streams < nb_streams)
+    {
+      StreamInfo* info = &entry->streams[entry->nb_streams++];
+
+      info->index = atoi(fields[1]);
+      copy_field(info->type, sizeof(info->type), fields[2]);
+      copy_field(info->codec, sizeof(info->codec), fields[3]);
+      info->codec_id = atoi(fields[4]);
+      info->bit_rate = strtoll(fields[5], NULL, 10);
+      info->duration = atof(fields[6]);
+      info->time_base.num = atoi(fields[7]);
+      info->time_base.den = atoi(fields[8]);
+      info->width = atoi(fields[9]);
+      info->height = atoi(fields[10]);
+      copy_field(info->pix_fmt, sizeof(info->pix_fmt), fields[11]);
+      info->sample_rate = atoi(fields[12]);
+      info->channels = atoi(fields[13]);
+      copy_field(info->sample_fmt, sizeof(info->sample_fmt), fields[14]);
+    }
+  } // while
+
+  fclose(file);
+
+  qsort(catalog, nb_catalog, sizeof(ScanEntry), compare_entries);
+  return 0;
+}
+
+static const char* field_or_dash(const char* str)
+{
+  return (str[0] != '\0') ? str : "-";
+}
+
+static void write_catalog_entry(FILE* file, const ScanEntry* entry)
+{
+  int index;
+
+  fprintf(file, "F\t%s\t%"PRId64"\t%"PRId64"\t%s\t%s\t%d\n"
+    , entry->path, entry->size, entry->mtime
+    , field_or_dash(entry->format), field_or_dash(entry->error), entry->nb_streams);
+
+  for(index = 0; index < entry->nb_streams; index++)
+  {
+    const StreamInfo* info = &entry->streams[index];
+    fprintf(file, "S\t%d\t%s\t%s\t%d\t%"PRId64"\t%.3f\t%d\t%d\t%d\t%d\t%s\t%d\t%d\t%s\n"
+      , info->index, field_or_dash(info->type), field_or_dash(info->codec), info->codec_id
+      , info->bit_rate, info->duration, info->time_base.num, info->time_base.den
+      , info->width, info->height, field_or_dash(info->pix_fmt)
+      , info->sample_rate, info->channels, field_or_dash(info->sample_fmt));
+  }
+}
+
+// Writes this scan plus every older entry it did not touch, through a temporary file
+// so that an interrupted scan never leaves a truncated catalog behind.
+static int save_catalog(const char* catalog_path)
+{
+  char temp_path[4096];
+  ScanEntry* cached;
+  FILE* file;
+  int index;
+
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", catalog_path);
+  file = fopen(temp_path, "w");
+  if(file == NULL)
+  {
+    printf("Could not write catalog %s\n", temp_path);
+    return -1;
+  }
+
+  for(index = 0; index < scan_list.nb_entries; index++)
+  {
+    ScanEntry* entry = &scan_list.entries[index];
+
+    // The old record goes in any case, a vanished file must not come back from it.
+    cached = find_catalog_entry(entry->path);
+    if(cached != NULL)
+    {
+      cached->rescanned = 1;
+    }
+
+    // Files which vanished or have unusable names are not worth remembering.
+    if(entry->mtime == 0 || strpbrk(entry->path, "\t\n") != NULL)
+    {
+      continue;
+    }
+
+    write_catalog_entry(file, entry);
+  }
+
+  for(index = 0; index < nb_catalog; index++)
+  {
+    if(!catalog[index].rescanned)
+    {
+      write_catalog_entry(file, &catalog[index]);
+    }
+  }
+
+  if(fclose(file) != 0 || rename(temp_path, catalog_path) != 0)
+  {
+    printf("Could not write catalog %s\n", catalog_path);
+    return -2;
+  }
+
+  return 0;
+}
+
+// Prints what the catalog knows about each path without touching the media.
+static int query_catalog()
+{
+  ScanEntry* cached;
+  int nb_missing = 0;
+  int index;
+
+  for(index = 0; index < scan_list.nb_entries; index++)
+  {
+    ScanEntry* entry = &scan_list.entries[index];
+
+    cached = find_catalog_entry(entry->path);
+    if(cached == NULL)
+    {
+      snprintf(entry->error, sizeof(entry->error), "not_found");
+      print_entry(stdout, entry);
+      nb_missing++;
+    }
+    else
+    {
+      print_entry(stdout, cached);
+    }
+  }
+
+  return nb_missing;
+}
+
+static int run_scanner(int nb_threads)
+{
+  pthread_t* threads;
+  int nb_started = 0;
+  int index;
+
+  threads = av_malloc_array(nb_threads, sizeof(pthread_t));
+  if(threads == NULL || av_lockmgr_register(lock_manager) < 0)
+  {
+    av_free(threads);
+    return -1;
+  }
+
+  for(index = 0; index < nb_threads && index < scan_list.nb_entries; index++)
+  {
+    if(pthread_create(&threads[nb_started], NULL, scan_worker, NULL) != 0)
+    {
+      break;
+    }
+    nb_started++;
+  }
+
+  if(nb_started == 0)
+  {
+    scan_worker(NULL);
+  }
+
+  for(index = 0; index < nb_started; index++)
+  {
+    pthread_join(threads[index], NULL);
+  }
+
+  av_free(threads);
+  return scan_list.nb_failed;
+}
+
 int main(int argc, char* argv[])
 {
   unsigned int index;
+  const char* list_path = NULL;
+  const char* catalog_path = NULL;
+  int scanner = 0;
+  int query = 0;
+  int nb_threads = av_cpu_count();
+  int opt;
+  int ret;
 
   av_register_all();
 
+  while((opt = getopt(argc, argv, "sf:j:p:a:l:c:q")) != -1)
+  {
+    switch(opt)
+    {
+    case 's':
+      scanner = 1;
+      break;
+    case 'f':
+      output_format = (strcmp(optarg, "csv") == 0) ? OUTPUT_CSV : OUTPUT_JSON;
+      break;
+    case 'j':
+      nb_threads = atoi(optarg);
+      break;
+    case 'p':
+      probe_size = strtoll(optarg, NULL, 10);
+      break;
+    case 'a':
+      analyze_duration = strtoll(optarg, NULL, 10);
+      break;
+    case 'l':
+      list_path = optarg;
+      break;
+    case 'c':
+      catalog_path = optarg;
+      break;
+    case 'q':
+      query = 1;
+      scanner = 1;
+      break;
+    default:
+      optind = argc;
+      scanner = -1;
+      break;
+    }
+  }
+
+  if(scanner > 0 && nb_threads > 0)
+  {
+    // Only records go to stdout in scanner mode.
+    av_log_set_level(AV_LOG_QUIET);
+    pthread_mutex_init(&scan_list.mutex, NULL);
+
+    ret = (list_path != NULL) ? load_scan_list(list_path) : 0;
+    for(; ret >= 0 && optind < argc; optind++)
+    {
+      ret = add_entry(&scan_list.entries, &scan_list.nb_entries, argv[optind]);
+    }
+
+    if(ret >= 0 && catalog_path != NULL)
+    {
+      ret = load_catalog(catalog_path);
+    }
+
+    if(ret >= 0 && output_format == OUTPUT_CSV)
+    {
+      printf("path,format,index,type,codec,codec_id,bit_rate,duration,time_base,width,height,pix_fmt,sample_rate,channels,sample_fmt\n");
+    }
+
+    if(ret >= 0 && query)
+    {
+      ret = query_catalog();
+    }
+    else if(ret >= 0)
+    {
+      ret = run_scanner(nb_threads);
+      if(catalog_path != NULL)
+      {
+        fprintf(stderr, "%d files, %d from catalog, %d failed\n"
+          , scan_list.nb_entries, scan_list.nb_cached, scan_list.nb_failed);
+        if(save_catalog(catalog_path) < 0)
+        {
+          ret = -1;
+        }
+      }
+    }
+
+    free_entries(&scan_list.entries, &scan_list.nb_entries);
+    free_entries(&catalog, &nb_catalog);
+    pthread_mutex_destroy(&scan_list.mutex);
+
+    return (ret != 0) ? 1 : 0;
+  }
+
   // Print debug log in library level.
   av_log_set_level(AV_LOG_DEBUG);
 
-  if(argc < 2)
+  if(scanner != 0 || argc - optind < 1)
   {
     printf("usage : %s <input>\n", argv[0]);
+    printf("        %s -s [-f json|csv] [-j threads] [-p probesize] [-a analyzeduration_us] [-l list|-] [-c catalog] [input...]\n", argv[0]);
+    printf("        %s -q -c catalog [-f json|csv] [-l list|-] [input...]\n", argv[0]);
     return 0;
   }
 
   // Get fmt_ctx from given file path. 
-  if(avformat_open_input(&fmt_ctx, argv[1], NULL, NULL) < 0)
+  if(avformat_open_input(&fmt_ctx, argv[optind], NULL, NULL) < 0)
   {
-    printf("Could not open input file %s\n", argv[1]);
+    printf("Could not open input file %s\n", argv[optind]);
     return -1;
   }
 
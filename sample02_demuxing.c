@@ -1,6 +1,12 @@
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 typedef struct _FileContext
 {
@@ -9,7 +15,305 @@ typedef struct _FileContext
   int a_index;
 } FileContext;
 
+// Local file mapped into memory, read through a custom AVIOContext.
+typedef struct _MappedFile
+{
+  uint8_t* data;
+  int64_t size;
+  int64_t pos;
+  AVIOContext* pb;
+} MappedFile;
+
+#define INDEX_MAGIC "KFINDEX1"
+#define INDEX_VERSION 2
+
+// Every audio packet is a sync point, one entry a second is enough to seek with.
+#define AUDIO_SYNC_INTERVAL 1.0
+
+// Sidecar keyframe index, stored in host byte order with every field naturally aligned,
+// so a mapped file can be used in place:
+//   IndexHeader | IndexStream[nb_streams] | IndexEntry[total entries]
+typedef struct _IndexHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t nb_streams;
+  uint64_t source_size;   // size and mtime of the indexed file, to tell a stale index
+  int64_t source_mtime;   // nanoseconds
+} IndexHeader;
+
+typedef struct _IndexStream
+{
+  int32_t stream_index;
+  int32_t media_type;     // entries of an audio stream are sync points, not keyframes
+  int32_t time_base_num;
+  int32_t time_base_den;
+  uint32_t nb_entries;
+  uint32_t reserved;
+  uint64_t first_entry;   // position of its first entry in the entry table
+} IndexStream;
+
+// Keyframes of one stream are sorted by pts.
+typedef struct _IndexEntry
+{
+  int64_t pts;
+  int64_t dts;
+  int64_t pos;            // byte position in the container, -1 if unknown
+} IndexEntry;
+
+// Keyframes collected for one stream while walking the packets.
+typedef struct _KeyframeList
+{
+  int stream_index;
+  IndexEntry* entries;
+  int nb_entries;
+  int capacity;
+} KeyframeList;
+
 static FileContext input_ctx;
+static MappedFile mapped_file;
+static int use_mmap = 0;
+static KeyframeList keyframe_lists[2];  // video and audio
+
+#define MMAP_IO_BUFFER_SIZE (256 * 1024)
+#define MMAP_READAHEAD_SIZE (64 * 1024 * 1024)
+
+static int mapped_read(void* opaque, uint8_t* buf, int buf_size)
+{
+  MappedFile* file = opaque;
+  int64_t left = file->size - file->pos;
+  int size;
+
+  if(left <= 0)
+  {
+    return AVERROR_EOF;
+  }
+
+  size = (int)FFMIN(buf_size, left);
+  memcpy(buf, file->data + file->pos, size);
+  file->pos += size;
+
+  return size;
+}
+
+static int64_t mapped_seek(void* opaque, int64_t offset, int whence)
+{
+  MappedFile* file = opaque;
+  int64_t pos;
+
+  switch(whence & ~AVSEEK_FORCE)
+  {
+  case AVSEEK_SIZE:
+    return file->size;
+  case SEEK_SET:
+    pos = offset;
+    break;
+  case SEEK_CUR:
+    pos = file->pos + offset;
+    break;
+  case SEEK_END:
+    pos = file->size + offset;
+    break;
+  default:
+    return AVERROR(EINVAL);
+  }
+
+  if(pos < 0 || pos > file->size)
+  {
+    return AVERROR(EINVAL);
+  }
+
+  // Sequential hint covers streaming reads, a seek starts a new window of read-ahead.
+  if(pos != file->pos && pos < file->size)
+  {
+    madvise(file->data + (pos & ~(int64_t)(sysconf(_SC_PAGESIZE) - 1)),
+      FFMIN(MMAP_READAHEAD_SIZE, file->size - pos), MADV_WILLNEED);
+  }
+
+  file->pos = pos;
+  return pos;
+}
+
+// Maps the whole file and attaches it to fmt_ctx as its AVIOContext.
+static int open_mapped_file(const char* filename, AVFormatContext** fmt_ctx)
+{
+  struct stat st;
+  unsigned char* io_buffer;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if(fd < 0)
+  {
+    return AVERROR(errno);
+  }
+
+  if(fstat(fd, &st) < 0 || st.st_size == 0)
+  {
+    close(fd);
+    return AVERROR(EINVAL);
+  }
+
+  mapped_file.data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapped_file.data == MAP_FAILED)
+  {
+    mapped_file.data = NULL;
+    return AVERROR(errno);
+  }
+
+  mapped_file.size = st.st_size;
+  mapped_file.pos = 0;
+  madvise(mapped_file.data, mapped_file.size, MADV_SEQUENTIAL);
+  madvise(mapped_file.data, FFMIN(MMAP_READAHEAD_SIZE, mapped_file.size), MADV_WILLNEED);
+
+  io_buffer = av_malloc(MMAP_IO_BUFFER_SIZE);
+  if(io_buffer == NULL)
+  {
+    return AVERROR(ENOMEM);
+  }
+
+  *fmt_ctx = avformat_alloc_context();
+  if(*fmt_ctx == NULL)
+  {
+    av_free(io_buffer);
+    return AVERROR(ENOMEM);
+  }
+
+  mapped_file.pb = avio_alloc_context(io_buffer, MMAP_IO_BUFFER_SIZE, 0, &mapped_file, mapped_read, NULL, mapped_seek);
+  if(mapped_file.pb == NULL)
+  {
+    av_free(io_buffer);
+    avformat_free_context(*fmt_ctx);
+    *fmt_ctx = NULL;
+    return AVERROR(ENOMEM);
+  }
+
+  // Reads larger than the buffer go straight from the mapping into the packet.
+  mapped_file.pb->direct = 1;
+  (*fmt_ctx)->pb = mapped_file.pb;
+
+  return 0;
+}
+
+static void close_mapped_file()
+{
+  // avformat_close_input() leaves a custom AVIOContext to its owner.
+  if(mapped_file.pb != NULL)
+  {
+    av_freep(&mapped_file.pb->buffer);
+    av_freep(&mapped_file.pb);
+  }
+
+  if(mapped_file.data != NULL)
+  {
+    munmap(mapped_file.data, mapped_file.size);
+    mapped_file.data = NULL;
+  }
+}
+
+// Streams to read, by type or by index. Everything else is discarded by the demuxer.
+static int select_video = 1;
+static int select_audio = 1;
+static int selected_tracks[2] = {-1, -1};
+static int nb_selected_tracks = 0;
+
+// Parses av, video, audio or up to two stream indexes, e.g. "0,3".
+static int parse_stream_selector(const char* arg)
+{
+  const char* track = arg;
+  char* end;
+
+  select_video = select_audio = 1;
+  nb_selected_tracks = 0;
+
+  if(strcmp(arg, "av") == 0)
+  {
+    return 0;
+  }
+  else if(strcmp(arg, "video") == 0)
+  {
+    select_audio = 0;
+    return 0;
+  }
+  else if(strcmp(arg, "audio") == 0)
+  {
+    select_video = 0;
+    return 0;
+  }
+
+  while(*track != '\0' && nb_selected_tracks < 2)
+  {
+    long index = strtol(track, &end, 10);
+    if(end == track || index < 0)
+    {
+      return -1;
+    }
+
+    selected_tracks[nb_selected_tracks++] = (int)index;
+    if(*end == ',' && end[1] == '\0')
+    {
+      return -1;
+    }
+    track = (*end == ',') ? end + 1 : end;
+  }
+
+  return (*track == '\0' && nb_selected_tracks > 0) ? 0 : -2;
+}
+
+static int stream_wanted(unsigned int index, enum AVMediaType type)
+{
+  int track;
+
+  if(nb_selected_tracks > 0)
+  {
+    for(track = 0; track < nb_selected_tracks; track++)
+    {
+      if(selected_tracks[track] == (int)index)
+      {
+        return 1;
+      }
+    }
+
+    return 0;
+  }
+
+  return (type == AVMEDIA_TYPE_VIDEO) ? select_video : select_audio;
+}
+
+// Streams picked by index still have to be audio or video.
+static int check_selected_tracks(AVFormatContext* fmt_ctx)
+{
+  int track;
+
+  for(track = 0; track < nb_selected_tracks; track++)
+  {
+    int index = selected_tracks[track];
+    enum AVMediaType type = (index < (int)fmt_ctx->nb_streams) ? 
+      fmt_ctx->streams[index]->codec->codec_type : AVMEDIA_TYPE_UNKNOWN;
+
+    if(type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO)
+    {
+      printf("Stream %d is neither audio nor video\n", index);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Packets of discarded streams are skipped before parsing, so they cost no allocation.
+static void discard_unused_streams(AVFormatContext* fmt_ctx, int v_index, int a_index)
+{
+  unsigned int index;
+
+  for(index = 0; index < fmt_ctx->nb_streams; index++)
+  {
+    if((int)index != v_index && (int)index != a_index)
+    {
+      fmt_ctx->streams[index]->discard = AVDISCARD_ALL;
+    }
+  }
+}
 
 static int open_input(const char* filename)
 {
@@ -18,6 +322,12 @@ static int open_input(const char* filename)
   input_ctx.fmt_ctx = NULL;
   input_ctx.v_index = input_ctx.a_index = -1;
 
+  if(use_mmap && open_mapped_file(filename, &input_ctx.fmt_ctx) < 0)
+  {
+    printf("Could not map input file %s\n", filename);
+    return -1;
+  }
+
   if(avformat_open_input(&input_ctx.fmt_ctx, filename, NULL, NULL) < 0)
   {
     printf("Could not open input file %s\n", filename);
@@ -30,19 +340,28 @@ static int open_input(const char* filename)
     return -2;
   }
 
+  if(check_selected_tracks(input_ctx.fmt_ctx) < 0)
+  {
+    return -3;
+  }
+
   for(index = 0; index < input_ctx.fmt_ctx->nb_streams; index++)
   {
     AVCodecContext* codec_ctx = input_ctx.fmt_ctx->streams[index]->codec;
-    if(codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && input_ctx.v_index < 0)
+    if(codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && input_ctx.v_index < 0 && 
+      stream_wanted(index, AVMEDIA_TYPE_VIDEO))
     {
       input_ctx.v_index = index;
     }
-    else if(codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO && input_ctx.a_index < 0)
+    else if(codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO && input_ctx.a_index < 0 && 
+      stream_wanted(index, AVMEDIA_TYPE_AUDIO))
     {
       input_ctx.a_index = index;
     }
   } // for
 
+  discard_unused_streams(input_ctx.fmt_ctx, input_ctx.v_index, input_ctx.a_index);
+
   if(input_ctx.v_index < 0 && input_ctx.a_index < 0)
   {
     printf("Failed to retrieve input stream information\n");
@@ -58,22 +377,384 @@ static void release()
   {
     avformat_close_input(&input_ctx.fmt_ctx);
   }
+
+  close_mapped_file();
+}
+
+static int add_keyframe(KeyframeList* list, const AVPacket* pkt)
+{
+  IndexEntry* entry;
+
+  if(list->nb_entries == list->capacity)
+  {
+    int capacity = (list->capacity > 0) ? list->capacity * 2 : 1024;
+    IndexEntry* entries = av_realloc_array(list->entries, capacity, sizeof(IndexEntry));
+    if(entries == NULL)
+    {
+      return AVERROR(ENOMEM);
+    }
+
+    list->entries = entries;
+    list->capacity = capacity;
+  }
+
+  entry = &list->entries[list->nb_entries++];
+  entry->pts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts : pkt->dts;
+  entry->dts = pkt->dts;
+  entry->pos = pkt->pos;
+
+  return 0;
+}
+
+// Video keyframes all go into the index, audio sync points once every AUDIO_SYNC_INTERVAL.
+static int collect_keyframe(const AVPacket* pkt)
+{
+  KeyframeList* list = (pkt->stream_index == input_ctx.v_index) ? &keyframe_lists[0] :
+                       (pkt->stream_index == input_ctx.a_index) ? &keyframe_lists[1] : NULL;
+  int64_t pts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts : pkt->dts;
+
+  if(list == NULL || !(pkt->flags & AV_PKT_FLAG_KEY) || pts == AV_NOPTS_VALUE)
+  {
+    return 0;
+  }
+
+  if(list == &keyframe_lists[1] && list->nb_entries > 0)
+  {
+    AVRational time_base = input_ctx.fmt_ctx->streams[pkt->stream_index]->time_base;
+    if((pts - list->entries[list->nb_entries - 1].pts) * av_q2d(time_base) < AUDIO_SYNC_INTERVAL)
+    {
+      return 0;
+    }
+  }
+
+  return add_keyframe(list, pkt);
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+  int64_t x = ((const IndexEntry*)a)->pts;
+  int64_t y = ((const IndexEntry*)b)->pts;
+
+  return (x > y) - (x < y);
+}
+
+static int write_index(const char* index_path, const char* source)
+{
+  IndexHeader header;
+  IndexStream streams[2];
+  struct stat st;
+  uint64_t first_entry = 0;
+  int nb_streams = 0;
+  FILE* file;
+  int index;
+
+  memset(&header, 0, sizeof(header));
+  memset(streams, 0, sizeof(streams));
+
+  for(index = 0; index < 2; index++)
+  {
+    KeyframeList* list = &keyframe_lists[index];
+    if(list->stream_index < 0)
+    {
+      continue;
+    }
+
+    AVRational time_base = input_ctx.fmt_ctx->streams[list->stream_index]->time_base;
+
+    // Packets come in dts order, lookups are by pts.
+    qsort(list->entries, list->nb_entries, sizeof(IndexEntry), compare_entries);
+
+    streams[nb_streams].stream_index = list->stream_index;
+    streams[nb_streams].media_type = (index == 0) ? AVMEDIA_TYPE_VIDEO : AVMEDIA_TYPE_AUDIO;
+    streams[nb_streams].time_base_num = time_base.num;
+    streams[nb_streams].time_base_den = time_base.den;
+    streams[nb_streams].nb_entries = list->nb_entries;
+    streams[nb_streams].first_entry = first_entry;
+    first_entry += list->nb_entries;
+    nb_streams++;
+  }
+
+  memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  header.version = INDEX_VERSION;
+  header.nb_streams = nb_streams;
+  if(stat(source, &st) == 0)
+  {
+    header.source_size = st.st_size;
+    header.source_mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  }
+
+  file = fopen(index_path, "wb");
+  if(file == NULL)
+  {
+    printf("Could not create index file %s\n", index_path);
+    return -1;
+  }
+
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(streams, sizeof(IndexStream), nb_streams, file);
+  for(index = 0; index < 2; index++)
+  {
+    KeyframeList* list = &keyframe_lists[index];
+    if(list->stream_index >= 0 && list->nb_entries > 0)
+    {
+      fwrite(list->entries, sizeof(IndexEntry), list->nb_entries, file);
+    }
+  }
+
+  if(fclose(file) != 0)
+  {
+    printf("Failed writing index file %s\n", index_path);
+    return -2;
+  }
+
+  printf("Index : %d video keyframes and %d audio sync points written to %s\n"
+    , keyframe_lists[0].nb_entries, keyframe_lists[1].nb_entries, index_path);
+  return 0;
+}
+
+// Maps an index file, which is all that loading it takes.
+static const IndexHeader* map_index(const char* index_path, size_t* size)
+{
+  const IndexHeader* header;
+  struct stat st;
+  uint64_t nb_entries = 0;
+  unsigned int index;
+  int fd;
+
+  fd = open(index_path, O_RDONLY);
+  if(fd < 0)
+  {
+    return NULL;
+  }
+
+  if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(IndexHeader))
+  {
+    close(fd);
+    return NULL;
+  }
+
+  header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(header == MAP_FAILED)
+  {
+    return NULL;
+  }
+  *size = st.st_size;
+
+  if(memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 || header->version != INDEX_VERSION ||
+    sizeof(IndexHeader) + (uint64_t)header->nb_streams * sizeof(IndexStream) > (uint64_t)*size)
+  {
+    munmap((void*)header, *size);
+    return NULL;
+  }
+
+  const IndexStream* streams = (const IndexStream*)(header + 1);
+  for(index = 0; index < header->nb_streams; index++)
+  {
+    nb_entries += streams[index].nb_entries;
+  }
+
+  if(sizeof(IndexHeader) + header->nb_streams * sizeof(IndexStream) + nb_entries * sizeof(IndexEntry) > *size)
+  {
+    munmap((void*)header, *size);
+    return NULL;
+  }
+
+  return header;
+}
+
+// An index is only good for the file it was built from, as it was then.
+static int index_matches_source(const IndexHeader* header, const char* source)
+{
+  struct stat st;
+
+  if(stat(source, &st) < 0)
+  {
+    return 0;
+  }
+
+  return header->source_size == (uint64_t)st.st_size &&
+    header->source_mtime == (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+// Walks every packet of the input to write a fresh index. The caller seeks afterwards.
+static int build_index(const char* index_path, const char* source)
+{
+  AVPacket pkt;
+  int ret;
+
+  while((ret = av_read_frame(input_ctx.fmt_ctx, &pkt)) >= 0)
+  {
+    ret = collect_keyframe(&pkt);
+    av_free_packet(&pkt);
+    if(ret < 0)
+    {
+      return ret;
+    }
+  }
+
+  if(ret != AVERROR_EOF)
+  {
+    return ret;
+  }
+
+  ret = write_index(index_path, source);
+
+  // Packets read after the seek may be indexed again.
+  keyframe_lists[0].nb_entries = 0;
+  keyframe_lists[1].nb_entries = 0;
+  return ret;
+}
+
+// Last keyframe of stream_index at or before timestamp (in stream time_base), NULL if none.
+static const IndexEntry* find_keyframe(const IndexHeader* header, int stream_index, int64_t timestamp)
+{
+  const IndexStream* streams = (const IndexStream*)(header + 1);
+  const IndexEntry* entries = (const IndexEntry*)(streams + header->nb_streams);
+  unsigned int index;
+
+  for(index = 0; index < header->nb_streams; index++)
+  {
+    if(streams[index].stream_index != stream_index || streams[index].nb_entries == 0)
+    {
+      continue;
+    }
+
+    const IndexEntry* first = entries + streams[index].first_entry;
+    int low = 0, high = streams[index].nb_entries - 1;
+
+    if(first[0].pts > timestamp)
+    {
+      return NULL;
+    }
+
+    while(low < high)
+    {
+      int mid = (low + high + 1) / 2;
+      if(first[mid].pts <= timestamp)
+      {
+        low = mid;
+      }
+      else
+      {
+        high = mid - 1;
+      }
+    }
+
+    return &first[low];
+  }
+
+  return NULL;
+}
+
+// Seeks using the sidecar instead of the container's own index.
+static int seek_with_index(const char* index_path, const char* source, double seconds)
+{
+  const IndexHeader* header;
+  const IndexEntry* keyframe;
+  size_t size;
+  int stream_index = (input_ctx.v_index >= 0) ? input_ctx.v_index : input_ctx.a_index;
+  AVStream* stream = input_ctx.fmt_ctx->streams[stream_index];
+  // seconds count from the start of the stream, which in MPEG-TS is usually far above 0.
+  int64_t start = (stream->start_time != AV_NOPTS_VALUE) ? stream->start_time : 0;
+  int64_t timestamp = start + (int64_t)(seconds / av_q2d(stream->time_base));
+  int ret;
+
+  header = map_index(index_path, &size);
+  if(header != NULL && !index_matches_source(header, source))
+  {
+    printf("Index file %s is out of date with %s, rebuilding it\n", index_path, source);
+    munmap((void*)header, size);
+    header = (build_index(index_path, source) == 0) ? map_index(index_path, &size) : NULL;
+  }
+  if(header == NULL)
+  {
+    printf("Could not load index file %s\n", index_path);
+    return -1;
+  }
+
+  keyframe = find_keyframe(header, stream_index, timestamp);
+  if(keyframe == NULL)
+  {
+    munmap((void*)header, size);
+    printf("No keyframe before %.3f s\n", seconds);
+    return -2;
+  }
+
+  printf("Seek : %s pts %"PRId64" dts %"PRId64" at byte %"PRId64"\n"
+    , (stream_index == input_ctx.v_index) ? "keyframe" : "sync point", keyframe->pts, keyframe->dts, keyframe->pos);
+
+  // Byte seek goes straight to the keyframe. Formats which refuse it still get the exact timestamp.
+  ret = -1;
+  if(keyframe->pos >= 0 && !(input_ctx.fmt_ctx->iformat->flags & AVFMT_NO_BYTE_SEEK))
+  {
+    ret = av_seek_frame(input_ctx.fmt_ctx, stream_index, keyframe->pos, AVSEEK_FLAG_BYTE);
+  }
+  if(ret < 0)
+  {
+    ret = av_seek_frame(input_ctx.fmt_ctx, stream_index, keyframe->pts, AVSEEK_FLAG_BACKWARD);
+  }
+
+  munmap((void*)header, size);
+  return ret;
 }
 
 int main(int argc, char* argv[])
 {
+  const char* index_path = NULL;
+  const char* seek_index_path = NULL;
+  double seek_seconds = 0;
+  int failed = 1;
   int ret;
+  int opt;
 
   av_register_all();
   av_log_set_level(AV_LOG_DEBUG);
 
-  if(argc < 2)
+  while((opt = getopt(argc, argv, "mi:k:s:T:")) != -1)
+  {
+    switch(opt)
+    {
+    case 'm':
+      use_mmap = 1;
+      break;
+    case 'T':
+      if(parse_stream_selector(optarg) < 0)
+      {
+        printf("Invalid stream selection %s\n", optarg);
+        return -1;
+      }
+      break;
+    case 'i':
+      index_path = optarg;
+      break;
+    case 'k':
+      seek_index_path = optarg;
+      break;
+    case 's':
+      seek_seconds = atof(optarg);
+      break;
+    default:
+      optind = argc;
+      break;
+    }
+  }
+
+  if(argc - optind < 1)
   {
-    printf("usage : %s <input>\n", argv[0]);
+    printf("usage : %s [-m] [-T av|video|audio|<stream>[,<stream>]] [-i index_to_build] [-k index -s seconds] <input>\n", argv[0]);
     return 0;
   }
 
-  if(open_input(argv[1]) < 0)
+  if(open_input(argv[optind]) < 0)
+  {
+    goto main_end;
+  }
+
+  keyframe_lists[0].stream_index = input_ctx.v_index;
+  keyframe_lists[1].stream_index = input_ctx.a_index;
+
+  if(seek_index_path != NULL && seek_with_index(seek_index_path, argv[optind], seek_seconds) < 0)
   {
     goto main_end;
   }
@@ -90,6 +771,11 @@ int main(int argc, char* argv[])
       printf("End of frame\n");
       break;
     }
+    else if(ret < 0)
+    {
+      printf("Failed to read a packet (%d)\n", ret);
+      goto main_end;
+    }
 
     if(pkt.stream_index == input_ctx.v_index)
     {
@@ -100,11 +786,26 @@ int main(int argc, char* argv[])
       printf("Audio packet\n");
     }
 
+    if(index_path != NULL && collect_keyframe(&pkt) < 0)
+    {
+      av_free_packet(&pkt);
+      goto main_end;
+    }
+
     av_free_packet(&pkt);
   } // while
 
+  if(index_path != NULL && write_index(index_path, argv[optind]) < 0)
+  {
+    goto main_end;
+  }
+
+  failed = 0;
+
 main_end:
+  av_freep(&keyframe_lists[0].entries);
+  av_freep(&keyframe_lists[1].entries);
   release();
 
-  return 0;
+  return failed;
 }
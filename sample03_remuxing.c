@@ -1,6 +1,16 @@
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
 
 typedef struct _FileContext
 {
@@ -9,41 +19,360 @@ typedef struct _FileContext
   int a_index;
 } FileContext;
 
-static FileContext inputFile, outputFile;
+// Local file mapped into memory, read through a custom AVIOContext.
+typedef struct _MappedFile
+{
+  uint8_t* data;
+  int64_t size;
+  int64_t pos;
+  AVIOContext* pb;
+} MappedFile;
+
+// Everything one remux owns, so that batch workers can run side by side.
+typedef struct _RemuxContext
+{
+  FileContext input;
+  FileContext output;
+  MappedFile mapped;
+  int64_t fragment_start;  // dts of the keyframe opening the current fragment, in output time_base
+  int nb_fragments;
+  AVBitStreamFilterContext* annexb;  // H.264 from MP4/MKV into MPEG-TS, NULL if not needed
+} RemuxContext;
+
+static int use_mmap = 0;
+
+#define MMAP_IO_BUFFER_SIZE (256 * 1024)
+#define MMAP_READAHEAD_SIZE (64 * 1024 * 1024)
+
+static int mapped_read(void* opaque, uint8_t* buf, int buf_size)
+{
+  MappedFile* file = opaque;
+  int64_t left = file->size - file->pos;
+  int size;
+
+  if(left <= 0)
+  {
+    return AVERROR_EOF;
+  }
+
+  size = (int)FFMIN(buf_size, left);
+  memcpy(buf, file->data + file->pos, size);
+  file->pos += size;
+
+  return size;
+}
+
+static int64_t mapped_seek(void* opaque, int64_t offset, int whence)
+{
+  MappedFile* file = opaque;
+  int64_t pos;
+
+  switch(whence & ~AVSEEK_FORCE)
+  {
+  case AVSEEK_SIZE:
+    return file->size;
+  case SEEK_SET:
+    pos = offset;
+    break;
+  case SEEK_CUR:
+    pos = file->pos + offset;
+    break;
+  case SEEK_END:
+    pos = file->size + offset;
+    break;
+  default:
+    return AVERROR(EINVAL);
+  }
+
+  if(pos < 0 || pos > file->size)
+  {
+    return AVERROR(EINVAL);
+  }
+
+  // Sequential hint covers streaming reads, a seek starts a new window of read-ahead.
+  if(pos != file->pos && pos < file->size)
+  {
+    madvise(file->data + (pos & ~(int64_t)(sysconf(_SC_PAGESIZE) - 1)),
+      FFMIN(MMAP_READAHEAD_SIZE, file->size - pos), MADV_WILLNEED);
+  }
+
+  file->pos = pos;
+  return pos;
+}
+
+// Maps the whole file and attaches it to fmt_ctx as its AVIOContext.
+static int open_mapped_file(MappedFile* mapped_file, const char* filename, AVFormatContext** fmt_ctx)
+{
+  struct stat st;
+  unsigned char* io_buffer;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if(fd < 0)
+  {
+    return AVERROR(errno);
+  }
+
+  if(fstat(fd, &st) < 0 || st.st_size == 0)
+  {
+    close(fd);
+    return AVERROR(EINVAL);
+  }
+
+  mapped_file->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapped_file->data == MAP_FAILED)
+  {
+    mapped_file->data = NULL;
+    return AVERROR(errno);
+  }
+
+  mapped_file->size = st.st_size;
+  mapped_file->pos = 0;
+  madvise(mapped_file->data, mapped_file->size, MADV_SEQUENTIAL);
+  madvise(mapped_file->data, FFMIN(MMAP_READAHEAD_SIZE, mapped_file->size), MADV_WILLNEED);
+
+  io_buffer = av_malloc(MMAP_IO_BUFFER_SIZE);
+  if(io_buffer == NULL)
+  {
+    return AVERROR(ENOMEM);
+  }
+
+  *fmt_ctx = avformat_alloc_context();
+  if(*fmt_ctx == NULL)
+  {
+    av_free(io_buffer);
+    return AVERROR(ENOMEM);
+  }
+
+  mapped_file->pb = avio_alloc_context(io_buffer, MMAP_IO_BUFFER_SIZE, 0, mapped_file, mapped_read, NULL, mapped_seek);
+  if(mapped_file->pb == NULL)
+  {
+    av_free(io_buffer);
+    avformat_free_context(*fmt_ctx);
+    *fmt_ctx = NULL;
+    return AVERROR(ENOMEM);
+  }
+
+  // Reads larger than the buffer go straight from the mapping into the packet.
+  mapped_file->pb->direct = 1;
+  (*fmt_ctx)->pb = mapped_file->pb;
+
+  return 0;
+}
+
+static void close_mapped_file(MappedFile* mapped_file)
+{
+  // avformat_close_input() leaves a custom AVIOContext to its owner.
+  if(mapped_file->pb != NULL)
+  {
+    av_freep(&mapped_file->pb->buffer);
+    av_freep(&mapped_file->pb);
+  }
+
+  if(mapped_file->data != NULL)
+  {
+    munmap(mapped_file->data, mapped_file->size);
+    mapped_file->data = NULL;
+  }
+}
+
+// Streams to read, by type or by index. Everything else is discarded by the demuxer.
+static int select_video = 1;
+static int select_audio = 1;
+static int selected_tracks[2] = {-1, -1};
+static int nb_selected_tracks = 0;
+
+// Parses av, video, audio or up to two stream indexes, e.g. "0,3".
+static int parse_stream_selector(const char* arg)
+{
+  const char* track = arg;
+  char* end;
+
+  select_video = select_audio = 1;
+  nb_selected_tracks = 0;
+
+  if(strcmp(arg, "av") == 0)
+  {
+    return 0;
+  }
+  else if(strcmp(arg, "video") == 0)
+  {
+    select_audio = 0;
+    return 0;
+  }
+  else if(strcmp(arg, "audio") == 0)
+  {
+    select_video = 0;
+    return 0;
+  }
+
+  while(*track != '\0' && nb_selected_tracks < 2)
+  {
+    long index = strtol(track, &end, 10);
+    if(end == track || index < 0)
+    {
+      return -1;
+    }
+
+    selected_tracks[nb_selected_tracks++] = (int)index;
+    if(*end == ',' && end[1] == '\0')
+    {
+      return -1;
+    }
+    track = (*end == ',') ? end + 1 : end;
+  }
+
+  return (*track == '\0' && nb_selected_tracks > 0) ? 0 : -2;
+}
+
+static int stream_wanted(unsigned int index, enum AVMediaType type)
+{
+  int track;
+
+  if(nb_selected_tracks > 0)
+  {
+    for(track = 0; track < nb_selected_tracks; track++)
+    {
+      if(selected_tracks[track] == (int)index)
+      {
+        return 1;
+      }
+    }
+
+    return 0;
+  }
+
+  return (type == AVMEDIA_TYPE_VIDEO) ? select_video : select_audio;
+}
+
+// Streams picked by index still have to be audio or video.
+static int check_selected_tracks(AVFormatContext* fmt_ctx)
+{
+  int track;
+
+  for(track = 0; track < nb_selected_tracks; track++)
+  {
+    int index = selected_tracks[track];
+    enum AVMediaType type = (index < (int)fmt_ctx->nb_streams) ? 
+      fmt_ctx->streams[index]->codec->codec_type : AVMEDIA_TYPE_UNKNOWN;
+
+    if(type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO)
+    {
+      printf("Stream %d is neither audio nor video\n", index);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Packets of discarded streams are skipped before parsing, so they cost no allocation.
+static void discard_unused_streams(AVFormatContext* fmt_ctx, int v_index, int a_index)
+{
+  unsigned int index;
+
+  for(index = 0; index < fmt_ctx->nb_streams; index++)
+  {
+    if((int)index != v_index && (int)index != a_index)
+    {
+      fmt_ctx->streams[index]->discard = AVDISCARD_ALL;
+    }
+  }
+}
+
+// Live input from a pipe, FIFO or socket: little probing and no buffering anywhere.
+static int live_mode = 0;
+
+#define LIVE_PROBE_SIZE 500000        // bytes
+#define LIVE_ANALYZE_DURATION 500000  // microseconds
+
+// "-" is stdin for input and stdout for output, anything else goes to libavformat as is.
+static const char* live_url(const char* fileName, const char* pipe_url)
+{
+  return (live_mode && strcmp(fileName, "-") == 0) ? pipe_url : fileName;
+}
+
+// Descriptor the muxer writes to when the output is stdout.
+static char stdout_url[32] = "pipe:1";
+
+// A stream on stdout would be corrupted by everything printed along with it, so that goes to
+// stderr from here on and the muxer gets a copy of the real stdout.
+static int move_stdout_to_stderr()
+{
+  int fd;
+
+  fflush(stdout);
+  fd = dup(STDOUT_FILENO);
+  if(fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+  {
+    return -1;
+  }
+
+  snprintf(stdout_url, sizeof(stdout_url), "pipe:%d", fd);
+  return 0;
+}
 
-static int open_input(const char* fileName)
+static int open_input(RemuxContext* ctx, const char* fileName)
 {
+  AVDictionary* options = NULL;
   unsigned int index;
+  int ret;
+
+  ctx->input.fmt_ctx = NULL;
+  ctx->input.a_index = ctx->input.v_index = -1;
 
-  inputFile.fmt_ctx = NULL;
-  inputFile.a_index = inputFile.v_index = -1;
+  if(use_mmap && open_mapped_file(&ctx->mapped, fileName, &ctx->input.fmt_ctx) < 0)
+  {
+    printf("Could not map input file %s\n", fileName);
+    return -1;
+  }
+
+  if(live_mode)
+  {
+    // Stop probing as soon as every stream is known, and hand packets out as soon as they are read.
+    av_dict_set_int(&options, "probesize", LIVE_PROBE_SIZE, 0);
+    av_dict_set_int(&options, "analyzeduration", LIVE_ANALYZE_DURATION, 0);
+    av_dict_set(&options, "fflags", "nobuffer", 0);
+  }
 
-  if(avformat_open_input(&inputFile.fmt_ctx, fileName, NULL, NULL) < 0)
+  ret = avformat_open_input(&ctx->input.fmt_ctx, live_url(fileName, "pipe:0"), NULL, &options);
+  av_dict_free(&options);
+  if(ret < 0)
   {
     printf("Could not open input file %s\n", fileName);
     return -1;
   }
 
-  if(avformat_find_stream_info(inputFile.fmt_ctx, NULL) < 0)
+  if(avformat_find_stream_info(ctx->input.fmt_ctx, NULL) < 0)
   {
     printf("Failed to retrieve input stream information\n");
     return -2;
   }
 
-  for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
+  if(check_selected_tracks(ctx->input.fmt_ctx) < 0)
   {
-    AVCodecContext* codec_ctx = inputFile.fmt_ctx->streams[index]->codec;
-    if(codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && inputFile.v_index < 0)
+    return -3;
+  }
+
+  for(index = 0; index < ctx->input.fmt_ctx->nb_streams; index++)
+  {
+    AVCodecContext* codec_ctx = ctx->input.fmt_ctx->streams[index]->codec;
+    if(codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && ctx->input.v_index < 0 && 
+      stream_wanted(index, AVMEDIA_TYPE_VIDEO))
     {
-      inputFile.v_index = index;
+      ctx->input.v_index = index;
     }
-    else if(codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO && inputFile.a_index < 0)
+    else if(codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO && ctx->input.a_index < 0 && 
+      stream_wanted(index, AVMEDIA_TYPE_AUDIO))
     {
-      inputFile.a_index = index;
+      ctx->input.a_index = index;
     }
   } // for
 
-  if(inputFile.v_index < 0 && inputFile.a_index < 0)
+  discard_unused_streams(ctx->input.fmt_ctx, ctx->input.v_index, ctx->input.a_index);
+
+  if(ctx->input.v_index < 0 && ctx->input.a_index < 0)
   {
     printf("Failed to retrieve input stream information\n");
     return -3;
@@ -52,35 +381,212 @@ static int open_input(const char* fileName)
   return 0;
 }
 
-static int create_output(const char* fileName)
+// Output written in pieces which can be served before the remux is finished.
+typedef enum _SegmentMode
+{
+  SEGMENT_NONE,
+  SEGMENT_FMP4,   // one fragmented MP4, a fragment per segment
+  SEGMENT_HLS     // playlist plus MPEG-TS segments
+} SegmentMode;
+
+static SegmentMode segment_mode = SEGMENT_NONE;
+static double segment_duration = 4.0;
+
+// Parses fmp4 or hls with an optional segment duration in seconds, e.g. "hls:6".
+static int parse_segment_mode(const char* arg)
+{
+  const char* colon = strchr(arg, ':');
+  size_t len = (colon != NULL) ? (size_t)(colon - arg) : strlen(arg);
+
+  if(len == 4 && strncmp(arg, "fmp4", 4) == 0)
+  {
+    segment_mode = SEGMENT_FMP4;
+  }
+  else if(len == 3 && strncmp(arg, "hls", 3) == 0)
+  {
+    segment_mode = SEGMENT_HLS;
+  }
+  else
+  {
+    return -1;
+  }
+
+  if(colon != NULL)
+  {
+    segment_duration = atof(colon + 1);
+  }
+
+  return (segment_duration > 0.0) ? 0 : -2;
+}
+
+// Muxer options for the segment mode, given to avformat_write_header().
+static void set_segment_options(AVDictionary** options)
+{
+  char duration[32];
+
+  snprintf(duration, sizeof(duration), "%g", segment_duration);
+  switch(segment_mode)
+  {
+  case SEGMENT_FMP4:
+    // Fragments are cut by cut_fragment(). empty_moov makes the file playable from the first one.
+    av_dict_set(options, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+    break;
+  case SEGMENT_HLS:
+    // The muxer splits at keyframes and rewrites the playlist whenever a segment is closed.
+    av_dict_set(options, "hls_time", duration, 0);
+    av_dict_set(options, "hls_list_size", "0", 0);
+    break;
+  default:
+    break;
+  }
+}
+
+// Closes the current fragment at a keyframe of the first stream once it is long enough,
+// and pushes it to the file right away.
+static int cut_fragment(RemuxContext* ctx, const AVPacket* pkt)
 {
+  int ref_index = (ctx->output.v_index >= 0) ? ctx->output.v_index : ctx->output.a_index;
+  AVStream* stream = ctx->output.fmt_ctx->streams[ref_index];
+
+  if(segment_mode != SEGMENT_FMP4 || pkt->stream_index != ref_index ||
+    !(pkt->flags & AV_PKT_FLAG_KEY) || pkt->dts == AV_NOPTS_VALUE)
+  {
+    return 0;
+  }
+
+  if(ctx->fragment_start == AV_NOPTS_VALUE)
+  {
+    ctx->fragment_start = pkt->dts;
+    return 0;
+  }
+
+  if(pkt->dts - ctx->fragment_start < av_rescale_q((int64_t)(segment_duration * AV_TIME_BASE), AV_TIME_BASE_Q, stream->time_base))
+  {
+    return 0;
+  }
+
+  // Packets still waiting for interleaving belong to the fragment being closed.
+  if(av_interleaved_write_frame(ctx->output.fmt_ctx, NULL) < 0 ||
+    av_write_frame(ctx->output.fmt_ctx, NULL) < 0)
+  {
+    return -1;
+  }
+
+  avio_flush(ctx->output.fmt_ctx->pb);
+  ctx->fragment_start = pkt->dts;
+  ctx->nb_fragments++;
+  return 0;
+}
+
+static int needs_annexb(const AVOutputFormat* oformat)
+{
+  return strcmp(oformat->name, "mpegts") == 0 || strcmp(oformat->name, "hls") == 0;
+}
+
+static int is_avcc(const AVCodecContext* codec_ctx)
+{
+  return codec_ctx->codec_id == AV_CODEC_ID_H264 && codec_ctx->extradata_size > 0 && codec_ctx->extradata[0] == 1;
+}
+
+// Rewrites a video packet from length prefixed NAL units to start codes, with SPS and PPS in front of keyframes.
+static int filter_annexb(RemuxContext* ctx, AVPacket* pkt)
+{
+  AVCodecContext* codec_ctx = ctx->input.fmt_ctx->streams[ctx->input.v_index]->codec;
+  AVPacket out = *pkt;
+  int ret;
+
+  ret = av_bitstream_filter_filter(ctx->annexb, codec_ctx, NULL, &out.data, &out.size
+    , pkt->data, pkt->size, pkt->flags & AV_PKT_FLAG_KEY);
+  if(ret < 0)
+  {
+    return ret;
+  }
+
+  if(ret > 0)
+  {
+    // The filter allocated new data, side data moves over to the new packet.
+    out.buf = av_buffer_create(out.data, out.size, av_buffer_default_free, NULL, 0);
+    if(out.buf == NULL)
+    {
+      av_free(out.data);
+      return AVERROR(ENOMEM);
+    }
+
+    pkt->side_data = NULL;
+    pkt->side_data_elems = 0;
+    av_free_packet(pkt);
+    *pkt = out;
+  }
+
+  return 0;
+}
+
+static int create_output(RemuxContext* ctx, const char* fileName)
+{
+  AVDictionary* options = NULL;
+  const char* format_name = NULL;
   unsigned int index;
   int out_index;
+  int ret;
 
-  outputFile.fmt_ctx = NULL;
-  outputFile.a_index = outputFile.v_index = -1;
+  ctx->output.fmt_ctx = NULL;
+  ctx->output.a_index = ctx->output.v_index = -1;
+  ctx->fragment_start = AV_NOPTS_VALUE;
+  ctx->nb_fragments = 0;
+  ctx->annexb = NULL;
 
-  if(avformat_alloc_output_context2(&outputFile.fmt_ctx, NULL, NULL, fileName) < 0)
+  if(segment_mode == SEGMENT_FMP4)
+  {
+    format_name = "mp4";
+  }
+  else if(segment_mode == SEGMENT_HLS)
+  {
+    format_name = "hls";
+  }
+
+  fileName = live_url(fileName, stdout_url);
+
+  // Pipes and sockets have no extension to guess from, MPEG-TS is what live streams are carried in.
+  if(avformat_alloc_output_context2(&ctx->output.fmt_ctx, NULL, format_name, fileName) < 0 &&
+    (!live_mode || avformat_alloc_output_context2(&ctx->output.fmt_ctx, NULL, "mpegts", fileName) < 0))
   {
     printf("Could not create output context\n");
     return -1;
   }
 
+  if(live_mode)
+  {
+    ctx->output.fmt_ctx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+  }
+
+  // MPEG-TS needs start codes, which this version of libavformat does not insert by itself.
+  // avcC extradata, as in MP4 and MKV, starts with version 1 instead of a start code.
+  if(ctx->input.v_index >= 0 && needs_annexb(ctx->output.fmt_ctx->oformat) &&
+    is_avcc(ctx->input.fmt_ctx->streams[ctx->input.v_index]->codec))
+  {
+    ctx->annexb = av_bitstream_filter_init("h264_mp4toannexb");
+    if(ctx->annexb == NULL)
+    {
+      printf("Could not create h264_mp4toannexb filter\n");
+      return -1;
+    }
+  }
+
   // stream index starts from 0.
   out_index = 0;
   // this copy video/audio streams from input video.
-  for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
+  for(index = 0; index < ctx->input.fmt_ctx->nb_streams; index++)
   {
     // Make sure we only copy streams which is checked before.
-    if(index != inputFile.v_index && index != inputFile.a_index)
+    if(index != ctx->input.v_index && index != ctx->input.a_index)
     {
       continue;
     }
 
-    AVStream* in_stream = inputFile.fmt_ctx->streams[index];
+    AVStream* in_stream = ctx->input.fmt_ctx->streams[index];
     AVCodecContext* in_codec_ctx = in_stream->codec;
 
-    AVStream* out_stream = avformat_new_stream(outputFile.fmt_ctx, in_codec_ctx->codec);
+    AVStream* out_stream = avformat_new_stream(ctx->output.fmt_ctx, in_codec_ctx->codec);
     if(out_stream == NULL)
     {
       printf("Failed to allocate output stream\n");
@@ -98,25 +604,25 @@ static int create_output(const char* fileName)
     out_stream->time_base = in_stream->time_base;
     // Remove codec tag info for compatibility with ffmpeg.
     outCodecContext->codec_tag = 0;
-    if(outputFile.fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+    if(ctx->output.fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
     {
       outCodecContext->flags |= CODEC_FLAG_GLOBAL_HEADER;
     }
 
-    if(index == inputFile.v_index)
+    if(index == ctx->input.v_index)
     {
-      outputFile.v_index = out_index++;
+      ctx->output.v_index = out_index++;
     }
     else
     {
-      outputFile.a_index = out_index++;
+      ctx->output.a_index = out_index++;
     }
   } // for
 
-  if(!(outputFile.fmt_ctx->oformat->flags & AVFMT_NOFILE))
+  if(!(ctx->output.fmt_ctx->oformat->flags & AVFMT_NOFILE))
   {
     // This actually open the file
-    if(avio_open(&outputFile.fmt_ctx->pb, fileName, AVIO_FLAG_WRITE) < 0)
+    if(avio_open(&ctx->output.fmt_ctx->pb, fileName, AVIO_FLAG_WRITE) < 0)
     {
       printf("Failed to create output file %s\n", fileName);
       return -4;
@@ -124,7 +630,10 @@ static int create_output(const char* fileName)
   }
 
   // write the header for output video container.
-  if(avformat_write_header(outputFile.fmt_ctx, NULL) < 0)
+  set_segment_options(&options);
+  ret = avformat_write_header(ctx->output.fmt_ctx, &options);
+  av_dict_free(&options);
+  if(ret < 0)
   {
     printf("Failed writing header into output file\n");
     return -5;  
@@ -133,89 +642,701 @@ static int create_output(const char* fileName)
   return 0;
 }
 
-static void release()
+static void release(RemuxContext* ctx)
 {
-  if(inputFile.fmt_ctx != NULL)
+  if(ctx->input.fmt_ctx != NULL)
   {
-    avformat_close_input(&inputFile.fmt_ctx);
+    avformat_close_input(&ctx->input.fmt_ctx);
   }
 
-  if(outputFile.fmt_ctx != NULL)
+  close_mapped_file(&ctx->mapped);
+
+  if(ctx->output.fmt_ctx != NULL)
   {
-    if(!(outputFile.fmt_ctx->oformat->flags & AVFMT_NOFILE))
+    if(!(ctx->output.fmt_ctx->oformat->flags & AVFMT_NOFILE))
     {
-      avio_closep(&outputFile.fmt_ctx->pb);
+      avio_closep(&ctx->output.fmt_ctx->pb);
     }
-    avformat_free_context(outputFile.fmt_ctx);
+    avformat_free_context(ctx->output.fmt_ctx);
+  }
+
+  if(ctx->annexb != NULL)
+  {
+    av_bitstream_filter_close(ctx->annexb);
+    ctx->annexb = NULL;
   }
 }
 
-int main(int argc, char* argv[])
+static int64_t monotonic_us()
 {
-  int ret;
+  struct timespec ts;
 
-  av_register_all();
-  av_log_set_level(AV_LOG_DEBUG);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Built with -DCOUNT_ALLOCS, every heap allocation of the process, the libraries' included, goes through
+// these replacements of the glibc allocator, which count it. Other builds keep the stock allocator.
+#define ALLOC_WARMUP_PACKETS 100   // packets which fill the muxer's and demuxer's buffers first
+
+#ifdef COUNT_ALLOCS
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+extern void* __libc_valloc(size_t size);
+extern void* __libc_pvalloc(size_t size);
+
+static volatile int64_t nb_heap_allocs = 0;
 
-  if(argc < 3)
+void* malloc(size_t size)
+{
+  __sync_fetch_and_add(&nb_heap_allocs, 1);
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+  __sync_fetch_and_add(&nb_heap_allocs, 1);
+  return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+  __sync_fetch_and_add(&nb_heap_allocs, 1);
+  return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+  __sync_fetch_and_add(&nb_heap_allocs, 1);
+  return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+  return memalign(alignment, size);
+}
+
+void* valloc(size_t size)
+{
+  __sync_fetch_and_add(&nb_heap_allocs, 1);
+  return __libc_valloc(size);
+}
+
+void* pvalloc(size_t size)
+{
+  __sync_fetch_and_add(&nb_heap_allocs, 1);
+  return __libc_pvalloc(size);
+}
+
+// av_malloc allocates through this one.
+int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+  void* mem;
+
+  if(alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
   {
-    printf("usage : %s <input> <output>\n", argv[0]);
-    return 0;
+    return EINVAL;
   }
 
-  if(open_input(argv[1]) < 0)
+  mem = memalign(alignment, size);
+  if(mem == NULL)
   {
-    goto main_end;
+    return ENOMEM;
   }
 
-  if(create_output(argv[2]) < 0)
+  *ptr = mem;
+  return 0;
+}
+
+static int64_t heap_allocs()
+{
+  return __sync_add_and_fetch(&nb_heap_allocs, 0);
+}
+#else
+// Nothing is counted.
+static int64_t heap_allocs()
+{
+  return -1;
+}
+#endif
+
+// Remuxes one file, returns the number of packets written or a negative error.
+static int64_t remux(const char* input, const char* output, int verbose)
+{
+  RemuxContext remux_ctx;
+  RemuxContext* ctx = &remux_ctx;
+  int64_t nb_packets = 0;
+  int ret;
+
+  memset(ctx, 0, sizeof(*ctx));
+
+  if(open_input(ctx, input) < 0)
   {
-    goto main_end;
+    nb_packets = -1;
+    goto remux_end;
   }
 
-  // dump output container, which i just make from above.
-  av_dump_format(outputFile.fmt_ctx, 0, outputFile.fmt_ctx->filename, 1);
+  if(create_output(ctx, output) < 0)
+  {
+    nb_packets = -2;
+    goto remux_end;
+  }
+
+  if(verbose)
+  {
+    // dump output container, which i just make from above.
+    av_dump_format(ctx->output.fmt_ctx, 0, ctx->output.fmt_ctx->filename, 1);
+  }
 
   AVPacket pkt;
   int out_stream_index;
+  int64_t arrival, pts;
+  int64_t latency_total = 0;
+  int64_t latency_max = 0;
+  int64_t nb_latencies = 0;
+  int64_t warmup_allocs = 0;
+  int64_t steady_allocs;
 
   while(1)
   {
-    ret = av_read_frame(inputFile.fmt_ctx, &pkt);
-    if(ret == AVERROR_EOF)
+    ret = av_read_frame(ctx->input.fmt_ctx, &pkt);
+    // A live source can also end with a read error, e.g. when the sender goes away.
+    if(ret < 0)
     {
-      printf("End of frame\n");
+      if(verbose) printf((ret == AVERROR_EOF) ? "End of frame\n" : "Error occurred while reading packet\n");
       break;
     }
+    arrival = monotonic_us();
 
-    if(pkt.stream_index != inputFile.v_index && 
-      pkt.stream_index != inputFile.a_index)
+    if(pkt.stream_index != ctx->input.v_index && 
+      pkt.stream_index != ctx->input.a_index)
     {
       av_free_packet(&pkt);
       continue;
     }
 
-    AVStream* in_stream = inputFile.fmt_ctx->streams[pkt.stream_index];
-    out_stream_index = (pkt.stream_index == inputFile.v_index) ? 
-            outputFile.v_index : outputFile.a_index;
-    AVStream* out_stream = outputFile.fmt_ctx->streams[out_stream_index];
+    if(ctx->annexb != NULL && pkt.stream_index == ctx->input.v_index && filter_annexb(ctx, &pkt) < 0)
+    {
+      printf("Failed to convert H.264 packet to Annex B\n");
+      av_free_packet(&pkt);
+      nb_packets = -3;
+      break;
+    }
+
+    AVStream* in_stream = ctx->input.fmt_ctx->streams[pkt.stream_index];
+    out_stream_index = (pkt.stream_index == ctx->input.v_index) ? 
+            ctx->output.v_index : ctx->output.a_index;
+    AVStream* out_stream = ctx->output.fmt_ctx->streams[out_stream_index];
 
     av_packet_rescale_ts(&pkt, in_stream->time_base, out_stream->time_base);
 
     pkt.stream_index = out_stream_index;
 
-    if(av_interleaved_write_frame(outputFile.fmt_ctx, &pkt) < 0)
+    if(cut_fragment(ctx, &pkt) < 0)
+    {
+      printf("Failed to flush fragment\n");
+      av_free_packet(&pkt);
+      nb_packets = -3;
+      break;
+    }
+
+    pts = pkt.pts;
+
+    // Interleaving would hold packets back until every stream has one queued.
+    ret = live_mode ? av_write_frame(ctx->output.fmt_ctx, &pkt) : av_interleaved_write_frame(ctx->output.fmt_ctx, &pkt);
+    if(live_mode)
+    {
+      av_free_packet(&pkt);
+    }
+
+    if(ret < 0)
     {
       printf("Error occurred when writing packet into file\n");
+      nb_packets = -3;
       break;
     }   
+    nb_packets++;
+    if(nb_packets == ALLOC_WARMUP_PACKETS)
+    {
+      warmup_allocs = heap_allocs();
+    }
+
+    if(live_mode && out_stream_index == ctx->output.v_index)
+    {
+      int64_t latency = monotonic_us() - arrival;
+      latency_total += latency;
+      latency_max = FFMAX(latency_max, latency);
+      nb_latencies++;
+      printf("Latency : pts %"PRId64", %"PRId64" us\n", pts, latency);
+    }
   } // while
+  steady_allocs = heap_allocs();
+
+  if(nb_latencies > 0)
+  {
+    printf("Latency : %"PRId64" frames, average %"PRId64" us, max %"PRId64" us\n"
+      , nb_latencies, latency_total / nb_latencies, latency_max);
+  }
+
+  // Packets of batch jobs running side by side would be counted together.
+  if(verbose && steady_allocs >= 0 && nb_packets > ALLOC_WARMUP_PACKETS)
+  {
+    printf("Allocations : %"PRId64" total, %.2f per packet over %"PRId64" packets after warm-up\n"
+      , heap_allocs(), (double)(steady_allocs - warmup_allocs) / (nb_packets - ALLOC_WARMUP_PACKETS)
+      , nb_packets - ALLOC_WARMUP_PACKETS);
+  }
 
   // Writes remain informations, which it is called trailer.
-  av_write_trailer(outputFile.fmt_ctx);
+  av_write_trailer(ctx->output.fmt_ctx);
+
+  if(verbose && segment_mode == SEGMENT_FMP4)
+  {
+    printf("Fragments : %d\n", ctx->nb_fragments + 1);
+  }
 
-main_end:
-  release();
+remux_end:
+  release(ctx);
+
+  return nb_packets;
+}
+
+typedef struct _BatchJob
+{
+  char* input;
+  char* output;
+  int64_t nb_packets;   // negative on failure
+  int64_t elapsed;      // microseconds
+} BatchJob;
+
+// Work list shared by the worker threads, each takes the next job until none is left.
+typedef struct _Batch
+{
+  BatchJob* jobs;
+  int nb_jobs;
+  int next_job;
+  pthread_mutex_t mutex;
+} Batch;
+
+static Batch batch;
+
+static int add_batch_job(const char* input, const char* output_dir, const char* ext)
+{
+  const char* base = strrchr(input, '/');
+  const char* dot;
+  BatchJob* jobs;
+  size_t size;
+  int base_len;
+
+  base = (base != NULL) ? base + 1 : input;
+  dot = strrchr(base, '.');
+  base_len = (dot != NULL && dot != base) ? (int)(dot - base) : (int)strlen(base);
+  if(ext == NULL)
+  {
+    // Keep the input container.
+    ext = (dot != NULL && dot != base) ? dot + 1 : "mkv";
+  }
+
+  jobs = av_realloc_array(batch.jobs, batch.nb_jobs + 1, sizeof(BatchJob));
+  if(jobs == NULL)
+  {
+    return AVERROR(ENOMEM);
+  }
+  batch.jobs = jobs;
+
+  size = strlen(output_dir) + base_len + strlen(ext) + 3;
+  jobs[batch.nb_jobs].input = av_strdup(input);
+  jobs[batch.nb_jobs].output = av_malloc(size);
+  if(jobs[batch.nb_jobs].input == NULL || jobs[batch.nb_jobs].output == NULL)
+  {
+    av_freep(&jobs[batch.nb_jobs].input);
+    av_freep(&jobs[batch.nb_jobs].output);
+    return AVERROR(ENOMEM);
+  }
+
+  snprintf(jobs[batch.nb_jobs].output, size, "%s/%.*s.%s", output_dir, base_len, base, ext);
+  jobs[batch.nb_jobs].nb_packets = 0;
+  jobs[batch.nb_jobs].elapsed = 0;
+  batch.nb_jobs++;
 
   return 0;
 }
+
+static int compare_jobs(const void* a, const void* b)
+{
+  return strcmp(((const BatchJob*)a)->input, ((const BatchJob*)b)->input);
+}
+
+// source is either a directory, whose regular files are all remuxed,
+// or a manifest which lists one input path per line.
+static int load_batch(const char* source, const char* output_dir, const char* ext)
+{
+  struct stat st;
+  char path[4096];
+  int ret = 0;
+
+  if(stat(source, &st) < 0)
+  {
+    printf("Could not find batch source %s\n", source);
+    return -1;
+  }
+
+  if(S_ISDIR(st.st_mode))
+  {
+    DIR* dir = opendir(source);
+    struct dirent* entry;
+
+    if(dir == NULL)
+    {
+      printf("Could not open directory %s\n", source);
+      return -2;
+    }
+
+    while(ret >= 0 && (entry = readdir(dir)) != NULL)
+    {
+      snprintf(path, sizeof(path), "%s/%s", source, entry->d_name);
+      if(stat(path, &st) == 0 && S_ISREG(st.st_mode))
+      {
+        ret = add_batch_job(path, output_dir, ext);
+      }
+    }
+
+    closedir(dir);
+
+    // readdir order is arbitrary, sort so that summaries can be compared.
+    qsort(batch.jobs, batch.nb_jobs, sizeof(BatchJob), compare_jobs);
+  }
+  else
+  {
+    FILE* manifest = fopen(source, "r");
+    if(manifest == NULL)
+    {
+      printf("Could not open manifest %s\n", source);
+      return -3;
+    }
+
+    while(ret >= 0 && fgets(path, sizeof(path), manifest) != NULL)
+    {
+      path[strcspn(path, "\r\n")] = '\0';
+      if(path[0] != '\0' && path[0] != '#')
+      {
+        ret = add_batch_job(path, output_dir, ext);
+      }
+    }
+
+    fclose(manifest);
+  }
+
+  return ret;
+}
+
+static void* batch_worker(void* arg)
+{
+  BatchJob* job;
+  int64_t begin;
+
+  while(1)
+  {
+    pthread_mutex_lock(&batch.mutex);
+    job = (batch.next_job < batch.nb_jobs) ? &batch.jobs[batch.next_job++] : NULL;
+    pthread_mutex_unlock(&batch.mutex);
+
+    if(job == NULL)
+    {
+      break;
+    }
+
+    begin = monotonic_us();
+    job->nb_packets = remux(job->input, job->output, 0);
+    job->elapsed = monotonic_us() - begin;
+  } // while
+
+  return NULL;
+}
+
+// libavcodec refuses concurrent avcodec_open2() calls, which stream probing does,
+// unless it is given a lock.
+static int lock_manager(void** mutex, enum AVLockOp op)
+{
+  switch(op)
+  {
+  case AV_LOCK_CREATE:
+    *mutex = av_malloc(sizeof(pthread_mutex_t));
+    return (*mutex == NULL || pthread_mutex_init(*mutex, NULL) != 0);
+  case AV_LOCK_OBTAIN:
+    return (pthread_mutex_lock(*mutex) != 0);
+  case AV_LOCK_RELEASE:
+    return (pthread_mutex_unlock(*mutex) != 0);
+  case AV_LOCK_DESTROY:
+    pthread_mutex_destroy(*mutex);
+    av_freep(mutex);
+    return 0;
+  }
+
+  return 1;
+}
+
+// Whether path is one of the inputs or one of the first nb_outputs outputs, all of them resolved.
+static int batch_path_taken(const char* path, char** inputs, char** outputs, int nb_outputs)
+{
+  int index;
+
+  for(index = 0; index < batch.nb_jobs; index++)
+  {
+    if(inputs[index] != NULL && strcmp(inputs[index], path) == 0)
+    {
+      return 1;
+    }
+  }
+
+  for(index = 0; index < nb_outputs; index++)
+  {
+    if(strcmp(outputs[index], path) == 0)
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// An output must neither truncate an input, which may be read at the same time, nor another output,
+// as a.mp4 and a.mov would with -e mkv. Colliding names get a -<n> suffix before the extension.
+static int make_batch_outputs_unique(const char* output_dir)
+{
+  char dir[PATH_MAX];
+  char path[PATH_MAX + 32];
+  char** inputs;
+  char** outputs;
+  int ret = 0;
+  int index, n;
+
+  if(realpath(output_dir, dir) == NULL)
+  {
+    printf("Output directory %s does not exist\n", output_dir);
+    return -1;
+  }
+
+  inputs = av_mallocz_array(FFMAX(batch.nb_jobs, 1), sizeof(char*));
+  outputs = av_mallocz_array(FFMAX(batch.nb_jobs, 1), sizeof(char*));
+  if(inputs == NULL || outputs == NULL)
+  {
+    ret = AVERROR(ENOMEM);
+    goto unique_end;
+  }
+
+  for(index = 0; index < batch.nb_jobs; index++)
+  {
+    inputs[index] = realpath(batch.jobs[index].input, NULL);
+  }
+
+  for(index = 0; index < batch.nb_jobs; index++)
+  {
+    BatchJob* job = &batch.jobs[index];
+    // The output is <output_dir>/<name>.<ext>, as made by add_batch_job.
+    const char* name = strrchr(job->output, '/') + 1;
+    const char* dot = strrchr(name, '.');
+
+    for(n = 0; ; n++)
+    {
+      if(n == 0)
+      {
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+      }
+      else
+      {
+        snprintf(path, sizeof(path), "%s/%.*s-%d%s", dir, (int)(dot - name), name, n, dot);
+      }
+
+      if(!batch_path_taken(path, inputs, outputs, index))
+      {
+        break;
+      }
+    }
+
+    if(n > 0)
+    {
+      printf("Output of %s renamed to %s\n", job->input, path);
+    }
+
+    av_free(job->output);
+    job->output = av_strdup(path);
+    if(job->output == NULL)
+    {
+      ret = AVERROR(ENOMEM);
+      break;
+    }
+    outputs[index] = job->output;
+  }
+
+unique_end:
+  for(index = 0; inputs != NULL && index < batch.nb_jobs; index++)
+  {
+    // realpath allocates with malloc.
+    free(inputs[index]);
+  }
+  av_free(inputs);
+  av_free(outputs);
+
+  return ret;
+}
+
+static int run_batch(const char* source, const char* output_dir, const char* ext, int nb_workers)
+{
+  pthread_t* workers;
+  int64_t begin, elapsed;
+  int nb_started = 0;
+  int nb_failed = 0;
+  int index;
+  int ret = -1;
+
+  pthread_mutex_init(&batch.mutex, NULL);
+
+  if(av_lockmgr_register(lock_manager) < 0)
+  {
+    printf("Failed to register lock manager\n");
+    goto batch_end;
+  }
+
+  if(load_batch(source, output_dir, ext) < 0 || make_batch_outputs_unique(output_dir) < 0)
+  {
+    goto batch_end;
+  }
+
+  workers = av_malloc_array(nb_workers, sizeof(pthread_t));
+  if(workers == NULL)
+  {
+    goto batch_end;
+  }
+
+  begin = monotonic_us();
+  for(index = 0; index < nb_workers && index < batch.nb_jobs; index++)
+  {
+    if(pthread_create(&workers[nb_started], NULL, batch_worker, NULL) != 0)
+    {
+      break;
+    }
+    nb_started++;
+  }
+
+  if(nb_started == 0)
+  {
+    // Still do the work, just without extra threads.
+    batch_worker(NULL);
+  }
+
+  for(index = 0; index < nb_started; index++)
+  {
+    pthread_join(workers[index], NULL);
+  }
+  elapsed = monotonic_us() - begin;
+  av_free(workers);
+
+  printf("%-6s %10s %10s %s\n", "status", "time(ms)", "packets", "input");
+  for(index = 0; index < batch.nb_jobs; index++)
+  {
+    BatchJob* job = &batch.jobs[index];
+    if(job->nb_packets < 0)
+    {
+      nb_failed++;
+    }
+
+    printf("%-6s %10.1f %10"PRId64" %s\n"
+      , (job->nb_packets < 0) ? "FAILED" : "ok"
+      , job->elapsed / 1000.0
+      , FFMAX(job->nb_packets, 0)
+      , job->input);
+  }
+  printf("%d files, %d failed, %.3f s with %d workers\n"
+    , batch.nb_jobs, nb_failed, elapsed / 1e6, FFMAX(nb_started, 1));
+  ret = nb_failed ? -1 : 0;
+
+batch_end:
+  for(index = 0; index < batch.nb_jobs; index++)
+  {
+    av_free(batch.jobs[index].input);
+    av_free(batch.jobs[index].output);
+  }
+  av_freep(&batch.jobs);
+  pthread_mutex_destroy(&batch.mutex);
+  av_lockmgr_register(NULL);
+
+  return ret;
+}
+
+int main(int argc, char* argv[])
+{
+  const char* output_dir = NULL;
+  const char* ext = NULL;
+  int nb_workers = 4;
+  int opt;
+
+  av_register_all();
+  av_log_set_level(AV_LOG_DEBUG);
+
+  while((opt = getopt(argc, argv, "mb:j:e:T:s:l")) != -1)
+  {
+    switch(opt)
+    {
+    case 'm':
+      use_mmap = 1;
+      break;
+    case 'l':
+      live_mode = 1;
+      break;
+    case 'T':
+      if(parse_stream_selector(optarg) < 0)
+      {
+        printf("Invalid stream selection %s\n", optarg);
+        return -1;
+      }
+      break;
+    case 's':
+      if(parse_segment_mode(optarg) < 0)
+      {
+        optind = argc;
+      }
+      break;
+    case 'b':
+      output_dir = optarg;
+      break;
+    case 'j':
+      nb_workers = atoi(optarg);
+      break;
+    case 'e':
+      ext = optarg;
+      break;
+    default:
+      optind = argc;
+      break;
+    }
+  }
+
+  if(output_dir != NULL && argc - optind >= 1 && nb_workers > 0)
+  {
+    // Debug log of many files at once is unreadable.
+    av_log_set_level(AV_LOG_ERROR);
+    return (run_batch(argv[optind], output_dir, ext, nb_workers) < 0) ? 1 : 0;
+  }
+
+  if(output_dir != NULL || argc - optind < 2)
+  {
+    printf("usage : %s [-m] [-l] [-T av|video|audio|<stream>[,<stream>]] [-s fmp4|hls[:seconds]] <input> <output>\n", argv[0]);
+    printf("        %s [-m] [-T av|video|audio|<stream>[,<stream>]] [-s fmp4|hls[:seconds]] -b <output_dir> [-j workers] [-e extension] <directory|manifest>\n", argv[0]);
+    return 0;
+  }
+
+  if(live_mode)
+  {
+    avformat_network_init();
+
+    if(strcmp(argv[optind + 1], "-") == 0 && move_stdout_to_stderr() < 0)
+    {
+      printf("Failed to move output off stdout\n");
+      return 1;
+    }
+  }
+
+  return (remux(argv[optind], argv[optind + 1], 1) < 0) ? 1 : 0;
+}
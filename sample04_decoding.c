@@ -2,7 +2,16 @@
 #include <libavcodec/avcodec.h>
 #include <libavutil/common.h>
 #include <libavutil/avutil.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/imgutils.h>
+#include <libswscale/swscale.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
 
 typedef struct _FileContext
 {
@@ -11,127 +20,1518 @@ typedef struct _FileContext
   int a_index;
 } FileContext;
 
+// Decoder threading for one stream type.
+typedef struct _ThreadConfig
+{
+  int thread_type;   // FF_THREAD_FRAME, FF_THREAD_SLICE or both
+  int thread_count;  // 0 lets libavcodec pick by number of cores
+} ThreadConfig;
+
+// Decoded video frames from one keyframe up to the next one.
+typedef struct _GopEntry
+{
+  int64_t start_pts;   // pts of the keyframe, in stream time_base
+  int64_t end_pts;     // pts of the next keyframe, INT64_MAX for the last GOP
+  AVFrame** frames;    // in presentation order
+  int nb_frames;
+  int capacity;
+  uint64_t last_used;
+} GopEntry;
+
+typedef struct _GopCache
+{
+  GopEntry* gops;
+  int nb_gops;
+  uint64_t clock;
+  int hits;
+  int misses;
+  int64_t decoded_frames;
+} GopCache;
+
 static FileContext inputFile;
+static GopCache frame_cache;
+
+// Same as libavcodec defaults, which means a single thread.
+static ThreadConfig vdecoder_threads = {FF_THREAD_FRAME | FF_THREAD_SLICE, 1};
+static ThreadConfig adecoder_threads = {FF_THREAD_FRAME | FF_THREAD_SLICE, 1};
+
+static const char* thread_type_name(int thread_type)
+{
+  switch(thread_type)
+  {
+  case FF_THREAD_FRAME:
+    return "frame";
+  case FF_THREAD_SLICE:
+    return "slice";
+  case FF_THREAD_FRAME | FF_THREAD_SLICE:
+    return "auto";
+  }
+
+  return "none";
+}
+
+// Parses <stream>=<type>[:<count>] where stream is v or a
+// and type is frame, slice or auto, e.g. "v=frame:8".
+static int parse_thread_config(const char* arg)
+{
+  ThreadConfig* config;
+  const char* type;
+  const char* count;
+  size_t type_len;
+
+  if(strncmp(arg, "v=", 2) == 0)
+  {
+    config = &vdecoder_threads;
+  }
+  else if(strncmp(arg, "a=", 2) == 0)
+  {
+    config = &adecoder_threads;
+  }
+  else
+  {
+    return -1;
+  }
+
+  type = arg + 2;
+  count = strchr(type, ':');
+  type_len = (count != NULL) ? (size_t)(count - type) : strlen(type);
+
+  if(type_len == 5 && strncmp(type, "frame", 5) == 0)
+  {
+    config->thread_type = FF_THREAD_FRAME;
+  }
+  else if(type_len == 5 && strncmp(type, "slice", 5) == 0)
+  {
+    config->thread_type = FF_THREAD_SLICE;
+  }
+  else if(type_len == 4 && strncmp(type, "auto", 4) == 0)
+  {
+    config->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  }
+  else
+  {
+    return -2;
+  }
+
+  if(count != NULL)
+  {
+    config->thread_count = atoi(count + 1);
+    if(config->thread_count < 0)
+    {
+      return -3;
+    }
+  }
+
+  return 0;
+}
+
+#define FRAME_ALIGN 64                // cache line and widest SIMD register
+#define HUGE_PAGE_SIZE (2 << 20)
+#define MAX_FRAME_POOLS 32
+
+typedef enum _FrameAllocMode
+{
+  FRAME_ALLOC_DEFAULT,   // libavcodec's own get_buffer2
+  FRAME_ALLOC_POOL,      // size-class pools of aligned memory
+  FRAME_ALLOC_THP,       // pools backed by transparent huge pages
+  FRAME_ALLOC_HUGETLB,   // pools backed by reserved huge pages, THP if none left
+} FrameAllocMode;
+
+// Buffer pools by size class, shared by every video decoder.
+typedef struct _FramePools
+{
+  AVBufferPool* pools[MAX_FRAME_POOLS];
+  int sizes[MAX_FRAME_POOLS];
+  int nb_pools;
+  int64_t nb_frames;            // frames served from the pools
+  int64_t nb_allocs;            // backing allocations, the rest were reused
+  int64_t frame_bytes;
+  int64_t alloc_bytes;
+  int64_t nb_hugetlb_allocs;
+  int64_t nb_fallbacks;         // frames left to the default allocator
+  pthread_mutex_t mutex;
+} FramePools;
+
+static FrameAllocMode frame_alloc_mode = FRAME_ALLOC_DEFAULT;
+static FramePools frame_pools = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static int parse_frame_alloc_mode(const char* arg)
+{
+  if(strcmp(arg, "default") == 0)
+  {
+    frame_alloc_mode = FRAME_ALLOC_DEFAULT;
+  }
+  else if(strcmp(arg, "pool") == 0)
+  {
+    frame_alloc_mode = FRAME_ALLOC_POOL;
+  }
+  else if(strcmp(arg, "thp") == 0)
+  {
+    frame_alloc_mode = FRAME_ALLOC_THP;
+  }
+  else if(strcmp(arg, "hugetlb") == 0)
+  {
+    frame_alloc_mode = FRAME_ALLOC_HUGETLB;
+  }
+  else
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+static void free_frame_memory(void* opaque, uint8_t* data)
+{
+  // opaque holds the mapping size of huge pages.
+  if(opaque != NULL)
+  {
+    munmap(data, (size_t)(intptr_t)opaque);
+  }
+  else
+  {
+    free(data);
+  }
+}
+
+static AVBufferRef* alloc_frame_memory(int size)
+{
+  AVBufferRef* buf;
+  void* data = NULL;
+  void* opaque = NULL;
+  int huge = (frame_alloc_mode >= FRAME_ALLOC_THP && size >= HUGE_PAGE_SIZE);
+
+  if(huge && frame_alloc_mode == FRAME_ALLOC_HUGETLB)
+  {
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(data == MAP_FAILED)
+    {
+      data = NULL;
+    }
+    else
+    {
+      opaque = (void*)(intptr_t)size;
+    }
+  }
+
+  if(data == NULL)
+  {
+    if(posix_memalign(&data, huge ? HUGE_PAGE_SIZE : FRAME_ALIGN, size) != 0)
+    {
+      return NULL;
+    }
+
+    if(huge)
+    {
+      madvise(data, size, MADV_HUGEPAGE);
+    }
+  }
+
+  buf = av_buffer_create(data, size, free_frame_memory, opaque, 0);
+  if(buf == NULL)
+  {
+    free_frame_memory(opaque, data);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&frame_pools.mutex);
+  frame_pools.nb_allocs++;
+  frame_pools.alloc_bytes += size;
+  frame_pools.nb_hugetlb_allocs += (opaque != NULL);
+  pthread_mutex_unlock(&frame_pools.mutex);
+
+  return buf;
+}
+
+// Rounds up to a quarter of the next power of two, or to whole huge pages,
+// so frames of slightly different sizes still share a pool.
+static int frame_size_class(int size)
+{
+  int step = 4096;
+
+  if(frame_alloc_mode >= FRAME_ALLOC_THP && size >= HUGE_PAGE_SIZE)
+  {
+    return FFALIGN(size, HUGE_PAGE_SIZE);
+  }
+
+  while(step * 4 < size)
+  {
+    step *= 2;
+  }
+
+  return FFALIGN(size, step);
+}
+
+static AVBufferPool* get_frame_pool(int size)
+{
+  AVBufferPool* pool = NULL;
+  int index;
+
+  size = frame_size_class(size);
+
+  pthread_mutex_lock(&frame_pools.mutex);
+  for(index = 0; index < frame_pools.nb_pools; index++)
+  {
+    if(frame_pools.sizes[index] == size)
+    {
+      pool = frame_pools.pools[index];
+      break;
+    }
+  }
+
+  if(pool == NULL && frame_pools.nb_pools < MAX_FRAME_POOLS)
+  {
+    pool = av_buffer_pool_init(size, alloc_frame_memory);
+    if(pool != NULL)
+    {
+      frame_pools.pools[frame_pools.nb_pools] = pool;
+      frame_pools.sizes[frame_pools.nb_pools] = size;
+      frame_pools.nb_pools++;
+    }
+  }
+  pthread_mutex_unlock(&frame_pools.mutex);
+
+  return pool;
+}
+
+// get_buffer2 handing out all planes of a video frame in one pooled buffer.
+static int get_pooled_buffer(AVCodecContext* codec_ctx, AVFrame* frame, int flags)
+{
+  const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(frame->format);
+  int linesize_align[AV_NUM_DATA_POINTERS];
+  int linesizes[4];
+  uint8_t* planes[4];
+  int width = frame->width;
+  int height = frame->height;
+  AVBufferPool* pool = NULL;
+  int size;
+  int index;
+
+  if(desc != NULL && !(desc->flags & AV_PIX_FMT_FLAG_HWACCEL))
+  {
+    // Same padding as libavcodec, so decoders may write past the visible picture.
+    avcodec_align_dimensions2(codec_ctx, &width, &height, linesize_align);
+    if(av_image_fill_linesizes(linesizes, frame->format, width) >= 0)
+    {
+      for(index = 0; index < 4; index++)
+      {
+        linesizes[index] = FFALIGN(linesizes[index], FRAME_ALIGN);
+      }
+
+      // Without a base pointer this only gives the offset of every plane.
+      size = av_image_fill_pointers(planes, frame->format, height, NULL, linesizes);
+      if(size > 0)
+      {
+        pool = get_frame_pool(size + FRAME_ALIGN);
+      }
+    }
+  }
+
+  if(pool == NULL)
+  {
+    pthread_mutex_lock(&frame_pools.mutex);
+    frame_pools.nb_fallbacks++;
+    pthread_mutex_unlock(&frame_pools.mutex);
+
+    return avcodec_default_get_buffer2(codec_ctx, frame, flags);
+  }
+
+  frame->buf[0] = av_buffer_pool_get(pool);
+  if(frame->buf[0] == NULL)
+  {
+    return AVERROR(ENOMEM);
+  }
+
+  for(index = 0; index < 4; index++)
+  {
+    if(index == 0 || planes[index] != NULL)
+    {
+      frame->data[index] = frame->buf[0]->data + (planes[index] - planes[0]);
+      frame->linesize[index] = linesizes[index];
+    }
+  }
+  frame->extended_data = frame->data;
+
+  pthread_mutex_lock(&frame_pools.mutex);
+  frame_pools.nb_frames++;
+  frame_pools.frame_bytes += size;
+  pthread_mutex_unlock(&frame_pools.mutex);
+
+  return 0;
+}
+
+// Pools go away once the last frame taken from them is freed.
+static void release_frame_pools()
+{
+  int index;
+
+  if(frame_alloc_mode == FRAME_ALLOC_DEFAULT)
+  {
+    return;
+  }
+
+  printf("Frame pools : %"PRId64" frames (%.1f MB), %"PRId64" allocations (%.1f MB, %"PRId64" on hugetlb), "
+    "%d size classes, %"PRId64" fallbacks\n"
+    , frame_pools.nb_frames, frame_pools.frame_bytes / 1048576.0
+    , frame_pools.nb_allocs, frame_pools.alloc_bytes / 1048576.0, frame_pools.nb_hugetlb_allocs
+    , frame_pools.nb_pools, frame_pools.nb_fallbacks);
+
+  for(index = 0; index < frame_pools.nb_pools; index++)
+  {
+    av_buffer_pool_uninit(&frame_pools.pools[index]);
+  }
+  frame_pools.nb_pools = 0;
+}
+
+static int open_decoder(AVCodecContext* codec_ctx, const ThreadConfig* threads)
+{
+  // Find a decoder by codec ID
+  AVCodec* decoder = avcodec_find_decoder(codec_ctx->codec_id);
+  if(decoder == NULL)
+  {
+    return -1;
+  }
+
+  // Threading has to be decided before the codec is opened.
+  codec_ctx->thread_type = threads->thread_type;
+  codec_ctx->thread_count = threads->thread_count;
+
+  // Video frames come from the shared pools, which decoders without DR1 can not write into.
+  if(frame_alloc_mode != FRAME_ALLOC_DEFAULT && codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO &&
+    (decoder->capabilities & CODEC_CAP_DR1))
+  {
+    codec_ctx->get_buffer2 = get_pooled_buffer;
+    codec_ctx->thread_safe_callbacks = 1;
+  }
+
+  // Open the codec using decoder
+  if(avcodec_open2(codec_ctx, decoder, NULL) < 0)
+  {
+    return -2;
+  }
+
+  // libavcodec falls back to what the codec supports, so report what is actually used.
+  printf("%s decoder %s : requested %s threading with %d threads, using %s threading with %d threads\n"
+    , (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ? "Video" : "Audio"
+    , decoder->name
+    , thread_type_name(threads->thread_type), threads->thread_count
+    , thread_type_name(codec_ctx->active_thread_type), codec_ctx->thread_count);
+
+  return 0;
+}
+
+// Streams to read, by type or by index. Everything else is discarded by the demuxer.
+static int select_video = 1;
+static int select_audio = 1;
+static int selected_tracks[2] = {-1, -1};
+static int nb_selected_tracks = 0;
+
+// Parses av, video, audio or up to two stream indexes, e.g. "0,3".
+static int parse_stream_selector(const char* arg)
+{
+  const char* track = arg;
+  char* end;
+
+  select_video = select_audio = 1;
+  nb_selected_tracks = 0;
+
+  if(strcmp(arg, "av") == 0)
+  {
+    return 0;
+  }
+  else if(strcmp(arg, "video") == 0)
+  {
+    select_audio = 0;
+    return 0;
+  }
+  else if(strcmp(arg, "audio") == 0)
+  {
+    select_video = 0;
+    return 0;
+  }
+
+  while(*track != '\0' && nb_selected_tracks < 2)
+  {
+    long index = strtol(track, &end, 10);
+    if(end == track || index < 0)
+    {
+      return -1;
+    }
+
+    selected_tracks[nb_selected_tracks++] = (int)index;
+    if(*end == ',' && end[1] == '\0')
+    {
+      return -1;
+    }
+    track = (*end == ',') ? end + 1 : end;
+  }
+
+  return (*track == '\0' && nb_selected_tracks > 0) ? 0 : -2;
+}
+
+static int stream_wanted(unsigned int index, enum AVMediaType type)
+{
+  int track;
+
+  if(nb_selected_tracks > 0)
+  {
+    for(track = 0; track < nb_selected_tracks; track++)
+    {
+      if(selected_tracks[track] == (int)index)
+      {
+        return 1;
+      }
+    }
+
+    return 0;
+  }
+
+  return (type == AVMEDIA_TYPE_VIDEO) ? select_video : select_audio;
+}
+
+// Streams picked by index still have to be audio or video.
+static int check_selected_tracks(AVFormatContext* fmt_ctx)
+{
+  int track;
+
+  for(track = 0; track < nb_selected_tracks; track++)
+  {
+    int index = selected_tracks[track];
+    enum AVMediaType type = (index < (int)fmt_ctx->nb_streams) ? 
+      fmt_ctx->streams[index]->codec->codec_type : AVMEDIA_TYPE_UNKNOWN;
+
+    if(type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO)
+    {
+      printf("Stream %d is neither audio nor video\n", index);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Packets of discarded streams are skipped before parsing, so they cost no allocation.
+static void discard_unused_streams(AVFormatContext* fmt_ctx, int v_index, int a_index)
+{
+  unsigned int index;
+
+  for(index = 0; index < fmt_ctx->nb_streams; index++)
+  {
+    if((int)index != v_index && (int)index != a_index)
+    {
+      fmt_ctx->streams[index]->discard = AVDISCARD_ALL;
+    }
+  }
+}
+
+static int open_input(const char* filename)
+{
+  unsigned int index;
+
+  inputFile.fmt_ctx = NULL;
+  inputFile.a_index = inputFile.v_index = -1;
+
+  if(avformat_open_input(&inputFile.fmt_ctx, filename, NULL, NULL) < 0)
+  {
+    printf("Could not open input file %s\n", filename);
+    return -1;
+  }
+
+  if(avformat_find_stream_info(inputFile.fmt_ctx, NULL) < 0)
+  {
+    printf("Failed to retrieve input stream information\n");
+    return -2;
+  }
+
+  if(check_selected_tracks(inputFile.fmt_ctx) < 0)
+  {
+    return -3;
+  }
+
+  for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
+  {
+    AVCodecContext* codec_ctx = inputFile.fmt_ctx->streams[index]->codec;
+    if(codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && inputFile.v_index < 0 && 
+      stream_wanted(index, AVMEDIA_TYPE_VIDEO))
+    {
+      if(open_decoder(codec_ctx, &vdecoder_threads) < 0)
+      {
+        break;
+      }
+
+      inputFile.v_index = index;
+    }
+    else if(codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO && inputFile.a_index < 0 && 
+      stream_wanted(index, AVMEDIA_TYPE_AUDIO))
+    {
+      if(open_decoder(codec_ctx, &adecoder_threads) < 0)
+      {
+        break;
+      }
+
+      inputFile.a_index = index;
+    }
+  } // for
+
+  discard_unused_streams(inputFile.fmt_ctx, inputFile.v_index, inputFile.a_index);
+
+  if(inputFile.v_index < 0 && inputFile.a_index < 0)
+  {
+    printf("Failed to retrieve input stream information\n");
+    return -3;
+  }
+
+  return 0;
+}
+
+static void release()
+{
+  if(inputFile.fmt_ctx != NULL)
+  {
+    unsigned int index;
+    for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
+    {
+      AVCodecContext* codec_ctx = inputFile.fmt_ctx->streams[index]->codec;
+      if(index == inputFile.v_index || index == inputFile.a_index)
+      {
+        avcodec_close(codec_ctx);
+      }
+    }
+
+    avformat_close_input(&inputFile.fmt_ctx);
+  }
+}
+
+static int decode_packet(AVCodecContext* codec_ctx, AVPacket* pkt, AVFrame** frame, int* got_frame)
+{
+  int (*decode_func)(AVCodecContext *, AVFrame *, int *, const AVPacket *);
+  int decoded_size;
+
+  // Decide which is needed for decoding pakcet. 
+  decode_func = (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ? avcodec_decode_video2 : avcodec_decode_audio4;
+  decoded_size = decode_func(codec_ctx, *frame, got_frame, pkt);
+  if(*got_frame)
+  {
+    // This adjust PTS/DTS automatically in frame.
+    (*frame)->pts = av_frame_get_best_effort_timestamp(*frame);
+  }
+
+  return decoded_size;
+}
+
+static int64_t monotonic_us()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void clear_gop(GopEntry* gop)
+{
+  int index;
+
+  for(index = 0; index < gop->nb_frames; index++)
+  {
+    av_frame_free(&gop->frames[index]);
+  }
+
+  gop->nb_frames = 0;
+  gop->start_pts = gop->end_pts = AV_NOPTS_VALUE;
+}
+
+static int append_gop_frame(GopEntry* gop, const AVFrame* frame)
+{
+  if(gop->nb_frames == gop->capacity)
+  {
+    int capacity = (gop->capacity > 0) ? gop->capacity * 2 : 64;
+    AVFrame** frames = av_realloc_array(gop->frames, capacity, sizeof(AVFrame*));
+    if(frames == NULL)
+    {
+      return AVERROR(ENOMEM);
+    }
+
+    gop->frames = frames;
+    gop->capacity = capacity;
+  }
+
+  // Only takes a reference to the decoder's buffer, no copy.
+  gop->frames[gop->nb_frames] = av_frame_clone(frame);
+  if(gop->frames[gop->nb_frames] == NULL)
+  {
+    return AVERROR(ENOMEM);
+  }
+
+  gop->nb_frames++;
+  return 0;
+}
+
+static int init_frame_cache(int nb_gops)
+{
+  int index;
+
+  frame_cache.gops = av_mallocz_array(nb_gops, sizeof(GopEntry));
+  if(frame_cache.gops == NULL)
+  {
+    return -1;
+  }
+
+  frame_cache.nb_gops = nb_gops;
+  for(index = 0; index < nb_gops; index++)
+  {
+    clear_gop(&frame_cache.gops[index]);
+  }
+
+  return 0;
+}
+
+static void release_frame_cache()
+{
+  int index;
+
+  for(index = 0; index < frame_cache.nb_gops; index++)
+  {
+    clear_gop(&frame_cache.gops[index]);
+    av_freep(&frame_cache.gops[index].frames);
+  }
+
+  av_freep(&frame_cache.gops);
+  frame_cache.nb_gops = 0;
+}
+
+static GopEntry* find_cached_gop(int64_t pts)
+{
+  int index;
+
+  for(index = 0; index < frame_cache.nb_gops; index++)
+  {
+    GopEntry* gop = &frame_cache.gops[index];
+    if(gop->nb_frames > 0 && gop->start_pts <= pts && pts < gop->end_pts)
+    {
+      return gop;
+    }
+  }
+
+  return NULL;
+}
+
+// Empties the least recently used GOP and hands it out for decoding.
+static GopEntry* claim_gop()
+{
+  GopEntry* victim = &frame_cache.gops[0];
+  int index;
+
+  for(index = 1; index < frame_cache.nb_gops; index++)
+  {
+    if(frame_cache.gops[index].last_used < victim->last_used)
+    {
+      victim = &frame_cache.gops[index];
+    }
+  }
+
+  clear_gop(victim);
+  victim->last_used = ++frame_cache.clock;
+  return victim;
+}
+
+// Seeks to the keyframe before pts and decodes forward, caching every complete GOP,
+// until the one holding pts is done. Returns NULL if nothing could be decoded.
+static GopEntry* decode_gops(int64_t pts)
+{
+  AVStream* stream = inputFile.fmt_ctx->streams[inputFile.v_index];
+  AVCodecContext* codec_ctx = stream->codec;
+  GopEntry* gop = NULL;
+  GopEntry* found = NULL;
+  AVFrame* frame;
+  AVPacket pkt;
+  int got_frame;
+  int eof = 0;
+  int ret;
+
+  if(av_seek_frame(inputFile.fmt_ctx, inputFile.v_index, pts, AVSEEK_FLAG_BACKWARD) < 0)
+  {
+    printf("Failed to seek to %"PRId64"\n", pts);
+    return NULL;
+  }
+
+  // Drop whatever the decoder still holds from before the seek.
+  avcodec_flush_buffers(codec_ctx);
+
+  frame = av_frame_alloc();
+  if(frame == NULL)
+  {
+    return NULL;
+  }
+
+  while(found == NULL)
+  {
+    if(!eof)
+    {
+      ret = av_read_frame(inputFile.fmt_ctx, &pkt);
+      if(ret < 0)
+      {
+        // Drain the frames still buffered in the decoder.
+        eof = 1;
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+      }
+      else if(pkt.stream_index != inputFile.v_index)
+      {
+        av_free_packet(&pkt);
+        continue;
+      }
+    }
+
+    got_frame = 0;
+    ret = decode_packet(codec_ctx, &pkt, &frame, &got_frame);
+    if(!eof)
+    {
+      av_free_packet(&pkt);
+    }
+
+    if(ret < 0 || !got_frame)
+    {
+      if(eof)
+      {
+        break;
+      }
+
+      continue;
+    }
+
+    frame_cache.decoded_frames++;
+    if(frame->pts == AV_NOPTS_VALUE)
+    {
+      av_frame_unref(frame);
+      continue;
+    }
+
+    if(frame->key_frame)
+    {
+      if(gop != NULL)
+      {
+        gop->end_pts = frame->pts;
+        if(pts < gop->end_pts)
+        {
+          found = gop;
+        }
+      }
+
+      gop = (found == NULL) ? claim_gop() : NULL;
+      if(gop != NULL)
+      {
+        gop->start_pts = frame->pts;
+      }
+    }
+
+    // Frames before the first keyframe can not be decoded correctly, so skip them.
+    if(gop != NULL && append_gop_frame(gop, frame) < 0)
+    {
+      clear_gop(gop);
+      gop = NULL;
+      av_frame_unref(frame);
+      break;
+    }
+
+    av_frame_unref(frame);
+  } // while
+
+  // The last GOP of the stream has no keyframe after it.
+  if(found == NULL && gop != NULL && gop->nb_frames > 0)
+  {
+    gop->end_pts = INT64_MAX;
+    found = gop;
+  }
+  else if(gop != NULL && found != NULL)
+  {
+    clear_gop(gop);
+  }
+
+  av_frame_free(&frame);
+  return found;
+}
+
+// Returns a reference to the video frame shown at pts (stream time_base) in frame.
+static int get_frame_at(int64_t pts, AVFrame* frame)
+{
+  GopEntry* gop;
+  int index;
+
+  gop = find_cached_gop(pts);
+  if(gop != NULL)
+  {
+    frame_cache.hits++;
+  }
+  else
+  {
+    frame_cache.misses++;
+    gop = decode_gops(pts);
+    if(gop == NULL)
+    {
+      return -1;
+    }
+  }
+
+  gop->last_used = ++frame_cache.clock;
+
+  // Last frame starting at or before pts, or the first one if pts precedes the GOP.
+  for(index = gop->nb_frames - 1; index > 0; index--)
+  {
+    if(gop->frames[index]->pts <= pts)
+    {
+      break;
+    }
+  }
+
+  return av_frame_ref(frame, gop->frames[index]);
+}
+
+static int get_frame_at_time(double seconds, AVFrame* frame)
+{
+  AVStream* stream = inputFile.fmt_ctx->streams[inputFile.v_index];
+  int64_t start = (stream->start_time != AV_NOPTS_VALUE) ? stream->start_time : 0;
+
+  return get_frame_at(start + (int64_t)(seconds / av_q2d(stream->time_base)), frame);
+}
+
+static int get_frame_at_number(int64_t number, AVFrame* frame)
+{
+  AVStream* stream = inputFile.fmt_ctx->streams[inputFile.v_index];
+  AVRational frame_rate = (stream->avg_frame_rate.num > 0) ? stream->avg_frame_rate : stream->r_frame_rate;
+  int64_t start = (stream->start_time != AV_NOPTS_VALUE) ? stream->start_time : 0;
+
+  if(frame_rate.num <= 0 || frame_rate.den <= 0)
+  {
+    return -1;
+  }
+
+  // Aim at the middle of the frame so rounding of timestamps can not pick the previous one.
+  return get_frame_at(start + av_rescale_q(2 * number + 1, (AVRational){frame_rate.den, 2 * frame_rate.num},
+    stream->time_base), frame);
+}
+
+// Each position is seconds, or a frame number prefixed with '#', e.g. "12.5,#300,3".
+static int random_access(char* positions)
+{
+  AVStream* stream = inputFile.fmt_ctx->streams[inputFile.v_index];
+  AVFrame* frame;
+  char* position;
+  char* saveptr = NULL;
+  int nb_missing = 0;
+  int ret = 0;
+
+  frame = av_frame_alloc();
+  if(frame == NULL)
+  {
+    return -1;
+  }
+
+  for(position = strtok_r(positions, ",", &saveptr); position != NULL; position = strtok_r(NULL, ",", &saveptr))
+  {
+    int64_t begin = monotonic_us();
+
+    if(position[0] == '#')
+    {
+      ret = get_frame_at_number(strtoll(position + 1, NULL, 10), frame);
+    }
+    else
+    {
+      ret = get_frame_at_time(atof(position), frame);
+    }
+
+    if(ret < 0)
+    {
+      printf("Frame %s : not found\n", position);
+      nb_missing++;
+      continue;
+    }
+
+    printf("Frame %s : pts %"PRId64" (%.3f s) %dx%d %s, %"PRId64" us\n", position
+      , frame->pts, frame->pts * av_q2d(stream->time_base)
+      , frame->width, frame->height, frame->key_frame ? "keyframe" : "inter"
+      , monotonic_us() - begin);
+
+    av_frame_unref(frame);
+  } // for
 
-static int open_decoder(AVCodecContext* codec_ctx)
+  printf("GOP cache : %d hits, %d misses, %"PRId64" frames decoded\n"
+    , frame_cache.hits, frame_cache.misses, frame_cache.decoded_frames);
+
+  av_frame_free(&frame);
+  return nb_missing ? -1 : 0;
+}
+
+#define MAX_THUMBNAIL_DECODERS 32
+
+// Evenly spaced thumbnails laid out on one image, row by row.
+typedef struct _Sprite
 {
-  // Find a decoder by codec ID
-  AVCodec* decoder = avcodec_find_decoder(codec_ctx->codec_id);
-  if(decoder == NULL)
+  AVFrame* frame;
+  int64_t* positions;  // seek target of every tile, in stream time_base
+  int nb_tiles;
+  int columns;
+  int tile_width;
+  int tile_height;
+} Sprite;
+
+// A decoder instance of its own, filling a contiguous range of tiles.
+typedef struct _ThumbnailWorker
+{
+  pthread_t thread;
+  const char* filename;
+  AVFormatContext* fmt_ctx;
+  AVCodecContext* codec_ctx;
+  struct SwsContext* sws_ctx;
+  int first_tile;
+  int nb_tiles;
+  int nb_done;
+  int64_t nb_packets;
+} ThumbnailWorker;
+
+static Sprite sprite;
+
+// avcodec_open2() is called from several threads at once.
+static int lock_manager(void** mutex, enum AVLockOp op)
+{
+  switch(op)
+  {
+  case AV_LOCK_CREATE:
+    *mutex = av_malloc(sizeof(pthread_mutex_t));
+    return (*mutex == NULL || pthread_mutex_init(*mutex, NULL) != 0);
+  case AV_LOCK_OBTAIN:
+    return (pthread_mutex_lock(*mutex) != 0);
+  case AV_LOCK_RELEASE:
+    return (pthread_mutex_unlock(*mutex) != 0);
+  case AV_LOCK_DESTROY:
+    pthread_mutex_destroy(*mutex);
+    av_freep(mutex);
+    return 0;
+  }
+
+  return 1;
+}
+
+// Parses <count>[:<width>], e.g. "100:160".
+static int parse_thumbnail_config(const char* arg, int* count, int* width)
+{
+  const char* colon = strchr(arg, ':');
+
+  *count = atoi(arg);
+  if(colon != NULL)
+  {
+    *width = atoi(colon + 1);
+  }
+
+  return (*count > 0 && *width > 0) ? 0 : -1;
+}
+
+static int init_sprite(const char* output, int count, int width)
+{
+  AVStream* stream = inputFile.fmt_ctx->streams[inputFile.v_index];
+  AVCodecContext* codec_ctx = stream->codec;
+  AVRational sar = av_guess_sample_aspect_ratio(inputFile.fmt_ctx, stream, NULL);
+  AVFrame* frame;
+  int rows;
+
+  if(codec_ctx->width <= 0 || codec_ctx->height <= 0)
   {
     return -1;
   }
 
-  // Open the codec using decoder
-  if(avcodec_open2(codec_ctx, decoder, NULL) < 0)
+  if(sar.num <= 0 || sar.den <= 0)
+  {
+    sar = (AVRational){1, 1};
+  }
+
+  sprite.nb_tiles = count;
+  for(sprite.columns = 1; sprite.columns * sprite.columns < count; sprite.columns++);
+  rows = (count + sprite.columns - 1) / sprite.columns;
+
+  // Tiles start on 16 pixel columns for SIMD, and on even rows and columns so 4:2:0 chroma lines up.
+  sprite.tile_width = FFALIGN(width, 16);
+  sprite.tile_height = FFALIGN((int)av_rescale(sprite.tile_width, (int64_t)codec_ctx->height * sar.den,
+    (int64_t)codec_ctx->width * sar.num), 2);
+
+  sprite.positions = av_malloc_array(count, sizeof(int64_t));
+  sprite.frame = frame = av_frame_alloc();
+  if(sprite.positions == NULL || frame == NULL)
   {
     return -2;
   }
 
+  frame->format = av_match_ext(output, "png") ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_YUVJ420P;
+  frame->width = sprite.columns * sprite.tile_width;
+  frame->height = rows * sprite.tile_height;
+  if(av_frame_get_buffer(frame, FRAME_ALIGN) < 0)
+  {
+    return -3;
+  }
+
+  // Tiles which can not be decoded stay black.
+  memset(frame->data[0], 0, frame->linesize[0] * frame->height);
+  if(frame->format == AV_PIX_FMT_YUVJ420P)
+  {
+    memset(frame->data[1], 128, frame->linesize[1] * (frame->height / 2));
+    memset(frame->data[2], 128, frame->linesize[2] * (frame->height / 2));
+  }
+
   return 0;
 }
 
-static int open_input(const char* filename)
+static void release_sprite()
 {
-  unsigned int index;
+  av_frame_free(&sprite.frame);
+  av_freep(&sprite.positions);
+}
 
-  inputFile.fmt_ctx = NULL;
-  inputFile.a_index = inputFile.v_index = -1;
+static int open_thumbnail_worker(ThumbnailWorker* worker)
+{
+  AVCodecContext* in_codec_ctx = inputFile.fmt_ctx->streams[inputFile.v_index]->codec;
+  AVCodec* decoder = avcodec_find_decoder(in_codec_ctx->codec_id);
 
-  if(avformat_open_input(&inputFile.fmt_ctx, filename, NULL, NULL) < 0)
+  if(avformat_open_input(&worker->fmt_ctx, worker->filename, NULL, NULL) < 0)
   {
-    printf("Could not open input file %s\n", filename);
     return -1;
   }
 
-  if(avformat_find_stream_info(inputFile.fmt_ctx, NULL) < 0)
+  // Streams of most containers are known from the header, others need probing.
+  if(worker->fmt_ctx->nb_streams <= inputFile.v_index &&
+    avformat_find_stream_info(worker->fmt_ctx, NULL) < 0)
   {
-    printf("Failed to retrieve input stream information\n");
     return -2;
   }
 
-  for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
+  if(worker->fmt_ctx->nb_streams <= inputFile.v_index)
   {
-    AVCodecContext* codec_ctx = inputFile.fmt_ctx->streams[index]->codec;
-    if(codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && inputFile.v_index < 0)
+    return -2;
+  }
+
+  discard_unused_streams(worker->fmt_ctx, inputFile.v_index, -1);
+
+  worker->codec_ctx = avcodec_alloc_context3(NULL);
+  if(worker->codec_ctx == NULL || avcodec_copy_context(worker->codec_ctx, in_codec_ctx) < 0)
+  {
+    return -3;
+  }
+
+  // Only keyframes are decoded, so there is nothing to reorder and every frame can come out at once.
+  // Frame threading would hold frames back the same way, slice threading does not.
+  worker->codec_ctx->skip_frame = AVDISCARD_NONKEY;
+  worker->codec_ctx->flags |= CODEC_FLAG_LOW_DELAY;
+  worker->codec_ctx->thread_type = FF_THREAD_SLICE;
+  worker->codec_ctx->thread_count = vdecoder_threads.thread_count;
+
+  if(decoder == NULL || avcodec_open2(worker->codec_ctx, decoder, NULL) < 0)
+  {
+    return -4;
+  }
+
+  return 0;
+}
+
+static void close_thumbnail_worker(ThumbnailWorker* worker)
+{
+  avcodec_free_context(&worker->codec_ctx);
+  avformat_close_input(&worker->fmt_ctx);
+  sws_freeContext(worker->sws_ctx);
+  worker->sws_ctx = NULL;
+}
+
+// Decodes the keyframe at or before pts.
+static int decode_keyframe_at(ThumbnailWorker* worker, int64_t pts, AVFrame* frame)
+{
+  AVPacket pkt;
+  int got_frame = 0;
+  int eof = 0;
+  int ret;
+
+  if(av_seek_frame(worker->fmt_ctx, inputFile.v_index, pts, AVSEEK_FLAG_BACKWARD) < 0)
+  {
+    return -1;
+  }
+
+  avcodec_flush_buffers(worker->codec_ctx);
+
+  while(!got_frame)
+  {
+    if(!eof)
     {
-      if(open_decoder(codec_ctx) < 0)
+      if(av_read_frame(worker->fmt_ctx, &pkt) < 0)
       {
-        break;
+        eof = 1;
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
       }
-
-      inputFile.v_index = index;
-    }
-    else if(codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO && inputFile.a_index < 0)
-    {
-      if(open_decoder(codec_ctx) < 0)
+      else if(pkt.stream_index != inputFile.v_index)
       {
-        break;
+        av_free_packet(&pkt);
+        continue;
       }
+    }
 
-      inputFile.a_index = index;
+    worker->nb_packets++;
+    ret = avcodec_decode_video2(worker->codec_ctx, frame, &got_frame, &pkt);
+    if(!eof)
+    {
+      av_free_packet(&pkt);
     }
-  } // for
+    else if(ret < 0 || !got_frame)
+    {
+      break;
+    }
+  } // while
+
+  return got_frame ? 0 : -2;
+}
+
+// Scales frame straight into its place on the sprite.
+static int draw_tile(ThumbnailWorker* worker, const AVFrame* frame, int tile)
+{
+  AVFrame* dst = sprite.frame;
+  int x = (tile % sprite.columns) * sprite.tile_width;
+  int y = (tile / sprite.columns) * sprite.tile_height;
+  uint8_t* data[4] = {NULL};
 
-  if(inputFile.a_index < 0 && inputFile.a_index < 0)
+  worker->sws_ctx = sws_getCachedContext(worker->sws_ctx, frame->width, frame->height, frame->format,
+    sprite.tile_width, sprite.tile_height, dst->format, SWS_BILINEAR, NULL, NULL, NULL);
+  if(worker->sws_ctx == NULL)
   {
-    printf("Failed to retrieve input stream information\n");
-    return -3;
+    return -1;
   }
 
+  if(dst->format == AV_PIX_FMT_RGB24)
+  {
+    data[0] = dst->data[0] + y * dst->linesize[0] + x * 3;
+  }
+  else
+  {
+    data[0] = dst->data[0] + y * dst->linesize[0] + x;
+    data[1] = dst->data[1] + (y / 2) * dst->linesize[1] + x / 2;
+    data[2] = dst->data[2] + (y / 2) * dst->linesize[2] + x / 2;
+  }
+
+  sws_scale(worker->sws_ctx, (const uint8_t* const*)frame->data, frame->linesize, 0, frame->height,
+    data, dst->linesize);
   return 0;
 }
 
-static void release()
+static void* thumbnail_worker(void* arg)
 {
-  if(inputFile.fmt_ctx != NULL)
+  ThumbnailWorker* worker = (ThumbnailWorker*)arg;
+  AVFrame* frame;
+  int tile;
+
+  if(open_thumbnail_worker(worker) < 0)
   {
-    unsigned int index;
-    for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
+    printf("Failed to open %s for tiles %d to %d\n", worker->filename
+      , worker->first_tile, worker->first_tile + worker->nb_tiles - 1);
+    return NULL;
+  }
+
+  frame = av_frame_alloc();
+  if(frame == NULL)
+  {
+    return NULL;
+  }
+
+  // Tiles of a worker are in file order, so every seek goes forward.
+  for(tile = worker->first_tile; tile < worker->first_tile + worker->nb_tiles; tile++)
+  {
+    if(decode_keyframe_at(worker, sprite.positions[tile], frame) < 0)
     {
-      AVCodecContext* codec_ctx = inputFile.fmt_ctx->streams[index]->codec;
-      if(index == inputFile.v_index || index == inputFile.a_index)
-      {
-        avcodec_close(codec_ctx);
-      }
+      continue;
     }
 
-    avformat_close_input(&inputFile.fmt_ctx);
+    if(draw_tile(worker, frame, tile) == 0)
+    {
+      worker->nb_done++;
+    }
+
+    av_frame_unref(frame);
+  } // for
+
+  av_frame_free(&frame);
+  return NULL;
+}
+
+static int write_sprite(const char* output)
+{
+  AVFrame* frame = sprite.frame;
+  AVCodec* encoder;
+  AVCodecContext* enc_ctx;
+  AVPacket pkt;
+  FILE* file;
+  int got_packet = 0;
+  int ret = -1;
+
+  encoder = avcodec_find_encoder((frame->format == AV_PIX_FMT_RGB24) ? AV_CODEC_ID_PNG : AV_CODEC_ID_MJPEG);
+  if(encoder == NULL)
+  {
+    printf("Could not find an encoder for %s\n", output);
+    return -1;
+  }
+
+  enc_ctx = avcodec_alloc_context3(encoder);
+  if(enc_ctx == NULL)
+  {
+    return -2;
+  }
+
+  enc_ctx->width = frame->width;
+  enc_ctx->height = frame->height;
+  enc_ctx->pix_fmt = frame->format;
+  enc_ctx->time_base = (AVRational){1, 1};
+  if(encoder->id == AV_CODEC_ID_MJPEG)
+  {
+    enc_ctx->flags |= CODEC_FLAG_QSCALE;
+    enc_ctx->global_quality = frame->quality = FF_QP2LAMBDA * 3;
+  }
+
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+
+  if(avcodec_open2(enc_ctx, encoder, NULL) < 0)
+  {
+    printf("Could not open %s encoder\n", encoder->name);
+    goto write_end;
+  }
+
+  frame->pts = 0;
+  if(avcodec_encode_video2(enc_ctx, &pkt, frame, &got_packet) < 0 || !got_packet)
+  {
+    printf("Failed to encode %s\n", output);
+    goto write_end;
+  }
+
+  file = fopen(output, "wb");
+  if(file == NULL)
+  {
+    printf("Could not open output file %s\n", output);
+    goto write_end;
   }
+
+  if(fwrite(pkt.data, 1, pkt.size, file) == (size_t)pkt.size)
+  {
+    ret = 0;
+  }
+  fclose(file);
+
+write_end:
+  av_free_packet(&pkt);
+  avcodec_free_context(&enc_ctx);
+  return ret;
 }
 
-static int decode_packet(AVCodecContext* codec_ctx, AVPacket* pkt, AVFrame** frame, int* got_frame)
+// Grabs count keyframes spread evenly over the file with nb_decoders decoders in parallel.
+static int extract_thumbnails(const char* filename, const char* output, int count, int width, int nb_decoders)
 {
-  int (*decode_func)(AVCodecContext *, AVFrame *, int *, const AVPacket *);
-  int decoded_size;
+  AVStream* stream = inputFile.fmt_ctx->streams[inputFile.v_index];
+  ThumbnailWorker* workers = NULL;
+  int64_t duration = inputFile.fmt_ctx->duration;
+  int64_t start = (stream->start_time != AV_NOPTS_VALUE) ? stream->start_time : 0;
+  int64_t begin, elapsed;
+  int64_t nb_packets = 0;
+  int nb_started = 0;
+  int nb_done = 0;
+  int index;
+  int ret = -1;
 
-  // Decide which is needed for decoding pakcet. 
-  decode_func = (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ? avcodec_decode_video2 : avcodec_decode_audio4;
-  decoded_size = decode_func(codec_ctx, *frame, got_frame, pkt);
-  if(*got_frame)
+  if(duration == AV_NOPTS_VALUE || duration <= 0)
   {
-    // This adjust PTS/DTS automatically in frame.
-    (*frame)->pts = av_frame_get_best_effort_timestamp(*frame);
+    printf("Thumbnails need the duration of the input\n");
+    return -1;
   }
 
-  return decoded_size;
+  if(init_sprite(output, count, width) < 0)
+  {
+    printf("Failed to allocate the sprite\n");
+    goto thumbnail_end;
+  }
+
+  // The middle of each of count equal parts, which skips black frames at the very start.
+  for(index = 0; index < count; index++)
+  {
+    sprite.positions[index] = start + av_rescale_q(av_rescale(duration, 2 * index + 1, 2 * count),
+      AV_TIME_BASE_Q, stream->time_base);
+  }
+
+  nb_decoders = FFMIN(FFMIN(nb_decoders, count), MAX_THUMBNAIL_DECODERS);
+  workers = av_mallocz_array(nb_decoders, sizeof(ThumbnailWorker));
+  if(workers == NULL || av_lockmgr_register(lock_manager) < 0)
+  {
+    goto thumbnail_end;
+  }
+
+  for(index = 0; index < nb_decoders; index++)
+  {
+    workers[index].filename = filename;
+    workers[index].first_tile = count * index / nb_decoders;
+    workers[index].nb_tiles = count * (index + 1) / nb_decoders - workers[index].first_tile;
+  }
+
+  begin = monotonic_us();
+  for(nb_started = 0; nb_started < nb_decoders; nb_started++)
+  {
+    if(pthread_create(&workers[nb_started].thread, NULL, thumbnail_worker, &workers[nb_started]) != 0)
+    {
+      break;
+    }
+  }
+
+  // Still do the work of workers which could not be started, just without extra threads.
+  for(index = nb_started; index < nb_decoders; index++)
+  {
+    thumbnail_worker(&workers[index]);
+  }
+
+  for(index = 0; index < nb_started; index++)
+  {
+    pthread_join(workers[index].thread, NULL);
+  }
+  elapsed = monotonic_us() - begin;
+
+  for(index = 0; index < nb_decoders; index++)
+  {
+    nb_done += workers[index].nb_done;
+    nb_packets += workers[index].nb_packets;
+  }
+
+  printf("Thumbnails : %d of %d tiles of %dx%d with %d decoders, %"PRId64" packets decoded, %"PRId64" us\n"
+    , nb_done, count, sprite.tile_width, sprite.tile_height, nb_decoders, nb_packets, elapsed);
+
+  ret = write_sprite(output);
+  if(ret == 0)
+  {
+    printf("Sprite : %s %dx%d, %d columns\n", output, sprite.frame->width, sprite.frame->height, sprite.columns);
+  }
+
+thumbnail_end:
+  if(workers != NULL)
+  {
+    for(index = 0; index < nb_decoders; index++)
+    {
+      close_thumbnail_worker(&workers[index]);
+    }
+    av_free(workers);
+  }
+  release_sprite();
+
+  return ret;
 }
 
 int main(int argc, char* argv[])
 {
+  char* positions = NULL;
+  int cache_gops = 4;
+  const char* sprite_output = "sprite.jpg";
+  int thumbnails = 0;
+  int thumbnail_width = 160;
+  int nb_decoders = 4;
+  int failed = 1;
   int ret;
+  int opt;
 
   av_register_all();
   av_log_set_level(AV_LOG_DEBUG);
 
-  if(argc < 2)
+  while((opt = getopt(argc, argv, "d:r:g:b:T:t:o:j:")) != -1)
+  {
+    switch(opt)
+    {
+    case 'd':
+      if(parse_thread_config(optarg) < 0)
+      {
+        optind = argc;
+      }
+      break;
+    case 'b':
+      if(parse_frame_alloc_mode(optarg) < 0)
+      {
+        optind = argc;
+      }
+      break;
+    case 'T':
+      if(parse_stream_selector(optarg) < 0)
+      {
+        printf("Invalid stream selection %s\n", optarg);
+        return -1;
+      }
+      break;
+    case 'r':
+      positions = optarg;
+      break;
+    case 'g':
+      cache_gops = atoi(optarg);
+      if(cache_gops < 1)
+      {
+        optind = argc;
+      }
+      break;
+    case 't':
+      if(parse_thumbnail_config(optarg, &thumbnails, &thumbnail_width) < 0)
+      {
+        optind = argc;
+      }
+      break;
+    case 'o':
+      sprite_output = optarg;
+      break;
+    case 'j':
+      nb_decoders = atoi(optarg);
+      if(nb_decoders < 1)
+      {
+        optind = argc;
+      }
+      break;
+    default:
+      optind = argc;
+      break;
+    }
+  }
+
+  if(argc - optind < 1)
   {
-    printf("usage : %s <input>\n", argv[0]);
+    printf("usage : %s [-d v|a=frame|slice|auto[:threads]] [-b default|pool|thp|hugetlb] [-T av|video|audio|<stream>[,<stream>]] [-r seconds|#frame[,...] [-g cached_gops]] [-t count[:width] [-o sprite.jpg|png] [-j decoders]] <input>\n", argv[0]);
     return 0;
   }
 
-  if(open_input(argv[1]) < 0)
+  if(open_input(argv[optind]) < 0)
+  {
+    goto main_end;
+  }
+
+  if(thumbnails > 0)
+  {
+    if(inputFile.v_index < 0)
+    {
+      printf("Thumbnails need a video stream\n");
+      goto main_end;
+    }
+
+    if(extract_thumbnails(argv[optind], sprite_output, thumbnails, thumbnail_width, nb_decoders) >= 0)
+    {
+      failed = 0;
+    }
+    goto main_end;
+  }
+
+  if(positions != NULL)
   {
+    if(inputFile.v_index < 0)
+    {
+      printf("Random access needs a video stream\n");
+      goto main_end;
+    }
+
+    if(init_frame_cache(cache_gops) == 0 && random_access(positions) == 0)
+    {
+      failed = 0;
+    }
+
+    release_frame_cache();
     goto main_end;
   }
 
@@ -148,6 +1548,12 @@ int main(int argc, char* argv[])
     if(ret == AVERROR_EOF)
     {
       printf("End of frame\n");
+      failed = 0;
+      break;
+    }
+    else if(ret < 0)
+    {
+      printf("Failed to read a packet (%d)\n", ret);
       break;
     }
 
@@ -193,6 +1599,7 @@ int main(int argc, char* argv[])
 
 main_end:
   release();
+  release_frame_pools();
 
-  return 0;
+  return failed;
 }
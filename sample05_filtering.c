@@ -2,13 +2,27 @@
 #include <libavcodec/avcodec.h>
 #include <libavutil/common.h>
 #include <libavutil/avutil.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libavutil/cpu.h>
+#include <libavutil/audio_fifo.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include <libavfilter/avfilter.h>
 #include <libavfilter/avfiltergraph.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 
+#include <libswscale/swscale.h>
+#include <libswresample/swresample.h>
+
 typedef struct _FileContext
 {
   AVFormatContext* fmt_ctx;
@@ -16,22 +30,371 @@ typedef struct _FileContext
   int a_index;
 } FileContext;
 
+// Decoder threading for one stream type.
+typedef struct _ThreadConfig
+{
+  int thread_type;   // FF_THREAD_FRAME, FF_THREAD_SLICE or both
+  int thread_count;  // 0 lets libavcodec pick by number of cores
+} ThreadConfig;
+
 typedef struct _FilterContext
 {
   AVFilterGraph* filter_graph;
   AVFilterContext* src_ctx;
   AVFilterContext* sink_ctx;
+  const char* name;                // filter of this step when profiling
+  int64_t elapsed;                 // nanoseconds spent in this graph
+  int64_t nb_frames;
 } FilterContext;
 
 static FileContext inputFile;
+
+// Same as libavcodec defaults, which means a single thread.
+static ThreadConfig vdecoder_threads = {FF_THREAD_FRAME | FF_THREAD_SLICE, 1};
+static ThreadConfig adecoder_threads = {FF_THREAD_FRAME | FF_THREAD_SLICE, 1};
 static FilterContext vfilter_ctx, afilter_ctx;
+static int vfilter_bypass = 0, afilter_bypass = 0;   // frames are used as they are
+
+// Filter graph threading and scaler, libavfilter defaults unless set on the command line.
+static int filter_thread_type = AVFILTER_THREAD_SLICE;
+static int filter_threads = 0;           // 0 means one per core
+static const char* scale_flags = NULL;   // NULL keeps the scale filter's default
+static int profile_filters = 0;
 
 static const int dst_width = 480;
 static const int dst_height = 320;
 static const int64_t dst_ch_layout = AV_CH_LAYOUT_MONO;
 static const int dst_sample_rate = 32000;
 
-static int open_decoder(AVCodecContext* codec_ctx)
+static const char* thread_type_name(int thread_type)
+{
+  switch(thread_type)
+  {
+  case FF_THREAD_FRAME:
+    return "frame";
+  case FF_THREAD_SLICE:
+    return "slice";
+  case FF_THREAD_FRAME | FF_THREAD_SLICE:
+    return "auto";
+  }
+
+  return "none";
+}
+
+// Parses <stream>=<type>[:<count>] where stream is v or a
+// and type is frame, slice or auto, e.g. "v=frame:8".
+static int parse_thread_config(const char* arg)
+{
+  ThreadConfig* config;
+  const char* type;
+  const char* count;
+  size_t type_len;
+
+  if(strncmp(arg, "v=", 2) == 0)
+  {
+    config = &vdecoder_threads;
+  }
+  else if(strncmp(arg, "a=", 2) == 0)
+  {
+    config = &adecoder_threads;
+  }
+  else
+  {
+    return -1;
+  }
+
+  type = arg + 2;
+  count = strchr(type, ':');
+  type_len = (count != NULL) ? (size_t)(count - type) : strlen(type);
+
+  if(type_len == 5 && strncmp(type, "frame", 5) == 0)
+  {
+    config->thread_type = FF_THREAD_FRAME;
+  }
+  else if(type_len == 5 && strncmp(type, "slice", 5) == 0)
+  {
+    config->thread_type = FF_THREAD_SLICE;
+  }
+  else if(type_len == 4 && strncmp(type, "auto", 4) == 0)
+  {
+    config->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  }
+  else
+  {
+    return -2;
+  }
+
+  if(count != NULL)
+  {
+    config->thread_count = atoi(count + 1);
+    if(config->thread_count < 0)
+    {
+      return -3;
+    }
+  }
+
+  return 0;
+}
+
+#define FRAME_ALIGN 64                // cache line and widest SIMD register
+#define HUGE_PAGE_SIZE (2 << 20)
+#define MAX_FRAME_POOLS 32
+
+typedef enum _FrameAllocMode
+{
+  FRAME_ALLOC_DEFAULT,   // libavcodec's own get_buffer2
+  FRAME_ALLOC_POOL,      // size-class pools of aligned memory
+  FRAME_ALLOC_THP,       // pools backed by transparent huge pages
+  FRAME_ALLOC_HUGETLB,   // pools backed by reserved huge pages, THP if none left
+} FrameAllocMode;
+
+// Buffer pools by size class, shared by every video decoder.
+typedef struct _FramePools
+{
+  AVBufferPool* pools[MAX_FRAME_POOLS];
+  int sizes[MAX_FRAME_POOLS];
+  int nb_pools;
+  int64_t nb_frames;            // frames served from the pools
+  int64_t nb_allocs;            // backing allocations, the rest were reused
+  int64_t frame_bytes;
+  int64_t alloc_bytes;
+  int64_t nb_hugetlb_allocs;
+  int64_t nb_fallbacks;         // frames left to the default allocator
+  pthread_mutex_t mutex;
+} FramePools;
+
+static FrameAllocMode frame_alloc_mode = FRAME_ALLOC_DEFAULT;
+static FramePools frame_pools = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static int parse_frame_alloc_mode(const char* arg)
+{
+  if(strcmp(arg, "default") == 0)
+  {
+    frame_alloc_mode = FRAME_ALLOC_DEFAULT;
+  }
+  else if(strcmp(arg, "pool") == 0)
+  {
+    frame_alloc_mode = FRAME_ALLOC_POOL;
+  }
+  else if(strcmp(arg, "thp") == 0)
+  {
+    frame_alloc_mode = FRAME_ALLOC_THP;
+  }
+  else if(strcmp(arg, "hugetlb") == 0)
+  {
+    frame_alloc_mode = FRAME_ALLOC_HUGETLB;
+  }
+  else
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+static void free_frame_memory(void* opaque, uint8_t* data)
+{
+  // opaque holds the mapping size of huge pages.
+  if(opaque != NULL)
+  {
+    munmap(data, (size_t)(intptr_t)opaque);
+  }
+  else
+  {
+    free(data);
+  }
+}
+
+static AVBufferRef* alloc_frame_memory(int size)
+{
+  AVBufferRef* buf;
+  void* data = NULL;
+  void* opaque = NULL;
+  int huge = (frame_alloc_mode >= FRAME_ALLOC_THP && size >= HUGE_PAGE_SIZE);
+
+  if(huge && frame_alloc_mode == FRAME_ALLOC_HUGETLB)
+  {
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(data == MAP_FAILED)
+    {
+      data = NULL;
+    }
+    else
+    {
+      opaque = (void*)(intptr_t)size;
+    }
+  }
+
+  if(data == NULL)
+  {
+    if(posix_memalign(&data, huge ? HUGE_PAGE_SIZE : FRAME_ALIGN, size) != 0)
+    {
+      return NULL;
+    }
+
+    if(huge)
+    {
+      madvise(data, size, MADV_HUGEPAGE);
+    }
+  }
+
+  buf = av_buffer_create(data, size, free_frame_memory, opaque, 0);
+  if(buf == NULL)
+  {
+    free_frame_memory(opaque, data);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&frame_pools.mutex);
+  frame_pools.nb_allocs++;
+  frame_pools.alloc_bytes += size;
+  frame_pools.nb_hugetlb_allocs += (opaque != NULL);
+  pthread_mutex_unlock(&frame_pools.mutex);
+
+  return buf;
+}
+
+// Rounds up to a quarter of the next power of two, or to whole huge pages,
+// so frames of slightly different sizes still share a pool.
+static int frame_size_class(int size)
+{
+  int step = 4096;
+
+  if(frame_alloc_mode >= FRAME_ALLOC_THP && size >= HUGE_PAGE_SIZE)
+  {
+    return FFALIGN(size, HUGE_PAGE_SIZE);
+  }
+
+  while(step * 4 < size)
+  {
+    step *= 2;
+  }
+
+  return FFALIGN(size, step);
+}
+
+static AVBufferPool* get_frame_pool(int size)
+{
+  AVBufferPool* pool = NULL;
+  int index;
+
+  size = frame_size_class(size);
+
+  pthread_mutex_lock(&frame_pools.mutex);
+  for(index = 0; index < frame_pools.nb_pools; index++)
+  {
+    if(frame_pools.sizes[index] == size)
+    {
+      pool = frame_pools.pools[index];
+      break;
+    }
+  }
+
+  if(pool == NULL && frame_pools.nb_pools < MAX_FRAME_POOLS)
+  {
+    pool = av_buffer_pool_init(size, alloc_frame_memory);
+    if(pool != NULL)
+    {
+      frame_pools.pools[frame_pools.nb_pools] = pool;
+      frame_pools.sizes[frame_pools.nb_pools] = size;
+      frame_pools.nb_pools++;
+    }
+  }
+  pthread_mutex_unlock(&frame_pools.mutex);
+
+  return pool;
+}
+
+// get_buffer2 handing out all planes of a video frame in one pooled buffer.
+static int get_pooled_buffer(AVCodecContext* codec_ctx, AVFrame* frame, int flags)
+{
+  const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(frame->format);
+  int linesize_align[AV_NUM_DATA_POINTERS];
+  int linesizes[4];
+  uint8_t* planes[4];
+  int width = frame->width;
+  int height = frame->height;
+  AVBufferPool* pool = NULL;
+  int size;
+  int index;
+
+  if(desc != NULL && !(desc->flags & AV_PIX_FMT_FLAG_HWACCEL))
+  {
+    // Same padding as libavcodec, so decoders may write past the visible picture.
+    avcodec_align_dimensions2(codec_ctx, &width, &height, linesize_align);
+    if(av_image_fill_linesizes(linesizes, frame->format, width) >= 0)
+    {
+      for(index = 0; index < 4; index++)
+      {
+        linesizes[index] = FFALIGN(linesizes[index], FRAME_ALIGN);
+      }
+
+      // Without a base pointer this only gives the offset of every plane.
+      size = av_image_fill_pointers(planes, frame->format, height, NULL, linesizes);
+      if(size > 0)
+      {
+        pool = get_frame_pool(size + FRAME_ALIGN);
+      }
+    }
+  }
+
+  if(pool == NULL)
+  {
+    pthread_mutex_lock(&frame_pools.mutex);
+    frame_pools.nb_fallbacks++;
+    pthread_mutex_unlock(&frame_pools.mutex);
+
+    return avcodec_default_get_buffer2(codec_ctx, frame, flags);
+  }
+
+  frame->buf[0] = av_buffer_pool_get(pool);
+  if(frame->buf[0] == NULL)
+  {
+    return AVERROR(ENOMEM);
+  }
+
+  for(index = 0; index < 4; index++)
+  {
+    if(index == 0 || planes[index] != NULL)
+    {
+      frame->data[index] = frame->buf[0]->data + (planes[index] - planes[0]);
+      frame->linesize[index] = linesizes[index];
+    }
+  }
+  frame->extended_data = frame->data;
+
+  pthread_mutex_lock(&frame_pools.mutex);
+  frame_pools.nb_frames++;
+  frame_pools.frame_bytes += size;
+  pthread_mutex_unlock(&frame_pools.mutex);
+
+  return 0;
+}
+
+// Pools go away once the last frame taken from them is freed.
+static void release_frame_pools()
+{
+  int index;
+
+  if(frame_alloc_mode == FRAME_ALLOC_DEFAULT)
+  {
+    return;
+  }
+
+  printf("Frame pools : %"PRId64" frames (%.1f MB), %"PRId64" allocations (%.1f MB, %"PRId64" on hugetlb), "
+    "%d size classes, %"PRId64" fallbacks\n"
+    , frame_pools.nb_frames, frame_pools.frame_bytes / 1048576.0
+    , frame_pools.nb_allocs, frame_pools.alloc_bytes / 1048576.0, frame_pools.nb_hugetlb_allocs
+    , frame_pools.nb_pools, frame_pools.nb_fallbacks);
+
+  for(index = 0; index < frame_pools.nb_pools; index++)
+  {
+    av_buffer_pool_uninit(&frame_pools.pools[index]);
+  }
+  frame_pools.nb_pools = 0;
+}
+
+static int open_decoder(AVCodecContext* codec_ctx, const ThreadConfig* threads)
 {
   AVCodec* decoder = avcodec_find_decoder(codec_ctx->codec_id);
   if(decoder == NULL)
@@ -39,14 +402,137 @@ static int open_decoder(AVCodecContext* codec_ctx)
     return -1;
   }
 
+  // Threading has to be decided before the codec is opened.
+  codec_ctx->thread_type = threads->thread_type;
+  codec_ctx->thread_count = threads->thread_count;
+
+  // Video frames come from the shared pools, which decoders without DR1 can not write into.
+  if(frame_alloc_mode != FRAME_ALLOC_DEFAULT && codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO &&
+    (decoder->capabilities & CODEC_CAP_DR1))
+  {
+    codec_ctx->get_buffer2 = get_pooled_buffer;
+    codec_ctx->thread_safe_callbacks = 1;
+  }
+
   if(avcodec_open2(codec_ctx, decoder, NULL) < 0)
   {
     return -2;
   }
 
+  // libavcodec falls back to what the codec supports, so report what is actually used.
+  printf("%s decoder %s : requested %s threading with %d threads, using %s threading with %d threads\n"
+    , (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ? "Video" : "Audio"
+    , decoder->name
+    , thread_type_name(threads->thread_type), threads->thread_count
+    , thread_type_name(codec_ctx->active_thread_type), codec_ctx->thread_count);
+
+  return 0;
+}
+
+// Streams to read, by type or by index. Everything else is discarded by the demuxer.
+static int select_video = 1;
+static int select_audio = 1;
+static int selected_tracks[2] = {-1, -1};
+static int nb_selected_tracks = 0;
+
+// Parses av, video, audio or up to two stream indexes, e.g. "0,3".
+static int parse_stream_selector(const char* arg)
+{
+  const char* track = arg;
+  char* end;
+
+  select_video = select_audio = 1;
+  nb_selected_tracks = 0;
+
+  if(strcmp(arg, "av") == 0)
+  {
+    return 0;
+  }
+  else if(strcmp(arg, "video") == 0)
+  {
+    select_audio = 0;
+    return 0;
+  }
+  else if(strcmp(arg, "audio") == 0)
+  {
+    select_video = 0;
+    return 0;
+  }
+
+  while(*track != '\0' && nb_selected_tracks < 2)
+  {
+    long index = strtol(track, &end, 10);
+    if(end == track || index < 0)
+    {
+      return -1;
+    }
+
+    selected_tracks[nb_selected_tracks++] = (int)index;
+    if(*end == ',' && end[1] == '\0')
+    {
+      return -1;
+    }
+    track = (*end == ',') ? end + 1 : end;
+  }
+
+  return (*track == '\0' && nb_selected_tracks > 0) ? 0 : -2;
+}
+
+static int stream_wanted(unsigned int index, enum AVMediaType type)
+{
+  int track;
+
+  if(nb_selected_tracks > 0)
+  {
+    for(track = 0; track < nb_selected_tracks; track++)
+    {
+      if(selected_tracks[track] == (int)index)
+      {
+        return 1;
+      }
+    }
+
+    return 0;
+  }
+
+  return (type == AVMEDIA_TYPE_VIDEO) ? select_video : select_audio;
+}
+
+// Streams picked by index still have to be audio or video.
+static int check_selected_tracks(AVFormatContext* fmt_ctx)
+{
+  int track;
+
+  for(track = 0; track < nb_selected_tracks; track++)
+  {
+    int index = selected_tracks[track];
+    enum AVMediaType type = (index < (int)fmt_ctx->nb_streams) ? 
+      fmt_ctx->streams[index]->codec->codec_type : AVMEDIA_TYPE_UNKNOWN;
+
+    if(type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO)
+    {
+      printf("Stream %d is neither audio nor video\n", index);
+      return -1;
+    }
+  }
+
   return 0;
 }
 
+// Packets of discarded streams are skipped before parsing, so they cost no allocation.
+static void discard_unused_streams(AVFormatContext* fmt_ctx, int v_index, int a_index)
+{
+  unsigned int index;
+
+  for(index = 0; index < fmt_ctx->nb_streams; index++)
+  {
+    if((int)index != v_index && (int)index != a_index)
+    {
+      fmt_ctx->streams[index]->discard = AVDISCARD_ALL;
+    }
+  }
+}
+
 static int open_input(const char* filename)
 {
   unsigned int index;
@@ -65,21 +551,28 @@ static int open_input(const char* filename)
     return -2;
   }
 
+  if(check_selected_tracks(inputFile.fmt_ctx) < 0)
+  {
+    return -3;
+  }
+
   for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
   {
     AVCodecContext* codec_ctx = inputFile.fmt_ctx->streams[index]->codec;
-    if(codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && inputFile.v_index < 0)
+    if(codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && inputFile.v_index < 0 && 
+      stream_wanted(index, AVMEDIA_TYPE_VIDEO))
     {
-      if(open_decoder(codec_ctx) < 0)
+      if(open_decoder(codec_ctx, &vdecoder_threads) < 0)
       {
         break;
       }
 
       inputFile.v_index = index;
     }
-    else if(codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO && inputFile.a_index < 0)
+    else if(codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO && inputFile.a_index < 0 && 
+      stream_wanted(index, AVMEDIA_TYPE_AUDIO))
     {
-      if(open_decoder(codec_ctx) < 0)
+      if(open_decoder(codec_ctx, &adecoder_threads) < 0)
       {
         break;
       }
@@ -88,7 +581,9 @@ static int open_input(const char* filename)
     }
   } // for
 
-  if(inputFile.a_index < 0 && inputFile.a_index < 0)
+  discard_unused_streams(inputFile.fmt_ctx, inputFile.v_index, inputFile.a_index);
+
+  if(inputFile.v_index < 0 && inputFile.a_index < 0)
   {
     printf("Failed to retrieve input stream information\n");
     return -3;
@@ -97,279 +592,1220 @@ static int open_input(const char* filename)
   return 0;
 }
 
-static int init_video_filter()
+// Parses none or slice[:<count>], e.g. "slice:4".
+static int parse_filter_threads(const char* arg)
 {
-  AVStream* stream = inputFile.fmt_ctx->streams[inputFile.v_index];
-  AVCodecContext* codec_ctx = stream->codec;
-  AVFilterContext* rescale_filter;
-  AVFilterInOut *inputs, *outputs;
-  char args[512];
-
-  vfilter_ctx.filter_graph = NULL;
-  vfilter_ctx.src_ctx = NULL;
-  vfilter_ctx.sink_ctx = NULL;
+  if(strcmp(arg, "none") == 0)
+  {
+    filter_thread_type = 0;
+    filter_threads = 1;
+    return 0;
+  }
 
-  // Allocate memory for filter graph
-  vfilter_ctx.filter_graph = avfilter_graph_alloc();
-  if(vfilter_ctx.filter_graph == NULL)
+  if(strncmp(arg, "slice", 5) != 0 || (arg[5] != '\0' && arg[5] != ':'))
   {
     return -1;
   }
 
-  // Link input and output with filter graph.
-  if(avfilter_graph_parse2(vfilter_ctx.filter_graph, "null", &inputs, &outputs) < 0)
+  filter_thread_type = AVFILTER_THREAD_SLICE;
+  if(arg[5] == ':')
   {
-    printf("Failed to parse video filtergraph\n");
-    return -2;
+    filter_threads = atoi(arg + 6);
+    if(filter_threads < 0)
+    {
+      return -2;
+    }
+  }
+
+  return 0;
+}
+
+// Same algorithm as the scale filter uses when no flags are given.
+#define DEFAULT_SCALE_FLAGS "bilinear"
+
+static const char* scale_flags_name(const char* flags)
+{
+  return (flags != NULL) ? flags : "default";
+}
+
+static void scale_filter_args(char* args, size_t size, int width, int height)
+{
+  if(scale_flags != NULL)
+  {
+    snprintf(args, size, "%d:%d:flags=%s", width, height, scale_flags);
+  }
+  else
+  {
+    snprintf(args, size, "%d:%d", width, height);
+  }
+}
+
+static int configure_graph(AVFilterGraph* graph)
+{
+  char sws_opts[128];
+
+  // Has to be set before any filter is added to the graph.
+  graph->thread_type = filter_thread_type;
+  graph->nb_threads = filter_threads;
+
+  if(scale_flags == NULL)
+  {
+    return 0;
+  }
+
+  // Scalers inserted by format negotiation use the same algorithm.
+  snprintf(sws_opts, sizeof(sws_opts), "flags=%s", scale_flags);
+  graph->scale_sws_opts = av_strdup(sws_opts);
+
+  return (graph->scale_sws_opts != NULL) ? 0 : -1;
+}
+
+// One graph holding a single filter, so its time can be measured on its own.
+static int init_filter_step(FilterContext* step, const char* filter_name, const char* filter_args, const char* src_args)
+{
+  AVFilterContext* filter;
+
+  step->name = filter_name;
+  step->filter_graph = avfilter_graph_alloc();
+  if(step->filter_graph == NULL || configure_graph(step->filter_graph) < 0)
+  {
+    return -1;
+  }
+
+  if(avfilter_graph_create_filter(&step->src_ctx, avfilter_get_by_name("buffer")
+          , "in", src_args, NULL, step->filter_graph) < 0 ||
+    avfilter_graph_create_filter(&filter, avfilter_get_by_name(filter_name)
+          , filter_name, filter_args, NULL, step->filter_graph) < 0 ||
+    avfilter_graph_create_filter(&step->sink_ctx, avfilter_get_by_name("buffersink")
+          , "out", NULL, NULL, step->filter_graph) < 0)
+  {
+    printf("Failed to create %s filter step\n", filter_name);
+    return -2;
+  }
+
+  if(avfilter_link(step->src_ctx, 0, filter, 0) < 0 || avfilter_link(filter, 0, step->sink_ctx, 0) < 0)
+  {
+    printf("Failed to link %s filter step\n", filter_name);
+    return -3;
+  }
+
+  if(avfilter_graph_config(step->filter_graph, NULL) < 0)
+  {
+    printf("Failed to configure %s filter step\n", filter_name);
+    return -4;
+  }
+
+  return 0;
+}
+
+// Same scale as init_video_filter() in a graph of its own. Conversions which
+// format negotiation inserts are charged to it.
+static int init_video_filter_steps()
+{
+  AVStream* stream = inputFile.fmt_ctx->streams[inputFile.v_index];
+  AVCodecContext* codec_ctx = stream->codec;
+  char filter_args[128];
+  char src_args[512];
+
+  scale_filter_args(filter_args, sizeof(filter_args), dst_width, dst_height);
+
+  snprintf(src_args, sizeof(src_args), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d"
+    , codec_ctx->width, codec_ctx->height
+    , codec_ctx->pix_fmt
+    , stream->time_base.num, stream->time_base.den
+    , codec_ctx->sample_aspect_ratio.num, codec_ctx->sample_aspect_ratio.den);
+
+  return (init_filter_step(&vfilter_ctx, "scale", filter_args, src_args) < 0) ? -2 : 0;
+}
+
+static void release_filter(FilterContext* filter_ctx)
+{
+  if(filter_ctx->filter_graph != NULL)
+  {
+    avfilter_graph_free(&filter_ctx->filter_graph);
+  }
+}
+
+static int init_video_filter()
+{
+  AVStream* stream = inputFile.fmt_ctx->streams[inputFile.v_index];
+  AVCodecContext* codec_ctx = stream->codec;
+  AVFilterContext* rescale_filter;
+  AVFilterInOut *inputs, *outputs;
+  char args[512];
+
+  vfilter_ctx.filter_graph = NULL;
+  vfilter_ctx.src_ctx = NULL;
+  vfilter_ctx.sink_ctx = NULL;
+
+  if(profile_filters)
+  {
+    return init_video_filter_steps();
+  }
+
+  // Allocate memory for filter graph
+  vfilter_ctx.filter_graph = avfilter_graph_alloc();
+  if(vfilter_ctx.filter_graph == NULL || configure_graph(vfilter_ctx.filter_graph) < 0)
+  {
+    return -1;
+  }
+
+  // Link input and output with filter graph.
+  if(avfilter_graph_parse2(vfilter_ctx.filter_graph, "null", &inputs, &outputs) < 0)
+  {
+    printf("Failed to parse video filtergraph\n");
+    return -2;
+  }
+
+  // Create input filter
+  // Create Buffer Source -> input filter
+  snprintf(args, sizeof(args), "time_base=%d/%d:video_size=%dx%d:pix_fmt=%d:pixel_aspect=%d/%d"
+    , stream->time_base.num, stream->time_base.den
+    , codec_ctx->width, codec_ctx->height
+    , codec_ctx->pix_fmt
+    , codec_ctx->sample_aspect_ratio.num, codec_ctx->sample_aspect_ratio.den);
+
+  // Create Buffer Source
+  if(avfilter_graph_create_filter(
+          &vfilter_ctx.src_ctx
+          , avfilter_get_by_name("buffer")
+          , "in", args, NULL, vfilter_ctx.filter_graph) < 0)
+  {
+    printf("Failed to create video buffer source\n");
+    return -3;
+  }
+
+  // Link Buffer Source with input filter
+  if(avfilter_link(vfilter_ctx.src_ctx, 0, inputs->filter_ctx, 0) < 0)
+  {
+    printf("Failed to link video buffer source\n");
+    return -4;
+  }
+
+  // Create output filter
+  // Create Buffer Sink
+  if(avfilter_graph_create_filter(
+          &vfilter_ctx.sink_ctx
+          , avfilter_get_by_name("buffersink")
+          , "out", NULL, NULL, vfilter_ctx.filter_graph) < 0)
+  {
+    printf("Failed to create video buffer sink\n");
+    return -3;
+  }
+
+  // Create rescaler filter to resize video resolution
+  scale_filter_args(args, sizeof(args), dst_width, dst_height);
+
+  if(avfilter_graph_create_filter(
+          &rescale_filter
+          , avfilter_get_by_name("scale")
+          , "scale", args, NULL, vfilter_ctx.filter_graph) < 0)
+  {
+    printf("Failed to create video scale filter\n");
+    return -4;
+  }
+
+  // link rescaler filter with aformat filter
+  if(avfilter_link(outputs->filter_ctx, 0, rescale_filter, 0) < 0)
+  {
+    printf("Failed to link video format filter\n");
+    return -4;
+  }
+
+  // aformat is linked with Buffer Sink filter.
+  if(avfilter_link(rescale_filter, 0, vfilter_ctx.sink_ctx, 0) < 0)
+  {
+    printf("Failed to link video format filter\n");
+    return -4;
+  }
+
+  // Configure all prepared filters.
+  if(avfilter_graph_config(vfilter_ctx.filter_graph, NULL) < 0)
+  {
+    printf("Failed to configure video filter context\n");
+    return -5;
+  }
+
+  av_buffersink_set_frame_size(vfilter_ctx.sink_ctx, codec_ctx->frame_size);
+
+  avfilter_inout_free(&inputs);
+  avfilter_inout_free(&outputs);
+}
+
+static int init_audio_filter()
+{
+  AVStream* stream = inputFile.fmt_ctx->streams[inputFile.a_index];
+  AVCodecContext* codec_ctx = stream->codec;
+  AVFilterInOut *inputs, *outputs;
+  AVFilterContext* resample_filter;
+  char args[512];
+
+  afilter_ctx.filter_graph = NULL;
+  afilter_ctx.src_ctx = NULL;
+  afilter_ctx.sink_ctx = NULL;
+
+  // Allocate memory for filter graph
+  afilter_ctx.filter_graph = avfilter_graph_alloc();
+  if(afilter_ctx.filter_graph == NULL || configure_graph(afilter_ctx.filter_graph) < 0)
+  {
+    return -1;
+  }
+
+  // Link input and output with filter graph.
+  if(avfilter_graph_parse2(afilter_ctx.filter_graph, "anull", &inputs, &outputs) < 0)
+  {
+    printf("Failed to parse audio filtergraph\n");
+    return -2;
+  }
+
+  // Create input filter
+  // Create Buffer Source -> input filter
+  snprintf(args, sizeof(args), "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%"PRIx64
+    , stream->time_base.num, stream->time_base.den
+    , codec_ctx->sample_rate
+    , av_get_sample_fmt_name(codec_ctx->sample_fmt)
+    , codec_ctx->channel_layout);
+
+  // Create Buffer Source filter
+  if(avfilter_graph_create_filter(
+          &afilter_ctx.src_ctx
+          , avfilter_get_by_name("abuffer")
+          , "in", args, NULL, afilter_ctx.filter_graph) < 0)
+  {
+    printf("Failed to create audio buffer source\n");
+    return -3;
+  }
+
+  // Link Buffer Source with input filter.
+  if(avfilter_link(afilter_ctx.src_ctx, 0, inputs->filter_ctx, 0) < 0)
+  {
+    printf("Failed to link audio buffer source\n");
+    return -4;
+  }
+
+  // Create output filter
+  // Create Buffer Sink
+  if(avfilter_graph_create_filter(
+          &afilter_ctx.sink_ctx
+          , avfilter_get_by_name("abuffersink")
+          , "out", NULL, NULL, afilter_ctx.filter_graph) < 0)
+  {
+    printf("Failed to create audio buffer sink\n");
+    return -3;
+  }
+
+  // Create aformat to change audio format.
+  snprintf(args, sizeof(args), "sample_rates=%d:channel_layouts=0x%"PRIx64
+    , dst_sample_rate
+    , dst_ch_layout);
+
+  // Create aformat filter
+  if(avfilter_graph_create_filter(
+          &resample_filter
+          , avfilter_get_by_name("aformat")
+          , "aformat", args, NULL, afilter_ctx.filter_graph) < 0)
+  {
+    printf("Failed to create audio format filter\n");
+    return -4;
+  }
+
+  // Link output filter with aformat filter
+  if(avfilter_link(outputs->filter_ctx, 0, resample_filter, 0) < 0)
+  {
+    printf("Failed to link audio format filter\n");
+    return -4;
+  }
+
+  // aformat filter is linked with Buffer Sink.
+  if(avfilter_link(resample_filter, 0, afilter_ctx.sink_ctx, 0) < 0)
+  {
+    printf("Failed to link audio format filter\n");
+    return -4;
+  }
+
+  // Configure all prepared filters.
+  if(avfilter_graph_config(afilter_ctx.filter_graph, NULL) < 0)
+  {
+    printf("Failed to configure audio filter context\n");
+    return -5;
+  }
+
+  av_buffersink_set_frame_size(afilter_ctx.sink_ctx, codec_ctx->frame_size);
+
+  avfilter_inout_free(&inputs);
+  avfilter_inout_free(&outputs);
+}
+
+static void release()
+{
+  if(inputFile.fmt_ctx != NULL)
+  {
+    unsigned int index;
+    for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
+    {
+      AVCodecContext* codec_ctx = inputFile.fmt_ctx->streams[index]->codec;
+      if(index == inputFile.v_index || index == inputFile.a_index)
+      {
+        avcodec_close(codec_ctx);
+      }
+    }
+
+    avformat_close_input(&inputFile.fmt_ctx);
+  }
+
+  release_filter(&afilter_ctx);
+  release_filter(&vfilter_ctx);
+}
+
+static int decode_packet(AVCodecContext* codec_ctx, AVPacket* pkt, AVFrame** frame, int* got_frame)
+{
+  int (*decode_func)(AVCodecContext *, AVFrame *, int *, const AVPacket *);
+  int decoded_size;
+
+  decode_func = (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ? avcodec_decode_video2 : avcodec_decode_audio4;
+  decoded_size = decode_func(codec_ctx, *frame, got_frame, pkt);
+  if(*got_frame)
+  {
+    (*frame)->pts = av_frame_get_best_effort_timestamp(*frame);
+  }
+
+  return decoded_size;
+}
+
+static int64_t monotonic_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int filter_add_frame(FilterContext* filter_ctx, AVFrame* frame)
+{
+  int64_t begin = monotonic_ns();
+  int ret = av_buffersrc_add_frame(filter_ctx->src_ctx, frame);
+
+  filter_ctx->elapsed += monotonic_ns() - begin;
+  return ret;
+}
+
+static int filter_get_frame(FilterContext* filter_ctx, AVFrame* frame)
+{
+  int64_t begin = monotonic_ns();
+  int ret = av_buffersink_get_frame(filter_ctx->sink_ctx, frame);
+
+  filter_ctx->elapsed += monotonic_ns() - begin;
+  if(ret >= 0)
+  {
+    filter_ctx->nb_frames++;
+  }
+  return ret;
+}
+
+static void print_filter_profile()
+{
+  printf("Filter graph : %s threading with %d threads (0 is one per core), scaler flags %s\n"
+    , filter_thread_type ? "slice" : "no", filter_threads, scale_flags_name(scale_flags));
+
+  if(vfilter_ctx.filter_graph != NULL)
+  {
+    printf("Filter %-8s : %"PRId64" frames, %.3f ms, %.3f ms per frame\n"
+      , (vfilter_ctx.name != NULL) ? vfilter_ctx.name : "video", vfilter_ctx.nb_frames, vfilter_ctx.elapsed / 1000000.0
+      , vfilter_ctx.nb_frames ? vfilter_ctx.elapsed / 1000000.0 / vfilter_ctx.nb_frames : 0.0);
+  }
+
+  if(afilter_ctx.filter_graph != NULL)
+  {
+    printf("Filter %-8s : %"PRId64" frames, %.3f ms, %.3f ms per frame\n"
+      , "audio", afilter_ctx.nb_frames, afilter_ctx.elapsed / 1000000.0
+      , afilter_ctx.nb_frames ? afilter_ctx.elapsed / 1000000.0 / afilter_ctx.nb_frames : 0.0);
+  }
+}
+
+#define MAX_SCALE_SLICES 16
+
+typedef enum _ConversionEngine
+{
+  CONVERT_GRAPH,    // buffer -> scale/aformat -> buffersink
+  CONVERT_DIRECT,   // swscale and swresample called directly
+} ConversionEngine;
+
+// Horizontal band of the picture converted by its own SwsContext. The context covers the
+// band plus an overlap on either side, and only the band's own rows go to the frame.
+typedef struct _ScaleSlice
+{
+  struct SwsContext* sws_ctx;
+  int src_y;              // source rows the context reads
+  int src_h;
+  int dst_y;              // rows the context writes, overlap included
+  int dst_h;
+  int keep_y;             // rows of the band itself
+  int keep_h;
+  AVFrame* scratch;       // output of a context with overlap, NULL when it writes the frame
+} ScaleSlice;
+
+typedef struct _Scaler
+{
+  ScaleSlice slices[MAX_SCALE_SLICES];
+  int nb_slices;
+  int src_width, src_height, src_chroma_shift;
+  enum AVPixelFormat src_format;
+  int dst_width, dst_height, dst_chroma_shift;
+  enum AVPixelFormat dst_format;
+  int dst_row_bytes[4];
+  int verified;                           // bands were compared with a single context
+  int single_band;                        // they differed, so the picture is scaled in one piece
+  const AVFrame* src;                     // frame being scaled by the workers
+  AVFrame* dst;
+  pthread_t threads[MAX_SCALE_SLICES];
+  int nb_threads;                         // workers besides the calling thread
+  int generation;                         // bumped for every frame
+  int pending;                            // workers still busy with this frame
+  int quit;
+  int64_t elapsed;
+  int64_t nb_frames;
+  pthread_mutex_t mutex;
+  pthread_cond_t start;
+  pthread_cond_t done;
+} Scaler;
+
+typedef struct _Resampler
+{
+  struct SwrContext* swr_ctx;
+  AVAudioFifo* fifo;
+  uint8_t** buffer;                       // output of swr_convert, reused
+  int buffer_samples;
+  int frame_size;                         // samples per output frame, 0 for any
+  int src_sample_rate;
+  AVRational src_time_base;
+  enum AVSampleFormat dst_format;
+  int dst_channels;
+  int64_t next_pts;                       // in 1/dst_sample_rate
+  int64_t elapsed;
+  int64_t nb_frames;
+} Resampler;
+
+static ConversionEngine conversion_engine = CONVERT_GRAPH;
+static int scale_threads = 0;             // 0 means one per core
+static Scaler scaler = {.mutex = PTHREAD_MUTEX_INITIALIZER, .start = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+static Resampler resampler;
+
+// Parses graph or direct[:<threads>], e.g. "direct:4".
+static int parse_conversion_engine(const char* arg)
+{
+  if(strcmp(arg, "graph") == 0)
+  {
+    conversion_engine = CONVERT_GRAPH;
+    return 0;
+  }
+
+  if(strncmp(arg, "direct", 6) != 0 || (arg[6] != '\0' && arg[6] != ':'))
+  {
+    return -1;
+  }
+
+  conversion_engine = CONVERT_DIRECT;
+  if(arg[6] == ':')
+  {
+    scale_threads = atoi(arg + 7);
+    if(scale_threads < 0)
+    {
+      return -2;
+    }
+  }
+
+  return 0;
+}
+
+static void scale_slice(const ScaleSlice* slice, const AVFrame* src, AVFrame* dst)
+{
+  const uint8_t* src_data[4] = {NULL};
+  uint8_t* dst_data[4] = {NULL};
+  AVFrame* out = (slice->scratch != NULL) ? slice->scratch : dst;
+  int out_y = (slice->scratch != NULL) ? 0 : slice->dst_y;
+  int plane;
+
+  for(plane = 0; plane < 4; plane++)
+  {
+    // Only the chroma planes are subsampled vertically.
+    int src_shift = (plane == 1 || plane == 2) ? scaler.src_chroma_shift : 0;
+    int dst_shift = (plane == 1 || plane == 2) ? scaler.dst_chroma_shift : 0;
+
+    if(src->data[plane] != NULL)
+    {
+      src_data[plane] = src->data[plane] + (slice->src_y >> src_shift) * src->linesize[plane];
+    }
+    if(out->data[plane] != NULL)
+    {
+      dst_data[plane] = out->data[plane] + (out_y >> dst_shift) * out->linesize[plane];
+    }
+  }
+
+  sws_scale(slice->sws_ctx, src_data, src->linesize, 0, slice->src_h, dst_data, out->linesize);
+
+  if(slice->scratch == NULL)
+  {
+    return;
+  }
+
+  // The overlap rows belong to the neighbours.
+  for(plane = 0; plane < 4 && dst->data[plane] != NULL; plane++)
+  {
+    int shift = (plane == 1 || plane == 2) ? scaler.dst_chroma_shift : 0;
+
+    av_image_copy_plane(dst->data[plane] + (slice->keep_y >> shift) * dst->linesize[plane], dst->linesize[plane],
+      out->data[plane] + ((slice->keep_y - slice->dst_y) >> shift) * out->linesize[plane], out->linesize[plane],
+      scaler.dst_row_bytes[plane], -((-slice->keep_h) >> shift));
+  }
+}
+
+static void* scale_worker(void* arg)
+{
+  int index = (int)(intptr_t)arg;
+  int generation = 0;
+
+  pthread_mutex_lock(&scaler.mutex);
+  while(1)
+  {
+    while(scaler.generation == generation && !scaler.quit)
+    {
+      pthread_cond_wait(&scaler.start, &scaler.mutex);
+    }
+
+    if(scaler.quit)
+    {
+      break;
+    }
+
+    generation = scaler.generation;
+    pthread_mutex_unlock(&scaler.mutex);
+
+    if(index < scaler.nb_slices)
+    {
+      scale_slice(&scaler.slices[index], scaler.src, scaler.dst);
+    }
+
+    pthread_mutex_lock(&scaler.mutex);
+    if(--scaler.pending == 0)
+    {
+      pthread_cond_signal(&scaler.done);
+    }
+  } // while
+  pthread_mutex_unlock(&scaler.mutex);
+
+  return NULL;
+}
+
+static void release_scale_slices()
+{
+  int index;
+
+  for(index = 0; index < scaler.nb_slices; index++)
+  {
+    sws_freeContext(scaler.slices[index].sws_ctx);
+    scaler.slices[index].sws_ctx = NULL;
+    av_frame_free(&scaler.slices[index].scratch);
+  }
+
+  scaler.nb_slices = 0;
+}
+
+static struct SwsContext* alloc_band_context(int src_h, int dst_h)
+{
+  struct SwsContext* sws_ctx = sws_alloc_context();
+  if(sws_ctx == NULL)
+  {
+    return NULL;
+  }
+
+  av_opt_set_int(sws_ctx, "srcw", scaler.src_width, 0);
+  av_opt_set_int(sws_ctx, "srch", src_h, 0);
+  av_opt_set_int(sws_ctx, "src_format", scaler.src_format, 0);
+  av_opt_set_int(sws_ctx, "dstw", scaler.dst_width, 0);
+  av_opt_set_int(sws_ctx, "dsth", dst_h, 0);
+  av_opt_set_int(sws_ctx, "dst_format", scaler.dst_format, 0);
+  if(av_opt_set(sws_ctx, "sws_flags", (scale_flags != NULL) ? scale_flags : DEFAULT_SCALE_FLAGS, 0) < 0 ||
+    sws_init_context(sws_ctx, NULL, NULL) < 0)
+  {
+    printf("Failed to initialize scaler with flags %s\n", scale_flags_name(scale_flags));
+    sws_freeContext(sws_ctx);
+    return NULL;
+  }
+
+  return sws_ctx;
+}
+
+// Smallest band height, in destination rows, at which a context for a band steps through
+// the source with the same filter phases as one for the whole picture, 0 if there is none.
+// swscale steps in 16.16 fixed point, so the vertical ratio has to be exact in it.
+static int scale_band_unit(int src_height, int dst_height)
+{
+  int src_chroma_height = -((-src_height) >> scaler.src_chroma_shift);
+  int dst_chroma_height = -((-dst_height) >> scaler.dst_chroma_shift);
+  int64_t gcd = av_gcd(src_height, dst_height);
+  int64_t unit;
+
+  if((((int64_t)src_height << 16) % dst_height) != 0 ||
+    (((int64_t)src_chroma_height << 16) % dst_chroma_height) != 0 ||
+    ((int64_t)src_chroma_height * dst_height << scaler.src_chroma_shift) !=
+      ((int64_t)dst_chroma_height * src_height << scaler.dst_chroma_shift))
+  {
+    return 0;
+  }
+
+  // Bands also start on a chroma row on both sides and on a row of the 8 line dither pattern.
+  for(unit = dst_height / gcd; unit <= dst_height; unit += dst_height / gcd)
+  {
+    if(unit % (8 << scaler.dst_chroma_shift) == 0 &&
+      (unit / (dst_height / gcd) * (src_height / gcd)) % (1 << scaler.src_chroma_shift) == 0)
+    {
+      return (int)unit;
+    }
+  }
+
+  return 0;
+}
+
+// Splits the picture into one band per thread. Each band's context reads enough rows
+// around it for the widest filter (sinc and spline reach 10 taps each way), so it gives
+// the same rows as a single context would. Ratios which make that impossible use one band.
+static int init_scale_slices(int src_width, int src_height, enum AVPixelFormat src_format)
+{
+  const AVPixFmtDescriptor* src_desc = av_pix_fmt_desc_get(src_format);
+  const AVPixFmtDescriptor* dst_desc = av_pix_fmt_desc_get(scaler.dst_format);
+  int nb_slices = FFMIN(scaler.nb_threads + 1, scaler.dst_height / 16);
+  int unit = 0;
+  int overlap = 0;
+  int nb_units;
+  int index;
+
+  release_scale_slices();
+
+  if(src_desc == NULL || dst_desc == NULL || (src_desc->flags & AV_PIX_FMT_FLAG_HWACCEL))
+  {
+    return -1;
+  }
+
+  scaler.src_width = src_width;
+  scaler.src_height = src_height;
+  scaler.src_format = src_format;
+  scaler.src_chroma_shift = src_desc->log2_chroma_h;
+  scaler.dst_chroma_shift = dst_desc->log2_chroma_h;
+  scaler.verified = 0;
+  if(av_image_fill_linesizes(scaler.dst_row_bytes, scaler.dst_format, scaler.dst_width) < 0)
+  {
+    return -1;
+  }
+
+  // A palette is not a picture plane, so such formats are scaled in one piece.
+  if(nb_slices < 1 || scaler.single_band || (src_desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_PSEUDOPAL)))
+  {
+    nb_slices = 1;
+  }
+
+  if(nb_slices > 1)
+  {
+    unit = scale_band_unit(src_height, scaler.dst_height);
+  }
+
+  if(unit > 0)
+  {
+    // Whole units of overlap, so every context still starts in phase.
+    int reach = (10 * FFMAX((src_height + scaler.dst_height - 1) / scaler.dst_height, 1) + 2) << scaler.src_chroma_shift;
+    overlap = (int)(((int64_t)reach * scaler.dst_height / src_height + unit) / unit * unit);
+    nb_units = scaler.dst_height / unit;
+    nb_slices = FFMIN(nb_slices, nb_units);
+  }
+  else
+  {
+    nb_units = nb_slices = 1;
+  }
+
+  for(index = 0; index < nb_slices; index++)
+  {
+    ScaleSlice* slice = &scaler.slices[index];
+    int keep_end = (index == nb_slices - 1) ? scaler.dst_height : nb_units * (index + 1) / nb_slices * unit;
+    int dst_end;
+
+    slice->keep_y = nb_units * index / nb_slices * unit;
+    slice->keep_h = keep_end - slice->keep_y;
+    slice->dst_y = FFMAX(slice->keep_y - overlap, 0);
+    dst_end = FFMIN(keep_end + overlap, scaler.dst_height);
+    slice->dst_h = dst_end - slice->dst_y;
+    slice->src_y = (int)((int64_t)slice->dst_y * src_height / scaler.dst_height);
+    slice->src_h = ((dst_end == scaler.dst_height) ? src_height : (int)((int64_t)dst_end * src_height / scaler.dst_height)) - slice->src_y;
+
+    slice->sws_ctx = alloc_band_context(slice->src_h, slice->dst_h);
+    if(slice->sws_ctx == NULL)
+    {
+      return -3;
+    }
+    scaler.nb_slices = index + 1;
+
+    if(nb_slices > 1)
+    {
+      slice->scratch = av_frame_alloc();
+      if(slice->scratch == NULL)
+      {
+        return -2;
+      }
+
+      slice->scratch->format = scaler.dst_format;
+      slice->scratch->width = scaler.dst_width;
+      slice->scratch->height = slice->dst_h;
+      if(av_frame_get_buffer(slice->scratch, FRAME_ALIGN) < 0)
+      {
+        return -2;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Scales the first frame once more with a single context and compares. Bands which do not
+// give the same bytes are given up for the rest of the run.
+static int check_scale_slices(const AVFrame* src, AVFrame* dst)
+{
+  ScaleSlice whole = {NULL};
+  AVFrame* reference;
+  int nb_slices = scaler.nb_slices;
+  int same = 1;
+  int plane, row;
+  int ret = 0;
+
+  scaler.verified = 1;
+  if(nb_slices == 1)
+  {
+    return 0;
+  }
+
+  reference = av_frame_alloc();
+  if(reference == NULL)
+  {
+    return AVERROR(ENOMEM);
+  }
+
+  reference->format = scaler.dst_format;
+  reference->width = scaler.dst_width;
+  reference->height = scaler.dst_height;
+  whole.src_h = whole.keep_h = scaler.src_height;
+  whole.dst_h = scaler.dst_height;
+  whole.sws_ctx = alloc_band_context(whole.src_h, whole.dst_h);
+  if(whole.sws_ctx == NULL || av_frame_get_buffer(reference, FRAME_ALIGN) < 0)
+  {
+    ret = -1;
+    goto check_end;
+  }
+
+  scale_slice(&whole, src, reference);
+
+  for(plane = 0; plane < 4 && dst->data[plane] != NULL && same; plane++)
+  {
+    int shift = (plane == 1 || plane == 2) ? scaler.dst_chroma_shift : 0;
+
+    for(row = 0; row < -((-scaler.dst_height) >> shift); row++)
+    {
+      if(memcmp(dst->data[plane] + row * dst->linesize[plane],
+        reference->data[plane] + row * reference->linesize[plane], scaler.dst_row_bytes[plane]) != 0)
+      {
+        same = 0;
+        break;
+      }
+    }
   }
 
-  // Create input filter
-  // Create Buffer Source -> input filter
-  snprintf(args, sizeof(args), "time_base=%d/%d:video_size=%dx%d:pix_fmt=%d:pixel_aspect=%d/%d"
-    , stream->time_base.num, stream->time_base.den
-    , codec_ctx->width, codec_ctx->height
-    , codec_ctx->pix_fmt
-    , codec_ctx->sample_aspect_ratio.num, codec_ctx->sample_aspect_ratio.den);
-
-  // Create Buffer Source
-  if(avfilter_graph_create_filter(
-          &vfilter_ctx.src_ctx
-          , avfilter_get_by_name("buffer")
-          , "in", args, NULL, vfilter_ctx.filter_graph) < 0)
+  if(same)
   {
-    printf("Failed to create video buffer source\n");
-    return -3;
+    printf("Scaler : %d bands match a single context\n", nb_slices);
+    goto check_end;
   }
 
-  // Link Buffer Source with input filter
-  if(avfilter_link(vfilter_ctx.src_ctx, 0, inputs->filter_ctx, 0) < 0)
+  printf("Scaler : %d bands differ from a single context, using one band\n", nb_slices);
+  scaler.single_band = 1;
+  ret = init_scale_slices(scaler.src_width, scaler.src_height, scaler.src_format);
+  if(ret >= 0)
   {
-    printf("Failed to link video buffer source\n");
-    return -4;
+    ret = av_frame_copy(dst, reference);
   }
 
-  // Create output filter
-  // Create Buffer Sink
-  if(avfilter_graph_create_filter(
-          &vfilter_ctx.sink_ctx
-          , avfilter_get_by_name("buffersink")
-          , "out", NULL, NULL, vfilter_ctx.filter_graph) < 0)
+check_end:
+  sws_freeContext(whole.sws_ctx);
+  av_frame_free(&reference);
+  return ret;
+}
+
+static int init_scaler(const AVCodecContext* in_codec_ctx, int dst_width, int dst_height, enum AVPixelFormat dst_format)
+{
+  int nb_threads = (scale_threads > 0) ? scale_threads : av_cpu_count();
+
+  scaler.dst_width = dst_width;
+  scaler.dst_height = dst_height;
+  scaler.dst_format = dst_format;
+
+  for(scaler.nb_threads = 0; scaler.nb_threads < FFMIN(nb_threads, MAX_SCALE_SLICES) - 1; scaler.nb_threads++)
   {
-    printf("Failed to create video buffer sink\n");
-    return -3;
+    if(pthread_create(&scaler.threads[scaler.nb_threads], NULL, scale_worker, (void*)(intptr_t)(scaler.nb_threads + 1)) != 0)
+    {
+      break;
+    }
   }
 
-  // Create rescaler filter to resize video resolution
-  snprintf(args, sizeof(args), "%d:%d", dst_width, dst_height);
+  return init_scale_slices(in_codec_ctx->width, in_codec_ctx->height, in_codec_ctx->pix_fmt);
+}
 
-  if(avfilter_graph_create_filter(
-          &rescale_filter
-          , avfilter_get_by_name("scale")
-          , "scale", args, NULL, vfilter_ctx.filter_graph) < 0)
+// Scales into a newly allocated dst, which is laid out the way the encoder wants it.
+static int scale_frame(const AVFrame* src, AVFrame* dst)
+{
+  int64_t begin = monotonic_ns();
+  int ret;
+
+  if(src->width != scaler.src_width || src->height != scaler.src_height || src->format != scaler.src_format)
   {
-    printf("Failed to create video scale filter\n");
-    return -4;
+    ret = init_scale_slices(src->width, src->height, src->format);
+    if(ret < 0)
+    {
+      return ret;
+    }
   }
 
-  // link rescaler filter with aformat filter
-  if(avfilter_link(outputs->filter_ctx, 0, rescale_filter, 0) < 0)
+  dst->format = scaler.dst_format;
+  dst->width = scaler.dst_width;
+  dst->height = scaler.dst_height;
+  ret = av_frame_get_buffer(dst, FRAME_ALIGN);
+  if(ret < 0)
   {
-    printf("Failed to link video format filter\n");
-    return -4;
+    return ret;
   }
 
-  // aformat is linked with Buffer Sink filter.
-  if(avfilter_link(rescale_filter, 0, vfilter_ctx.sink_ctx, 0) < 0)
+  av_frame_copy_props(dst, src);
+  if(src->sample_aspect_ratio.num > 0)
   {
-    printf("Failed to link video format filter\n");
-    return -4;
+    // Same as the scale filter, the picture keeps its display aspect ratio.
+    dst->sample_aspect_ratio = av_mul_q(src->sample_aspect_ratio,
+      (AVRational){scaler.dst_height * src->width, scaler.dst_width * src->height});
   }
 
-  // Configure all prepared filters.
-  if(avfilter_graph_config(vfilter_ctx.filter_graph, NULL) < 0)
+  pthread_mutex_lock(&scaler.mutex);
+  scaler.src = src;
+  scaler.dst = dst;
+  scaler.pending = scaler.nb_threads;
+  scaler.generation++;
+  pthread_cond_broadcast(&scaler.start);
+  pthread_mutex_unlock(&scaler.mutex);
+
+  scale_slice(&scaler.slices[0], src, dst);
+
+  pthread_mutex_lock(&scaler.mutex);
+  while(scaler.pending > 0)
   {
-    printf("Failed to configure video filter context\n");
-    return -5;
+    pthread_cond_wait(&scaler.done, &scaler.mutex);
   }
+  pthread_mutex_unlock(&scaler.mutex);
 
-  av_buffersink_set_frame_size(vfilter_ctx.sink_ctx, codec_ctx->frame_size);
+  if(!scaler.verified)
+  {
+    ret = check_scale_slices(src, dst);
+    if(ret < 0)
+    {
+      return ret;
+    }
+  }
 
-  avfilter_inout_free(&inputs);
-  avfilter_inout_free(&outputs);
+  scaler.elapsed += monotonic_ns() - begin;
+  scaler.nb_frames++;
+  return 0;
 }
 
-static int init_audio_filter()
+static void release_scaler()
 {
-  AVStream* stream = inputFile.fmt_ctx->streams[inputFile.a_index];
-  AVCodecContext* codec_ctx = stream->codec;
-  AVFilterInOut *inputs, *outputs;
-  AVFilterContext* resample_filter;
-  char args[512];
+  int index;
 
-  afilter_ctx.filter_graph = NULL;
-  afilter_ctx.src_ctx = NULL;
-  afilter_ctx.sink_ctx = NULL;
+  pthread_mutex_lock(&scaler.mutex);
+  scaler.quit = 1;
+  pthread_cond_broadcast(&scaler.start);
+  pthread_mutex_unlock(&scaler.mutex);
 
-  // Allocate memory for filter graph
-  afilter_ctx.filter_graph = avfilter_graph_alloc();
-  if(afilter_ctx.filter_graph == NULL)
+  for(index = 0; index < scaler.nb_threads; index++)
+  {
+    pthread_join(scaler.threads[index], NULL);
+  }
+
+  scaler.nb_threads = 0;
+  release_scale_slices();
+}
+
+static int init_resampler(const AVCodecContext* in_codec_ctx, enum AVSampleFormat dst_format, int frame_size)
+{
+  int64_t src_ch_layout = in_codec_ctx->channel_layout ? 
+    (int64_t)in_codec_ctx->channel_layout : av_get_default_channel_layout(in_codec_ctx->channels);
+
+  resampler.frame_size = frame_size;
+  resampler.src_sample_rate = in_codec_ctx->sample_rate;
+  resampler.src_time_base = (in_codec_ctx->time_base.num > 0) ? in_codec_ctx->time_base : (AVRational){1, in_codec_ctx->sample_rate};
+  resampler.dst_format = dst_format;
+  resampler.dst_channels = av_get_channel_layout_nb_channels(dst_ch_layout);
+  resampler.next_pts = AV_NOPTS_VALUE;
+
+  resampler.swr_ctx = swr_alloc_set_opts(NULL
+    , dst_ch_layout, dst_format, dst_sample_rate
+    , src_ch_layout, in_codec_ctx->sample_fmt, in_codec_ctx->sample_rate
+    , 0, NULL);
+  if(resampler.swr_ctx == NULL || swr_init(resampler.swr_ctx) < 0)
   {
+    printf("Failed to initialize resampler\n");
     return -1;
   }
 
-  // Link input and output with filter graph.
-  if(avfilter_graph_parse2(afilter_ctx.filter_graph, "anull", &inputs, &outputs) < 0)
+  resampler.fifo = av_audio_fifo_alloc(dst_format, resampler.dst_channels, (frame_size > 0) ? frame_size : 1024);
+  if(resampler.fifo == NULL)
   {
-    printf("Failed to parse audio filtergraph\n");
     return -2;
   }
 
-  // Create input filter
-  // Create Buffer Source -> input filter
-  snprintf(args, sizeof(args), "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%"PRIx64
-    , stream->time_base.num, stream->time_base.den
-    , codec_ctx->sample_rate
-    , av_get_sample_fmt_name(codec_ctx->sample_fmt)
-    , codec_ctx->channel_layout);
+  return 0;
+}
 
-  // Create Buffer Source filter
-  if(avfilter_graph_create_filter(
-          &afilter_ctx.src_ctx
-          , avfilter_get_by_name("abuffer")
-          , "in", args, NULL, afilter_ctx.filter_graph) < 0)
+// Converts src, or drains the resampler when src is NULL, into the fifo.
+static int resample_frame(const AVFrame* src)
+{
+  int64_t begin = monotonic_ns();
+  int nb_samples = (src != NULL) ? src->nb_samples : 0;
+  int out_samples;
+  int converted;
+
+  if(src != NULL && resampler.next_pts == AV_NOPTS_VALUE && src->pts != AV_NOPTS_VALUE)
   {
-    printf("Failed to create audio buffer source\n");
-    return -3;
+    resampler.next_pts = av_rescale_q(src->pts, resampler.src_time_base, (AVRational){1, dst_sample_rate});
   }
 
-  // Link Buffer Source with input filter.
-  if(avfilter_link(afilter_ctx.src_ctx, 0, inputs->filter_ctx, 0) < 0)
+  out_samples = av_rescale_rnd(swr_get_delay(resampler.swr_ctx, resampler.src_sample_rate) + nb_samples
+    , dst_sample_rate, resampler.src_sample_rate, AV_ROUND_UP);
+
+  if(out_samples > resampler.buffer_samples)
   {
-    printf("Failed to link audio buffer source\n");
-    return -4;
+    if(resampler.buffer != NULL)
+    {
+      av_freep(&resampler.buffer[0]);
+      av_freep(&resampler.buffer);
+    }
+
+    if(av_samples_alloc_array_and_samples(&resampler.buffer, NULL
+        , resampler.dst_channels, out_samples, resampler.dst_format, 0) < 0)
+    {
+      resampler.buffer_samples = 0;
+      return AVERROR(ENOMEM);
+    }
+    resampler.buffer_samples = out_samples;
   }
 
-  // Create output filter
-  // Create Buffer Sink
-  if(avfilter_graph_create_filter(
-          &afilter_ctx.sink_ctx
-          , avfilter_get_by_name("abuffersink")
-          , "out", NULL, NULL, afilter_ctx.filter_graph) < 0)
+  converted = swr_convert(resampler.swr_ctx, resampler.buffer, out_samples
+    , (src != NULL) ? (const uint8_t**)src->extended_data : NULL, nb_samples);
+  if(converted < 0)
   {
-    printf("Failed to create audio buffer sink\n");
-    return -3;
+    return converted;
   }
 
-  // Create aformat to change audio format.
-  snprintf(args, sizeof(args), "sample_rates=%d:channel_layouts=0x%"PRIx64
-    , dst_sample_rate
-    , dst_ch_layout);
-
-  // Create aformat filter
-  if(avfilter_graph_create_filter(
-          &resample_filter
-          , avfilter_get_by_name("aformat")
-          , "aformat", args, NULL, afilter_ctx.filter_graph) < 0)
+  if(av_audio_fifo_write(resampler.fifo, (void**)resampler.buffer, converted) < converted)
   {
-    printf("Failed to create audio format filter\n");
-    return -4;
+    return AVERROR(ENOMEM);
   }
 
-  // Link output filter with aformat filter
-  if(avfilter_link(outputs->filter_ctx, 0, resample_filter, 0) < 0)
+  resampler.elapsed += monotonic_ns() - begin;
+  return 0;
+}
+
+// Takes the next frame_size samples out of the fifo, or the rest of them when flushing.
+static int resample_get_frame(AVFrame* dst, int flush)
+{
+  int64_t begin = monotonic_ns();
+  int available = av_audio_fifo_size(resampler.fifo);
+  int nb_samples = (resampler.frame_size > 0) ? resampler.frame_size : available;
+  int ret;
+
+  if(available == 0 || (available < nb_samples && !flush))
   {
-    printf("Failed to link audio format filter\n");
-    return -4;
+    return AVERROR(EAGAIN);
   }
 
-  // aformat filter is linked with Buffer Sink.
-  if(avfilter_link(resample_filter, 0, afilter_ctx.sink_ctx, 0) < 0)
+  dst->nb_samples = FFMIN(nb_samples, available);
+  dst->format = resampler.dst_format;
+  dst->channel_layout = dst_ch_layout;
+  dst->channels = resampler.dst_channels;
+  dst->sample_rate = dst_sample_rate;
+  ret = av_frame_get_buffer(dst, 0);
+  if(ret < 0)
   {
-    printf("Failed to link audio format filter\n");
-    return -4;
+    return ret;
   }
 
-  // Configure all prepared filters.
-  if(avfilter_graph_config(afilter_ctx.filter_graph, NULL) < 0)
+  av_audio_fifo_read(resampler.fifo, (void**)dst->extended_data, dst->nb_samples);
+
+  dst->pts = resampler.next_pts;
+  if(resampler.next_pts != AV_NOPTS_VALUE)
   {
-    printf("Failed to configure audio filter context\n");
-    return -5;
+    resampler.next_pts += dst->nb_samples;
   }
 
-  av_buffersink_set_frame_size(afilter_ctx.sink_ctx, codec_ctx->frame_size);
-
-  avfilter_inout_free(&inputs);
-  avfilter_inout_free(&outputs);
+  resampler.elapsed += monotonic_ns() - begin;
+  resampler.nb_frames++;
+  return 0;
 }
 
-static void release()
+static void release_resampler()
 {
-  if(inputFile.fmt_ctx != NULL)
+  swr_free(&resampler.swr_ctx);
+
+  if(resampler.fifo != NULL)
   {
-    unsigned int index;
-    for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
-    {
-      AVCodecContext* codec_ctx = inputFile.fmt_ctx->streams[index]->codec;
-      if(index == inputFile.v_index || index == inputFile.a_index)
-      {
-        avcodec_close(codec_ctx);
-      }
-    }
+    av_audio_fifo_free(resampler.fifo);
+    resampler.fifo = NULL;
+  }
 
-    avformat_close_input(&inputFile.fmt_ctx);
+  if(resampler.buffer != NULL)
+  {
+    av_freep(&resampler.buffer[0]);
+    av_freep(&resampler.buffer);
   }
+  resampler.buffer_samples = 0;
+}
 
-  if(afilter_ctx.filter_graph != NULL)
+static void print_conversion_profile()
+{
+  printf("Convert scale    : %"PRId64" frames, %.3f ms, %.3f ms per frame, %d slices\n"
+    , scaler.nb_frames, scaler.elapsed / 1000000.0
+    , scaler.nb_frames ? scaler.elapsed / 1000000.0 / scaler.nb_frames : 0.0, scaler.nb_slices);
+  printf("Convert resample : %"PRId64" frames, %.3f ms\n"
+    , resampler.nb_frames, resampler.elapsed / 1000000.0);
+}
+
+static int init_conversion(int stream_index)
+{
+  AVCodecContext* codec_ctx = inputFile.fmt_ctx->streams[stream_index]->codec;
+
+  // Same output as the filter graphs, which keep pixel and sample format.
+  if(stream_index == inputFile.v_index)
   {
-    avfilter_graph_free(&afilter_ctx.filter_graph);
+    return (conversion_engine == CONVERT_DIRECT) ? 
+      init_scaler(codec_ctx, dst_width, dst_height, codec_ctx->pix_fmt) : init_video_filter();
   }
 
-  if(vfilter_ctx.filter_graph != NULL)
+  return (conversion_engine == CONVERT_DIRECT) ? 
+    init_resampler(codec_ctx, codec_ctx->sample_fmt, codec_ctx->frame_size) : init_audio_filter();
+}
+
+// True when a decoded frame already has the size, sample rate and layout asked for.
+static int frame_is_identity(const AVFrame* frame, int stream_index)
+{
+  if(stream_index == inputFile.v_index)
   {
-    avfilter_graph_free(&vfilter_ctx.filter_graph);
+    return frame->width == dst_width && frame->height == dst_height;
   }
+
+  return frame->sample_rate == dst_sample_rate && frame->channel_layout == dst_ch_layout;
 }
 
-static int decode_packet(AVCodecContext* codec_ctx, AVPacket* pkt, AVFrame** frame, int* got_frame)
+static int stream_is_identity(int stream_index)
 {
-  int (*decode_func)(AVCodecContext *, AVFrame *, int *, const AVPacket *);
-  int decoded_size;
+  AVCodecContext* codec_ctx = inputFile.fmt_ctx->streams[stream_index]->codec;
 
-  decode_func = (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ? avcodec_decode_video2 : avcodec_decode_audio4;
-  decoded_size = decode_func(codec_ctx, *frame, got_frame, pkt);
-  if(*got_frame)
+  if(stream_index == inputFile.v_index)
   {
-    (*frame)->pts = av_frame_get_best_effort_timestamp(*frame);
+    return codec_ctx->width == dst_width && codec_ctx->height == dst_height;
   }
 
-  return decoded_size;
+  return codec_ctx->sample_rate == dst_sample_rate && codec_ctx->channel_layout == dst_ch_layout;
+}
+
+static void print_filtered_frame(int stream_index, const AVFrame* frame)
+{
+  if(stream_index == inputFile.v_index)
+  {
+    printf("[after] Video : resolution : %dx%d\n"
+      , frame->width, frame->height);
+  }
+  else
+  {
+    printf("[after] Audio : sample_rate : %d / channels : %d\n"
+      , frame->sample_rate, frame->channels);
+  }
 }
 
 int main(int argc, char* argv[])
 {
+  int failed = 1;
   int ret;
+  int opt;
 
   av_register_all();
   avfilter_register_all();
   av_log_set_level(AV_LOG_DEBUG);
 
-  if(argc < 2)
+  while((opt = getopt(argc, argv, "d:b:F:S:Pc:T:")) != -1)
+  {
+    switch(opt)
+    {
+    case 'd':
+      ret = parse_thread_config(optarg);
+      break;
+    case 'b':
+      ret = parse_frame_alloc_mode(optarg);
+      break;
+    case 'F':
+      ret = parse_filter_threads(optarg);
+      break;
+    case 'S':
+      scale_flags = optarg;
+      ret = 0;
+      break;
+    case 'P':
+      profile_filters = 1;
+      ret = 0;
+      break;
+    case 'c':
+      ret = parse_conversion_engine(optarg);
+      break;
+    case 'T':
+      ret = parse_stream_selector(optarg);
+      if(ret < 0)
+      {
+        printf("Invalid stream selection %s\n", optarg);
+        return -1;
+      }
+      break;
+    default:
+      ret = -1;
+      break;
+    }
+
+    if(ret < 0)
+    {
+      optind = argc;
+      break;
+    }
+  }
+
+  if(argc - optind < 1)
   {
-    printf("usage : %s <input>\n", argv[0]);
+    printf("usage : %s [-d v|a=frame|slice|auto[:threads]] [-b default|pool|thp|hugetlb] [-F none|slice[:threads]] [-S scaler_flags] [-P] [-c graph|direct[:threads]] [-T av|video|audio|<stream>[,<stream>]] <input>\n", argv[0]);
     return 0;
   }
 
-  if(open_input(argv[1]) < 0)
+  if(open_input(argv[optind]) < 0)
   {
     goto main_end;
   }
 
-  if(init_video_filter() < 0)
+  // Streams which already match the target skip conversion.
+  vfilter_bypass = (inputFile.v_index >= 0 && stream_is_identity(inputFile.v_index));
+  afilter_bypass = (inputFile.a_index >= 0 && stream_is_identity(inputFile.a_index));
+
+  if(inputFile.v_index >= 0 && !vfilter_bypass && init_conversion(inputFile.v_index) < 0)
   {
     goto main_end;
   }
 
-  if(init_audio_filter() < 0)
+  if(inputFile.a_index >= 0 && !afilter_bypass && init_conversion(inputFile.a_index) < 0)
   {
     goto main_end;
   }
@@ -397,6 +1833,12 @@ int main(int argc, char* argv[])
     if(ret == AVERROR_EOF)
     {
       printf("End of frame\n");
+      failed = 0;
+      break;
+    }
+    else if(ret < 0)
+    {
+      printf("Failed to read a packet (%d)\n", ret);
       break;
     }
 
@@ -418,6 +1860,7 @@ int main(int argc, char* argv[])
     if(ret >= 0 && got_frame)
     {
       FilterContext* filter_ctx;
+      int* bypass = (stream_index == inputFile.v_index) ? &vfilter_bypass : &afilter_bypass;
       
       if(stream_index == inputFile.v_index)
       {
@@ -432,32 +1875,59 @@ int main(int argc, char* argv[])
           , decoded_frame->sample_rate, decoded_frame->channels);
       }
 
-      // put frame into filter.
-      if(av_buffersrc_add_frame(filter_ctx->src_ctx, decoded_frame) < 0)
+      if(*bypass)
       {
-        printf("Error occurred when putting frame into filter context\n");
-        break;
+        if(frame_is_identity(decoded_frame, stream_index))
+        {
+          print_filtered_frame(stream_index, decoded_frame);
+          av_frame_unref(decoded_frame);
+          av_free_packet(&pkt);
+          continue;
+        }
+
+        // Parameters changed in the middle of the stream, from now on it gets converted.
+        *bypass = 0;
+        if(init_conversion(stream_index) < 0)
+        {
+          break;
+        }
       }
 
-      while(1)
+      if(conversion_engine == CONVERT_DIRECT)
       {
-        // Get frame from filter, if it returns < 0 then filter is currently empty.
-        if(av_buffersink_get_frame(filter_ctx->sink_ctx, filtered_frame) < 0)
+        // A scaled frame is ready in filtered_frame, resampled audio waits in the fifo.
+        ret = (stream_index == inputFile.v_index) ? 
+          scale_frame(decoded_frame, filtered_frame) : resample_frame(decoded_frame);
+        if(ret < 0)
         {
+          printf("Error occurred when converting frame\n");
           break;
         }
+      }
+      // put frame into filter.
+      else if(filter_add_frame(filter_ctx, decoded_frame) < 0)
+      {
+        printf("Error occurred when putting frame into filter context\n");
+        break;
+      }
 
-        if(stream_index == inputFile.v_index)
+      while(1)
+      {
+        if(conversion_engine == CONVERT_DIRECT)
         {
-          printf("[after] Video : resolution : %dx%d\n"
-            , filtered_frame->width, filtered_frame->height);
+          if((stream_index == inputFile.v_index) ? 
+            (filtered_frame->buf[0] == NULL) : (resample_get_frame(filtered_frame, 0) < 0))
+          {
+            break;
+          }
         }
-        else
+        // Get frame from filter, if it returns < 0 then filter is currently empty.
+        else if(filter_get_frame(filter_ctx, filtered_frame) < 0)
         {
-          printf("[after] Audio : sample_rate : %d / channels : %d\n"
-            , filtered_frame->sample_rate, filtered_frame->channels);
+          break;
         }
 
+        print_filtered_frame(stream_index, filtered_frame);
         av_frame_unref(filtered_frame);
       } // while
       av_frame_unref(decoded_frame);
@@ -469,7 +1939,19 @@ int main(int argc, char* argv[])
   av_frame_free(&decoded_frame);
   av_frame_free(&filtered_frame);
 
+  if(conversion_engine == CONVERT_DIRECT)
+  {
+    print_conversion_profile();
+  }
+  else
+  {
+    print_filter_profile();
+  }
+
 main_end:
   release();
-  return 0;
+  release_scaler();
+  release_resampler();
+  release_frame_pools();
+  return failed;
 }
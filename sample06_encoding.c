@@ -2,14 +2,29 @@
 #include <libavcodec/avcodec.h>
 #include <libavutil/common.h>
 #include <libavutil/avutil.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libavutil/cpu.h>
+#include <libavutil/audio_fifo.h>
 #include <libavutil/pixdesc.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <sys/wait.h>
 
 #include <libavfilter/avfilter.h>
 #include <libavfilter/avfiltergraph.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 
+#include <libswscale/swscale.h>
+#include <libswresample/swresample.h>
+
 typedef struct _FileContext
 {
   AVFormatContext* fmt_ctx;
@@ -17,15 +32,213 @@ typedef struct _FileContext
   int a_index;
 } FileContext;
 
+// Decoder threading for one stream type.
+typedef struct _ThreadConfig
+{
+  int thread_type;   // FF_THREAD_FRAME, FF_THREAD_SLICE or both
+  int thread_count;  // 0 lets libavcodec pick by number of cores
+} ThreadConfig;
+
 typedef struct _FilterContext
 {
   AVFilterGraph* filter_graph;
   AVFilterContext* src_ctx;
   AVFilterContext* sink_ctx;
+  const char* name;                // filter of this step when profiling
+  int64_t elapsed;                 // nanoseconds spent in this graph
+  int64_t nb_frames;
+  int eof;
+  struct _FilterContext* next;     // following step when profiling
 } FilterContext;
 
+enum
+{
+  STAGE_DEMUX = 0,
+  STAGE_DECODE,
+  STAGE_FILTER,
+  STAGE_ENCODE,
+  STAGE_MUX,
+  STAGE_COUNT
+};
+
+enum
+{
+  ITEM_PACKET = 0,
+  ITEM_FRAME,
+  ITEM_FLUSH,   // end of one stream
+  ITEM_END      // end of all streams
+};
+
+// Unit of work passed between pipeline stages, stream_index is always the input stream index.
+typedef struct _StageItem
+{
+  int type;
+  int stream_index;
+  AVPacket pkt;
+  AVFrame* frame;
+} StageItem;
+
+// Bounded FIFO between two stages running on different threads.
+typedef struct _StageQueue
+{
+  StageItem* items;
+  int capacity;
+  int head;
+  int count;
+  int aborted;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} StageQueue;
+
+typedef struct _Pipeline
+{
+  int group[STAGE_COUNT];         // thread which runs each stage
+  StageQueue queue[STAGE_COUNT];  // input queue of each stage which starts a thread
+  int error;
+  pthread_mutex_t error_mutex;
+} Pipeline;
+
+enum
+{
+  TIMER_READ = 0,
+  TIMER_DECODE,
+  TIMER_FILTER,
+  TIMER_ENCODE,
+  TIMER_WRITE,
+  TIMER_LATENCY,  // input-to-output time of each video frame in live mode
+  TIMER_COUNT
+};
+
+// Latency of every call to one library function, in nanoseconds.
+typedef struct _StageTimer
+{
+  int64_t* samples;
+  int nb_samples;
+  int capacity;
+  int64_t total;
+} StageTimer;
+
+// Each counter is only touched by the thread running its stage.
+typedef struct _TranscodeStats
+{
+  StageTimer timer[TIMER_COUNT];
+  int64_t start_time;
+  int64_t end_time;
+  int64_t encoded_frames;
+  int64_t read_bytes;
+  int64_t written_bytes;
+  int64_t nb_frames;        // given to the encoders, audio included
+  int64_t warmup_allocs;    // heap allocations once nb_frames reached ALLOC_WARMUP_FRAMES
+  int64_t steady_allocs;    // and once the input ended
+  int64_t steady_frames;
+} TranscodeStats;
+
+static const char* timer_names[TIMER_COUNT] = {"read", "decode", "filter", "encode", "write", "latency"};
+
+// Built with -DCOUNT_ALLOCS, every heap allocation of the process, the libraries' included, goes through
+// these replacements of the glibc allocator, which count it. Other builds keep the stock allocator.
+#define ALLOC_WARMUP_FRAMES 100   // frames which fill the pools, queues and codec buffers first
+
+#ifdef COUNT_ALLOCS
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+extern void* __libc_valloc(size_t size);
+extern void* __libc_pvalloc(size_t size);
+
+static volatile int64_t nb_heap_allocs = 0;
+
+void* malloc(size_t size)
+{
+  __sync_fetch_and_add(&nb_heap_allocs, 1);
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+  __sync_fetch_and_add(&nb_heap_allocs, 1);
+  return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+  __sync_fetch_and_add(&nb_heap_allocs, 1);
+  return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+  __sync_fetch_and_add(&nb_heap_allocs, 1);
+  return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+  return memalign(alignment, size);
+}
+
+void* valloc(size_t size)
+{
+  __sync_fetch_and_add(&nb_heap_allocs, 1);
+  return __libc_valloc(size);
+}
+
+void* pvalloc(size_t size)
+{
+  __sync_fetch_and_add(&nb_heap_allocs, 1);
+  return __libc_pvalloc(size);
+}
+
+// av_malloc allocates through this one.
+int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+  void* mem;
+
+  if(alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+  {
+    return EINVAL;
+  }
+
+  mem = memalign(alignment, size);
+  if(mem == NULL)
+  {
+    return ENOMEM;
+  }
+
+  *ptr = mem;
+  return 0;
+}
+
+static int64_t heap_allocs()
+{
+  return __sync_add_and_fetch(&nb_heap_allocs, 0);
+}
+#else
+// Nothing is counted.
+static int64_t heap_allocs()
+{
+  return -1;
+}
+#endif
+
 static FileContext inputFile, outputFile;
 static FilterContext vfilter_ctx, afilter_ctx;
+static int vfilter_bypass = 0, afilter_bypass = 0;   // frames go to the encoder as they are
+
+// Filter graph threading and scaler, libavfilter defaults unless set on the command line.
+static int filter_thread_type = AVFILTER_THREAD_SLICE;
+static int filter_threads = 0;           // 0 means one per core
+static const char* scale_flags = NULL;   // NULL keeps the scale filter's default
+static int profile_filters = 0;
+static Pipeline pipeline;
+static TranscodeStats stats;
+static AVFrame* decoded_frame;
+
+// Same as libavcodec defaults, which means a single thread.
+static ThreadConfig vdecoder_threads = {FF_THREAD_FRAME | FF_THREAD_SLICE, 1};
+static ThreadConfig adecoder_threads = {FF_THREAD_FRAME | FF_THREAD_SLICE, 1};
 
 static const int dst_width = 480;
 static const int dst_height = 320;
@@ -34,616 +247,5577 @@ static const int dst_abit_rate = 128000;
 static const int64_t dst_ch_layout = AV_CH_LAYOUT_STEREO;
 static const int dst_sample_rate = 32000;
 
-static int open_decoder(AVCodecContext* codec_ctx)
-{
-  AVCodec* decoder = avcodec_find_decoder(codec_ctx->codec_id);
-  if(decoder == NULL)
-  {
-    return -1;
-  }
+// Range of video this process transcodes in segmented mode, in input stream time_base.
+static int64_t segment_start = AV_NOPTS_VALUE;
+static int64_t segment_end = AV_NOPTS_VALUE;
+// Same range in decoder time_base, which is what decoded frames carry.
+static int64_t segment_frame_start = AV_NOPTS_VALUE;
+static int64_t segment_frame_end = AV_NOPTS_VALUE;
+// Which stream type a segment worker keeps, AVMEDIA_TYPE_UNKNOWN keeps both.
+static enum AVMediaType segment_media = AVMEDIA_TYPE_UNKNOWN;
 
-  if(avcodec_open2(codec_ctx, decoder, NULL) < 0)
+static const char* thread_type_name(int thread_type)
+{
+  switch(thread_type)
   {
-    return -2;
+  case FF_THREAD_FRAME:
+    return "frame";
+  case FF_THREAD_SLICE:
+    return "slice";
+  case FF_THREAD_FRAME | FF_THREAD_SLICE:
+    return "auto";
   }
 
-  return 0;
+  return "none";
 }
 
-static int open_input(const char* filename)
+// Parses <stream>=<type>[:<count>] where stream is v or a
+// and type is frame, slice or auto, e.g. "v=frame:8".
+static int parse_thread_config(const char* arg)
 {
-  unsigned int index;
-
-  inputFile.fmt_ctx = NULL;
-  inputFile.a_index = inputFile.v_index = -1;
+  ThreadConfig* config;
+  const char* type;
+  const char* count;
+  size_t type_len;
 
-  if(avformat_open_input(&inputFile.fmt_ctx, filename, NULL, NULL) < 0)
+  if(strncmp(arg, "v=", 2) == 0)
+  {
+    config = &vdecoder_threads;
+  }
+  else if(strncmp(arg, "a=", 2) == 0)
+  {
+    config = &adecoder_threads;
+  }
+  else
   {
-    printf("Could not open input file %s\n", filename);
     return -1;
   }
 
-  if(avformat_find_stream_info(inputFile.fmt_ctx, NULL) < 0)
+  type = arg + 2;
+  count = strchr(type, ':');
+  type_len = (count != NULL) ? (size_t)(count - type) : strlen(type);
+
+  if(type_len == 5 && strncmp(type, "frame", 5) == 0)
+  {
+    config->thread_type = FF_THREAD_FRAME;
+  }
+  else if(type_len == 5 && strncmp(type, "slice", 5) == 0)
+  {
+    config->thread_type = FF_THREAD_SLICE;
+  }
+  else if(type_len == 4 && strncmp(type, "auto", 4) == 0)
+  {
+    config->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  }
+  else
   {
-    printf("Failed to retrieve input stream information\n");
     return -2;
   }
 
-  for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
+  if(count != NULL)
   {
-    AVCodecContext* codec_ctx = inputFile.fmt_ctx->streams[index]->codec;
-    if(codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && inputFile.v_index < 0)
-    {
-      if(open_decoder(codec_ctx) < 0)
-      {
-        break;
-      }
-
-      inputFile.v_index = index;
-    }
-    else if(codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO && inputFile.a_index < 0)
+    config->thread_count = atoi(count + 1);
+    if(config->thread_count < 0)
     {
-      if(open_decoder(codec_ctx) < 0)
-      {
-        break;
-      }
-
-      inputFile.a_index = index;
+      return -3;
     }
-  } // for
-
-  if(inputFile.a_index < 0 && inputFile.a_index < 0)
-  {
-    printf("Failed to retrieve input stream information\n");
-    return -3;
   }
 
   return 0;
 }
 
-static int create_output(const char* filename)
+#define FRAME_ALIGN 64                // cache line and widest SIMD register
+#define HUGE_PAGE_SIZE (2 << 20)
+#define MAX_FRAME_POOLS 32
+
+typedef enum _FrameAllocMode
 {
-  unsigned int index;
-  int out_index;
+  FRAME_ALLOC_DEFAULT,   // libavcodec's own get_buffer2
+  FRAME_ALLOC_POOL,      // size-class pools of aligned memory
+  FRAME_ALLOC_THP,       // pools backed by transparent huge pages
+  FRAME_ALLOC_HUGETLB,   // pools backed by reserved huge pages, THP if none left
+} FrameAllocMode;
 
-  outputFile.fmt_ctx = NULL;
-  outputFile.a_index = outputFile.v_index = -1;
+// Buffer pools by size class, shared by every video decoder.
+typedef struct _FramePools
+{
+  AVBufferPool* pools[MAX_FRAME_POOLS];
+  int sizes[MAX_FRAME_POOLS];
+  int nb_pools;
+  int64_t nb_frames;            // frames served from the pools
+  int64_t nb_allocs;            // backing allocations, the rest were reused
+  int64_t frame_bytes;
+  int64_t alloc_bytes;
+  int64_t nb_hugetlb_allocs;
+  int64_t nb_fallbacks;         // frames left to the default allocator
+  pthread_mutex_t mutex;
+} FramePools;
 
-  if(avformat_alloc_output_context2(&outputFile.fmt_ctx, NULL, NULL, filename) < 0)
+static FrameAllocMode frame_alloc_mode = FRAME_ALLOC_DEFAULT;
+static FramePools frame_pools = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static int parse_frame_alloc_mode(const char* arg)
+{
+  if(strcmp(arg, "default") == 0)
+  {
+    frame_alloc_mode = FRAME_ALLOC_DEFAULT;
+  }
+  else if(strcmp(arg, "pool") == 0)
+  {
+    frame_alloc_mode = FRAME_ALLOC_POOL;
+  }
+  else if(strcmp(arg, "thp") == 0)
+  {
+    frame_alloc_mode = FRAME_ALLOC_THP;
+  }
+  else if(strcmp(arg, "hugetlb") == 0)
+  {
+    frame_alloc_mode = FRAME_ALLOC_HUGETLB;
+  }
+  else
   {
-    printf("Could not create output context\n");
     return -1;
   }
 
-  out_index = 0;
-  for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
+  return 0;
+}
+
+static void free_frame_memory(void* opaque, uint8_t* data)
+{
+  // opaque holds the mapping size of huge pages.
+  if(opaque != NULL)
   {
-    if(index != inputFile.v_index && index != inputFile.a_index)
+    munmap(data, (size_t)(intptr_t)opaque);
+  }
+  else
+  {
+    free(data);
+  }
+}
+
+static AVBufferRef* alloc_frame_memory(int size)
+{
+  AVBufferRef* buf;
+  void* data = NULL;
+  void* opaque = NULL;
+  int huge = (frame_alloc_mode >= FRAME_ALLOC_THP && size >= HUGE_PAGE_SIZE);
+
+  if(huge && frame_alloc_mode == FRAME_ALLOC_HUGETLB)
+  {
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(data == MAP_FAILED)
     {
-      continue;
+      data = NULL;
     }
-
-    AVStream* stream;
-    AVCodecContext* in_codec_ctx = inputFile.fmt_ctx->streams[index]->codec;
-    AVCodecContext* out_codec_ctx;
-    AVCodec* encoder;
-    
-    encoder = avcodec_find_encoder((index == inputFile.v_index) ? AV_CODEC_ID_H264 : AV_CODEC_ID_AAC);
-    if(encoder == NULL)
+    else
     {
-      break;
+      opaque = (void*)(intptr_t)size;
     }
+  }
 
-    stream = avformat_new_stream(outputFile.fmt_ctx, encoder);
-    if(stream == NULL)
+  if(data == NULL)
+  {
+    if(posix_memalign(&data, huge ? HUGE_PAGE_SIZE : FRAME_ALIGN, size) != 0)
     {
-      break;
+      return NULL;
     }
 
-    out_codec_ctx = stream->codec;
-
-    if(index == inputFile.v_index)
+    if(huge)
     {
-      out_codec_ctx->bit_rate = dst_vbit_rate;
-      out_codec_ctx->width = dst_width;
-      out_codec_ctx->height = dst_height;
-      out_codec_ctx->time_base = in_codec_ctx->time_base;
-      out_codec_ctx->sample_aspect_ratio = in_codec_ctx->sample_aspect_ratio;
-      out_codec_ctx->pix_fmt = avcodec_default_get_format(out_codec_ctx, encoder->pix_fmts);
-
-      outputFile.v_index = out_index++;
+      madvise(data, size, MADV_HUGEPAGE);
     }
-    else if(index == inputFile.a_index)
-    {
-      out_codec_ctx->bit_rate = dst_abit_rate;
-      out_codec_ctx->sample_rate = dst_sample_rate;
-      out_codec_ctx->channel_layout = dst_ch_layout;
-      out_codec_ctx->channels = av_get_channel_layout_nb_channels(dst_ch_layout);
-      out_codec_ctx->sample_fmt = encoder->sample_fmts[0];
-      out_codec_ctx->time_base = (AVRational){1, dst_sample_rate};
+  }
 
-      outputFile.a_index = out_index++;
-    }
+  buf = av_buffer_create(data, size, free_frame_memory, opaque, 0);
+  if(buf == NULL)
+  {
+    free_frame_memory(opaque, data);
+    return NULL;
+  }
 
-    if(outputFile.fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
-    {
-      out_codec_ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
-    }
+  pthread_mutex_lock(&frame_pools.mutex);
+  frame_pools.nb_allocs++;
+  frame_pools.alloc_bytes += size;
+  frame_pools.nb_hugetlb_allocs += (opaque != NULL);
+  pthread_mutex_unlock(&frame_pools.mutex);
 
-    if(avcodec_open2(out_codec_ctx, encoder, NULL) < 0) 
-    {
-      return -2;
-    }
-  } // for
+  return buf;
+}
 
-  if(!(outputFile.fmt_ctx->oformat->flags & AVFMT_NOFILE))
+// Rounds up to a quarter of the next power of two, or to whole huge pages,
+// so frames of slightly different sizes still share a pool.
+static int frame_size_class(int size)
+{
+  int step = 4096;
+
+  if(frame_alloc_mode >= FRAME_ALLOC_THP && size >= HUGE_PAGE_SIZE)
   {
-    if(avio_open(&outputFile.fmt_ctx->pb, filename, AVIO_FLAG_WRITE) < 0)
-    {
-      printf("Failed to create output file %s\n", filename);
-      return -4;
-    }
+    return FFALIGN(size, HUGE_PAGE_SIZE);
   }
 
-  if(avformat_write_header(outputFile.fmt_ctx, NULL) < 0)
+  while(step * 4 < size)
   {
-    printf("Failed writing header into output file\n");
-    return -5;  
+    step *= 2;
   }
 
-  return 0;
+  return FFALIGN(size, step);
 }
 
-static int init_video_filter()
+static AVBufferPool* get_frame_pool(int size)
 {
-  AVStream* in_stream = inputFile.fmt_ctx->streams[inputFile.v_index];
-  AVStream* out_stream = outputFile.fmt_ctx->streams[outputFile.v_index];
-  AVCodecContext* in_codec_ctx = in_stream->codec;
-  AVCodecContext* out_codec_ctx = in_stream->codec;
-  AVFilterContext* rescale_filter;  
-  AVFilterContext* format_filter;
-
-  AVFilterInOut *inputs, *outputs;
-  char args[512];
+  AVBufferPool* pool = NULL;
+  int index;
 
-  vfilter_ctx.filter_graph = NULL;
-  vfilter_ctx.src_ctx = NULL;
-  vfilter_ctx.sink_ctx = NULL;
+  size = frame_size_class(size);
 
-  vfilter_ctx.filter_graph = avfilter_graph_alloc();
-  if(vfilter_ctx.filter_graph == NULL)
+  pthread_mutex_lock(&frame_pools.mutex);
+  for(index = 0; index < frame_pools.nb_pools; index++)
   {
-    return -1;
+    if(frame_pools.sizes[index] == size)
+    {
+      pool = frame_pools.pools[index];
+      break;
+    }
   }
 
-  if(avfilter_graph_parse2(vfilter_ctx.filter_graph, "null", &inputs, &outputs) < 0)
+  if(pool == NULL && frame_pools.nb_pools < MAX_FRAME_POOLS)
   {
-    printf("Failed to parse video filtergraph\n");
-    return -2;
+    pool = av_buffer_pool_init(size, alloc_frame_memory);
+    if(pool != NULL)
+    {
+      frame_pools.pools[frame_pools.nb_pools] = pool;
+      frame_pools.sizes[frame_pools.nb_pools] = size;
+      frame_pools.nb_pools++;
+    }
   }
+  pthread_mutex_unlock(&frame_pools.mutex);
 
-  snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d"
-    , in_codec_ctx->width, in_codec_ctx->height
-    , in_codec_ctx->pix_fmt
-    , in_stream->time_base.num, in_stream->time_base.den
-    , in_codec_ctx->sample_aspect_ratio.num, in_codec_ctx->sample_aspect_ratio.den);
+  return pool;
+}
 
-  if(avfilter_graph_create_filter(
-          &vfilter_ctx.src_ctx
-          , avfilter_get_by_name("buffer")
-          , "in", args, NULL, vfilter_ctx.filter_graph) < 0)
+// Lays out all planes of a video frame in one buffer from the pools, with room for width x height.
+// Returns AVERROR(ENOSYS) when there is no pool for it.
+static int get_pooled_planes(AVFrame* frame, int width, int height)
+{
+  int linesizes[4];
+  uint8_t* planes[4];
+  AVBufferPool* pool = NULL;
+  int size;
+  int index;
+
+  if(av_image_fill_linesizes(linesizes, frame->format, width) < 0)
   {
-    printf("Failed to create video buffer source\n");
-    return -3;
+    return AVERROR(ENOSYS);
   }
 
-  if(avfilter_link(vfilter_ctx.src_ctx, 0, inputs->filter_ctx, 0) < 0)
+  for(index = 0; index < 4; index++)
   {
-    printf("Failed to link video buffer source\n");
-    return -4;
+    linesizes[index] = FFALIGN(linesizes[index], FRAME_ALIGN);
   }
 
-  if(avfilter_graph_create_filter(
-          &vfilter_ctx.sink_ctx
-          , avfilter_get_by_name("buffersink")
-          , "out", NULL, NULL, vfilter_ctx.filter_graph) < 0)
+  // Without a base pointer this only gives the offset of every plane.
+  size = av_image_fill_pointers(planes, frame->format, height, NULL, linesizes);
+  if(size > 0)
   {
-    printf("Failed to create video buffer sink\n");
-    return -3;
+    pool = get_frame_pool(size + FRAME_ALIGN);
   }
 
-  snprintf(args, sizeof(args), "%d:%d", dst_width, dst_height);
+  if(pool == NULL)
+  {
+    return AVERROR(ENOSYS);
+  }
 
-  if(avfilter_graph_create_filter(
-          &rescale_filter
-          , avfilter_get_by_name("scale")
-          , "scale", args, NULL, vfilter_ctx.filter_graph) < 0)
+  frame->buf[0] = av_buffer_pool_get(pool);
+  if(frame->buf[0] == NULL)
   {
-    printf("Failed to create video scale filter\n");
-    return -4;
+    return AVERROR(ENOMEM);
   }
 
-  if(avfilter_link(outputs->filter_ctx, 0, rescale_filter, 0) < 0)
+  for(index = 0; index < 4; index++)
   {
-    printf("Failed to link video format filter\n");
-    return -4;
+    if(index == 0 || planes[index] != NULL)
+    {
+      frame->data[index] = frame->buf[0]->data + (planes[index] - planes[0]);
+      frame->linesize[index] = linesizes[index];
+    }
   }
+  frame->extended_data = frame->data;
 
-  if(avfilter_graph_create_filter(
-            &format_filter
-            , avfilter_get_by_name("format")
-            , "format"
-            , av_get_pix_fmt_name(out_codec_ctx->pix_fmt)
-            , NULL, vfilter_ctx.filter_graph) < 0)
-  {
-    printf("Failed to create video format filter\n");
-    return -4;
-  }
+  pthread_mutex_lock(&frame_pools.mutex);
+  frame_pools.nb_frames++;
+  frame_pools.frame_bytes += size;
+  pthread_mutex_unlock(&frame_pools.mutex);
 
-  if(avfilter_link(rescale_filter, 0, format_filter, 0) < 0)
+  return 0;
+}
+
+// Same for audio, with nb_samples, format and channels of the frame already set.
+static int get_pooled_samples(AVFrame* frame)
+{
+  AVBufferPool* pool = NULL;
+  int linesize;
+  int size;
+
+  size = av_samples_get_buffer_size(&linesize, frame->channels, frame->nb_samples, frame->format, FRAME_ALIGN);
+  if(size > 0 && frame->channels <= AV_NUM_DATA_POINTERS)
   {
-    printf("Failed to link video format filter\n");
-    return -4;
+    pool = get_frame_pool(size);
   }
 
-  if(avfilter_link(format_filter, 0, vfilter_ctx.sink_ctx, 0) < 0)
+  if(pool == NULL)
   {
-    printf("Failed to link video format filter\n");
-    return -4;
+    return AVERROR(ENOSYS);
   }
 
-  if(avfilter_graph_config(vfilter_ctx.filter_graph, NULL) < 0)
+  frame->buf[0] = av_buffer_pool_get(pool);
+  if(frame->buf[0] == NULL)
   {
-    printf("Failed to configure video filter context\n");
-    return -5;
+    return AVERROR(ENOMEM);
   }
 
-  av_buffersink_set_frame_size(vfilter_ctx.sink_ctx, in_codec_ctx->frame_size);
+  av_samples_fill_arrays(frame->data, &frame->linesize[0], frame->buf[0]->data
+    , frame->channels, frame->nb_samples, frame->format, FRAME_ALIGN);
+  frame->extended_data = frame->data;
 
-  avfilter_inout_free(&inputs);
-  avfilter_inout_free(&outputs);
+  pthread_mutex_lock(&frame_pools.mutex);
+  frame_pools.nb_frames++;
+  frame_pools.frame_bytes += size;
+  pthread_mutex_unlock(&frame_pools.mutex);
+
+  return 0;
 }
 
-static int init_audio_filter()
+// get_buffer2 handing out all planes of a video frame in one pooled buffer.
+static int get_pooled_buffer(AVCodecContext* codec_ctx, AVFrame* frame, int flags)
 {
-  AVStream* in_stream = inputFile.fmt_ctx->streams[inputFile.a_index];
-  AVCodecContext* in_codec_ctx = in_stream->codec;
-  AVFilterInOut *inputs, *outputs;
-  AVFilterContext* resample_filter;
-  char args[512];
+  const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(frame->format);
+  int linesize_align[AV_NUM_DATA_POINTERS];
+  int width = frame->width;
+  int height = frame->height;
   int ret;
 
-  afilter_ctx.filter_graph = NULL;
-  afilter_ctx.src_ctx = NULL;
-  afilter_ctx.sink_ctx = NULL;
-
-  afilter_ctx.filter_graph = avfilter_graph_alloc();
-  if(afilter_ctx.filter_graph == NULL)
+  if(desc != NULL && !(desc->flags & AV_PIX_FMT_FLAG_HWACCEL))
   {
-    return -1;
+    // Same padding as libavcodec, so decoders may write past the visible picture.
+    avcodec_align_dimensions2(codec_ctx, &width, &height, linesize_align);
+    ret = get_pooled_planes(frame, width, height);
+    if(ret != AVERROR(ENOSYS))
+    {
+      return ret;
+    }
   }
 
-  ret = avfilter_graph_parse2(afilter_ctx.filter_graph, "anull", &inputs, &outputs);
-  if(ret < 0)
-  {
-    printf("Failed to parse audio filtergraph\n");
-    return -2;
-  }
+  pthread_mutex_lock(&frame_pools.mutex);
+  frame_pools.nb_fallbacks++;
+  pthread_mutex_unlock(&frame_pools.mutex);
 
-  snprintf(args, sizeof(args), "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%"PRIx64
-    , in_stream->time_base.num, in_stream->time_base.den
-    , in_codec_ctx->sample_rate
-    , av_get_sample_fmt_name(in_codec_ctx->sample_fmt)
-    , in_codec_ctx->channel_layout);
+  return avcodec_default_get_buffer2(codec_ctx, frame, flags);
+}
 
-  if(avfilter_graph_create_filter(
-          &afilter_ctx.src_ctx
-          , avfilter_get_by_name("abuffer")
-          , "in", args, NULL, afilter_ctx.filter_graph) < 0)
-  {
-    printf("Failed to create audio buffer source\n");
-    return -3;
-  }
+// Pools go away once the last frame taken from them is freed.
+static void release_frame_pools()
+{
+  int index;
 
-  if(avfilter_link(afilter_ctx.src_ctx, 0, inputs->filter_ctx, 0) < 0)
+  // Converted frames always come from the pools, decoded ones only with -b.
+  if(frame_alloc_mode != FRAME_ALLOC_DEFAULT)
   {
-    printf("Failed to link audio buffer source\n");
-    return -4;
+    printf("Frame pools : %"PRId64" frames (%.1f MB), %"PRId64" allocations (%.1f MB, %"PRId64" on hugetlb), "
+      "%d size classes, %"PRId64" fallbacks\n"
+      , frame_pools.nb_frames, frame_pools.frame_bytes / 1048576.0
+      , frame_pools.nb_allocs, frame_pools.alloc_bytes / 1048576.0, frame_pools.nb_hugetlb_allocs
+      , frame_pools.nb_pools, frame_pools.nb_fallbacks);
   }
 
-  if(avfilter_graph_create_filter(
-          &afilter_ctx.sink_ctx
-          , avfilter_get_by_name("abuffersink")
-          , "out", NULL, NULL, afilter_ctx.filter_graph) < 0)
+  for(index = 0; index < frame_pools.nb_pools; index++)
   {
-    printf("Failed to create audio buffer sink\n");
-    return -3;
+    av_buffer_pool_uninit(&frame_pools.pools[index]);
   }
+  frame_pools.nb_pools = 0;
+}
 
-  snprintf(args, sizeof(args), "sample_fmts=%s:sample_rates=%d:channel_layouts=0x%"PRIx64
-    , av_get_sample_fmt_name(outputFile.fmt_ctx->streams[outputFile.a_index]->codec->sample_fmt)
-    , dst_sample_rate
-    , dst_ch_layout);
+// Draft decoding trades picture quality for decoding speed when the output is much smaller than the source.
+#define DRAFT_AUTO -1
+#define MAX_DRAFT_LEVEL 3
+#define DRAFT_REPORT_FRAMES 100
 
-  if(avfilter_graph_create_filter(
-          &resample_filter
-          , avfilter_get_by_name("aformat")
-          , "aformat", args, NULL, afilter_ctx.filter_graph) < 0)
+static int draft_level = 0;
+static int draft_report_only = 0;
+// Video size the decoded frames have to serve, 0 for dst_width x dst_height.
+static int draft_width = 0;
+static int draft_height = 0;
+
+// Parses off, auto, report or a level from 0 to 3.
+static int parse_draft_level(const char* arg)
+{
+  if(strcmp(arg, "off") == 0)
   {
-    printf("Failed to create audio format filter\n");
-    return -4;
+    draft_level = 0;
   }
-
-  if(avfilter_link(outputs->filter_ctx, 0, resample_filter, 0) < 0)
+  else if(strcmp(arg, "auto") == 0)
   {
-    printf("Failed to link audio format filter\n");
-    return -4;
+    draft_level = DRAFT_AUTO;
   }
-
-  if(avfilter_link(resample_filter, 0, afilter_ctx.sink_ctx, 0) < 0)
+  else if(strcmp(arg, "report") == 0)
   {
-    printf("Failed to link audio format filter\n");
-    return -4;
+    draft_report_only = 1;
   }
-
-  if(avfilter_graph_config(afilter_ctx.filter_graph, NULL) < 0)
+  else if(arg[0] >= '0' && arg[0] - '0' <= MAX_DRAFT_LEVEL && arg[1] == '\0')
   {
-    printf("Failed to configure audio filter context\n");
-    return -5;
+    draft_level = arg[0] - '0';
+  }
+  else
+  {
+    return -1;
   }
 
-  av_buffersink_set_frame_size(afilter_ctx.sink_ctx, in_codec_ctx->frame_size);
+  return 0;
+}
 
-  avfilter_inout_free(&inputs);
-  avfilter_inout_free(&outputs);
+static void get_draft_target(int* width, int* height)
+{
+  *width = (draft_width > 0) ? draft_width : dst_width;
+  *height = (draft_height > 0) ? draft_height : dst_height;
 }
 
-static void release()
+// Picks a level from how much the output shrinks a source of the given size.
+static int auto_draft_level(int src_width, int src_height)
 {
-  unsigned int index;
-  if(inputFile.fmt_ctx != NULL)
+  int width, height;
+  double ratio;
+
+  get_draft_target(&width, &height);
+  ratio = FFMIN((double)src_width / width, (double)src_height / height);
+  if(ratio >= 4.0)
   {
-    for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
-    {
-      AVCodecContext* codec_ctx = inputFile.fmt_ctx->streams[index]->codec;
-      if(index == inputFile.v_index || index == inputFile.a_index)
-      {
-        avcodec_close(codec_ctx);
-      }
-    }
+    return 3;
+  }
+  else if(ratio >= 2.0)
+  {
+    return 2;
+  }
+  else if(ratio >= 1.5)
+  {
+    return 1;
+  }
 
-    avformat_close_input(&inputFile.fmt_ctx);
+  return 0;
+}
+
+// Has to be called before the decoder is opened, which applies lowres to codec_ctx->width and height.
+static void apply_draft_level(AVCodecContext* codec_ctx, const AVCodec* decoder, int level)
+{
+  int width, height;
+
+  if(level >= 1)
+  {
+    // Deblocking of frames nothing else refers to can not drift.
+    codec_ctx->flags2 |= CODEC_FLAG2_FAST;
+    codec_ctx->skip_loop_filter = AVDISCARD_NONREF;
   }
 
-  if(outputFile.fmt_ctx != NULL)
+  if(level >= 2)
   {
-    for(index = 0; index < outputFile.fmt_ctx->nb_streams; index++)
-    {
-      AVCodecContext* codec_ctx = outputFile.fmt_ctx->streams[index]->codec;
-      avcodec_close(codec_ctx);
-    }
+    codec_ctx->skip_loop_filter = AVDISCARD_ALL;
 
-    if(!(outputFile.fmt_ctx->oformat->flags & AVFMT_NOFILE))
+    // Decode at 1/2, 1/4 or 1/8 size as long as that is still no smaller than the output.
+    get_draft_target(&width, &height);
+    while(codec_ctx->lowres < decoder->max_lowres &&
+      (codec_ctx->width >> (codec_ctx->lowres + 1)) >= width &&
+      (codec_ctx->height >> (codec_ctx->lowres + 1)) >= height)
     {
-      avio_closep(&outputFile.fmt_ctx->pb);
+      codec_ctx->lowres++;
     }
-    avformat_free_context(outputFile.fmt_ctx);
-  }
-
-  if(afilter_ctx.filter_graph != NULL)
-  {
-    avfilter_graph_free(&afilter_ctx.filter_graph);
   }
 
-  if(vfilter_ctx.filter_graph != NULL)
+  if(level >= 3)
   {
-    avfilter_graph_free(&vfilter_ctx.filter_graph);
+    codec_ctx->skip_idct = AVDISCARD_BIDIR;
   }
 }
 
-static int decode_packet(AVCodecContext* codec_ctx, AVPacket* pkt, AVFrame** frame, int* got_frame)
+static int open_decoder(AVCodecContext* codec_ctx, const ThreadConfig* threads)
 {
-  int (*decode_func)(AVCodecContext *, AVFrame *, int *, const AVPacket *);
-  int decoded_size;
+  AVCodec* decoder = avcodec_find_decoder(codec_ctx->codec_id);
+  int level = 0;
 
-  decode_func = (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ? avcodec_decode_video2 : avcodec_decode_audio4;
-  decoded_size = decode_func(codec_ctx, *frame, got_frame, pkt);
-  if(*got_frame)
+  if(decoder == NULL)
   {
-    (*frame)->pts = av_frame_get_best_effort_timestamp(*frame);
+    return -1;
   }
 
-  return decoded_size;
-}
-
-static int encode_write_frame(AVFrame* frame, int out_stream_index, int* got_packet)
-{
-  AVStream* stream = outputFile.fmt_ctx->streams[out_stream_index];
-  AVCodecContext* codec_ctx = stream->codec;
-  int (*encode_func)(AVCodecContext*, AVPacket*, const AVFrame*, int *);
-  AVPacket encoded_pkt;
-  
-  av_init_packet(&encoded_pkt);
-  encoded_pkt.data = NULL;
-  encoded_pkt.size = 0;
-  
-  encode_func = (out_stream_index == outputFile.v_index) ? avcodec_encode_video2 : avcodec_encode_audio2;
-  *got_packet = 0;
+  // Threading has to be decided before the codec is opened.
+  codec_ctx->thread_type = threads->thread_type;
+  codec_ctx->thread_count = threads->thread_count;
 
-  if(frame != NULL) frame->pict_type = AV_PICTURE_TYPE_NONE;
+  if(codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    level = (draft_level == DRAFT_AUTO) ? auto_draft_level(codec_ctx->width, codec_ctx->height) : draft_level;
+    apply_draft_level(codec_ctx, decoder, level);
+  }
 
-  if(encode_func(codec_ctx, &encoded_pkt, frame, got_packet) < 0)
+  // Video frames come from the shared pools, which decoders without DR1 can not write into.
+  if(frame_alloc_mode != FRAME_ALLOC_DEFAULT && codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO &&
+    (decoder->capabilities & CODEC_CAP_DR1))
   {
-    printf("Error occurred when encoding frame\n");
-    return -1;
+    codec_ctx->get_buffer2 = get_pooled_buffer;
+    codec_ctx->thread_safe_callbacks = 1;
   }
 
-  if(*got_packet)
+  if(avcodec_open2(codec_ctx, decoder, NULL) < 0)
   {
-    encoded_pkt.stream_index = out_stream_index;
-    av_packet_rescale_ts(&encoded_pkt, codec_ctx->time_base, stream->time_base);
+    return -2;
+  }
 
-    if(av_interleaved_write_frame(outputFile.fmt_ctx, &encoded_pkt) < 0)
-    {
-      printf("Error occurred when writing packet into file\n");
-      return -2;
-    }
+  // libavcodec falls back to what the codec supports, so report what is actually used.
+  printf("%s decoder %s : requested %s threading with %d threads, using %s threading with %d threads\n"
+    , (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ? "Video" : "Audio"
+    , decoder->name
+    , thread_type_name(threads->thread_type), threads->thread_count
+    , thread_type_name(codec_ctx->active_thread_type), codec_ctx->thread_count);
 
-    av_free_packet(&encoded_pkt);
+  if(level > 0)
+  {
+    printf("Video decoder %s : draft level %d, lowres %d, decoding at %dx%d\n"
+      , decoder->name, level, codec_ctx->lowres, codec_ctx->width, codec_ctx->height);
   }
 
   return 0;
 }
 
-static int filter_encode_write_frame(AVFrame* frame, int out_stream_index)
+// Options handed to avcodec_open2() for every encoder of that stream type, e.g. preset, tune or threads.
+static AVDictionary* vencoder_options = NULL;
+static AVDictionary* aencoder_options = NULL;
+
+// Parses <stream>=<key>=<value>[,<key>=<value>...] where stream is v or a,
+// e.g. "v=preset=veryfast,tune=film,threads=8".
+static int parse_encoder_options(const char* arg)
 {
-  AVStream* out_stream = outputFile.fmt_ctx->streams[out_stream_index];
-  AVCodecContext* out_codec_ctx = out_stream->codec;
-  FilterContext* filterContext = (out_stream_index == outputFile.v_index) ? 
-                    &vfilter_ctx : &afilter_ctx;
-  int got_packet;
+  AVDictionary** options;
 
-  AVFrame* filtered_frame = av_frame_alloc();
-  if(filtered_frame == NULL)
+  if(strncmp(arg, "v=", 2) == 0)
+  {
+    options = &vencoder_options;
+  }
+  else if(strncmp(arg, "a=", 2) == 0)
+  {
+    options = &aencoder_options;
+  }
+  else
   {
     return -1;
   }
 
-  if(av_buffersrc_add_frame(filterContext->src_ctx, frame) < 0)
+  return (av_dict_parse_string(options, arg + 2, "=", ",", 0) < 0) ? -2 : 0;
+}
+
+// Opens an encoder with a copy of options, and reports the ones it does not know.
+static int open_encoder(AVCodecContext* codec_ctx, AVCodec* encoder, const AVDictionary* options)
+{
+  AVDictionary* unused = NULL;
+  AVDictionaryEntry* entry = NULL;
+  int ret;
+
+  av_dict_copy(&unused, options, 0);
+  ret = avcodec_open2(codec_ctx, encoder, &unused);
+
+  while((entry = av_dict_get(unused, "", entry, AV_DICT_IGNORE_SUFFIX)) != NULL)
   {
-    printf("Error occurred when putting frame into filter context\n");
-    return -2;
+    printf("Encoder %s : unknown option %s=%s\n", encoder->name, entry->key, entry->value);
   }
+  av_dict_free(&unused);
 
-  while(1)
-  {
-    if(av_buffersink_get_frame(filterContext->sink_ctx, filtered_frame) < 0)
-    {
-      break;
-    }
+  return ret;
+}
 
-    if(encode_write_frame(filtered_frame, out_stream_index, &got_packet) < 0)
-    {
-      break;
-    }
+// Samples per audio encoder call for codecs which take any frame size, 0 for the default,
+// AUDIO_BATCH_OFF to hand filtered frames to the encoder as they come.
+#define AUDIO_BATCH_OFF -1
+#define DEFAULT_AUDIO_BATCH 4096
 
-    av_frame_unref(filtered_frame);
-  } // while
+static int audio_batch_samples = 0;
 
-  av_frame_free(&filtered_frame);
-  return 0;
+// Parses off or a number of samples.
+static int parse_audio_batch(const char* arg)
+{
+  if(strcmp(arg, "off") == 0)
+  {
+    audio_batch_samples = AUDIO_BATCH_OFF;
+    return 0;
+  }
+
+  audio_batch_samples = atoi(arg);
+  return (audio_batch_samples > 0) ? 0 : -1;
 }
 
-int main(int argc, char* argv[])
+// Streams to read, by type or by index. Everything else is discarded by the demuxer.
+static int select_video = 1;
+static int select_audio = 1;
+static int selected_tracks[2] = {-1, -1};
+static int nb_selected_tracks = 0;
+
+// Parses av, video, audio or up to two stream indexes, e.g. "0,3".
+static int parse_stream_selector(const char* arg)
 {
-  int ret;
+  const char* track = arg;
+  char* end;
 
-  av_register_all();
-  avfilter_register_all();
-  av_log_set_level(AV_LOG_DEBUG);
+  select_video = select_audio = 1;
+  nb_selected_tracks = 0;
 
-  if(argc < 3)
+  if(strcmp(arg, "av") == 0)
   {
-    printf("usage : %s <input>\n", argv[0]);
     return 0;
   }
-
-  if(open_input(argv[1]) < 0 || create_output(argv[2]) < 0)
+  else if(strcmp(arg, "video") == 0)
   {
-    goto main_end;
+    select_audio = 0;
+    return 0;
   }
-
-  if(init_video_filter() < 0 || init_audio_filter() < 0)
+  else if(strcmp(arg, "audio") == 0)
   {
-    goto main_end;
+    select_video = 0;
+    return 0;
   }
 
-  AVFrame* decoded_frame = av_frame_alloc();
-  if(decoded_frame == NULL)
+  while(*track != '\0' && nb_selected_tracks < 2)
   {
-    goto main_end;
-  }
-  
-  AVPacket pkt;
-  int got_frame;
-  int out_stream_index;
-
-  while(1)
-  { 
-    ret = av_read_frame(inputFile.fmt_ctx, &pkt);
-    if(ret == AVERROR_EOF)
+    long index = strtol(track, &end, 10);
+    if(end == track || index < 0)
     {
-      printf("End of frame\n");
-      break;
+      return -1;
     }
 
-    if(pkt.stream_index != inputFile.v_index && 
-      pkt.stream_index != inputFile.a_index)
+    selected_tracks[nb_selected_tracks++] = (int)index;
+    if(*end == ',' && end[1] == '\0')
     {
-      av_free_packet(&pkt);
-      continue;
+      return -1;
     }
+    track = (*end == ',') ? end + 1 : end;
+  }
 
-    AVStream* in_stream = inputFile.fmt_ctx->streams[pkt.stream_index];
-    AVCodecContext* in_codec_ctx = in_stream->codec;
+  return (*track == '\0' && nb_selected_tracks > 0) ? 0 : -2;
+}
 
-    out_stream_index = (pkt.stream_index == inputFile.v_index) ? 
-            outputFile.v_index : outputFile.a_index;
+static int stream_wanted(unsigned int index, enum AVMediaType type)
+{
+  int track;
 
-    got_frame = 0;    
-    av_packet_rescale_ts(&pkt, in_stream->time_base, in_codec_ctx->time_base);
-    
-    ret = decode_packet(in_codec_ctx, &pkt, &decoded_frame, &got_frame);
-    if(ret >= 0 && got_frame)
+  if(nb_selected_tracks > 0)
+  {
+    for(track = 0; track < nb_selected_tracks; track++)
     {
-      ret = filter_encode_write_frame(decoded_frame, out_stream_index);
-      av_frame_unref(decoded_frame);
-      if(ret < 0)
+      if(selected_tracks[track] == (int)index)
       {
-        av_free_packet(&pkt);
-        break;
+        return 1;
       }
-    } // if
+    }
 
-    av_free_packet(&pkt);
-  } // while
+    return 0;
+  }
 
-  // Flush all remaining frames in encoder and filter.
-  int index, got_packet;
-  for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
+  return (type == AVMEDIA_TYPE_VIDEO) ? select_video : select_audio;
+}
+
+// Streams picked by index still have to be audio or video.
+static int check_selected_tracks(AVFormatContext* fmt_ctx)
+{
+  int track;
+
+  for(track = 0; track < nb_selected_tracks; track++)
   {
-    if(pkt.stream_index != inputFile.v_index && 
-      pkt.stream_index != inputFile.a_index)
+    int index = selected_tracks[track];
+    enum AVMediaType type = (index < (int)fmt_ctx->nb_streams) ? 
+      fmt_ctx->streams[index]->codec->codec_type : AVMEDIA_TYPE_UNKNOWN;
+
+    if(type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO)
     {
-      continue;
+      printf("Stream %d is neither audio nor video\n", index);
+      return -1;
     }
+  }
 
-    // Flush filter
-    out_stream_index = (index == inputFile.v_index) ? 
-            outputFile.v_index : outputFile.a_index;
-    ret = filter_encode_write_frame(NULL, out_stream_index);
+  return 0;
+}
+
+// Packets of discarded streams are skipped before parsing, so they cost no allocation.
+static void discard_unused_streams(AVFormatContext* fmt_ctx, int v_index, int a_index)
+{
+  unsigned int index;
+
+  for(index = 0; index < fmt_ctx->nb_streams; index++)
+  {
+    if((int)index != v_index && (int)index != a_index)
+    {
+      fmt_ctx->streams[index]->discard = AVDISCARD_ALL;
+    }
+  }
+}
+
+// Live input from a pipe, FIFO or socket: little probing and no buffering anywhere.
+static int live_mode = 0;
+
+#define LIVE_PROBE_SIZE 500000        // bytes
+#define LIVE_ANALYZE_DURATION 500000  // microseconds
+#define LATENCY_HISTORY 1024
+
+// Arrival time of recent video packets by pts in decoder time_base, looked up when the frame is written.
+typedef struct _LatencyTracker
+{
+  int64_t pts[LATENCY_HISTORY];
+  int64_t arrival[LATENCY_HISTORY];
+  int next;
+  pthread_mutex_t mutex;
+} LatencyTracker;
+
+static LatencyTracker latency_tracker = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+// "-" is stdin for input and stdout for output, anything else goes to libavformat as is.
+static const char* live_url(const char* filename, const char* pipe_url)
+{
+  return (live_mode && strcmp(filename, "-") == 0) ? pipe_url : filename;
+}
+
+// Descriptor the muxer writes to when the output is stdout.
+static char stdout_url[32] = "pipe:1";
+
+// A stream on stdout would be corrupted by everything printed along with it, so that goes to
+// stderr from here on and the muxer gets a copy of the real stdout.
+static int move_stdout_to_stderr()
+{
+  int fd;
+
+  fflush(stdout);
+  fd = dup(STDOUT_FILENO);
+  if(fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+  {
+    return -1;
+  }
+
+  snprintf(stdout_url, sizeof(stdout_url), "pipe:%d", fd);
+  return 0;
+}
+
+static void init_latency_tracker()
+{
+  int index;
+
+  for(index = 0; index < LATENCY_HISTORY; index++)
+  {
+    latency_tracker.pts[index] = AV_NOPTS_VALUE;
+  }
+  latency_tracker.next = 0;
+}
+
+static void record_arrival(int64_t pts, int64_t arrival)
+{
+  pthread_mutex_lock(&latency_tracker.mutex);
+  latency_tracker.pts[latency_tracker.next] = pts;
+  latency_tracker.arrival[latency_tracker.next] = arrival;
+  latency_tracker.next = (latency_tracker.next + 1) % LATENCY_HISTORY;
+  pthread_mutex_unlock(&latency_tracker.mutex);
+}
+
+// Returns the arrival time of the packet with pts, or AV_NOPTS_VALUE if it is not known any more.
+static int64_t find_arrival(int64_t pts)
+{
+  int64_t arrival = AV_NOPTS_VALUE;
+  int index;
+
+  pthread_mutex_lock(&latency_tracker.mutex);
+  for(index = 0; index < LATENCY_HISTORY; index++)
+  {
+    if(latency_tracker.pts[index] == pts)
+    {
+      arrival = latency_tracker.arrival[index];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&latency_tracker.mutex);
+
+  return arrival;
+}
+
+static int open_input(const char* filename)
+{
+  AVDictionary* options = NULL;
+  unsigned int index;
+  int ret;
+
+  inputFile.fmt_ctx = NULL;
+  inputFile.a_index = inputFile.v_index = -1;
+
+  if(live_mode)
+  {
+    // Stop probing as soon as every stream is known, and hand packets out as soon as they are read.
+    av_dict_set_int(&options, "probesize", LIVE_PROBE_SIZE, 0);
+    av_dict_set_int(&options, "analyzeduration", LIVE_ANALYZE_DURATION, 0);
+    av_dict_set(&options, "fflags", "nobuffer", 0);
+  }
+
+  ret = avformat_open_input(&inputFile.fmt_ctx, live_url(filename, "pipe:0"), NULL, &options);
+  av_dict_free(&options);
+  if(ret < 0)
+  {
+    printf("Could not open input file %s\n", filename);
+    return -1;
+  }
+
+  if(avformat_find_stream_info(inputFile.fmt_ctx, NULL) < 0)
+  {
+    printf("Failed to retrieve input stream information\n");
+    return -2;
+  }
+
+  if(check_selected_tracks(inputFile.fmt_ctx) < 0)
+  {
+    return -3;
+  }
+
+  for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
+  {
+    AVCodecContext* codec_ctx = inputFile.fmt_ctx->streams[index]->codec;
+    if(codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO && inputFile.v_index < 0 && 
+      stream_wanted(index, AVMEDIA_TYPE_VIDEO))
+    {
+      if(open_decoder(codec_ctx, &vdecoder_threads) < 0)
+      {
+        break;
+      }
+
+      inputFile.v_index = index;
+    }
+    else if(codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO && inputFile.a_index < 0 && 
+      stream_wanted(index, AVMEDIA_TYPE_AUDIO))
+    {
+      if(open_decoder(codec_ctx, &adecoder_threads) < 0)
+      {
+        break;
+      }
+
+      inputFile.a_index = index;
+    }
+  } // for
+
+  discard_unused_streams(inputFile.fmt_ctx, inputFile.v_index, inputFile.a_index);
+
+  if(inputFile.v_index < 0 && inputFile.a_index < 0)
+  {
+    printf("Failed to retrieve input stream information\n");
+    return -3;
+  }
+
+  return 0;
+}
+
+static int create_output(const char* filename)
+{
+  unsigned int index;
+  int out_index;
+
+  outputFile.fmt_ctx = NULL;
+  outputFile.a_index = outputFile.v_index = -1;
+  filename = live_url(filename, stdout_url);
+
+  // Pipes and sockets have no extension to guess from, MPEG-TS is what live streams are carried in.
+  if(avformat_alloc_output_context2(&outputFile.fmt_ctx, NULL, NULL, filename) < 0 &&
+    (!live_mode || avformat_alloc_output_context2(&outputFile.fmt_ctx, NULL, "mpegts", filename) < 0))
+  {
+    printf("Could not create output context\n");
+    return -1;
+  }
+
+  if(live_mode)
+  {
+    outputFile.fmt_ctx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+  }
+
+  out_index = 0;
+  for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
+  {
+    if(index != inputFile.v_index && index != inputFile.a_index)
+    {
+      continue;
+    }
+
+    AVStream* stream;
+    AVCodecContext* in_codec_ctx = inputFile.fmt_ctx->streams[index]->codec;
+    AVCodecContext* out_codec_ctx;
+    AVCodec* encoder;
+    
+    encoder = avcodec_find_encoder((index == inputFile.v_index) ? AV_CODEC_ID_H264 : AV_CODEC_ID_AAC);
+    if(encoder == NULL)
+    {
+      break;
+    }
+
+    stream = avformat_new_stream(outputFile.fmt_ctx, encoder);
+    if(stream == NULL)
+    {
+      break;
+    }
+
+    out_codec_ctx = stream->codec;
+
+    if(index == inputFile.v_index)
+    {
+      out_codec_ctx->bit_rate = dst_vbit_rate;
+      out_codec_ctx->width = dst_width;
+      out_codec_ctx->height = dst_height;
+      out_codec_ctx->time_base = in_codec_ctx->time_base;
+      out_codec_ctx->sample_aspect_ratio = in_codec_ctx->sample_aspect_ratio;
+      out_codec_ctx->pix_fmt = avcodec_default_get_format(out_codec_ctx, encoder->pix_fmts);
+      if(live_mode)
+      {
+        // No lookahead and no B-frames, so every frame comes out of the encoder as it goes in.
+        av_opt_set(out_codec_ctx->priv_data, "tune", "zerolatency", 0);
+      }
+
+      outputFile.v_index = out_index++;
+    }
+    else if(index == inputFile.a_index)
+    {
+      out_codec_ctx->bit_rate = dst_abit_rate;
+      out_codec_ctx->sample_rate = dst_sample_rate;
+      out_codec_ctx->channel_layout = dst_ch_layout;
+      out_codec_ctx->channels = av_get_channel_layout_nb_channels(dst_ch_layout);
+      out_codec_ctx->sample_fmt = encoder->sample_fmts[0];
+      out_codec_ctx->time_base = (AVRational){1, dst_sample_rate};
+
+      outputFile.a_index = out_index++;
+    }
+
+    if(outputFile.fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+    {
+      out_codec_ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    if(open_encoder(out_codec_ctx, encoder, (index == inputFile.v_index) ? vencoder_options : aencoder_options) < 0) 
+    {
+      return -2;
+    }
+  } // for
+
+  if(!(outputFile.fmt_ctx->oformat->flags & AVFMT_NOFILE))
+  {
+    if(avio_open(&outputFile.fmt_ctx->pb, filename, AVIO_FLAG_WRITE) < 0)
+    {
+      printf("Failed to create output file %s\n", filename);
+      return -4;
+    }
+  }
+
+  if(avformat_write_header(outputFile.fmt_ctx, NULL) < 0)
+  {
+    printf("Failed writing header into output file\n");
+    return -5;  
+  }
+
+  return 0;
+}
+
+// Parses none or slice[:<count>], e.g. "slice:4".
+static int parse_filter_threads(const char* arg)
+{
+  if(strcmp(arg, "none") == 0)
+  {
+    filter_thread_type = 0;
+    filter_threads = 1;
+    return 0;
+  }
+
+  if(strncmp(arg, "slice", 5) != 0 || (arg[5] != '\0' && arg[5] != ':'))
+  {
+    return -1;
+  }
+
+  filter_thread_type = AVFILTER_THREAD_SLICE;
+  if(arg[5] == ':')
+  {
+    filter_threads = atoi(arg + 6);
+    if(filter_threads < 0)
+    {
+      return -2;
+    }
+  }
+
+  return 0;
+}
+
+// Same algorithm as the scale filter uses when no flags are given.
+#define DEFAULT_SCALE_FLAGS "bilinear"
+
+static const char* scale_flags_name(const char* flags)
+{
+  return (flags != NULL) ? flags : "default";
+}
+
+static void scale_filter_args(char* args, size_t size, int width, int height)
+{
+  if(scale_flags != NULL)
+  {
+    snprintf(args, size, "%d:%d:flags=%s", width, height, scale_flags);
+  }
+  else
+  {
+    snprintf(args, size, "%d:%d", width, height);
+  }
+}
+
+static int configure_graph(AVFilterGraph* graph)
+{
+  char sws_opts[128];
+
+  // Has to be set before any filter is added to the graph.
+  graph->thread_type = filter_thread_type;
+  graph->nb_threads = filter_threads;
+
+  if(scale_flags == NULL)
+  {
+    return 0;
+  }
+
+  // Scalers inserted by format negotiation use the same algorithm.
+  snprintf(sws_opts, sizeof(sws_opts), "flags=%s", scale_flags);
+  graph->scale_sws_opts = av_strdup(sws_opts);
+
+  return (graph->scale_sws_opts != NULL) ? 0 : -1;
+}
+
+// One graph holding a single filter, so its time can be measured on its own.
+static int init_filter_step(FilterContext* step, const char* filter_name, const char* filter_args, const char* src_args)
+{
+  AVFilterContext* filter;
+
+  step->name = filter_name;
+  step->filter_graph = avfilter_graph_alloc();
+  if(step->filter_graph == NULL || configure_graph(step->filter_graph) < 0)
+  {
+    return -1;
+  }
+
+  if(avfilter_graph_create_filter(&step->src_ctx, avfilter_get_by_name("buffer")
+          , "in", src_args, NULL, step->filter_graph) < 0 ||
+    avfilter_graph_create_filter(&filter, avfilter_get_by_name(filter_name)
+          , filter_name, filter_args, NULL, step->filter_graph) < 0 ||
+    avfilter_graph_create_filter(&step->sink_ctx, avfilter_get_by_name("buffersink")
+          , "out", NULL, NULL, step->filter_graph) < 0)
+  {
+    printf("Failed to create %s filter step\n", filter_name);
+    return -2;
+  }
+
+  if(avfilter_link(step->src_ctx, 0, filter, 0) < 0 || avfilter_link(filter, 0, step->sink_ctx, 0) < 0)
+  {
+    printf("Failed to link %s filter step\n", filter_name);
+    return -3;
+  }
+
+  if(avfilter_graph_config(step->filter_graph, NULL) < 0)
+  {
+    printf("Failed to configure %s filter step\n", filter_name);
+    return -4;
+  }
+
+  return 0;
+}
+
+// Same filters as init_video_filter(), each in a graph of its own. Conversions
+// which format negotiation inserts are charged to the filter that needed them.
+static int init_video_filter_steps()
+{
+  AVStream* stream = inputFile.fmt_ctx->streams[inputFile.v_index];
+  AVCodecContext* codec_ctx = stream->codec;
+  const char* filter_names[2] = {"scale", "format"};
+  char filter_args[2][128];
+  char src_args[512];
+  FilterContext* step = &vfilter_ctx;
+  int index;
+
+  scale_filter_args(filter_args[0], sizeof(filter_args[0]), dst_width, dst_height);
+  snprintf(filter_args[1], sizeof(filter_args[1]), "%s", av_get_pix_fmt_name(codec_ctx->pix_fmt));
+
+  snprintf(src_args, sizeof(src_args), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d"
+    , codec_ctx->width, codec_ctx->height
+    , codec_ctx->pix_fmt
+    , stream->time_base.num, stream->time_base.den
+    , codec_ctx->sample_aspect_ratio.num, codec_ctx->sample_aspect_ratio.den);
+
+  for(index = 0; index < 2; index++)
+  {
+    if(index > 0)
+    {
+      AVFilterLink* link = step->sink_ctx->inputs[0];
+
+      step->next = av_mallocz(sizeof(FilterContext));
+      if(step->next == NULL)
+      {
+        return -1;
+      }
+      step = step->next;
+
+      snprintf(src_args, sizeof(src_args), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d"
+        , link->w, link->h, link->format
+        , link->time_base.num, link->time_base.den
+        , link->sample_aspect_ratio.num, link->sample_aspect_ratio.den);
+    }
+
+    if(init_filter_step(step, filter_names[index], filter_args[index], src_args) < 0)
+    {
+      return -2;
+    }
+  }
+
+  return 0;
+}
+
+static void release_filter(FilterContext* filter_ctx)
+{
+  FilterContext* next = filter_ctx->next;
+
+  if(filter_ctx->filter_graph != NULL)
+  {
+    avfilter_graph_free(&filter_ctx->filter_graph);
+  }
+
+  while(next != NULL)
+  {
+    FilterContext* step = next;
+    next = step->next;
+    avfilter_graph_free(&step->filter_graph);
+    av_free(step);
+  }
+
+  filter_ctx->next = NULL;
+}
+
+static int init_video_filter()
+{
+  AVStream* in_stream = inputFile.fmt_ctx->streams[inputFile.v_index];
+  AVStream* out_stream = outputFile.fmt_ctx->streams[outputFile.v_index];
+  AVCodecContext* in_codec_ctx = in_stream->codec;
+  AVCodecContext* out_codec_ctx = in_stream->codec;
+  AVFilterContext* rescale_filter;  
+  AVFilterContext* format_filter;
+
+  AVFilterInOut *inputs, *outputs;
+  char args[512];
+
+  vfilter_ctx.filter_graph = NULL;
+  vfilter_ctx.src_ctx = NULL;
+  vfilter_ctx.sink_ctx = NULL;
+
+  if(profile_filters)
+  {
+    return init_video_filter_steps();
+  }
+
+  vfilter_ctx.filter_graph = avfilter_graph_alloc();
+  if(vfilter_ctx.filter_graph == NULL || configure_graph(vfilter_ctx.filter_graph) < 0)
+  {
+    return -1;
+  }
+
+  if(avfilter_graph_parse2(vfilter_ctx.filter_graph, "null", &inputs, &outputs) < 0)
+  {
+    printf("Failed to parse video filtergraph\n");
+    return -2;
+  }
+
+  snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d"
+    , in_codec_ctx->width, in_codec_ctx->height
+    , in_codec_ctx->pix_fmt
+    , in_stream->time_base.num, in_stream->time_base.den
+    , in_codec_ctx->sample_aspect_ratio.num, in_codec_ctx->sample_aspect_ratio.den);
+
+  if(avfilter_graph_create_filter(
+          &vfilter_ctx.src_ctx
+          , avfilter_get_by_name("buffer")
+          , "in", args, NULL, vfilter_ctx.filter_graph) < 0)
+  {
+    printf("Failed to create video buffer source\n");
+    return -3;
+  }
+
+  if(avfilter_link(vfilter_ctx.src_ctx, 0, inputs->filter_ctx, 0) < 0)
+  {
+    printf("Failed to link video buffer source\n");
+    return -4;
+  }
+
+  if(avfilter_graph_create_filter(
+          &vfilter_ctx.sink_ctx
+          , avfilter_get_by_name("buffersink")
+          , "out", NULL, NULL, vfilter_ctx.filter_graph) < 0)
+  {
+    printf("Failed to create video buffer sink\n");
+    return -3;
+  }
+
+  scale_filter_args(args, sizeof(args), dst_width, dst_height);
+
+  if(avfilter_graph_create_filter(
+          &rescale_filter
+          , avfilter_get_by_name("scale")
+          , "scale", args, NULL, vfilter_ctx.filter_graph) < 0)
+  {
+    printf("Failed to create video scale filter\n");
+    return -4;
+  }
+
+  if(avfilter_link(outputs->filter_ctx, 0, rescale_filter, 0) < 0)
+  {
+    printf("Failed to link video format filter\n");
+    return -4;
+  }
+
+  if(avfilter_graph_create_filter(
+            &format_filter
+            , avfilter_get_by_name("format")
+            , "format"
+            , av_get_pix_fmt_name(out_codec_ctx->pix_fmt)
+            , NULL, vfilter_ctx.filter_graph) < 0)
+  {
+    printf("Failed to create video format filter\n");
+    return -4;
+  }
+
+  if(avfilter_link(rescale_filter, 0, format_filter, 0) < 0)
+  {
+    printf("Failed to link video format filter\n");
+    return -4;
+  }
+
+  if(avfilter_link(format_filter, 0, vfilter_ctx.sink_ctx, 0) < 0)
+  {
+    printf("Failed to link video format filter\n");
+    return -4;
+  }
+
+  if(avfilter_graph_config(vfilter_ctx.filter_graph, NULL) < 0)
+  {
+    printf("Failed to configure video filter context\n");
+    return -5;
+  }
+
+  av_buffersink_set_frame_size(vfilter_ctx.sink_ctx, in_codec_ctx->frame_size);
+
+  avfilter_inout_free(&inputs);
+  avfilter_inout_free(&outputs);
+
+  return 0;
+}
+
+static int init_audio_filter()
+{
+  AVStream* in_stream = inputFile.fmt_ctx->streams[inputFile.a_index];
+  AVCodecContext* in_codec_ctx = in_stream->codec;
+  AVFilterInOut *inputs, *outputs;
+  AVFilterContext* resample_filter;
+  char args[512];
+  int ret;
+
+  afilter_ctx.filter_graph = NULL;
+  afilter_ctx.src_ctx = NULL;
+  afilter_ctx.sink_ctx = NULL;
+
+  afilter_ctx.filter_graph = avfilter_graph_alloc();
+  if(afilter_ctx.filter_graph == NULL || configure_graph(afilter_ctx.filter_graph) < 0)
+  {
+    return -1;
+  }
+
+  ret = avfilter_graph_parse2(afilter_ctx.filter_graph, "anull", &inputs, &outputs);
+  if(ret < 0)
+  {
+    printf("Failed to parse audio filtergraph\n");
+    return -2;
+  }
+
+  snprintf(args, sizeof(args), "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%"PRIx64
+    , in_stream->time_base.num, in_stream->time_base.den
+    , in_codec_ctx->sample_rate
+    , av_get_sample_fmt_name(in_codec_ctx->sample_fmt)
+    , in_codec_ctx->channel_layout);
+
+  if(avfilter_graph_create_filter(
+          &afilter_ctx.src_ctx
+          , avfilter_get_by_name("abuffer")
+          , "in", args, NULL, afilter_ctx.filter_graph) < 0)
+  {
+    printf("Failed to create audio buffer source\n");
+    return -3;
+  }
+
+  if(avfilter_link(afilter_ctx.src_ctx, 0, inputs->filter_ctx, 0) < 0)
+  {
+    printf("Failed to link audio buffer source\n");
+    return -4;
+  }
+
+  if(avfilter_graph_create_filter(
+          &afilter_ctx.sink_ctx
+          , avfilter_get_by_name("abuffersink")
+          , "out", NULL, NULL, afilter_ctx.filter_graph) < 0)
+  {
+    printf("Failed to create audio buffer sink\n");
+    return -3;
+  }
+
+  snprintf(args, sizeof(args), "sample_fmts=%s:sample_rates=%d:channel_layouts=0x%"PRIx64
+    , av_get_sample_fmt_name(outputFile.fmt_ctx->streams[outputFile.a_index]->codec->sample_fmt)
+    , dst_sample_rate
+    , dst_ch_layout);
+
+  if(avfilter_graph_create_filter(
+          &resample_filter
+          , avfilter_get_by_name("aformat")
+          , "aformat", args, NULL, afilter_ctx.filter_graph) < 0)
+  {
+    printf("Failed to create audio format filter\n");
+    return -4;
+  }
+
+  if(avfilter_link(outputs->filter_ctx, 0, resample_filter, 0) < 0)
+  {
+    printf("Failed to link audio format filter\n");
+    return -4;
+  }
+
+  if(avfilter_link(resample_filter, 0, afilter_ctx.sink_ctx, 0) < 0)
+  {
+    printf("Failed to link audio format filter\n");
+    return -4;
+  }
+
+  if(avfilter_graph_config(afilter_ctx.filter_graph, NULL) < 0)
+  {
+    printf("Failed to configure audio filter context\n");
+    return -5;
+  }
+
+  // The encoder stage batches samples itself, so the sink does not need to copy them into equal frames.
+  if(audio_batch_samples == AUDIO_BATCH_OFF)
+  {
+    av_buffersink_set_frame_size(afilter_ctx.sink_ctx, in_codec_ctx->frame_size);
+  }
+
+  avfilter_inout_free(&inputs);
+  avfilter_inout_free(&outputs);
+
+  return 0;
+}
+
+static void release()
+{
+  unsigned int index;
+  if(inputFile.fmt_ctx != NULL)
+  {
+    for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
+    {
+      AVCodecContext* codec_ctx = inputFile.fmt_ctx->streams[index]->codec;
+      if(index == inputFile.v_index || index == inputFile.a_index)
+      {
+        avcodec_close(codec_ctx);
+      }
+    }
+
+    avformat_close_input(&inputFile.fmt_ctx);
+  }
+
+  if(outputFile.fmt_ctx != NULL)
+  {
+    for(index = 0; index < outputFile.fmt_ctx->nb_streams; index++)
+    {
+      AVCodecContext* codec_ctx = outputFile.fmt_ctx->streams[index]->codec;
+      avcodec_close(codec_ctx);
+    }
+
+    if(!(outputFile.fmt_ctx->oformat->flags & AVFMT_NOFILE))
+    {
+      avio_closep(&outputFile.fmt_ctx->pb);
+    }
+    avformat_free_context(outputFile.fmt_ctx);
+  }
+
+  release_filter(&afilter_ctx);
+  release_filter(&vfilter_ctx);
+}
+
+static int decode_packet(AVCodecContext* codec_ctx, AVPacket* pkt, AVFrame** frame, int* got_frame)
+{
+  int (*decode_func)(AVCodecContext *, AVFrame *, int *, const AVPacket *);
+  int decoded_size;
+
+  decode_func = (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO) ? avcodec_decode_video2 : avcodec_decode_audio4;
+  decoded_size = decode_func(codec_ctx, *frame, got_frame, pkt);
+  if(*got_frame)
+  {
+    (*frame)->pts = av_frame_get_best_effort_timestamp(*frame);
+  }
+
+  return decoded_size;
+}
+
+static int out_index_of(int in_stream_index)
+{
+  return (in_stream_index == inputFile.v_index) ? outputFile.v_index : outputFile.a_index;
+}
+
+// AVFrame structs passed between stages are unreferenced and kept here for the next frame,
+// instead of being freed and allocated again for every frame.
+#define MAX_SPARE_FRAMES 64
+
+typedef struct _SpareFrames
+{
+  AVFrame* frames[MAX_SPARE_FRAMES];
+  int nb_frames;
+  pthread_mutex_t mutex;
+} SpareFrames;
+
+static SpareFrames spare_frames = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static AVFrame* alloc_stage_frame()
+{
+  AVFrame* frame = NULL;
+
+  pthread_mutex_lock(&spare_frames.mutex);
+  if(spare_frames.nb_frames > 0)
+  {
+    frame = spare_frames.frames[--spare_frames.nb_frames];
+  }
+  pthread_mutex_unlock(&spare_frames.mutex);
+
+  return (frame != NULL) ? frame : av_frame_alloc();
+}
+
+static void free_stage_frame(AVFrame** frame)
+{
+  if(*frame == NULL)
+  {
+    return;
+  }
+
+  av_frame_unref(*frame);
+
+  pthread_mutex_lock(&spare_frames.mutex);
+  if(spare_frames.nb_frames < MAX_SPARE_FRAMES)
+  {
+    spare_frames.frames[spare_frames.nb_frames++] = *frame;
+    *frame = NULL;
+  }
+  pthread_mutex_unlock(&spare_frames.mutex);
+
+  av_frame_free(frame);
+}
+
+static void release_spare_frames()
+{
+  while(spare_frames.nb_frames > 0)
+  {
+    av_frame_free(&spare_frames.frames[--spare_frames.nb_frames]);
+  }
+}
+
+static void free_item(StageItem* item)
+{
+  if(item->type == ITEM_PACKET)
+  {
+    av_free_packet(&item->pkt);
+  }
+  else if(item->type == ITEM_FRAME)
+  {
+    free_stage_frame(&item->frame);
+  }
+}
+
+static int queue_init(StageQueue* queue, int capacity)
+{
+  queue->items = av_malloc_array(capacity, sizeof(StageItem));
+  if(queue->items == NULL)
+  {
+    return -1;
+  }
+
+  queue->capacity = capacity;
+  queue->head = queue->count = 0;
+  queue->aborted = 0;
+  pthread_mutex_init(&queue->mutex, NULL);
+  pthread_cond_init(&queue->not_empty, NULL);
+  pthread_cond_init(&queue->not_full, NULL);
+
+  return 0;
+}
+
+static void queue_destroy(StageQueue* queue)
+{
+  if(queue->items == NULL)
+  {
+    return;
+  }
+
+  // Items left behind by an aborted pipeline still own their packet/frame.
+  while(queue->count > 0)
+  {
+    free_item(&queue->items[queue->head]);
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+  }
+
+  pthread_mutex_destroy(&queue->mutex);
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_cond_destroy(&queue->not_full);
+  av_freep(&queue->items);
+}
+
+// Blocks while the queue is full, which gives backpressure to the stage in front.
+static int queue_push(StageQueue* queue, StageItem* item)
+{
+  pthread_mutex_lock(&queue->mutex);
+  while(queue->count == queue->capacity && !queue->aborted)
+  {
+    pthread_cond_wait(&queue->not_full, &queue->mutex);
+  }
+
+  if(queue->aborted)
+  {
+    pthread_mutex_unlock(&queue->mutex);
+    free_item(item);
+    return AVERROR_EXIT;
+  }
+
+  queue->items[(queue->head + queue->count) % queue->capacity] = *item;
+  queue->count++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->mutex);
+
+  return 0;
+}
+
+static int queue_pop(StageQueue* queue, StageItem* item)
+{
+  pthread_mutex_lock(&queue->mutex);
+  while(queue->count == 0 && !queue->aborted)
+  {
+    pthread_cond_wait(&queue->not_empty, &queue->mutex);
+  }
+
+  if(queue->aborted)
+  {
+    pthread_mutex_unlock(&queue->mutex);
+    return AVERROR_EXIT;
+  }
+
+  *item = queue->items[queue->head];
+  queue->head = (queue->head + 1) % queue->capacity;
+  queue->count--;
+  pthread_cond_signal(&queue->not_full);
+  pthread_mutex_unlock(&queue->mutex);
+
+  return 0;
+}
+
+static void pipeline_abort(int error)
+{
+  int stage;
+
+  for(stage = 0; stage < STAGE_COUNT; stage++)
+  {
+    StageQueue* queue = &pipeline.queue[stage];
+    if(queue->items == NULL)
+    {
+      continue;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->aborted = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+  }
+
+  pthread_mutex_lock(&pipeline.error_mutex);
+  if(pipeline.error == 0)
+  {
+    pipeline.error = error;
+  }
+  pthread_mutex_unlock(&pipeline.error_mutex);
+}
+
+// layout is either a preset name or one thread number per stage,
+// e.g. "01223" runs filter and encode on the same thread.
+static int parse_layout(const char* layout)
+{
+  int stage;
+
+  if(strcmp(layout, "serial") == 0)
+  {
+    layout = "00000";
+  }
+  else if(strcmp(layout, "io") == 0)
+  {
+    layout = "01112";
+  }
+  else if(strcmp(layout, "full") == 0)
+  {
+    layout = "01234";
+  }
+
+  if(strlen(layout) != STAGE_COUNT)
+  {
+    return -1;
+  }
+
+  for(stage = 0; stage < STAGE_COUNT; stage++)
+  {
+    pipeline.group[stage] = layout[stage] - '0';
+
+    // Stages run in order, so a thread can only take over a contiguous run of stages.
+    if((stage == 0 && pipeline.group[stage] != 0) ||
+      (stage > 0 && pipeline.group[stage] != pipeline.group[stage - 1] &&
+      pipeline.group[stage] != pipeline.group[stage - 1] + 1))
+    {
+      return -2;
+    }
+  }
+
+  return 0;
+}
+
+static int init_pipeline(const char* layout, int queue_depth)
+{
+  int stage;
+
+  memset(&pipeline, 0, sizeof(pipeline));
+  pthread_mutex_init(&pipeline.error_mutex, NULL);
+
+  if(parse_layout(layout) < 0)
+  {
+    printf("Invalid pipeline layout %s\n", layout);
+    return -1;
+  }
+
+  for(stage = 1; stage < STAGE_COUNT; stage++)
+  {
+    // A queue is only needed where a stage starts a new thread.
+    if(pipeline.group[stage] != pipeline.group[stage - 1])
+    {
+      if(queue_init(&pipeline.queue[stage], queue_depth) < 0)
+      {
+        return -2;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static void release_pipeline()
+{
+  int stage;
+
+  for(stage = 0; stage < STAGE_COUNT; stage++)
+  {
+    queue_destroy(&pipeline.queue[stage]);
+  }
+
+  pthread_mutex_destroy(&pipeline.error_mutex);
+}
+
+static int64_t monotonic_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+typedef struct _DraftResult
+{
+  int lowres;
+  int width;            // decoded size
+  int height;
+  int nb_frames;
+  int64_t decode_time;  // ns spent in the decoder
+  double sse;           // luma squared error against level 0 at output size
+} DraftResult;
+
+// Decodes the first DRAFT_REPORT_FRAMES video frames at level and scales their luma to the output size.
+// Level 0 fills reference, other levels are compared with it.
+static int draft_decode_level(const char* filename, int level, uint8_t* reference, uint8_t* scratch, DraftResult* result)
+{
+  AVFormatContext* fmt_ctx = NULL;
+  AVCodecContext* codec_ctx = NULL;
+  struct SwsContext* sws_ctx = NULL;
+  AVCodec* decoder = NULL;
+  AVFrame* frame = NULL;
+  AVPacket pkt;
+  int width, height;
+  int v_index;
+  int got_frame;
+  int eof = 0;
+  int ret = -1;
+
+  get_draft_target(&width, &height);
+  memset(result, 0, sizeof(DraftResult));
+
+  if(avformat_open_input(&fmt_ctx, filename, NULL, NULL) < 0 ||
+    avformat_find_stream_info(fmt_ctx, NULL) < 0)
+  {
+    printf("Could not open input file %s\n", filename);
+    goto level_end;
+  }
+
+  v_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+  if(v_index < 0)
+  {
+    printf("Draft report needs a video stream\n");
+    goto level_end;
+  }
+
+  discard_unused_streams(fmt_ctx, v_index, -1);
+  codec_ctx = fmt_ctx->streams[v_index]->codec;
+  codec_ctx->thread_type = vdecoder_threads.thread_type;
+  codec_ctx->thread_count = vdecoder_threads.thread_count;
+  apply_draft_level(codec_ctx, decoder, level);
+  if(avcodec_open2(codec_ctx, decoder, NULL) < 0)
+  {
+    codec_ctx = NULL;
+    goto level_end;
+  }
+
+  result->lowres = codec_ctx->lowres;
+  result->width = codec_ctx->width;
+  result->height = codec_ctx->height;
+
+  frame = av_frame_alloc();
+  if(frame == NULL)
+  {
+    goto level_end;
+  }
+
+  while(result->nb_frames < DRAFT_REPORT_FRAMES)
+  {
+    int64_t begin;
+
+    if(!eof)
+    {
+      if(av_read_frame(fmt_ctx, &pkt) < 0)
+      {
+        eof = 1;
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+      }
+      else if(pkt.stream_index != v_index)
+      {
+        av_free_packet(&pkt);
+        continue;
+      }
+    }
+
+    got_frame = 0;
+    begin = monotonic_ns();
+    ret = avcodec_decode_video2(codec_ctx, frame, &got_frame, &pkt);
+    result->decode_time += monotonic_ns() - begin;
+    if(!eof)
+    {
+      av_free_packet(&pkt);
+    }
+
+    if(ret < 0 || !got_frame)
+    {
+      if(eof)
+      {
+        break;
+      }
+
+      continue;
+    }
+
+    // Same scaler for every level, so only the decoding differs.
+    sws_ctx = sws_getCachedContext(sws_ctx, frame->width, frame->height, frame->format,
+      width, height, AV_PIX_FMT_GRAY8, SWS_BICUBIC, NULL, NULL, NULL);
+    if(sws_ctx != NULL)
+    {
+      uint8_t* plane = (level == 0) ? reference + (size_t)result->nb_frames * width * height : scratch;
+      int linesize = width;
+      int index;
+
+      sws_scale(sws_ctx, (const uint8_t* const*)frame->data, frame->linesize, 0, frame->height, &plane, &linesize);
+      if(level > 0)
+      {
+        const uint8_t* ref = reference + (size_t)result->nb_frames * width * height;
+        for(index = 0; index < width * height; index++)
+        {
+          int diff = plane[index] - ref[index];
+          result->sse += diff * diff;
+        }
+      }
+    }
+
+    result->nb_frames++;
+    av_frame_unref(frame);
+  } // while
+
+  ret = (result->nb_frames > 0) ? 0 : -1;
+
+level_end:
+  av_frame_free(&frame);
+  sws_freeContext(sws_ctx);
+  if(codec_ctx != NULL)
+  {
+    avcodec_close(codec_ctx);
+  }
+  avformat_close_input(&fmt_ctx);
+  return ret;
+}
+
+// Decodes the start of the input at every level and prints the speed and quality of each.
+static int draft_report(const char* filename)
+{
+  DraftResult results[MAX_DRAFT_LEVEL + 1];
+  uint8_t* reference;
+  uint8_t* scratch;
+  int width, height;
+  int level;
+  int ret = 0;
+
+  get_draft_target(&width, &height);
+  reference = av_malloc((size_t)width * height * DRAFT_REPORT_FRAMES);
+  scratch = av_malloc((size_t)width * height);
+  if(reference == NULL || scratch == NULL)
+  {
+    ret = -1;
+    goto report_end;
+  }
+
+  printf("%-6s %-7s %-10s %7s %9s %8s %8s\n", "level", "lowres", "decoded", "frames", "fps", "speedup", "PSNR(Y)");
+  for(level = 0; level <= MAX_DRAFT_LEVEL; level++)
+  {
+    DraftResult* result = &results[level];
+    char size[32];
+    double fps;
+
+    if(draft_decode_level(filename, level, reference, scratch, result) < 0)
+    {
+      ret = -2;
+      break;
+    }
+
+    fps = (result->decode_time > 0) ? result->nb_frames * 1e9 / result->decode_time : 0.0;
+    snprintf(size, sizeof(size), "%dx%d", result->width, result->height);
+    printf("%-6d %-7d %-10s %7d %9.1f %7.2fx", level, result->lowres, size, result->nb_frames, fps,
+      (result->decode_time > 0) ? (double)results[0].decode_time * result->nb_frames / results[0].nb_frames / result->decode_time : 0.0);
+    if(level == 0)
+    {
+      printf(" %8s\n", "ref");
+    }
+    else if(result->sse <= 0.0)
+    {
+      printf(" %8s\n", "inf");
+    }
+    else
+    {
+      printf(" %8.2f\n", 10.0 * log10(255.0 * 255.0 * width * height * result->nb_frames / result->sse));
+    }
+  } // for
+
+  printf("auto picks level %d for %dx%d from %dx%d\n", auto_draft_level(results[0].width, results[0].height),
+    width, height, results[0].width, results[0].height);
+
+report_end:
+  av_free(reference);
+  av_free(scratch);
+  return ret;
+}
+
+#define SWEEP_FRAMES 250
+
+static const char* sweep_presets = "ultrafast,superfast,veryfast,faster,fast,medium,slow";
+
+typedef struct _SweepResult
+{
+  int64_t encode_time;  // ns spent in the encoder
+  int64_t bytes;
+  double sse;           // luma squared error of the decoded output
+  int nb_decoded;
+} SweepResult;
+
+static double plane_sse(const uint8_t* a, int a_linesize, const uint8_t* b, int b_linesize, int width, int height)
+{
+  double sse = 0.0;
+  int x, y;
+
+  for(y = 0; y < height; y++)
+  {
+    for(x = 0; x < width; x++)
+    {
+      int diff = a[y * a_linesize + x] - b[y * b_linesize + x];
+      sse += diff * diff;
+    }
+  }
+
+  return sse;
+}
+
+// Video at the start of the input, scaled once so that every operating point encodes the same frames.
+static int load_sweep_frames(AVFrame** frames, int* nb_frames, enum AVPixelFormat pix_fmt)
+{
+  AVCodecContext* codec_ctx = inputFile.fmt_ctx->streams[inputFile.v_index]->codec;
+  struct SwsContext* sws_ctx = NULL;
+  AVFrame* frame;
+  AVPacket pkt;
+  int got_frame;
+  int eof = 0;
+  int ret = 0;
+
+  *nb_frames = 0;
+  frame = av_frame_alloc();
+  if(frame == NULL)
+  {
+    return -1;
+  }
+
+  while(*nb_frames < SWEEP_FRAMES)
+  {
+    AVFrame* scaled;
+
+    if(!eof)
+    {
+      if(av_read_frame(inputFile.fmt_ctx, &pkt) < 0)
+      {
+        eof = 1;
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+      }
+      else if(pkt.stream_index != inputFile.v_index)
+      {
+        av_free_packet(&pkt);
+        continue;
+      }
+    }
+
+    got_frame = 0;
+    ret = decode_packet(codec_ctx, &pkt, &frame, &got_frame);
+    if(!eof)
+    {
+      av_free_packet(&pkt);
+    }
+
+    if(ret < 0 || !got_frame)
+    {
+      if(eof)
+      {
+        break;
+      }
+
+      continue;
+    }
+
+    scaled = av_frame_alloc();
+    sws_ctx = sws_getCachedContext(sws_ctx, frame->width, frame->height, frame->format,
+      dst_width, dst_height, pix_fmt, SWS_BICUBIC, NULL, NULL, NULL);
+    if(scaled == NULL || sws_ctx == NULL)
+    {
+      av_frame_free(&scaled);
+      ret = -2;
+      break;
+    }
+
+    scaled->format = pix_fmt;
+    scaled->width = dst_width;
+    scaled->height = dst_height;
+    if(av_frame_get_buffer(scaled, FRAME_ALIGN) < 0)
+    {
+      av_frame_free(&scaled);
+      ret = -3;
+      break;
+    }
+
+    sws_scale(sws_ctx, (const uint8_t* const*)frame->data, frame->linesize, 0, frame->height,
+      scaled->data, scaled->linesize);
+    scaled->pts = *nb_frames;
+    frames[(*nb_frames)++] = scaled;
+    av_frame_unref(frame);
+  } // while
+
+  sws_freeContext(sws_ctx);
+  av_frame_free(&frame);
+  return (ret < 0 || *nb_frames == 0) ? -1 : 0;
+}
+
+// Decodes an encoded packet, or drains the decoder for an empty one, and adds up the error against the source.
+static int sweep_decode(AVCodecContext* dec_ctx, AVPacket* pkt, AVFrame* const* frames, int nb_frames,
+  AVFrame* decoded, SweepResult* result)
+{
+  int64_t pts;
+  int got_frame;
+
+  do
+  {
+    got_frame = 0;
+    if(avcodec_decode_video2(dec_ctx, decoded, &got_frame, pkt) < 0)
+    {
+      return -1;
+    }
+
+    if(got_frame)
+    {
+      pts = av_frame_get_best_effort_timestamp(decoded);
+      if(pts >= 0 && pts < nb_frames)
+      {
+        result->sse += plane_sse(decoded->data[0], decoded->linesize[0], frames[pts]->data[0], frames[pts]->linesize[0],
+          dst_width, dst_height);
+        result->nb_decoded++;
+      }
+      av_frame_unref(decoded);
+    }
+  } while(pkt->size == 0 && got_frame);
+
+  return 0;
+}
+
+// Encodes frames at one preset and thread count on top of the -e v= options.
+static int encode_sweep_point(AVCodec* encoder, AVFrame* const* frames, int nb_frames, AVRational frame_rate,
+  const char* preset, int threads, SweepResult* result)
+{
+  AVDictionary* options = NULL;
+  AVCodecContext* enc_ctx = NULL;
+  AVCodecContext* dec_ctx = NULL;
+  AVCodec* decoder = avcodec_find_decoder(encoder->id);
+  AVFrame* decoded = NULL;
+  AVPacket pkt;
+  int got_packet;
+  int index;
+  int ret = -1;
+
+  memset(result, 0, sizeof(SweepResult));
+
+  enc_ctx = avcodec_alloc_context3(encoder);
+  dec_ctx = avcodec_alloc_context3(decoder);
+  decoded = av_frame_alloc();
+  if(decoder == NULL || enc_ctx == NULL || dec_ctx == NULL || decoded == NULL)
+  {
+    goto point_end;
+  }
+
+  enc_ctx->bit_rate = dst_vbit_rate;
+  enc_ctx->width = dst_width;
+  enc_ctx->height = dst_height;
+  enc_ctx->time_base = av_inv_q(frame_rate);
+  enc_ctx->pix_fmt = frames[0]->format;
+
+  av_dict_copy(&options, vencoder_options, 0);
+  av_dict_set(&options, "preset", preset, 0);
+  av_dict_set_int(&options, "threads", threads, 0);
+  ret = open_encoder(enc_ctx, encoder, options);
+  av_dict_free(&options);
+  if(ret < 0 || avcodec_open2(dec_ctx, decoder, NULL) < 0)
+  {
+    ret = -1;
+    goto point_end;
+  }
+
+  // The last round passes NULL until the encoder is drained.
+  for(index = 0; index <= nb_frames; index++)
+  {
+    const AVFrame* frame = (index < nb_frames) ? frames[index] : NULL;
+
+    do
+    {
+      int64_t begin;
+
+      av_init_packet(&pkt);
+      pkt.data = NULL;
+      pkt.size = 0;
+
+      begin = monotonic_ns();
+      ret = avcodec_encode_video2(enc_ctx, &pkt, frame, &got_packet);
+      result->encode_time += monotonic_ns() - begin;
+      if(ret < 0)
+      {
+        goto point_end;
+      }
+
+      if(got_packet)
+      {
+        result->bytes += pkt.size;
+        ret = sweep_decode(dec_ctx, &pkt, frames, nb_frames, decoded, result);
+        av_free_packet(&pkt);
+        if(ret < 0)
+        {
+          goto point_end;
+        }
+      }
+    } while(frame == NULL && got_packet);
+  } // for
+
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+  ret = sweep_decode(dec_ctx, &pkt, frames, nb_frames, decoded, result);
+
+point_end:
+  av_frame_free(&decoded);
+  avcodec_free_context(&dec_ctx);
+  avcodec_free_context(&enc_ctx);
+  return ret;
+}
+
+// Encodes the start of the input across presets and thread counts, spec is <preset>[,...][/<threads>[,...]]
+// and "all" stands for the usual libx264 presets. Threads default to 1 and every core.
+static int encoder_sweep(const char* filename, const char* spec)
+{
+  AVFrame* frames[SWEEP_FRAMES];
+  AVCodec* encoder;
+  AVStream* stream;
+  AVRational frame_rate;
+  char presets[256];
+  char threads[64];
+  char* preset;
+  char* thread;
+  char* preset_saveptr = NULL;
+  const char* slash;
+  enum AVPixelFormat pix_fmt;
+  int nb_frames = 0;
+  int index;
+  int ret = -1;
+
+  slash = strchr(spec, '/');
+  snprintf(presets, sizeof(presets), "%.*s", (slash != NULL) ? (int)(slash - spec) : (int)strlen(spec), spec);
+  if(strcmp(presets, "all") == 0)
+  {
+    snprintf(presets, sizeof(presets), "%s", sweep_presets);
+  }
+
+  if(slash != NULL)
+  {
+    snprintf(threads, sizeof(threads), "%s", slash + 1);
+  }
+  else
+  {
+    snprintf(threads, sizeof(threads), "1,%d", av_cpu_count());
+  }
+
+  if(open_input(filename) < 0)
+  {
+    goto sweep_end;
+  }
+
+  if(inputFile.v_index < 0)
+  {
+    printf("Encoder sweep needs a video stream\n");
+    goto sweep_end;
+  }
+
+  encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
+  if(encoder == NULL)
+  {
+    printf("Could not find an H.264 encoder\n");
+    goto sweep_end;
+  }
+
+  stream = inputFile.fmt_ctx->streams[inputFile.v_index];
+  frame_rate = (stream->avg_frame_rate.num > 0) ? stream->avg_frame_rate : (AVRational){25, 1};
+  pix_fmt = (encoder->pix_fmts != NULL) ? encoder->pix_fmts[0] : AV_PIX_FMT_YUV420P;
+
+  if(load_sweep_frames(frames, &nb_frames, pix_fmt) < 0)
+  {
+    printf("Failed to decode frames for the sweep\n");
+    goto sweep_end;
+  }
+
+  printf("Encoder sweep : %s, %d frames of %dx%d at %d/%d fps\n", encoder->name, nb_frames
+    , dst_width, dst_height, frame_rate.num, frame_rate.den);
+  printf("%-10s %7s %9s %10s %8s\n", "preset", "threads", "fps", "kbit/s", "PSNR(Y)");
+
+  for(preset = strtok_r(presets, ",", &preset_saveptr); preset != NULL; preset = strtok_r(NULL, ",", &preset_saveptr))
+  {
+    char thread_list[64];
+    char* thread_saveptr = NULL;
+
+    // strtok_r() writes into the list, which is walked again for every preset.
+    snprintf(thread_list, sizeof(thread_list), "%s", threads);
+    for(thread = strtok_r(thread_list, ",", &thread_saveptr); thread != NULL; thread = strtok_r(NULL, ",", &thread_saveptr))
+    {
+      SweepResult result;
+      double seconds = nb_frames * av_q2d(av_inv_q(frame_rate));
+
+      if(encode_sweep_point(encoder, frames, nb_frames, frame_rate, preset, atoi(thread), &result) < 0)
+      {
+        printf("%-10s %7s failed\n", preset, thread);
+        continue;
+      }
+
+      printf("%-10s %7s %9.1f %10.1f", preset, thread
+        , (result.encode_time > 0) ? nb_frames * 1e9 / result.encode_time : 0.0
+        , result.bytes * 8 / seconds / 1000);
+      if(result.nb_decoded == 0)
+      {
+        printf(" %8s\n", "-");
+      }
+      else if(result.sse <= 0.0)
+      {
+        printf(" %8s\n", "inf");
+      }
+      else
+      {
+        printf(" %8.2f\n", 10.0 * log10(255.0 * 255.0 * dst_width * dst_height * result.nb_decoded / result.sse));
+      }
+    } // for
+  } // for
+
+  ret = 0;
+
+sweep_end:
+  for(index = 0; index < nb_frames; index++)
+  {
+    av_frame_free(&frames[index]);
+  }
+  release();
+  release_frame_pools();
+
+  return ret;
+}
+
+static void timer_add(int timer_index, int64_t elapsed)
+{
+  StageTimer* timer = &stats.timer[timer_index];
+
+  timer->total += elapsed;
+
+  if(timer->nb_samples == timer->capacity)
+  {
+    int capacity = (timer->capacity > 0) ? timer->capacity * 2 : 4096;
+    int64_t* samples = av_realloc_array(timer->samples, capacity, sizeof(int64_t));
+    if(samples == NULL)
+    {
+      // Percentiles only lose this sample, the total is still right.
+      return;
+    }
+
+    timer->samples = samples;
+    timer->capacity = capacity;
+  }
+
+  timer->samples[timer->nb_samples++] = elapsed;
+}
+
+static int compare_int64(const void* a, const void* b)
+{
+  int64_t x = *(const int64_t*)a;
+  int64_t y = *(const int64_t*)b;
+
+  return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples.
+static int64_t timer_percentile(const StageTimer* timer, int percent)
+{
+  int rank;
+
+  if(timer->nb_samples == 0)
+  {
+    return 0;
+  }
+
+  rank = (int)(((int64_t)timer->nb_samples * percent + 99) / 100);
+  return timer->samples[FFMAX(rank, 1) - 1];
+}
+
+static void print_stats(const char* json_path)
+{
+  double wall_time = (stats.end_time - stats.start_time) / 1e9;
+  double seconds = (wall_time > 0) ? wall_time : 1e-9;
+  int64_t steady_frames = stats.steady_frames - ALLOC_WARMUP_FRAMES;
+  double allocs_per_frame = (steady_frames > 0) ? (double)(stats.steady_allocs - stats.warmup_allocs) / steady_frames : 0.0;
+  FILE* json = NULL;
+  int index;
+
+  for(index = 0; index < TIMER_COUNT; index++)
+  {
+    StageTimer* timer = &stats.timer[index];
+    qsort(timer->samples, timer->nb_samples, sizeof(int64_t), compare_int64);
+  }
+
+  printf("------- Transcode stats -------\n");
+  printf("%-8s %10s %12s %10s %10s %10s\n", "stage", "calls", "total(ms)", "p50(us)", "p95(us)", "p99(us)");
+  for(index = 0; index < TIMER_COUNT; index++)
+  {
+    StageTimer* timer = &stats.timer[index];
+    printf("%-8s %10d %12.3f %10.1f %10.1f %10.1f\n"
+      , timer_names[index], timer->nb_samples, timer->total / 1e6
+      , timer_percentile(timer, 50) / 1e3
+      , timer_percentile(timer, 95) / 1e3
+      , timer_percentile(timer, 99) / 1e3);
+  }
+  printf("wall time : %.3f s\n", wall_time);
+  printf("video frames : %"PRId64" (%.2f fps)\n", stats.encoded_frames, stats.encoded_frames / seconds);
+  printf("input : %"PRId64" bytes (%.0f bytes/s)\n", stats.read_bytes, stats.read_bytes / seconds);
+  printf("output : %"PRId64" bytes (%.0f bytes/s)\n", stats.written_bytes, stats.written_bytes / seconds);
+  if(heap_allocs() >= 0)
+  {
+    printf("allocations : %"PRId64" total", heap_allocs());
+    if(steady_frames > 0)
+    {
+      printf(", %.2f per frame over %"PRId64" frames after warm-up", allocs_per_frame, steady_frames);
+    }
+    printf("\n");
+  }
+
+  if(json_path == NULL)
+  {
+    return;
+  }
+
+  json = (strcmp(json_path, "-") == 0) ? stdout : fopen(json_path, "w");
+  if(json == NULL)
+  {
+    printf("Could not open stats file %s\n", json_path);
+    return;
+  }
+
+  fprintf(json, "{\"wall_time_sec\": %.6f, \"video_frames\": %"PRId64", \"fps\": %.3f, "
+    "\"input_bytes\": %"PRId64", \"input_bytes_per_sec\": %.0f, "
+    "\"output_bytes\": %"PRId64", \"output_bytes_per_sec\": %.0f, "
+    , wall_time, stats.encoded_frames, stats.encoded_frames / seconds
+    , stats.read_bytes, stats.read_bytes / seconds
+    , stats.written_bytes, stats.written_bytes / seconds);
+  if(heap_allocs() >= 0)
+  {
+    fprintf(json, "\"allocations\": %"PRId64", \"allocations_per_frame\": %.3f, ", heap_allocs(), allocs_per_frame);
+  }
+  fprintf(json, "\"stages\": {");
+  for(index = 0; index < TIMER_COUNT; index++)
+  {
+    StageTimer* timer = &stats.timer[index];
+    fprintf(json, "%s\"%s\": {\"calls\": %d, \"total_ms\": %.3f, \"p50_us\": %.1f, \"p95_us\": %.1f, \"p99_us\": %.1f}"
+      , (index > 0) ? ", " : ""
+      , timer_names[index], timer->nb_samples, timer->total / 1e6
+      , timer_percentile(timer, 50) / 1e3
+      , timer_percentile(timer, 95) / 1e3
+      , timer_percentile(timer, 99) / 1e3);
+  }
+  fprintf(json, "}}\n");
+
+  if(json != stdout)
+  {
+    fclose(json);
+  }
+}
+
+static void release_stats()
+{
+  int index;
+
+  for(index = 0; index < TIMER_COUNT; index++)
+  {
+    av_freep(&stats.timer[index].samples);
+  }
+}
+
+static int process_item(int stage, StageItem* item);
+
+// Hands an item to the next stage, either directly or through its queue.
+static int emit_item(int stage, StageItem* item)
+{
+  int next = stage + 1;
+
+  if(next == STAGE_COUNT)
+  {
+    return 0;
+  }
+
+  if(pipeline.group[next] == pipeline.group[stage])
+  {
+    return process_item(next, item);
+  }
+
+  return queue_push(&pipeline.queue[next], item);
+}
+
+static int demux_stage()
+{
+  StageItem item;
+  unsigned int index;
+  int64_t begin;
+  int ret;
+
+  item.frame = NULL;
+
+  if(segment_start != AV_NOPTS_VALUE &&
+    av_seek_frame(inputFile.fmt_ctx, inputFile.v_index, segment_start, AVSEEK_FLAG_BACKWARD) < 0)
+  {
+    printf("Failed to seek to segment start\n");
+    return -1;
+  }
+
+  while(1)
+  {
+    begin = monotonic_ns();
+    ret = av_read_frame(inputFile.fmt_ctx, &item.pkt);
+    timer_add(TIMER_READ, monotonic_ns() - begin);
+    if(ret < 0)
+    {
+      printf((ret == AVERROR_EOF) ? "End of frame\n" : "Error occurred while reading packet\n");
+      break;
+    }
+
+    if(item.pkt.stream_index != inputFile.v_index && 
+      item.pkt.stream_index != inputFile.a_index)
+    {
+      av_free_packet(&item.pkt);
+      continue;
+    }
+
+    // Leading B-frames of an open GOP come after the cut keyframe in decoding order but are shown
+    // before it. The next segment can not decode them, so they are read here until a packet shown
+    // at or after the cut comes. Frames past the cut are dropped after decoding.
+    if(segment_end != AV_NOPTS_VALUE && item.pkt.stream_index == inputFile.v_index &&
+      item.pkt.dts != AV_NOPTS_VALUE && item.pkt.dts >= segment_end &&
+      (item.pkt.pts == AV_NOPTS_VALUE || item.pkt.pts >= segment_end))
+    {
+      av_free_packet(&item.pkt);
+      printf("End of segment\n");
+      break;
+    }
+
+    stats.read_bytes += item.pkt.size;
+
+    AVStream* in_stream = inputFile.fmt_ctx->streams[item.pkt.stream_index];
+
+    av_packet_rescale_ts(&item.pkt, in_stream->time_base, in_stream->codec->time_base);
+
+    if(live_mode && item.pkt.stream_index == inputFile.v_index && item.pkt.pts != AV_NOPTS_VALUE)
+    {
+      record_arrival(item.pkt.pts, monotonic_ns());
+    }
+
+    // Packet data may belong to the demuxer until the next read, so take our own reference.
+    if(av_dup_packet(&item.pkt) < 0)
+    {
+      av_free_packet(&item.pkt);
+      return -1;
+    }
+
+    item.type = ITEM_PACKET;
+    item.stream_index = item.pkt.stream_index;
+
+    ret = emit_item(STAGE_DEMUX, &item);
+    if(ret < 0)
+    {
+      return ret;
+    }
+  } // while
+
+  // Flush all remaining frames in filter and encoder, stream by stream.
+  for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
+  {
+    if(index != inputFile.v_index && index != inputFile.a_index)
+    {
+      continue;
+    }
+
+    item.type = ITEM_FLUSH;
+    item.stream_index = index;
+    ret = emit_item(STAGE_DEMUX, &item);
+    if(ret < 0)
+    {
+      return ret;
+    }
+  }
+
+  item.type = ITEM_END;
+  item.stream_index = -1;
+  return emit_item(STAGE_DEMUX, &item);
+}
+
+static int decode_emit_frame(AVCodecContext* codec_ctx, AVPacket* pkt, int stream_index, int* got_frame)
+{
+  StageItem out;
+  int64_t begin;
+  int ret;
+
+  *got_frame = 0;
+  begin = monotonic_ns();
+  ret = decode_packet(codec_ctx, pkt, &decoded_frame, got_frame);
+  timer_add(TIMER_DECODE, monotonic_ns() - begin);
+  if(ret < 0 || !*got_frame)
+  {
+    // Broken packets are skipped, as the rest of the stream is still decodable.
+    *got_frame = 0;
+    return 0;
+  }
+
+  // Frames decoded only as references for the segment are not part of it.
+  if(codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO &&
+    ((segment_frame_start != AV_NOPTS_VALUE && decoded_frame->pts < segment_frame_start) ||
+    (segment_frame_end != AV_NOPTS_VALUE && decoded_frame->pts >= segment_frame_end)))
+  {
+    av_frame_unref(decoded_frame);
+    return 0;
+  }
+
+  out.type = ITEM_FRAME;
+  out.stream_index = stream_index;
+  out.frame = alloc_stage_frame();
+  if(out.frame == NULL)
+  {
+    av_frame_unref(decoded_frame);
+    return -1;
+  }
+
+  av_frame_move_ref(out.frame, decoded_frame);
+  return emit_item(STAGE_DECODE, &out);
+}
+
+static int decode_stage(StageItem* item)
+{
+  AVPacket flush_pkt;
+  int got_frame;
+  int ret;
+
+  if(item->type == ITEM_END)
+  {
+    return emit_item(STAGE_DECODE, item);
+  }
+
+  AVCodecContext* codec_ctx = inputFile.fmt_ctx->streams[item->stream_index]->codec;
+
+  if(item->type == ITEM_FLUSH)
+  {
+    // Delayed frames, e.g. one per thread with frame threading, come out by feeding empty packets.
+    av_init_packet(&flush_pkt);
+    flush_pkt.data = NULL;
+    flush_pkt.size = 0;
+
+    do
+    {
+      ret = decode_emit_frame(codec_ctx, &flush_pkt, item->stream_index, &got_frame);
+      if(ret < 0)
+      {
+        return ret;
+      }
+    } while(got_frame);
+
+    return emit_item(STAGE_DECODE, item);
+  }
+
+  ret = decode_emit_frame(codec_ctx, &item->pkt, item->stream_index, &got_frame);
+  av_free_packet(&item->pkt);
+
+  return ret;
+}
+
+static int filter_add_frame(FilterContext* filter_ctx, AVFrame* frame)
+{
+  int64_t begin = monotonic_ns();
+  int ret = av_buffersrc_add_frame(filter_ctx->src_ctx, frame);
+
+  filter_ctx->elapsed += monotonic_ns() - begin;
+  return ret;
+}
+
+// Pulls a frame out of the last step, moving whatever earlier steps produced along the way.
+static int filter_get_frame(FilterContext* filter_ctx, AVFrame* frame)
+{
+  int64_t begin;
+  int ret;
+
+  while(1)
+  {
+    begin = monotonic_ns();
+    ret = av_buffersink_get_frame(filter_ctx->sink_ctx, frame);
+    filter_ctx->elapsed += monotonic_ns() - begin;
+    if(ret < 0)
+    {
+      break;
+    }
+
+    filter_ctx->nb_frames++;
+    if(filter_ctx->next == NULL)
+    {
+      return ret;
+    }
+
+    ret = av_buffersrc_add_frame(filter_ctx->next->src_ctx, frame);
+    if(ret < 0)
+    {
+      av_frame_unref(frame);
+      return ret;
+    }
+  } // while
+
+  if(filter_ctx->next == NULL)
+  {
+    return ret;
+  }
+
+  if(ret == AVERROR_EOF && !filter_ctx->eof)
+  {
+    filter_ctx->eof = 1;
+    av_buffersrc_add_frame(filter_ctx->next->src_ctx, NULL);
+  }
+
+  return filter_get_frame(filter_ctx->next, frame);
+}
+
+static void print_filter_profile()
+{
+  FilterContext* step;
+
+  printf("Filter graph : %s threading with %d threads (0 is one per core), scaler flags %s\n"
+    , filter_thread_type ? "slice" : "no", filter_threads, scale_flags_name(scale_flags));
+
+  for(step = &vfilter_ctx; step != NULL; step = step->next)
+  {
+    if(step->filter_graph != NULL)
+    {
+      printf("Filter %-8s : %"PRId64" frames, %.3f ms, %.3f ms per frame\n"
+        , (step->name != NULL) ? step->name : "video", step->nb_frames, step->elapsed / 1000000.0
+        , step->nb_frames ? step->elapsed / 1000000.0 / step->nb_frames : 0.0);
+    }
+  }
+
+  if(afilter_ctx.filter_graph != NULL)
+  {
+    printf("Filter %-8s : %"PRId64" frames, %.3f ms, %.3f ms per frame\n"
+      , "audio", afilter_ctx.nb_frames, afilter_ctx.elapsed / 1000000.0
+      , afilter_ctx.nb_frames ? afilter_ctx.elapsed / 1000000.0 / afilter_ctx.nb_frames : 0.0);
+  }
+}
+
+#define MAX_SCALE_SLICES 16
+
+typedef enum _ConversionEngine
+{
+  CONVERT_GRAPH,    // buffer -> scale/aformat -> buffersink
+  CONVERT_DIRECT,   // swscale and swresample called directly
+} ConversionEngine;
+
+// Horizontal band of the picture converted by its own SwsContext. The context covers the
+// band plus an overlap on either side, and only the band's own rows go to the frame.
+typedef struct _ScaleSlice
+{
+  struct SwsContext* sws_ctx;
+  int src_y;              // source rows the context reads
+  int src_h;
+  int dst_y;              // rows the context writes, overlap included
+  int dst_h;
+  int keep_y;             // rows of the band itself
+  int keep_h;
+  AVFrame* scratch;       // output of a context with overlap, NULL when it writes the frame
+} ScaleSlice;
+
+typedef struct _Scaler
+{
+  ScaleSlice slices[MAX_SCALE_SLICES];
+  int nb_slices;
+  int src_width, src_height, src_chroma_shift;
+  enum AVPixelFormat src_format;
+  int dst_width, dst_height, dst_chroma_shift;
+  enum AVPixelFormat dst_format;
+  int dst_row_bytes[4];
+  int verified;                           // bands were compared with a single context
+  int single_band;                        // they differed, so the picture is scaled in one piece
+  const AVFrame* src;                     // frame being scaled by the workers
+  AVFrame* dst;
+  pthread_t threads[MAX_SCALE_SLICES];
+  int nb_threads;                         // workers besides the calling thread
+  int generation;                         // bumped for every frame
+  int pending;                            // workers still busy with this frame
+  int quit;
+  int64_t elapsed;
+  int64_t nb_frames;
+  pthread_mutex_t mutex;
+  pthread_cond_t start;
+  pthread_cond_t done;
+} Scaler;
+
+typedef struct _Resampler
+{
+  struct SwrContext* swr_ctx;
+  AVAudioFifo* fifo;
+  uint8_t** buffer;                       // output of swr_convert, reused
+  int buffer_samples;
+  int frame_size;                         // samples per output frame, 0 for any
+  int src_sample_rate;
+  AVRational src_time_base;
+  enum AVSampleFormat dst_format;
+  int dst_channels;
+  int64_t next_pts;                       // in 1/dst_sample_rate
+  int64_t elapsed;
+  int64_t nb_frames;
+} Resampler;
+
+static ConversionEngine conversion_engine = CONVERT_GRAPH;
+static int scale_threads = 0;             // 0 means one per core
+static Scaler scaler = {.mutex = PTHREAD_MUTEX_INITIALIZER, .start = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+static Resampler resampler;
+
+// Parses graph or direct[:<threads>], e.g. "direct:4".
+static int parse_conversion_engine(const char* arg)
+{
+  if(strcmp(arg, "graph") == 0)
+  {
+    conversion_engine = CONVERT_GRAPH;
+    return 0;
+  }
+
+  if(strncmp(arg, "direct", 6) != 0 || (arg[6] != '\0' && arg[6] != ':'))
+  {
+    return -1;
+  }
+
+  conversion_engine = CONVERT_DIRECT;
+  if(arg[6] == ':')
+  {
+    scale_threads = atoi(arg + 7);
+    if(scale_threads < 0)
+    {
+      return -2;
+    }
+  }
+
+  return 0;
+}
+
+static void scale_slice(const ScaleSlice* slice, const AVFrame* src, AVFrame* dst)
+{
+  const uint8_t* src_data[4] = {NULL};
+  uint8_t* dst_data[4] = {NULL};
+  AVFrame* out = (slice->scratch != NULL) ? slice->scratch : dst;
+  int out_y = (slice->scratch != NULL) ? 0 : slice->dst_y;
+  int plane;
+
+  for(plane = 0; plane < 4; plane++)
+  {
+    // Only the chroma planes are subsampled vertically.
+    int src_shift = (plane == 1 || plane == 2) ? scaler.src_chroma_shift : 0;
+    int dst_shift = (plane == 1 || plane == 2) ? scaler.dst_chroma_shift : 0;
+
+    if(src->data[plane] != NULL)
+    {
+      src_data[plane] = src->data[plane] + (slice->src_y >> src_shift) * src->linesize[plane];
+    }
+    if(out->data[plane] != NULL)
+    {
+      dst_data[plane] = out->data[plane] + (out_y >> dst_shift) * out->linesize[plane];
+    }
+  }
+
+  sws_scale(slice->sws_ctx, src_data, src->linesize, 0, slice->src_h, dst_data, out->linesize);
+
+  if(slice->scratch == NULL)
+  {
+    return;
+  }
+
+  // The overlap rows belong to the neighbours.
+  for(plane = 0; plane < 4 && dst->data[plane] != NULL; plane++)
+  {
+    int shift = (plane == 1 || plane == 2) ? scaler.dst_chroma_shift : 0;
+
+    av_image_copy_plane(dst->data[plane] + (slice->keep_y >> shift) * dst->linesize[plane], dst->linesize[plane],
+      out->data[plane] + ((slice->keep_y - slice->dst_y) >> shift) * out->linesize[plane], out->linesize[plane],
+      scaler.dst_row_bytes[plane], -((-slice->keep_h) >> shift));
+  }
+}
+
+static void* scale_worker(void* arg)
+{
+  int index = (int)(intptr_t)arg;
+  int generation = 0;
+
+  pthread_mutex_lock(&scaler.mutex);
+  while(1)
+  {
+    while(scaler.generation == generation && !scaler.quit)
+    {
+      pthread_cond_wait(&scaler.start, &scaler.mutex);
+    }
+
+    if(scaler.quit)
+    {
+      break;
+    }
+
+    generation = scaler.generation;
+    pthread_mutex_unlock(&scaler.mutex);
+
+    if(index < scaler.nb_slices)
+    {
+      scale_slice(&scaler.slices[index], scaler.src, scaler.dst);
+    }
+
+    pthread_mutex_lock(&scaler.mutex);
+    if(--scaler.pending == 0)
+    {
+      pthread_cond_signal(&scaler.done);
+    }
+  } // while
+  pthread_mutex_unlock(&scaler.mutex);
+
+  return NULL;
+}
+
+static void release_scale_slices()
+{
+  int index;
+
+  for(index = 0; index < scaler.nb_slices; index++)
+  {
+    sws_freeContext(scaler.slices[index].sws_ctx);
+    scaler.slices[index].sws_ctx = NULL;
+    av_frame_free(&scaler.slices[index].scratch);
+  }
+
+  scaler.nb_slices = 0;
+}
+
+static struct SwsContext* alloc_band_context(int src_h, int dst_h)
+{
+  struct SwsContext* sws_ctx = sws_alloc_context();
+  if(sws_ctx == NULL)
+  {
+    return NULL;
+  }
+
+  av_opt_set_int(sws_ctx, "srcw", scaler.src_width, 0);
+  av_opt_set_int(sws_ctx, "srch", src_h, 0);
+  av_opt_set_int(sws_ctx, "src_format", scaler.src_format, 0);
+  av_opt_set_int(sws_ctx, "dstw", scaler.dst_width, 0);
+  av_opt_set_int(sws_ctx, "dsth", dst_h, 0);
+  av_opt_set_int(sws_ctx, "dst_format", scaler.dst_format, 0);
+  if(av_opt_set(sws_ctx, "sws_flags", (scale_flags != NULL) ? scale_flags : DEFAULT_SCALE_FLAGS, 0) < 0 ||
+    sws_init_context(sws_ctx, NULL, NULL) < 0)
+  {
+    printf("Failed to initialize scaler with flags %s\n", scale_flags_name(scale_flags));
+    sws_freeContext(sws_ctx);
+    return NULL;
+  }
+
+  return sws_ctx;
+}
+
+// Smallest band height, in destination rows, at which a context for a band steps through
+// the source with the same filter phases as one for the whole picture, 0 if there is none.
+// swscale steps in 16.16 fixed point, so the vertical ratio has to be exact in it.
+static int scale_band_unit(int src_height, int dst_height)
+{
+  int src_chroma_height = -((-src_height) >> scaler.src_chroma_shift);
+  int dst_chroma_height = -((-dst_height) >> scaler.dst_chroma_shift);
+  int64_t gcd = av_gcd(src_height, dst_height);
+  int64_t unit;
+
+  if((((int64_t)src_height << 16) % dst_height) != 0 ||
+    (((int64_t)src_chroma_height << 16) % dst_chroma_height) != 0 ||
+    ((int64_t)src_chroma_height * dst_height << scaler.src_chroma_shift) !=
+      ((int64_t)dst_chroma_height * src_height << scaler.dst_chroma_shift))
+  {
+    return 0;
+  }
+
+  // Bands also start on a chroma row on both sides and on a row of the 8 line dither pattern.
+  for(unit = dst_height / gcd; unit <= dst_height; unit += dst_height / gcd)
+  {
+    if(unit % (8 << scaler.dst_chroma_shift) == 0 &&
+      (unit / (dst_height / gcd) * (src_height / gcd)) % (1 << scaler.src_chroma_shift) == 0)
+    {
+      return (int)unit;
+    }
+  }
+
+  return 0;
+}
+
+// Splits the picture into one band per thread. Each band's context reads enough rows
+// around it for the widest filter (sinc and spline reach 10 taps each way), so it gives
+// the same rows as a single context would. Ratios which make that impossible use one band.
+static int init_scale_slices(int src_width, int src_height, enum AVPixelFormat src_format)
+{
+  const AVPixFmtDescriptor* src_desc = av_pix_fmt_desc_get(src_format);
+  const AVPixFmtDescriptor* dst_desc = av_pix_fmt_desc_get(scaler.dst_format);
+  int nb_slices = FFMIN(scaler.nb_threads + 1, scaler.dst_height / 16);
+  int unit = 0;
+  int overlap = 0;
+  int nb_units;
+  int index;
+
+  release_scale_slices();
+
+  if(src_desc == NULL || dst_desc == NULL || (src_desc->flags & AV_PIX_FMT_FLAG_HWACCEL))
+  {
+    return -1;
+  }
+
+  scaler.src_width = src_width;
+  scaler.src_height = src_height;
+  scaler.src_format = src_format;
+  scaler.src_chroma_shift = src_desc->log2_chroma_h;
+  scaler.dst_chroma_shift = dst_desc->log2_chroma_h;
+  scaler.verified = 0;
+  if(av_image_fill_linesizes(scaler.dst_row_bytes, scaler.dst_format, scaler.dst_width) < 0)
+  {
+    return -1;
+  }
+
+  // A palette is not a picture plane, so such formats are scaled in one piece.
+  if(nb_slices < 1 || scaler.single_band || (src_desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_PSEUDOPAL)))
+  {
+    nb_slices = 1;
+  }
+
+  if(nb_slices > 1)
+  {
+    unit = scale_band_unit(src_height, scaler.dst_height);
+  }
+
+  if(unit > 0)
+  {
+    // Whole units of overlap, so every context still starts in phase.
+    int reach = (10 * FFMAX((src_height + scaler.dst_height - 1) / scaler.dst_height, 1) + 2) << scaler.src_chroma_shift;
+    overlap = (int)(((int64_t)reach * scaler.dst_height / src_height + unit) / unit * unit);
+    nb_units = scaler.dst_height / unit;
+    nb_slices = FFMIN(nb_slices, nb_units);
+  }
+  else
+  {
+    nb_units = nb_slices = 1;
+  }
+
+  for(index = 0; index < nb_slices; index++)
+  {
+    ScaleSlice* slice = &scaler.slices[index];
+    int keep_end = (index == nb_slices - 1) ? scaler.dst_height : nb_units * (index + 1) / nb_slices * unit;
+    int dst_end;
+
+    slice->keep_y = nb_units * index / nb_slices * unit;
+    slice->keep_h = keep_end - slice->keep_y;
+    slice->dst_y = FFMAX(slice->keep_y - overlap, 0);
+    dst_end = FFMIN(keep_end + overlap, scaler.dst_height);
+    slice->dst_h = dst_end - slice->dst_y;
+    slice->src_y = (int)((int64_t)slice->dst_y * src_height / scaler.dst_height);
+    slice->src_h = ((dst_end == scaler.dst_height) ? src_height : (int)((int64_t)dst_end * src_height / scaler.dst_height)) - slice->src_y;
+
+    slice->sws_ctx = alloc_band_context(slice->src_h, slice->dst_h);
+    if(slice->sws_ctx == NULL)
+    {
+      return -3;
+    }
+    scaler.nb_slices = index + 1;
+
+    if(nb_slices > 1)
+    {
+      slice->scratch = av_frame_alloc();
+      if(slice->scratch == NULL)
+      {
+        return -2;
+      }
+
+      slice->scratch->format = scaler.dst_format;
+      slice->scratch->width = scaler.dst_width;
+      slice->scratch->height = slice->dst_h;
+      if(av_frame_get_buffer(slice->scratch, FRAME_ALIGN) < 0)
+      {
+        return -2;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Scales the first frame once more with a single context and compares. Bands which do not
+// give the same bytes are given up for the rest of the run.
+static int check_scale_slices(const AVFrame* src, AVFrame* dst)
+{
+  ScaleSlice whole = {NULL};
+  AVFrame* reference;
+  int nb_slices = scaler.nb_slices;
+  int same = 1;
+  int plane, row;
+  int ret = 0;
+
+  scaler.verified = 1;
+  if(nb_slices == 1)
+  {
+    return 0;
+  }
+
+  reference = av_frame_alloc();
+  if(reference == NULL)
+  {
+    return AVERROR(ENOMEM);
+  }
+
+  reference->format = scaler.dst_format;
+  reference->width = scaler.dst_width;
+  reference->height = scaler.dst_height;
+  whole.src_h = whole.keep_h = scaler.src_height;
+  whole.dst_h = scaler.dst_height;
+  whole.sws_ctx = alloc_band_context(whole.src_h, whole.dst_h);
+  if(whole.sws_ctx == NULL || av_frame_get_buffer(reference, FRAME_ALIGN) < 0)
+  {
+    ret = -1;
+    goto check_end;
+  }
+
+  scale_slice(&whole, src, reference);
+
+  for(plane = 0; plane < 4 && dst->data[plane] != NULL && same; plane++)
+  {
+    int shift = (plane == 1 || plane == 2) ? scaler.dst_chroma_shift : 0;
+
+    for(row = 0; row < -((-scaler.dst_height) >> shift); row++)
+    {
+      if(memcmp(dst->data[plane] + row * dst->linesize[plane],
+        reference->data[plane] + row * reference->linesize[plane], scaler.dst_row_bytes[plane]) != 0)
+      {
+        same = 0;
+        break;
+      }
+    }
+  }
+
+  if(same)
+  {
+    printf("Scaler : %d bands match a single context\n", nb_slices);
+    goto check_end;
+  }
+
+  printf("Scaler : %d bands differ from a single context, using one band\n", nb_slices);
+  scaler.single_band = 1;
+  ret = init_scale_slices(scaler.src_width, scaler.src_height, scaler.src_format);
+  if(ret >= 0)
+  {
+    ret = av_frame_copy(dst, reference);
+  }
+
+check_end:
+  sws_freeContext(whole.sws_ctx);
+  av_frame_free(&reference);
+  return ret;
+}
+
+static int init_scaler(const AVCodecContext* in_codec_ctx, int dst_width, int dst_height, enum AVPixelFormat dst_format)
+{
+  int nb_threads = (scale_threads > 0) ? scale_threads : av_cpu_count();
+
+  scaler.dst_width = dst_width;
+  scaler.dst_height = dst_height;
+  scaler.dst_format = dst_format;
+
+  for(scaler.nb_threads = 0; scaler.nb_threads < FFMIN(nb_threads, MAX_SCALE_SLICES) - 1; scaler.nb_threads++)
+  {
+    if(pthread_create(&scaler.threads[scaler.nb_threads], NULL, scale_worker, (void*)(intptr_t)(scaler.nb_threads + 1)) != 0)
+    {
+      break;
+    }
+  }
+
+  return init_scale_slices(in_codec_ctx->width, in_codec_ctx->height, in_codec_ctx->pix_fmt);
+}
+
+// Scales into dst, which gets a buffer from the pools laid out the way the encoder wants it.
+static int scale_frame(const AVFrame* src, AVFrame* dst)
+{
+  int64_t begin = monotonic_ns();
+  int ret;
+
+  if(src->width != scaler.src_width || src->height != scaler.src_height || src->format != scaler.src_format)
+  {
+    ret = init_scale_slices(src->width, src->height, src->format);
+    if(ret < 0)
+    {
+      return ret;
+    }
+  }
+
+  dst->format = scaler.dst_format;
+  dst->width = scaler.dst_width;
+  dst->height = scaler.dst_height;
+  ret = get_pooled_planes(dst, dst->width, dst->height);
+  if(ret == AVERROR(ENOSYS))
+  {
+    ret = av_frame_get_buffer(dst, FRAME_ALIGN);
+  }
+  if(ret < 0)
+  {
+    return ret;
+  }
+
+  av_frame_copy_props(dst, src);
+  if(src->sample_aspect_ratio.num > 0)
+  {
+    // Same as the scale filter, the picture keeps its display aspect ratio.
+    dst->sample_aspect_ratio = av_mul_q(src->sample_aspect_ratio,
+      (AVRational){scaler.dst_height * src->width, scaler.dst_width * src->height});
+  }
+
+  pthread_mutex_lock(&scaler.mutex);
+  scaler.src = src;
+  scaler.dst = dst;
+  scaler.pending = scaler.nb_threads;
+  scaler.generation++;
+  pthread_cond_broadcast(&scaler.start);
+  pthread_mutex_unlock(&scaler.mutex);
+
+  scale_slice(&scaler.slices[0], src, dst);
+
+  pthread_mutex_lock(&scaler.mutex);
+  while(scaler.pending > 0)
+  {
+    pthread_cond_wait(&scaler.done, &scaler.mutex);
+  }
+  pthread_mutex_unlock(&scaler.mutex);
+
+  if(!scaler.verified)
+  {
+    ret = check_scale_slices(src, dst);
+    if(ret < 0)
+    {
+      return ret;
+    }
+  }
+
+  scaler.elapsed += monotonic_ns() - begin;
+  scaler.nb_frames++;
+  return 0;
+}
+
+static void release_scaler()
+{
+  int index;
+
+  pthread_mutex_lock(&scaler.mutex);
+  scaler.quit = 1;
+  pthread_cond_broadcast(&scaler.start);
+  pthread_mutex_unlock(&scaler.mutex);
+
+  for(index = 0; index < scaler.nb_threads; index++)
+  {
+    pthread_join(scaler.threads[index], NULL);
+  }
+
+  scaler.nb_threads = 0;
+  release_scale_slices();
+}
+
+static int init_resampler(const AVCodecContext* in_codec_ctx, enum AVSampleFormat dst_format, int frame_size)
+{
+  int64_t src_ch_layout = in_codec_ctx->channel_layout ? 
+    (int64_t)in_codec_ctx->channel_layout : av_get_default_channel_layout(in_codec_ctx->channels);
+
+  resampler.frame_size = frame_size;
+  resampler.src_sample_rate = in_codec_ctx->sample_rate;
+  resampler.src_time_base = (in_codec_ctx->time_base.num > 0) ? in_codec_ctx->time_base : (AVRational){1, in_codec_ctx->sample_rate};
+  resampler.dst_format = dst_format;
+  resampler.dst_channels = av_get_channel_layout_nb_channels(dst_ch_layout);
+  resampler.next_pts = AV_NOPTS_VALUE;
+
+  resampler.swr_ctx = swr_alloc_set_opts(NULL
+    , dst_ch_layout, dst_format, dst_sample_rate
+    , src_ch_layout, in_codec_ctx->sample_fmt, in_codec_ctx->sample_rate
+    , 0, NULL);
+  if(resampler.swr_ctx == NULL || swr_init(resampler.swr_ctx) < 0)
+  {
+    printf("Failed to initialize resampler\n");
+    return -1;
+  }
+
+  resampler.fifo = av_audio_fifo_alloc(dst_format, resampler.dst_channels, (frame_size > 0) ? frame_size : 1024);
+  if(resampler.fifo == NULL)
+  {
+    return -2;
+  }
+
+  return 0;
+}
+
+// Converts src, or drains the resampler when src is NULL, into the fifo.
+static int resample_frame(const AVFrame* src)
+{
+  int64_t begin = monotonic_ns();
+  int nb_samples = (src != NULL) ? src->nb_samples : 0;
+  int out_samples;
+  int converted;
+
+  if(src != NULL && resampler.next_pts == AV_NOPTS_VALUE && src->pts != AV_NOPTS_VALUE)
+  {
+    resampler.next_pts = av_rescale_q(src->pts, resampler.src_time_base, (AVRational){1, dst_sample_rate});
+  }
+
+  out_samples = av_rescale_rnd(swr_get_delay(resampler.swr_ctx, resampler.src_sample_rate) + nb_samples
+    , dst_sample_rate, resampler.src_sample_rate, AV_ROUND_UP);
+
+  if(out_samples > resampler.buffer_samples)
+  {
+    if(resampler.buffer != NULL)
+    {
+      av_freep(&resampler.buffer[0]);
+      av_freep(&resampler.buffer);
+    }
+
+    if(av_samples_alloc_array_and_samples(&resampler.buffer, NULL
+        , resampler.dst_channels, out_samples, resampler.dst_format, 0) < 0)
+    {
+      resampler.buffer_samples = 0;
+      return AVERROR(ENOMEM);
+    }
+    resampler.buffer_samples = out_samples;
+  }
+
+  converted = swr_convert(resampler.swr_ctx, resampler.buffer, out_samples
+    , (src != NULL) ? (const uint8_t**)src->extended_data : NULL, nb_samples);
+  if(converted < 0)
+  {
+    return converted;
+  }
+
+  if(av_audio_fifo_write(resampler.fifo, (void**)resampler.buffer, converted) < converted)
+  {
+    return AVERROR(ENOMEM);
+  }
+
+  resampler.elapsed += monotonic_ns() - begin;
+  return 0;
+}
+
+// Takes the next frame_size samples out of the fifo, or the rest of them when flushing.
+static int resample_get_frame(AVFrame* dst, int flush)
+{
+  int64_t begin = monotonic_ns();
+  int available = av_audio_fifo_size(resampler.fifo);
+  int nb_samples = (resampler.frame_size > 0) ? resampler.frame_size : available;
+  int ret;
+
+  if(available == 0 || (available < nb_samples && !flush))
+  {
+    return AVERROR(EAGAIN);
+  }
+
+  dst->nb_samples = FFMIN(nb_samples, available);
+  dst->format = resampler.dst_format;
+  dst->channel_layout = dst_ch_layout;
+  dst->channels = resampler.dst_channels;
+  dst->sample_rate = dst_sample_rate;
+  ret = get_pooled_samples(dst);
+  if(ret == AVERROR(ENOSYS))
+  {
+    ret = av_frame_get_buffer(dst, 0);
+  }
+  if(ret < 0)
+  {
+    return ret;
+  }
+
+  av_audio_fifo_read(resampler.fifo, (void**)dst->extended_data, dst->nb_samples);
+
+  dst->pts = resampler.next_pts;
+  if(resampler.next_pts != AV_NOPTS_VALUE)
+  {
+    resampler.next_pts += dst->nb_samples;
+  }
+
+  resampler.elapsed += monotonic_ns() - begin;
+  resampler.nb_frames++;
+  return 0;
+}
+
+static void release_resampler()
+{
+  swr_free(&resampler.swr_ctx);
+
+  if(resampler.fifo != NULL)
+  {
+    av_audio_fifo_free(resampler.fifo);
+    resampler.fifo = NULL;
+  }
+
+  if(resampler.buffer != NULL)
+  {
+    av_freep(&resampler.buffer[0]);
+    av_freep(&resampler.buffer);
+  }
+  resampler.buffer_samples = 0;
+}
+
+static void print_conversion_profile()
+{
+  printf("Convert scale    : %"PRId64" frames, %.3f ms, %.3f ms per frame, %d slices\n"
+    , scaler.nb_frames, scaler.elapsed / 1000000.0
+    , scaler.nb_frames ? scaler.elapsed / 1000000.0 / scaler.nb_frames : 0.0, scaler.nb_slices);
+  printf("Convert resample : %"PRId64" frames, %.3f ms\n"
+    , resampler.nb_frames, resampler.elapsed / 1000000.0);
+}
+
+static int init_conversion(int in_stream_index)
+{
+  AVCodecContext* in_codec_ctx = inputFile.fmt_ctx->streams[in_stream_index]->codec;
+  AVCodecContext* out_codec_ctx = outputFile.fmt_ctx->streams[out_index_of(in_stream_index)]->codec;
+
+  if(in_stream_index == inputFile.v_index)
+  {
+    return (conversion_engine == CONVERT_DIRECT) ? 
+      init_scaler(in_codec_ctx, out_codec_ctx->width, out_codec_ctx->height, out_codec_ctx->pix_fmt) : init_video_filter();
+  }
+
+  return (conversion_engine == CONVERT_DIRECT) ? 
+    init_resampler(in_codec_ctx, out_codec_ctx->sample_fmt, out_codec_ctx->frame_size) : init_audio_filter();
+}
+
+// True when a decoded frame can be given to the encoder as it is.
+static int frame_is_identity(const AVFrame* frame, int in_stream_index)
+{
+  AVCodecContext* out_codec_ctx = outputFile.fmt_ctx->streams[out_index_of(in_stream_index)]->codec;
+
+  if(in_stream_index == inputFile.v_index)
+  {
+    return frame->width == out_codec_ctx->width && frame->height == out_codec_ctx->height && 
+      frame->format == out_codec_ctx->pix_fmt;
+  }
+
+  // Encoders with a fixed frame size only take a shorter frame at the very end.
+  return frame->sample_rate == out_codec_ctx->sample_rate && frame->format == out_codec_ctx->sample_fmt &&
+    frame->channel_layout == out_codec_ctx->channel_layout &&
+    (out_codec_ctx->frame_size == 0 || frame->nb_samples == out_codec_ctx->frame_size);
+}
+
+// Decides from the decoder's parameters whether the stream needs any conversion at all.
+static int stream_is_identity(int in_stream_index)
+{
+  AVCodecContext* in_codec_ctx = inputFile.fmt_ctx->streams[in_stream_index]->codec;
+  AVCodecContext* out_codec_ctx = outputFile.fmt_ctx->streams[out_index_of(in_stream_index)]->codec;
+
+  if(in_stream_index == inputFile.v_index)
+  {
+    return in_codec_ctx->width == out_codec_ctx->width && in_codec_ctx->height == out_codec_ctx->height && 
+      in_codec_ctx->pix_fmt == out_codec_ctx->pix_fmt;
+  }
+
+  // Timestamps are passed on unchanged, so they have to be in the encoder's time base already.
+  return in_codec_ctx->sample_rate == out_codec_ctx->sample_rate && in_codec_ctx->sample_fmt == out_codec_ctx->sample_fmt &&
+    in_codec_ctx->channel_layout == out_codec_ctx->channel_layout &&
+    av_cmp_q(in_codec_ctx->time_base, out_codec_ctx->time_base) == 0 &&
+    (out_codec_ctx->frame_size == 0 || in_codec_ctx->frame_size == out_codec_ctx->frame_size);
+}
+
+// Filter stage of the direct engine. Video is scaled straight into an encoder sized frame,
+// audio is resampled into a fifo which hands out frames of the encoder's frame_size.
+static int convert_stage(StageItem* item)
+{
+  StageItem out;
+  int64_t begin;
+  int64_t elapsed = 0;
+  int ret;
+
+  out.type = ITEM_FRAME;
+  out.stream_index = item->stream_index;
+
+  if(item->stream_index == inputFile.v_index)
+  {
+    if(item->type == ITEM_FRAME)
+    {
+      out.frame = alloc_stage_frame();
+      if(out.frame == NULL)
+      {
+        return -1;
+      }
+
+      begin = monotonic_ns();
+      ret = scale_frame(item->frame, out.frame);
+      timer_add(TIMER_FILTER, monotonic_ns() - begin);
+      free_stage_frame(&item->frame);
+      if(ret < 0)
+      {
+        printf("Error occurred when scaling frame\n");
+        free_stage_frame(&out.frame);
+        return -2;
+      }
+
+      return emit_item(STAGE_FILTER, &out);
+    }
+
+    return emit_item(STAGE_FILTER, item);
+  }
+
+  begin = monotonic_ns();
+  ret = resample_frame((item->type == ITEM_FRAME) ? item->frame : NULL);
+  elapsed = monotonic_ns() - begin;
+  free_stage_frame(&item->frame);
+  if(ret < 0)
+  {
+    printf("Error occurred when resampling frame\n");
+    timer_add(TIMER_FILTER, elapsed);
+    return -2;
+  }
+
+  while(1)
+  {
+    out.frame = alloc_stage_frame();
+    if(out.frame == NULL)
+    {
+      return -1;
+    }
+
+    begin = monotonic_ns();
+    ret = resample_get_frame(out.frame, item->type == ITEM_FLUSH);
+    elapsed += monotonic_ns() - begin;
+    if(ret < 0)
+    {
+      free_stage_frame(&out.frame);
+      break;
+    }
+
+    ret = emit_item(STAGE_FILTER, &out);
+    if(ret < 0)
+    {
+      return ret;
+    }
+  } // while
+
+  timer_add(TIMER_FILTER, elapsed);
+
+  if(item->type == ITEM_FLUSH)
+  {
+    return emit_item(STAGE_FILTER, item);
+  }
+
+  return 0;
+}
+
+// Keeps a transcode at real time by trading encoder preset and scaler quality for speed.
+#define PACING_MAX_LAG 0.5      // seconds behind the best lag seen before stepping down
+#define PACING_IDLE_BUSY 0.5    // share of real time spent encoding under which a step up is tried
+#define PACING_HOLD_WINDOWS 2   // one second windows to wait after a step, and to stay idle before a step up
+#define NB_PACING_PRESETS 9
+#define NB_PACING_SCALERS 3
+
+static const char* pacing_presets[NB_PACING_PRESETS] =
+  {"ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow", "slower", "veryslow"};
+// Level 0 is whatever -S asked for.
+static const char* pacing_scalers[NB_PACING_SCALERS] = {NULL, "bilinear", "fast_bilinear"};
+
+typedef struct _PacingController
+{
+  int enabled;
+  int preset;               // index in pacing_presets, -1 if the preset is unknown and left alone
+  int max_preset;           // the configured one, never stepped above
+  int can_reopen;           // new codec headers and a new encoder session fit in the middle of the stream
+  const char* base_scale_flags;
+  int scale_level;          // requested by the encoder thread
+  int applied_scale_level;  // only touched by the filter thread
+  int64_t start_wall;       // ns, 0 until the first video frame
+  int64_t start_pts;
+  int64_t window_pts;
+  int64_t window_encode_time;
+  double window_lag;
+  double min_lag;
+  int hold;
+  int nb_idle_windows;
+  pthread_mutex_t mutex;
+} PacingController;
+
+static PacingController pacing = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+// Rebuilds the video conversion when the controller asked for other scaler flags.
+static int apply_pacing_scaler()
+{
+  int level;
+
+  pthread_mutex_lock(&pacing.mutex);
+  level = pacing.scale_level;
+  pthread_mutex_unlock(&pacing.mutex);
+
+  if(level == pacing.applied_scale_level)
+  {
+    return 0;
+  }
+
+  pacing.applied_scale_level = level;
+  scale_flags = (level > 0) ? pacing_scalers[level] : pacing.base_scale_flags;
+
+  if(conversion_engine == CONVERT_DIRECT)
+  {
+    return init_scale_slices(scaler.src_width, scaler.src_height, scaler.src_format);
+  }
+
+  release_filter(&vfilter_ctx);
+  return init_video_filter();
+}
+
+static int filter_stage(StageItem* item)
+{
+  FilterContext* filter_ctx;
+  int* bypass;
+  StageItem out;
+  int64_t begin, elapsed;
+  int ret;
+
+  if(item->type == ITEM_END)
+  {
+    return emit_item(STAGE_FILTER, item);
+  }
+
+  bypass = (item->stream_index == inputFile.v_index) ? &vfilter_bypass : &afilter_bypass;
+  if(*bypass)
+  {
+    // Ownership of the decoded frame moves on, nothing is copied.
+    if(item->type != ITEM_FRAME || frame_is_identity(item->frame, item->stream_index))
+    {
+      return emit_item(STAGE_FILTER, item);
+    }
+
+    // Parameters changed in the middle of the stream, from now on it gets converted.
+    printf("%s frame needs conversion, leaving filter bypass\n", (bypass == &vfilter_bypass) ? "Video" : "Audio");
+    *bypass = 0;
+    if(init_conversion(item->stream_index) < 0)
+    {
+      free_stage_frame(&item->frame);
+      return -3;
+    }
+  }
+
+  if(pacing.enabled && item->stream_index == inputFile.v_index && apply_pacing_scaler() < 0)
+  {
+    printf("Failed to rebuild the video scaler\n");
+    free_stage_frame(&item->frame);
+    return -4;
+  }
+
+  if(conversion_engine == CONVERT_DIRECT)
+  {
+    return convert_stage(item);
+  }
+
+  filter_ctx = (item->stream_index == inputFile.v_index) ? &vfilter_ctx : &afilter_ctx;
+
+  // NULL frame means end of stream, which makes the filter drain its remaining frames.
+  begin = monotonic_ns();
+  ret = filter_add_frame(filter_ctx, (item->type == ITEM_FRAME) ? item->frame : NULL);
+  elapsed = monotonic_ns() - begin;
+  free_stage_frame(&item->frame);
+  if(ret < 0)
+  {
+    printf("Error occurred when putting frame into filter context\n");
+    timer_add(TIMER_FILTER, elapsed);
+    return -2;
+  }
+
+  while(1)
+  {
+    out.type = ITEM_FRAME;
+    out.stream_index = item->stream_index;
+    out.frame = alloc_stage_frame();
+    if(out.frame == NULL)
+    {
+      return -1;
+    }
+
+    begin = monotonic_ns();
+    ret = filter_get_frame(filter_ctx, out.frame);
+    elapsed += monotonic_ns() - begin;
+    if(ret < 0)
+    {
+      free_stage_frame(&out.frame);
+      break;
+    }
+
+    ret = emit_item(STAGE_FILTER, &out);
+    if(ret < 0)
+    {
+      return ret;
+    }
+  } // while
+
+  // Time spent in the following stages is not part of the filter time.
+  timer_add(TIMER_FILTER, elapsed);
+
+  if(item->type == ITEM_FLUSH)
+  {
+    return emit_item(STAGE_FILTER, item);
+  }
+
+  return 0;
+}
+
+// Audio collected in front of the encoder, which is fed exactly batch_samples per call.
+typedef struct _AudioBatcher
+{
+  AVAudioFifo* fifo;
+  int batch_samples;     // encoder frame_size, or audio_batch_samples if it takes any size
+  int pad_last;          // the encoder can not take a short last frame, so it is padded with silence
+  int64_t next_pts;      // of the first sample in the fifo, in encoder time_base
+  int64_t nb_calls;      // encoder calls with a frame, counted with batching on or off
+  int64_t nb_samples;
+  int64_t encode_time;
+} AudioBatcher;
+
+static AudioBatcher audio_batcher;
+
+static int encode_frame(AVFrame* frame, int in_stream_index, int* got_packet)
+{
+  int out_stream_index = out_index_of(in_stream_index);
+  AVStream* stream = outputFile.fmt_ctx->streams[out_stream_index];
+  AVCodecContext* codec_ctx = stream->codec;
+  int (*encode_func)(AVCodecContext*, AVPacket*, const AVFrame*, int *);
+  StageItem out;
+  int64_t begin, elapsed;
+  int ret;
+  
+  av_init_packet(&out.pkt);
+  out.pkt.data = NULL;
+  out.pkt.size = 0;
+  
+  encode_func = (out_stream_index == outputFile.v_index) ? avcodec_encode_video2 : avcodec_encode_audio2;
+  *got_packet = 0;
+
+  if(frame != NULL) frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+  begin = monotonic_ns();
+  ret = encode_func(codec_ctx, &out.pkt, frame, got_packet);
+  elapsed = monotonic_ns() - begin;
+  timer_add(TIMER_ENCODE, elapsed);
+  if(frame != NULL && out_stream_index == outputFile.a_index)
+  {
+    audio_batcher.nb_calls++;
+    audio_batcher.nb_samples += frame->nb_samples;
+    audio_batcher.encode_time += elapsed;
+  }
+  if(ret < 0)
+  {
+    printf("Error occurred when encoding frame\n");
+    return -1;
+  }
+
+  if(frame != NULL && out_stream_index == outputFile.v_index)
+  {
+    stats.encoded_frames++;
+  }
+
+  if(frame != NULL && ++stats.nb_frames == ALLOC_WARMUP_FRAMES)
+  {
+    stats.warmup_allocs = heap_allocs();
+  }
+
+  if(*got_packet)
+  {
+    out.pkt.stream_index = out_stream_index;
+    av_packet_rescale_ts(&out.pkt, codec_ctx->time_base, stream->time_base);
+
+    if(av_dup_packet(&out.pkt) < 0)
+    {
+      av_free_packet(&out.pkt);
+      return -2;
+    }
+
+    out.type = ITEM_PACKET;
+    out.stream_index = in_stream_index;
+    out.frame = NULL;
+    return emit_item(STAGE_ENCODE, &out);
+  }
+
+  return 0;
+}
+
+static int init_audio_batcher()
+{
+  AVCodecContext* codec_ctx = outputFile.fmt_ctx->streams[outputFile.a_index]->codec;
+  int variable = (codec_ctx->codec->capabilities & CODEC_CAP_VARIABLE_FRAME_SIZE) || codec_ctx->frame_size == 0;
+
+  audio_batcher.batch_samples = variable ? 
+    ((audio_batch_samples > 0) ? audio_batch_samples : DEFAULT_AUDIO_BATCH) : codec_ctx->frame_size;
+  audio_batcher.pad_last = !variable && !(codec_ctx->codec->capabilities & CODEC_CAP_SMALL_LAST_FRAME);
+  audio_batcher.next_pts = AV_NOPTS_VALUE;
+
+  if(!variable && audio_batch_samples > 0)
+  {
+    printf("Audio encoder %s has a fixed frame size of %d samples\n", codec_ctx->codec->name, codec_ctx->frame_size);
+  }
+
+  audio_batcher.fifo = av_audio_fifo_alloc(codec_ctx->sample_fmt, codec_ctx->channels, 2 * audio_batcher.batch_samples);
+  return (audio_batcher.fifo == NULL) ? -1 : 0;
+}
+
+static void release_audio_batcher()
+{
+  if(audio_batcher.fifo != NULL)
+  {
+    av_audio_fifo_free(audio_batcher.fifo);
+    audio_batcher.fifo = NULL;
+  }
+}
+
+// Time base of the audio frames reaching the encoder, which depends on where they come from.
+static AVRational audio_frame_time_base()
+{
+  if(afilter_bypass)
+  {
+    return inputFile.fmt_ctx->streams[inputFile.a_index]->codec->time_base;
+  }
+
+  if(conversion_engine == CONVERT_DIRECT)
+  {
+    return (AVRational){1, dst_sample_rate};
+  }
+
+  return afilter_ctx.sink_ctx->inputs[0]->time_base;
+}
+
+// Encodes nb_samples from the fifo as one frame, the last one of the stream may be shorter.
+static int encode_audio_batch(int in_stream_index, int nb_samples)
+{
+  AVCodecContext* codec_ctx = outputFile.fmt_ctx->streams[outputFile.a_index]->codec;
+  AVFrame* frame;
+  int got_packet;
+  int ret;
+
+  frame = alloc_stage_frame();
+  if(frame == NULL)
+  {
+    return AVERROR(ENOMEM);
+  }
+
+  frame->nb_samples = audio_batcher.pad_last ? audio_batcher.batch_samples : nb_samples;
+  frame->format = codec_ctx->sample_fmt;
+  frame->channel_layout = codec_ctx->channel_layout;
+  frame->channels = codec_ctx->channels;
+  frame->sample_rate = codec_ctx->sample_rate;
+  ret = get_pooled_samples(frame);
+  if(ret == AVERROR(ENOSYS))
+  {
+    ret = av_frame_get_buffer(frame, 0);
+  }
+  if(ret < 0)
+  {
+    free_stage_frame(&frame);
+    return ret;
+  }
+
+  av_audio_fifo_read(audio_batcher.fifo, (void**)frame->extended_data, nb_samples);
+  if(nb_samples < frame->nb_samples)
+  {
+    av_samples_set_silence(frame->extended_data, nb_samples, frame->nb_samples - nb_samples
+      , frame->channels, frame->format);
+  }
+
+  frame->pts = audio_batcher.next_pts;
+  if(audio_batcher.next_pts != AV_NOPTS_VALUE)
+  {
+    audio_batcher.next_pts += nb_samples;
+  }
+
+  ret = encode_frame(frame, in_stream_index, &got_packet);
+  free_stage_frame(&frame);
+  return ret;
+}
+
+// Queues a filtered frame, or with NULL at the end of stream encodes whatever is left.
+static int batch_audio_frame(AVFrame* frame, int in_stream_index)
+{
+  AVCodecContext* codec_ctx = outputFile.fmt_ctx->streams[outputFile.a_index]->codec;
+  int available;
+  int ret;
+
+  if(frame != NULL)
+  {
+    // Only a gap in the input can move the timeline, and it can only be noticed with nothing queued.
+    if(av_audio_fifo_size(audio_batcher.fifo) == 0 && frame->pts != AV_NOPTS_VALUE)
+    {
+      audio_batcher.next_pts = av_rescale_q(frame->pts, audio_frame_time_base(), codec_ctx->time_base);
+    }
+
+    // Frames of the right size already, as the resampler and the bypass hand out, skip the copy.
+    if(av_audio_fifo_size(audio_batcher.fifo) == 0 && frame->nb_samples == audio_batcher.batch_samples)
+    {
+      int got_packet;
+
+      frame->pts = audio_batcher.next_pts;
+      if(audio_batcher.next_pts != AV_NOPTS_VALUE)
+      {
+        audio_batcher.next_pts += frame->nb_samples;
+      }
+      return encode_frame(frame, in_stream_index, &got_packet);
+    }
+
+    if(av_audio_fifo_write(audio_batcher.fifo, (void**)frame->extended_data, frame->nb_samples) < frame->nb_samples)
+    {
+      return AVERROR(ENOMEM);
+    }
+  }
+
+  while((available = av_audio_fifo_size(audio_batcher.fifo)) >= audio_batcher.batch_samples ||
+    (frame == NULL && available > 0))
+  {
+    ret = encode_audio_batch(in_stream_index, FFMIN(available, audio_batcher.batch_samples));
+    if(ret < 0)
+    {
+      return ret;
+    }
+  }
+
+  return 0;
+}
+
+static void print_audio_batching()
+{
+  if(audio_batcher.nb_calls == 0)
+  {
+    return;
+  }
+
+  printf("Audio encode : batching %s, %"PRId64" calls, %.1f samples/call, %.3f ms total, %.1f us/call\n"
+    , (audio_batch_samples == AUDIO_BATCH_OFF) ? "off" : "on"
+    , audio_batcher.nb_calls, (double)audio_batcher.nb_samples / audio_batcher.nb_calls
+    , audio_batcher.encode_time / 1e6, audio_batcher.encode_time / 1e3 / audio_batcher.nb_calls);
+}
+
+static void init_pacing()
+{
+  AVDictionaryEntry* preset = av_dict_get(vencoder_options, "preset", NULL, 0);
+  AVCodecContext* video_ctx = outputFile.fmt_ctx->streams[outputFile.v_index]->codec;
+  int index;
+
+  pacing.preset = -1;
+  for(index = 0; index < NB_PACING_PRESETS; index++)
+  {
+    // libx264 itself starts from medium.
+    if(strcmp(pacing_presets[index], (preset != NULL) ? preset->value : "medium") == 0)
+    {
+      pacing.preset = index;
+    }
+  }
+
+  pacing.max_preset = pacing.preset;
+  // libx264 reports its B-frames in has_b_frames, max_b_frames only says what was asked for.
+  // A session with B-frames starts its dts below the last one of the previous session.
+  pacing.can_reopen = !(outputFile.fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) &&
+    video_ctx->has_b_frames == 0 && video_ctx->max_b_frames <= 0;
+  pacing.base_scale_flags = scale_flags;
+  pacing.scale_level = pacing.applied_scale_level = 0;
+  pacing.start_wall = 0;
+
+  printf("Pacing : preset %s%s, scaler %s\n", (pacing.preset >= 0) ? pacing_presets[pacing.preset] : "unknown"
+    , pacing.can_reopen ? "" : " (fixed, the muxer needs global headers or the encoder uses B-frames)"
+    , scale_flags_name(scale_flags));
+}
+
+// Fill of the fullest queue in front of the filter and encoder, in percent.
+static int pacing_queue_fill()
+{
+  int fill = 0;
+  int stage;
+
+  for(stage = STAGE_FILTER; stage <= STAGE_ENCODE; stage++)
+  {
+    StageQueue* queue = &pipeline.queue[stage];
+    if(pipeline.group[stage] == pipeline.group[stage - 1])
+    {
+      continue;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    fill = FFMAX(fill, queue->count * 100 / queue->capacity);
+    pthread_mutex_unlock(&queue->mutex);
+  }
+
+  return fill;
+}
+
+// Drains the video encoder and opens it again with another preset, which starts with a keyframe.
+static int reopen_video_encoder(int preset)
+{
+  AVCodecContext* codec_ctx = outputFile.fmt_ctx->streams[outputFile.v_index]->codec;
+  AVCodec* encoder = (AVCodec*)codec_ctx->codec;
+  AVDictionary* options = NULL;
+  int got_packet;
+  int ret;
+
+  do
+  {
+    if(encode_frame(NULL, inputFile.v_index, &got_packet) < 0)
+    {
+      return -1;
+    }
+  } while(got_packet);
+
+  avcodec_close(codec_ctx);
+
+  av_dict_copy(&options, vencoder_options, 0);
+  av_dict_set(&options, "preset", pacing_presets[preset], 0);
+  // Slower presets would turn B-frames on, which the first session did without.
+  av_dict_set(&options, "bf", "0", 0);
+  if(live_mode)
+  {
+    av_dict_set(&options, "tune", "zerolatency", AV_DICT_DONT_OVERWRITE);
+  }
+
+  ret = open_encoder(codec_ctx, encoder, options);
+  av_dict_free(&options);
+  if(ret < 0)
+  {
+    printf("Could not reopen %s with preset %s\n", encoder->name, pacing_presets[preset]);
+    return -2;
+  }
+
+  pacing.preset = preset;
+  return 0;
+}
+
+// Down means faster: the preset first, then the scaler. Up undoes it in reverse order.
+static int pacing_step(int down, double lag, double busy, int fill)
+{
+  int level = pacing.scale_level;
+  int preset = pacing.preset;
+
+  if(down)
+  {
+    if(pacing.can_reopen && preset > 0)
+    {
+      preset--;
+    }
+    else if(level < NB_PACING_SCALERS - 1)
+    {
+      level++;
+    }
+  }
+  else
+  {
+    if(level > 0)
+    {
+      level--;
+    }
+    else if(pacing.can_reopen && preset >= 0 && preset < pacing.max_preset)
+    {
+      preset++;
+    }
+  }
+
+  if(preset == pacing.preset && level == pacing.scale_level)
+  {
+    return 0;
+  }
+
+  printf("Pacing : lag %.3f s, encoder busy %.0f%%, queue %d%% : "
+    , lag, busy * 100, fill);
+  if(preset != pacing.preset)
+  {
+    printf("preset %s -> %s\n", pacing_presets[pacing.preset], pacing_presets[preset]);
+    return reopen_video_encoder(preset);
+  }
+
+  printf("scaler %s -> %s\n", scale_flags_name((pacing.scale_level > 0) ? pacing_scalers[pacing.scale_level] : pacing.base_scale_flags)
+    , scale_flags_name((level > 0) ? pacing_scalers[level] : pacing.base_scale_flags));
+  pthread_mutex_lock(&pacing.mutex);
+  pacing.scale_level = level;
+  pthread_mutex_unlock(&pacing.mutex);
+  return 0;
+}
+
+// Called by the encoder thread for every video frame. Once a second of video it compares how far
+// the output is behind the clock with the best seen so far, and how busy the encoder was.
+static int pace_video(const AVFrame* frame)
+{
+  AVCodecContext* codec_ctx = outputFile.fmt_ctx->streams[outputFile.v_index]->codec;
+  int64_t now = monotonic_ns();
+  int64_t encode_time = stats.timer[TIMER_ENCODE].total;
+  double window, lag, busy;
+  int fill;
+  int ret = 0;
+
+  if(frame->pts == AV_NOPTS_VALUE)
+  {
+    return 0;
+  }
+
+  if(pacing.start_wall == 0)
+  {
+    pacing.start_wall = now;
+    pacing.start_pts = pacing.window_pts = frame->pts;
+    pacing.window_encode_time = encode_time;
+    pacing.window_lag = pacing.min_lag = 0.0;
+    return 0;
+  }
+
+  window = (frame->pts - pacing.window_pts) * av_q2d(codec_ctx->time_base);
+  if(window < 1.0)
+  {
+    return 0;
+  }
+
+  // A live input can not get ahead of the clock, a file can, which only means there is headroom.
+  lag = (now - pacing.start_wall) / 1e9 - (frame->pts - pacing.start_pts) * av_q2d(codec_ctx->time_base);
+  pacing.min_lag = FFMIN(pacing.min_lag, lag);
+  busy = (encode_time - pacing.window_encode_time) / 1e9 / window;
+  fill = pacing_queue_fill();
+
+  if(pacing.hold > 0)
+  {
+    pacing.hold--;
+  }
+  else if((lag - pacing.min_lag > PACING_MAX_LAG && lag > pacing.window_lag) || fill >= 50)
+  {
+    ret = pacing_step(1, lag - pacing.min_lag, busy, fill);
+    pacing.hold = PACING_HOLD_WINDOWS;
+    pacing.nb_idle_windows = 0;
+  }
+  else if(busy < PACING_IDLE_BUSY && fill == 0 && lag - pacing.min_lag < PACING_MAX_LAG / 2)
+  {
+    if(++pacing.nb_idle_windows >= PACING_HOLD_WINDOWS)
+    {
+      ret = pacing_step(0, lag - pacing.min_lag, busy, fill);
+      pacing.hold = PACING_HOLD_WINDOWS;
+      pacing.nb_idle_windows = 0;
+    }
+  }
+  else
+  {
+    pacing.nb_idle_windows = 0;
+  }
+
+  // Time spent reopening the encoder belongs to no window.
+  pacing.window_pts = frame->pts;
+  pacing.window_encode_time = stats.timer[TIMER_ENCODE].total;
+  pacing.window_lag = lag;
+  return ret;
+}
+
+static int encode_stage(StageItem* item)
+{
+  int got_packet;
+  int ret;
+
+  if(item->type == ITEM_FRAME)
+  {
+    if(pacing.enabled && item->stream_index == inputFile.v_index && pace_video(item->frame) < 0)
+    {
+      free_stage_frame(&item->frame);
+      return -1;
+    }
+
+    if(item->stream_index == inputFile.a_index && audio_batcher.fifo != NULL)
+    {
+      ret = batch_audio_frame(item->frame, item->stream_index);
+    }
+    else
+    {
+      ret = encode_frame(item->frame, item->stream_index, &got_packet);
+    }
+    free_stage_frame(&item->frame);
+    return ret;
+  }
+
+  if(item->type == ITEM_FLUSH)
+  {
+    // Draining the encoders and the muxer is not part of the steady state.
+    if(stats.steady_frames == 0)
+    {
+      stats.steady_allocs = heap_allocs();
+      stats.steady_frames = stats.nb_frames;
+    }
+
+    if(item->stream_index == inputFile.a_index && audio_batcher.fifo != NULL)
+    {
+      ret = batch_audio_frame(NULL, item->stream_index);
+      if(ret < 0)
+      {
+        return ret;
+      }
+    }
+
+    // flush encoder
+    while(1)
+    {
+      ret = encode_frame(NULL, item->stream_index, &got_packet);
+      if(ret < 0)
+      {
+        return ret;
+      }
+
+      if(got_packet == 0)
+      {
+        break;
+      }
+    }
+  }
+
+  return emit_item(STAGE_ENCODE, item);
+}
+
+static int mux_stage(StageItem* item)
+{
+  int64_t arrival = AV_NOPTS_VALUE;
+  int64_t begin;
+  int ret;
+
+  if(item->type != ITEM_PACKET)
+  {
+    return 0;
+  }
+
+  stats.written_bytes += item->pkt.size;
+
+  if(live_mode && item->stream_index == inputFile.v_index && item->pkt.pts != AV_NOPTS_VALUE)
+  {
+    AVStream* stream = outputFile.fmt_ctx->streams[item->pkt.stream_index];
+    arrival = find_arrival(av_rescale_q(item->pkt.pts, stream->time_base, stream->codec->time_base));
+  }
+
+  // Interleaving would hold packets back until every stream has one queued.
+  begin = monotonic_ns();
+  ret = live_mode ? av_write_frame(outputFile.fmt_ctx, &item->pkt) : av_interleaved_write_frame(outputFile.fmt_ctx, &item->pkt);
+  timer_add(TIMER_WRITE, monotonic_ns() - begin);
+  if(ret < 0)
+  {
+    printf("Error occurred when writing packet into file\n");
+    av_free_packet(&item->pkt);
+    return -2;
+  }
+
+  if(arrival != AV_NOPTS_VALUE)
+  {
+    int64_t latency = monotonic_ns() - arrival;
+    timer_add(TIMER_LATENCY, latency);
+    printf("Latency : pts %"PRId64", %.3f ms\n", item->pkt.pts, latency / 1e6);
+  }
+
+  av_free_packet(&item->pkt);
+  return 0;
+}
+
+static int process_item(int stage, StageItem* item)
+{
+  switch(stage)
+  {
+  case STAGE_DECODE:
+    return decode_stage(item);
+  case STAGE_FILTER:
+    return filter_stage(item);
+  case STAGE_ENCODE:
+    return encode_stage(item);
+  case STAGE_MUX:
+    return mux_stage(item);
+  }
+
+  return AVERROR_BUG;
+}
+
+// Runs the group of stages starting at first_stage until the end of stream reaches it.
+static void* stage_thread(void* arg)
+{
+  int first_stage = (int)(intptr_t)arg;
+  StageItem item;
+  int ret;
+
+  if(first_stage == STAGE_DEMUX)
+  {
+    ret = demux_stage();
+  }
+  else
+  {
+    while(1)
+    {
+      ret = queue_pop(&pipeline.queue[first_stage], &item);
+      if(ret < 0)
+      {
+        break;
+      }
+
+      int end = (item.type == ITEM_END);
+      ret = process_item(first_stage, &item);
+      if(ret < 0 || end)
+      {
+        break;
+      }
+    } // while
+  }
+
+  if(ret < 0)
+  {
+    pipeline_abort(ret);
+  }
+
+  return NULL;
+}
+
+static int run_pipeline()
+{
+  pthread_t threads[STAGE_COUNT];
+  int nb_threads = 0;
+  int failed = 0;
+  int stage, index;
+
+  // Every stage which starts a new group gets its own thread, demuxer runs on this one.
+  for(stage = 1; stage < STAGE_COUNT; stage++)
+  {
+    if(pipeline.group[stage] == pipeline.group[stage - 1])
+    {
+      continue;
+    }
+
+    if(pthread_create(&threads[nb_threads], NULL, stage_thread, (void*)(intptr_t)stage) != 0)
+    {
+      printf("Failed to create pipeline thread\n");
+      pipeline_abort(-1);
+      failed = 1;
+      break;
+    }
+    nb_threads++;
+  }
+
+  if(!failed)
+  {
+    stage_thread((void*)(intptr_t)STAGE_DEMUX);
+  }
+
+  for(index = 0; index < nb_threads; index++)
+  {
+    pthread_join(threads[index], NULL);
+  }
+
+  return pipeline.error;
+}
+
+static void drop_input_stream(int* index)
+{
+  if(*index >= 0)
+  {
+    avcodec_close(inputFile.fmt_ctx->streams[*index]->codec);
+    inputFile.fmt_ctx->streams[*index]->discard = AVDISCARD_ALL;
+    *index = -1;
+  }
+}
+
+static int transcode(const char* input, const char* output, 
+                    const char* layout, int queue_depth, const char* stats_path)
+{
+  int ret = -1;
+
+  if(init_pipeline(layout, queue_depth) < 0)
+  {
+    goto transcode_end;
+  }
+
+  init_latency_tracker();
+
+  if(open_input(input) < 0)
+  {
+    goto transcode_end;
+  }
+
+  if(segment_media == AVMEDIA_TYPE_VIDEO)
+  {
+    drop_input_stream(&inputFile.a_index);
+  }
+  else if(segment_media == AVMEDIA_TYPE_AUDIO)
+  {
+    drop_input_stream(&inputFile.v_index);
+  }
+
+  if(inputFile.v_index < 0 && inputFile.a_index < 0)
+  {
+    // e.g. the audio worker of an input without audio.
+    printf("No stream left to transcode\n");
+    ret = 0;
+    goto transcode_end;
+  }
+
+  if(inputFile.v_index >= 0)
+  {
+    AVStream* stream = inputFile.fmt_ctx->streams[inputFile.v_index];
+    if(segment_start != AV_NOPTS_VALUE)
+    {
+      segment_frame_start = av_rescale_q(segment_start, stream->time_base, stream->codec->time_base);
+    }
+    if(segment_end != AV_NOPTS_VALUE)
+    {
+      segment_frame_end = av_rescale_q(segment_end, stream->time_base, stream->codec->time_base);
+    }
+  }
+
+  if(create_output(output) < 0)
+  {
+    goto transcode_end;
+  }
+
+  vfilter_bypass = (inputFile.v_index >= 0 && stream_is_identity(inputFile.v_index));
+  afilter_bypass = (inputFile.a_index >= 0 && stream_is_identity(inputFile.a_index));
+  if(vfilter_bypass || afilter_bypass)
+  {
+    printf("Filter bypass : video %s, audio %s\n", vfilter_bypass ? "on" : "off", afilter_bypass ? "on" : "off");
+  }
+
+  if((inputFile.v_index >= 0 && !vfilter_bypass && init_conversion(inputFile.v_index) < 0) ||
+    (inputFile.a_index >= 0 && !afilter_bypass && init_conversion(inputFile.a_index) < 0))
+  {
+    goto transcode_end;
+  }
+
+  decoded_frame = av_frame_alloc();
+  if(decoded_frame == NULL)
+  {
+    goto transcode_end;
+  }
+
+  if(inputFile.a_index >= 0 && audio_batch_samples != AUDIO_BATCH_OFF && init_audio_batcher() < 0)
+  {
+    goto transcode_end;
+  }
+
+  pacing.enabled = pacing.enabled && inputFile.v_index >= 0;
+  if(pacing.enabled)
+  {
+    init_pacing();
+  }
+
+  stats.start_time = monotonic_ns();
+  ret = run_pipeline();
+  if(ret < 0)
+  {
+    printf("Error occurred while running pipeline\n");
+  }
+  
+  // Writing trailer.
+  av_write_trailer(outputFile.fmt_ctx);
+  stats.end_time = monotonic_ns();
+  av_frame_free(&decoded_frame);
+
+  print_stats(stats_path);
+  print_audio_batching();
+  if(conversion_engine == CONVERT_DIRECT)
+  {
+    print_conversion_profile();
+  }
+  else
+  {
+    print_filter_profile();
+  }
+transcode_end:
+  release();
+  release_scaler();
+  release_resampler();
+  release_audio_batcher();
+  release_spare_frames();
+  release_frame_pools();
+  release_pipeline();
+  release_stats();
+
+  return ret;
+}
+
+// Picks the video keyframes closest after every 1/nb_segments of the duration.
+// points[0] is always AV_NOPTS_VALUE, meaning the start of file.
+static int find_segment_points(const char* filename, int nb_segments, int64_t* points, AVRational* time_base)
+{
+  AVFormatContext* fmt_ctx = NULL;
+  AVPacket pkt;
+  int64_t* keyframes = NULL;
+  int nb_keyframes = 0;
+  int count = 0;
+  int v_index;
+  int index;
+
+  if(avformat_open_input(&fmt_ctx, filename, NULL, NULL) < 0 ||
+    avformat_find_stream_info(fmt_ctx, NULL) < 0)
+  {
+    printf("Could not open input file %s\n", filename);
+    avformat_close_input(&fmt_ctx);
+    return -1;
+  }
+
+  v_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+  if(v_index < 0)
+  {
+    printf("Segmented mode needs a video stream\n");
+    avformat_close_input(&fmt_ctx);
+    return -2;
+  }
+  *time_base = fmt_ctx->streams[v_index]->time_base;
+  discard_unused_streams(fmt_ctx, v_index, -1);
+
+  // Only packet headers are needed, so this pass costs a demux and nothing more.
+  while(av_read_frame(fmt_ctx, &pkt) >= 0)
+  {
+    if(pkt.stream_index == v_index && (pkt.flags & AV_PKT_FLAG_KEY) && pkt.pts != AV_NOPTS_VALUE)
+    {
+      int64_t* grown = av_realloc_array(keyframes, nb_keyframes + 1, sizeof(int64_t));
+      if(grown == NULL)
+      {
+        av_free_packet(&pkt);
+        break;
+      }
+
+      keyframes = grown;
+      keyframes[nb_keyframes++] = pkt.pts;
+    }
+
+    av_free_packet(&pkt);
+  } // while
+
+  avformat_close_input(&fmt_ctx);
+
+  points[count++] = AV_NOPTS_VALUE;
+  if(nb_keyframes > 1)
+  {
+    int64_t first = keyframes[0];
+    int64_t last = keyframes[nb_keyframes - 1];
+
+    for(index = 1; index < nb_keyframes && count < nb_segments; index++)
+    {
+      int64_t target = first + (last - first) * count / nb_segments;
+      if(keyframes[index] > first && keyframes[index] >= target && 
+        (count == 1 || keyframes[index] > points[count - 1]))
+      {
+        points[count++] = keyframes[index];
+      }
+    }
+  }
+
+  av_free(keyframes);
+  return count;
+}
+
+static void segment_filename(char* buf, size_t size, const char* output, int segment)
+{
+  const char* ext = strrchr(output, '.');
+
+  // Keep the extension, so every segment uses the same muxer as the final output.
+  if(segment < 0)
+  {
+    snprintf(buf, size, "%s.audio%s", output, (ext != NULL) ? ext : "");
+  }
+  else
+  {
+    snprintf(buf, size, "%s.segment%d%s", output, segment, (ext != NULL) ? ext : "");
+  }
+}
+
+static int add_stitch_stream(AVFormatContext* out_ctx, AVFormatContext* in_ctx)
+{
+  AVStream* in_stream = in_ctx->streams[0];
+  AVStream* out_stream = avformat_new_stream(out_ctx, in_stream->codec->codec);
+  if(out_stream == NULL)
+  {
+    return -1;
+  }
+
+  if(avcodec_copy_context(out_stream->codec, in_stream->codec) < 0)
+  {
+    return -2;
+  }
+
+  out_stream->time_base = in_stream->time_base;
+  out_stream->codec->codec_tag = 0;
+  if(out_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+  {
+    out_stream->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  return 0;
+}
+
+// Joins the video segments back to back and interleaves the audio written in one piece.
+// Each segment is shifted so that its first packet lands on the keyframe it was cut at,
+// which undoes any offset the segment muxer applied.
+static int stitch_segments(const char* output, int nb_segments, const int64_t* points, AVRational time_base)
+{
+  AVFormatContext* out_ctx = NULL;
+  AVFormatContext* video_ctx = NULL;
+  AVFormatContext* audio_ctx = NULL;
+  AVPacket vpkt, apkt;
+  int64_t offset = 0;
+  int64_t last_dts = AV_NOPTS_VALUE;
+  int has_vpkt = 0, has_apkt = 0;
+  int segment = 0;
+  char filename[1024];
+  int ret = -1;
+
+  if(avformat_alloc_output_context2(&out_ctx, NULL, NULL, output) < 0)
+  {
+    printf("Could not create output context\n");
+    return -1;
+  }
+
+  segment_filename(filename, sizeof(filename), output, 0);
+  if(avformat_open_input(&video_ctx, filename, NULL, NULL) < 0 ||
+    avformat_find_stream_info(video_ctx, NULL) < 0 ||
+    add_stitch_stream(out_ctx, video_ctx) < 0)
+  {
+    printf("Failed to open segment %s\n", filename);
+    goto stitch_end;
+  }
+
+  segment_filename(filename, sizeof(filename), output, -1);
+  if(avformat_open_input(&audio_ctx, filename, NULL, NULL) < 0 ||
+    avformat_find_stream_info(audio_ctx, NULL) < 0 ||
+    add_stitch_stream(out_ctx, audio_ctx) < 0)
+  {
+    // Input without audio, video segments are all there is.
+    avformat_close_input(&audio_ctx);
+  }
+
+  if(!(out_ctx->oformat->flags & AVFMT_NOFILE) && 
+    avio_open(&out_ctx->pb, output, AVIO_FLAG_WRITE) < 0)
+  {
+    printf("Failed to create output file %s\n", output);
+    goto stitch_end;
+  }
+
+  if(avformat_write_header(out_ctx, NULL) < 0)
+  {
+    printf("Failed writing header into output file\n");
+    goto stitch_end;
+  }
+
+  while(1)
+  {
+    while(!has_vpkt && video_ctx != NULL)
+    {
+      if(av_read_frame(video_ctx, &vpkt) >= 0)
+      {
+        vpkt.pts = (vpkt.pts != AV_NOPTS_VALUE) ? vpkt.pts + offset : AV_NOPTS_VALUE;
+        vpkt.dts = (vpkt.dts != AV_NOPTS_VALUE) ? vpkt.dts + offset : AV_NOPTS_VALUE;
+        av_packet_rescale_ts(&vpkt, video_ctx->streams[0]->time_base, out_ctx->streams[0]->time_base);
+        has_vpkt = 1;
+        break;
+      }
+
+      avformat_close_input(&video_ctx);
+      if(++segment == nb_segments)
+      {
+        break;
+      }
+
+      segment_filename(filename, sizeof(filename), output, segment);
+      if(avformat_open_input(&video_ctx, filename, NULL, NULL) < 0 ||
+        avformat_find_stream_info(video_ctx, NULL) < 0)
+      {
+        printf("Failed to open segment %s\n", filename);
+        goto stitch_end;
+      }
+
+      // First packet of a segment is its keyframe, which decides the shift.
+      if(av_read_frame(video_ctx, &vpkt) < 0)
+      {
+        continue;
+      }
+
+      offset = av_rescale_q(points[segment], time_base, video_ctx->streams[0]->time_base) - vpkt.pts;
+      vpkt.pts += offset;
+      vpkt.dts = (vpkt.dts != AV_NOPTS_VALUE) ? vpkt.dts + offset : AV_NOPTS_VALUE;
+      av_packet_rescale_ts(&vpkt, video_ctx->streams[0]->time_base, out_ctx->streams[0]->time_base);
+      has_vpkt = 1;
+    } // while
+
+    if(!has_apkt && audio_ctx != NULL)
+    {
+      if(av_read_frame(audio_ctx, &apkt) >= 0)
+      {
+        av_packet_rescale_ts(&apkt, audio_ctx->streams[0]->time_base, out_ctx->streams[1]->time_base);
+        has_apkt = 1;
+      }
+      else
+      {
+        avformat_close_input(&audio_ctx);
+      }
+    }
+
+    if(!has_vpkt && !has_apkt)
+    {
+      break;
+    }
+
+    // Write whichever is earlier, so the muxer never has to buffer a whole stream.
+    if(has_vpkt && (!has_apkt || av_compare_ts(vpkt.dts, out_ctx->streams[0]->time_base, 
+                                              apkt.dts, out_ctx->streams[1]->time_base) <= 0))
+    {
+      if(last_dts != AV_NOPTS_VALUE && vpkt.dts != AV_NOPTS_VALUE && vpkt.dts <= last_dts)
+      {
+        printf("Non monotonic dts at segment boundary, %"PRId64" after %"PRId64"\n", vpkt.dts, last_dts);
+      }
+      last_dts = vpkt.dts;
+
+      vpkt.stream_index = 0;
+      ret = av_interleaved_write_frame(out_ctx, &vpkt);
+      av_free_packet(&vpkt);
+      has_vpkt = 0;
+    }
+    else
+    {
+      apkt.stream_index = 1;
+      ret = av_interleaved_write_frame(out_ctx, &apkt);
+      av_free_packet(&apkt);
+      has_apkt = 0;
+    }
+
+    if(ret < 0)
+    {
+      printf("Error occurred when writing packet into file\n");
+      goto stitch_end;
+    }
+  } // while
+
+  ret = av_write_trailer(out_ctx);
+
+stitch_end:
+  if(has_vpkt) av_free_packet(&vpkt);
+  if(has_apkt) av_free_packet(&apkt);
+  avformat_close_input(&video_ctx);
+  avformat_close_input(&audio_ctx);
+  if(!(out_ctx->oformat->flags & AVFMT_NOFILE))
+  {
+    avio_closep(&out_ctx->pb);
+  }
+  avformat_free_context(out_ctx);
+
+  return ret;
+}
+#define MAX_SEGMENTS 64
+
+// Transcodes every segment in its own process, audio as one more, then stitches them.
+static int transcode_segmented(const char* input, const char* output, int nb_segments,
+                              const char* layout, int queue_depth)
+{
+  int64_t points[MAX_SEGMENTS + 1];
+  pid_t pids[MAX_SEGMENTS + 1];
+  AVRational time_base;
+  char filename[1024];
+  int nb_workers = 0;
+  int failed = 0;
+  int segment, status;
+  int ret;
+
+  nb_segments = find_segment_points(input, nb_segments, points, &time_base);
+  if(nb_segments < 0)
+  {
+    return nb_segments;
+  }
+  points[nb_segments] = AV_NOPTS_VALUE;
+  printf("Transcoding %d segments in parallel\n", nb_segments);
+
+  // Nothing of FFmpeg is open at this point, so each worker starts from a clean state.
+  fflush(stdout);
+
+  // Segment -1 is the audio worker, audio is not split to keep it gapless.
+  for(segment = -1; segment < nb_segments; segment++)
+  {
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+      printf("Failed to start segment worker\n");
+      failed = 1;
+      break;
+    }
+
+    if(pid == 0)
+    {
+      if(segment < 0)
+      {
+        segment_media = AVMEDIA_TYPE_AUDIO;
+      }
+      else
+      {
+        segment_media = AVMEDIA_TYPE_VIDEO;
+        segment_start = points[segment];
+        segment_end = points[segment + 1];
+      }
+
+      segment_filename(filename, sizeof(filename), output, segment);
+      exit((transcode(input, filename, layout, queue_depth, NULL) < 0) ? 1 : 0);
+    }
+
+    pids[nb_workers++] = pid;
+  }
+
+  for(segment = 0; segment < nb_workers; segment++)
+  {
+    if(waitpid(pids[segment], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+      failed = 1;
+    }
+  }
+
+  ret = failed ? -1 : stitch_segments(output, nb_segments, points, time_base);
+
+  for(segment = -1; segment < nb_segments; segment++)
+  {
+    segment_filename(filename, sizeof(filename), output, segment);
+    unlink(filename);
+  }
+
+  if(failed)
+  {
+    printf("Segment worker failed\n");
+  }
+
+  return ret;
+}
+
+#define MAX_RENDITIONS 8
+
+// One output of the ladder, encoded and written by its own thread.
+typedef struct _Rendition
+{
+  int width;
+  int height;
+  int64_t bit_rate;
+  char filename[1024];
+  AVFormatContext* fmt_ctx;     // stream 0 is video, stream 1 audio
+  AVFilterContext* sink_ctx;
+  StageQueue queue;             // scaled frames and encoded audio packets
+  pthread_t thread;
+  int started;
+  int64_t nb_frames;
+  int64_t encode_time;
+  int ret;
+} Rendition;
+
+static Rendition renditions[MAX_RENDITIONS];
+static int nb_renditions = 0;
+static FilterContext ladder_filter;             // buffer -> split -> scale -> format per rendition
+static AVCodecContext* ladder_audio_ctx = NULL; // audio is encoded once for all renditions
+
+// Parses <width>x<height>:<bitrate>[k|M] separated by commas, e.g. "1280x720:2800k,640x360:800k".
+static int parse_ladder(const char* arg)
+{
+  const char* rung = arg;
+
+  nb_renditions = 0;
+  while(*rung != '\0')
+  {
+    Rendition* rendition;
+    double bit_rate;
+    int consumed = 0;
+
+    if(nb_renditions == MAX_RENDITIONS)
+    {
+      return -1;
+    }
+
+    rendition = &renditions[nb_renditions];
+    if(sscanf(rung, "%dx%d:%lf%n", &rendition->width, &rendition->height, &bit_rate, &consumed) != 3 ||
+      rendition->width <= 0 || rendition->height <= 0 || bit_rate <= 0)
+    {
+      return -2;
+    }
+
+    rung += consumed;
+    if(*rung == 'k' || *rung == 'M')
+    {
+      bit_rate *= (*rung == 'k') ? 1000 : 1000000;
+      rung++;
+    }
+    rendition->bit_rate = (int64_t)bit_rate;
+    nb_renditions++;
+
+    if(*rung == ',')
+    {
+      rung++;
+    }
+    else if(*rung != '\0')
+    {
+      return -3;
+    }
+  } // while
+
+  return (nb_renditions > 0) ? 0 : -4;
+}
+
+static int open_ladder_audio_encoder()
+{
+  AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_AAC);
+  if(encoder == NULL)
+  {
+    return -1;
+  }
+
+  ladder_audio_ctx = avcodec_alloc_context3(encoder);
+  if(ladder_audio_ctx == NULL)
+  {
+    return -2;
+  }
+
+  ladder_audio_ctx->bit_rate = dst_abit_rate;
+  ladder_audio_ctx->sample_rate = dst_sample_rate;
+  ladder_audio_ctx->channel_layout = dst_ch_layout;
+  ladder_audio_ctx->channels = av_get_channel_layout_nb_channels(dst_ch_layout);
+  ladder_audio_ctx->sample_fmt = encoder->sample_fmts[0];
+  ladder_audio_ctx->time_base = (AVRational){1, dst_sample_rate};
+
+  // All renditions use the same muxer, so the first one decides for the shared encoder.
+  if(renditions[0].fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+  {
+    ladder_audio_ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  if(open_encoder(ladder_audio_ctx, encoder, aencoder_options) < 0)
+  {
+    return -3;
+  }
+
+  // Frames of exactly the encoder's frame size come straight out of the resampler.
+  return init_resampler(inputFile.fmt_ctx->streams[inputFile.a_index]->codec
+    , ladder_audio_ctx->sample_fmt, ladder_audio_ctx->frame_size);
+}
+
+static int create_rendition_output(Rendition* rendition)
+{
+  AVCodecContext* in_codec_ctx = inputFile.fmt_ctx->streams[inputFile.v_index]->codec;
+  AVCodecContext* codec_ctx;
+  AVStream* stream;
+  AVCodec* encoder;
+
+  encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
+  if(encoder == NULL)
+  {
+    return -1;
+  }
+
+  stream = avformat_new_stream(rendition->fmt_ctx, encoder);
+  if(stream == NULL)
+  {
+    return -1;
+  }
+
+  codec_ctx = stream->codec;
+  codec_ctx->bit_rate = rendition->bit_rate;
+  codec_ctx->width = rendition->width;
+  codec_ctx->height = rendition->height;
+  codec_ctx->time_base = in_codec_ctx->time_base;
+  codec_ctx->sample_aspect_ratio = in_codec_ctx->sample_aspect_ratio;
+  codec_ctx->pix_fmt = avcodec_default_get_format(codec_ctx, encoder->pix_fmts);
+
+  // Renditions are encoded side by side, so they share the cores instead of each taking all.
+  // A threads option given with -e v= still wins.
+  codec_ctx->thread_count = FFMAX(1, av_cpu_count() / nb_renditions);
+
+  if(rendition->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+  {
+    codec_ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  if(open_encoder(codec_ctx, encoder, vencoder_options) < 0)
+  {
+    return -2;
+  }
+
+  if(ladder_audio_ctx != NULL)
+  {
+    stream = avformat_new_stream(rendition->fmt_ctx, ladder_audio_ctx->codec);
+    if(stream == NULL || avcodec_copy_context(stream->codec, ladder_audio_ctx) < 0)
+    {
+      return -3;
+    }
+
+    stream->time_base = ladder_audio_ctx->time_base;
+    stream->codec->codec_tag = 0;
+  }
+
+  if(!(rendition->fmt_ctx->oformat->flags & AVFMT_NOFILE))
+  {
+    if(avio_open(&rendition->fmt_ctx->pb, rendition->filename, AVIO_FLAG_WRITE) < 0)
+    {
+      printf("Failed to create output file %s\n", rendition->filename);
+      return -4;
+    }
+  }
+
+  if(avformat_write_header(rendition->fmt_ctx, NULL) < 0)
+  {
+    printf("Failed writing header into output file %s\n", rendition->filename);
+    return -5;
+  }
+
+  return 0;
+}
+
+static int init_ladder_filter()
+{
+  AVStream* stream = inputFile.fmt_ctx->streams[inputFile.v_index];
+  AVCodecContext* codec_ctx = stream->codec;
+  AVFilterContext* split_filter;
+  char args[512];
+  int index;
+
+  ladder_filter.filter_graph = avfilter_graph_alloc();
+  if(ladder_filter.filter_graph == NULL || configure_graph(ladder_filter.filter_graph) < 0)
+  {
+    return -1;
+  }
+
+  snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d"
+    , codec_ctx->width, codec_ctx->height
+    , codec_ctx->pix_fmt
+    , codec_ctx->time_base.num, codec_ctx->time_base.den
+    , codec_ctx->sample_aspect_ratio.num, codec_ctx->sample_aspect_ratio.den);
+
+  if(avfilter_graph_create_filter(&ladder_filter.src_ctx, avfilter_get_by_name("buffer")
+        , "in", args, NULL, ladder_filter.filter_graph) < 0)
+  {
+    printf("Failed to create video buffer source\n");
+    return -2;
+  }
+
+  snprintf(args, sizeof(args), "%d", nb_renditions);
+  if(avfilter_graph_create_filter(&split_filter, avfilter_get_by_name("split")
+        , "split", args, NULL, ladder_filter.filter_graph) < 0 ||
+    avfilter_link(ladder_filter.src_ctx, 0, split_filter, 0) < 0)
+  {
+    printf("Failed to create video split filter\n");
+    return -3;
+  }
+
+  for(index = 0; index < nb_renditions; index++)
+  {
+    Rendition* rendition = &renditions[index];
+    AVCodecContext* out_codec_ctx = rendition->fmt_ctx->streams[0]->codec;
+    AVFilterContext* rescale_filter;
+    AVFilterContext* format_filter;
+    char name[32];
+
+    snprintf(name, sizeof(name), "scale%d", index);
+    scale_filter_args(args, sizeof(args), rendition->width, rendition->height);
+    if(avfilter_graph_create_filter(&rescale_filter, avfilter_get_by_name("scale")
+          , name, args, NULL, ladder_filter.filter_graph) < 0)
+    {
+      printf("Failed to create video scale filter\n");
+      return -4;
+    }
+
+    snprintf(name, sizeof(name), "format%d", index);
+    if(avfilter_graph_create_filter(&format_filter, avfilter_get_by_name("format")
+          , name, av_get_pix_fmt_name(out_codec_ctx->pix_fmt), NULL, ladder_filter.filter_graph) < 0)
+    {
+      printf("Failed to create video format filter\n");
+      return -4;
+    }
+
+    snprintf(name, sizeof(name), "out%d", index);
+    if(avfilter_graph_create_filter(&rendition->sink_ctx, avfilter_get_by_name("buffersink")
+          , name, NULL, NULL, ladder_filter.filter_graph) < 0)
+    {
+      printf("Failed to create video buffer sink\n");
+      return -4;
+    }
+
+    if(avfilter_link(split_filter, index, rescale_filter, 0) < 0 ||
+      avfilter_link(rescale_filter, 0, format_filter, 0) < 0 ||
+      avfilter_link(format_filter, 0, rendition->sink_ctx, 0) < 0)
+    {
+      printf("Failed to link video filters of rendition %d\n", index);
+      return -5;
+    }
+  } // for
+
+  if(avfilter_graph_config(ladder_filter.filter_graph, NULL) < 0)
+  {
+    printf("Failed to configure video filter context\n");
+    return -6;
+  }
+
+  return 0;
+}
+
+static void abort_queue(StageQueue* queue)
+{
+  pthread_mutex_lock(&queue->mutex);
+  queue->aborted = 1;
+  pthread_cond_broadcast(&queue->not_empty);
+  pthread_cond_broadcast(&queue->not_full);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+// Encodes frame, or drains the encoder when frame is NULL, and writes the packets.
+static int encode_rendition(Rendition* rendition, AVFrame* frame)
+{
+  AVStream* stream = rendition->fmt_ctx->streams[0];
+  AVPacket pkt;
+  int got_packet;
+  int64_t begin;
+  int ret;
+
+  if(frame != NULL)
+  {
+    frame->pict_type = AV_PICTURE_TYPE_NONE;
+    rendition->nb_frames++;
+  }
+
+  do
+  {
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+
+    begin = monotonic_ns();
+    ret = avcodec_encode_video2(stream->codec, &pkt, frame, &got_packet);
+    rendition->encode_time += monotonic_ns() - begin;
     if(ret < 0)
     {
-      printf("Error occurred while flusing filter context\n");
-      break;
+      return ret;
+    }
+
+    if(got_packet)
+    {
+      pkt.stream_index = 0;
+      av_packet_rescale_ts(&pkt, stream->codec->time_base, stream->time_base);
+      ret = av_interleaved_write_frame(rendition->fmt_ctx, &pkt);
+      av_free_packet(&pkt);
+      if(ret < 0)
+      {
+        return ret;
+      }
+    }
+  } while(frame == NULL && got_packet);
+
+  return 0;
+}
+
+static void* rendition_thread(void* arg)
+{
+  Rendition* rendition = arg;
+  StageItem item;
+
+  while(queue_pop(&rendition->queue, &item) == 0)
+  {
+    if(item.type == ITEM_END)
+    {
+      break;
+    }
+
+    if(item.type == ITEM_PACKET)
+    {
+      rendition->ret = av_interleaved_write_frame(rendition->fmt_ctx, &item.pkt);
+      av_free_packet(&item.pkt);
+    }
+    else
+    {
+      rendition->ret = encode_rendition(rendition, (item.type == ITEM_FRAME) ? item.frame : NULL);
+      free_stage_frame(&item.frame);
+    }
+
+    if(rendition->ret < 0)
+    {
+      printf("Error occurred in rendition %dx%d\n", rendition->width, rendition->height);
+      // Unblocks the decoding thread, which may be waiting for room in the queue.
+      abort_queue(&rendition->queue);
+      return NULL;
     }
+  } // while
 
-    // flush encoder
+  rendition->ret = av_write_trailer(rendition->fmt_ctx);
+  return NULL;
+}
+
+// Feeds the split graph, or drains it when frame is NULL, and hands every scaled frame on.
+static int ladder_filter_frame(AVFrame* frame)
+{
+  StageItem item;
+  int index;
+  int ret;
+
+  ret = av_buffersrc_add_frame(ladder_filter.src_ctx, frame);
+  if(ret < 0)
+  {
+    return ret;
+  }
+
+  // Every sink is emptied each time, otherwise split keeps queueing frames for it.
+  for(index = 0; index < nb_renditions; index++)
+  {
     while(1)
     {
-      ret = encode_write_frame(NULL, out_stream_index, &got_packet);
-      if(ret < 0 || got_packet == 0)
+      item.type = ITEM_FRAME;
+      item.stream_index = 0;
+      item.frame = alloc_stage_frame();
+      if(item.frame == NULL)
+      {
+        return AVERROR(ENOMEM);
+      }
+
+      if(av_buffersink_get_frame(renditions[index].sink_ctx, item.frame) < 0)
       {
+        free_stage_frame(&item.frame);
         break;
       }
+
+      ret = queue_push(&renditions[index].queue, &item);
+      if(ret < 0)
+      {
+        return ret;
+      }
+    } // while
+  } // for
+
+  return 0;
+}
+
+// Encodes frame, or drains the encoder when frame is NULL, and gives every rendition a copy of the packets.
+static int ladder_encode_audio(AVFrame* frame)
+{
+  StageItem item;
+  AVPacket pkt;
+  int got_packet;
+  int index;
+  int ret;
+
+  do
+  {
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+
+    ret = avcodec_encode_audio2(ladder_audio_ctx, &pkt, frame, &got_packet);
+    if(ret < 0)
+    {
+      return ret;
     }
+
+    for(index = 0; got_packet && index < nb_renditions; index++)
+    {
+      item.type = ITEM_PACKET;
+      item.stream_index = 1;
+      item.frame = NULL;
+      // Renditions share the packet data, each only holds a reference.
+      if(av_packet_ref(&item.pkt, &pkt) < 0)
+      {
+        av_free_packet(&pkt);
+        return AVERROR(ENOMEM);
+      }
+
+      item.pkt.stream_index = 1;
+      av_packet_rescale_ts(&item.pkt, ladder_audio_ctx->time_base, renditions[index].fmt_ctx->streams[1]->time_base);
+      ret = queue_push(&renditions[index].queue, &item);
+      if(ret < 0)
+      {
+        av_free_packet(&pkt);
+        return ret;
+      }
+    } // for
+
+    av_free_packet(&pkt);
+  } while(frame == NULL && got_packet);
+
+  return 0;
+}
+
+// Decodes pkt, or drains the decoder when pkt is NULL, and sends the frames on.
+static int ladder_decode(int stream_index, AVPacket* pkt)
+{
+  AVStream* stream = inputFile.fmt_ctx->streams[stream_index];
+  AVCodecContext* codec_ctx = stream->codec;
+  int is_video = (stream_index == inputFile.v_index);
+  AVPacket empty;
+  AVFrame* frame;
+  int got_frame;
+  int ret;
+
+  if(pkt != NULL)
+  {
+    av_packet_rescale_ts(pkt, stream->time_base, codec_ctx->time_base);
   }
-  
-  // Writing trailer.
-  av_write_trailer(outputFile.fmt_ctx);
+  else
+  {
+    av_init_packet(&empty);
+    empty.data = NULL;
+    empty.size = 0;
+    pkt = &empty;
+  }
+
+  do
+  {
+    got_frame = 0;
+    if(decode_packet(codec_ctx, pkt, &decoded_frame, &got_frame) < 0 || !got_frame)
+    {
+      break;
+    }
+
+    ret = is_video ? ladder_filter_frame(decoded_frame) : resample_frame(decoded_frame);
+    av_frame_unref(decoded_frame);
+    if(ret < 0)
+    {
+      return ret;
+    }
+  } while(pkt->data == NULL);
+
+  if(is_video)
+  {
+    return (pkt->data == NULL) ? ladder_filter_frame(NULL) : 0;
+  }
+
+  if(pkt->data == NULL && resample_frame(NULL) < 0)
+  {
+    return -1;
+  }
+
+  // Audio leaves the resampler in encoder sized frames.
+  while(1)
+  {
+    frame = alloc_stage_frame();
+    if(frame == NULL)
+    {
+      return AVERROR(ENOMEM);
+    }
+
+    if(resample_get_frame(frame, pkt->data == NULL) < 0)
+    {
+      free_stage_frame(&frame);
+      break;
+    }
+
+    ret = ladder_encode_audio(frame);
+    free_stage_frame(&frame);
+    if(ret < 0)
+    {
+      return ret;
+    }
+  } // while
+
+  return (pkt->data == NULL) ? ladder_encode_audio(NULL) : 0;
+}
+
+static void release_ladder()
+{
+  int index;
+
+  for(index = 0; index < nb_renditions; index++)
+  {
+    Rendition* rendition = &renditions[index];
+
+    queue_destroy(&rendition->queue);
+    if(rendition->fmt_ctx != NULL)
+    {
+      unsigned int stream;
+      for(stream = 0; stream < rendition->fmt_ctx->nb_streams; stream++)
+      {
+        avcodec_close(rendition->fmt_ctx->streams[stream]->codec);
+      }
+
+      if(!(rendition->fmt_ctx->oformat->flags & AVFMT_NOFILE))
+      {
+        avio_closep(&rendition->fmt_ctx->pb);
+      }
+      avformat_free_context(rendition->fmt_ctx);
+      rendition->fmt_ctx = NULL;
+    }
+  }
+
+  if(ladder_filter.filter_graph != NULL)
+  {
+    avfilter_graph_free(&ladder_filter.filter_graph);
+  }
+
+  avcodec_free_context(&ladder_audio_ctx);
+}
+
+// Decodes the input once and encodes every rendition of the ladder from the same frames.
+static int transcode_ladder(const char* input, const char* output, int queue_depth)
+{
+  const char* ext = strrchr(output, '.');
+  int64_t start_time = monotonic_ns();
+  int64_t elapsed;
+  StageItem item;
+  AVPacket pkt;
+  int index;
+  int ret = -1;
+
+  if(ext == NULL)
+  {
+    ext = output + strlen(output);
+  }
+
+  if(open_input(input) < 0 || inputFile.v_index < 0)
+  {
+    goto ladder_end;
+  }
+
+  for(index = 0; index < nb_renditions; index++)
+  {
+    Rendition* rendition = &renditions[index];
+
+    // out.mp4 becomes out_1280x720.mp4 and so on.
+    snprintf(rendition->filename, sizeof(rendition->filename), "%.*s_%dx%d%s"
+      , (int)(ext - output), output, rendition->width, rendition->height, ext);
+    if(avformat_alloc_output_context2(&rendition->fmt_ctx, NULL, NULL, rendition->filename) < 0 ||
+      queue_init(&rendition->queue, queue_depth) < 0)
+    {
+      printf("Could not create output context for %s\n", rendition->filename);
+      goto ladder_end;
+    }
+  }
+
+  if(inputFile.a_index >= 0 && open_ladder_audio_encoder() < 0)
+  {
+    printf("Failed to open audio encoder\n");
+    goto ladder_end;
+  }
+
+  for(index = 0; index < nb_renditions; index++)
+  {
+    if(create_rendition_output(&renditions[index]) < 0)
+    {
+      goto ladder_end;
+    }
+  }
+
+  if(init_ladder_filter() < 0)
+  {
+    goto ladder_end;
+  }
+
+  decoded_frame = av_frame_alloc();
+  if(decoded_frame == NULL)
+  {
+    goto ladder_end;
+  }
+
+  for(index = 0; index < nb_renditions; index++)
+  {
+    if(pthread_create(&renditions[index].thread, NULL, rendition_thread, &renditions[index]) != 0)
+    {
+      goto ladder_join;
+    }
+    renditions[index].started = 1;
+  }
+
+  ret = 0;
+  while(ret >= 0)
+  {
+    if(av_read_frame(inputFile.fmt_ctx, &pkt) < 0)
+    {
+      break;
+    }
+
+    if(pkt.stream_index == inputFile.v_index || pkt.stream_index == inputFile.a_index)
+    {
+      ret = ladder_decode(pkt.stream_index, &pkt);
+    }
+    av_free_packet(&pkt);
+  } // while
+
+  if(ret >= 0)
+  {
+    ret = ladder_decode(inputFile.v_index, NULL);
+  }
+  if(ret >= 0 && inputFile.a_index >= 0)
+  {
+    ret = ladder_decode(inputFile.a_index, NULL);
+  }
+
+ladder_join:
+  for(index = 0; index < nb_renditions; index++)
+  {
+    Rendition* rendition = &renditions[index];
+    if(!rendition->started)
+    {
+      continue;
+    }
+
+    item.type = ITEM_FLUSH;
+    item.frame = NULL;
+    if(ret < 0 || queue_push(&rendition->queue, &item) < 0)
+    {
+      abort_queue(&rendition->queue);
+    }
+
+    item.type = ITEM_END;
+    queue_push(&rendition->queue, &item);
+    pthread_join(rendition->thread, NULL);
+    if(rendition->ret < 0)
+    {
+      ret = rendition->ret;
+    }
+  }
+
+  elapsed = monotonic_ns() - start_time;
+  for(index = 0; index < nb_renditions; index++)
+  {
+    Rendition* rendition = &renditions[index];
+    printf("Rendition %dx%d @ %"PRId64" kb/s : %"PRId64" frames, encoding %.3f s, %.1f fps -> %s\n"
+      , rendition->width, rendition->height, rendition->bit_rate / 1000, rendition->nb_frames
+      , rendition->encode_time / 1000000000.0
+      , elapsed > 0 ? rendition->nb_frames * 1000000000.0 / elapsed : 0.0
+      , rendition->filename);
+  }
+  printf("Ladder : %d renditions from one decode in %.3f s\n", nb_renditions, elapsed / 1000000000.0);
+
   av_frame_free(&decoded_frame);
-main_end:
+ladder_end:
+  release_ladder();
+  release_resampler();
+  release_spare_frames();
+  release_frame_pools();
   release();
 
-  return 0;
+  return ret;
+}
+
+int main(int argc, char* argv[])
+{
+  const char* layout = "serial";
+  const char* stats_path = NULL;
+  const char* sweep_spec = NULL;
+  int queue_depth = 8;
+  int nb_segments = 1;
+  int index;
+  int opt;
+  int ret = 0;
+
+  av_register_all();
+  avfilter_register_all();
+  av_log_set_level(AV_LOG_DEBUG);
+
+  while((opt = getopt(argc, argv, "t:q:d:s:n:b:F:S:Pc:L:T:D:le:W:RA:")) != -1)
+  {
+    switch(opt)
+    {
+    case 't':
+      layout = optarg;
+      break;
+    case 'q':
+      queue_depth = atoi(optarg);
+      break;
+    case 'l':
+      live_mode = 1;
+      break;
+    case 'R':
+      pacing.enabled = 1;
+      break;
+    case 'A':
+      if(parse_audio_batch(optarg) < 0)
+      {
+        printf("Invalid audio batch %s\n", optarg);
+        return -1;
+      }
+      break;
+    case 's':
+      stats_path = optarg;
+      break;
+    case 'n':
+      nb_segments = atoi(optarg);
+      break;
+    case 'T':
+      if(parse_stream_selector(optarg) < 0)
+      {
+        printf("Invalid stream selection %s\n", optarg);
+        return -1;
+      }
+      break;
+    case 'L':
+      if(parse_ladder(optarg) < 0)
+      {
+        printf("Invalid ladder %s\n", optarg);
+        return -1;
+      }
+      break;
+    case 'D':
+      if(parse_draft_level(optarg) < 0)
+      {
+        printf("Invalid draft decoding %s\n", optarg);
+        return -1;
+      }
+      break;
+    case 'F':
+      if(parse_filter_threads(optarg) < 0)
+      {
+        printf("Invalid filter threading %s\n", optarg);
+        return -1;
+      }
+      break;
+    case 'S':
+      scale_flags = optarg;
+      break;
+    case 'P':
+      profile_filters = 1;
+      break;
+    case 'c':
+      if(parse_conversion_engine(optarg) < 0)
+      {
+        printf("Invalid conversion engine %s\n", optarg);
+        return -1;
+      }
+      break;
+    case 'b':
+      if(parse_frame_alloc_mode(optarg) < 0)
+      {
+        printf("Invalid frame allocator %s\n", optarg);
+        return -1;
+      }
+      break;
+    case 'e':
+      if(parse_encoder_options(optarg) < 0)
+      {
+        printf("Invalid encoder options %s\n", optarg);
+        return -1;
+      }
+      break;
+    case 'W':
+      sweep_spec = optarg;
+      break;
+    case 'd':
+      if(parse_thread_config(optarg) < 0)
+      {
+        printf("Invalid decoder threading %s\n", optarg);
+        return -1;
+      }
+      break;
+    default:
+      optind = argc;
+      break;
+    }
+  }
+
+  // Reports only read the input. Segmented transcoding seeks in the input, which a live source can not do.
+  if(argc - optind < ((sweep_spec != NULL || draft_report_only) ? 1 : 2) || queue_depth < 1 ||
+    nb_segments < 1 || nb_segments > MAX_SEGMENTS || (live_mode && nb_segments > 1))
+  {
+    printf("usage : %s [-t serial|io|full|<thread per stage>] [-q queue_depth] [-l] [-R] [-d v|a=frame|slice|auto[:threads]] [-b default|pool|thp|hugetlb] [-e v|a=key=value[,...]] [-A off|<samples>] [-W presets|all[/threads,...]] [-F none|slice[:threads]] [-S scaler_flags] [-P] [-c graph|direct[:threads]] [-D off|auto|report|<level>] [-T av|video|audio|<stream>[,<stream>]] [-s stats.json|-] [-n segments] [-L WxH:bitrate[,...]] <input> <output>\n", argv[0]);
+    return 0;
+  }
+
+  if(live_mode)
+  {
+    avformat_network_init();
+
+    if(argc - optind >= 2 && strcmp(argv[optind + 1], "-") == 0 && move_stdout_to_stderr() < 0)
+    {
+      printf("Failed to move output off stdout\n");
+      return 1;
+    }
+  }
+
+  // In ladder mode decoded frames have to serve the biggest rendition.
+  for(index = 0; index < nb_renditions; index++)
+  {
+    draft_width = FFMAX(draft_width, renditions[index].width);
+    draft_height = FFMAX(draft_height, renditions[index].height);
+  }
+
+  if(sweep_spec != NULL)
+  {
+    ret = encoder_sweep(argv[optind], sweep_spec);
+  }
+  else if(draft_report_only)
+  {
+    ret = draft_report(argv[optind]);
+  }
+  else if(nb_renditions > 0)
+  {
+    ret = transcode_ladder(argv[optind], argv[optind + 1], queue_depth);
+  }
+  else if(nb_segments > 1)
+  {
+    ret = transcode_segmented(argv[optind], argv[optind + 1], nb_segments, layout, queue_depth);
+  }
+  else
+  {
+    ret = transcode(argv[optind], argv[optind + 1], layout, queue_depth, stats_path);
+  }
+
+  av_dict_free(&vencoder_options);
+  av_dict_free(&aencoder_options);
+
+  return (ret < 0) ? 1 : 0;
 }